@@ -277,6 +277,12 @@ static int dispatch_loadplugin(oconfig_item_t *ci) {
       cf_util_get_cdtime(child, &ctx.flush_interval);
     else if (strcasecmp("FlushTimeout", child->key) == 0)
       cf_util_get_cdtime(child, &ctx.flush_timeout);
+    else if (strcasecmp("WriteThreads", child->key) == 0)
+      cf_util_get_int(child, &ctx.write_threads);
+    else if (strcasecmp("WriteQueueLimitHigh", child->key) == 0)
+      cf_util_get_int(child, &ctx.write_queue_limit_high);
+    else if (strcasecmp("WriteQueueLimitLow", child->key) == 0)
+      cf_util_get_int(child, &ctx.write_queue_limit_low);
     else {
       WARNING("Ignoring unknown LoadPlugin option \"%s\" "
               "for plugin \"%s\"",
@@ -40,6 +40,8 @@
 #include "utils_heap.h"
 #include "utils_llist.h"
 #include "utils_random.h"
+#include "utils_ring.h"
+#include "utils_slab.h"
 #include "utils_time.h"
 
 #if HAVE_PTHREAD_NP_H
@@ -79,12 +81,63 @@ typedef struct read_func_s read_func_t;
 
 struct write_queue_s;
 typedef struct write_queue_s write_queue_t;
+/* One or more value lists dispatched at once. The value lists and their
+ * values are allocated in one block with the header. */
 struct write_queue_s {
-  value_list_t *vl;
   plugin_ctx_t ctx;
-  write_queue_t *next;
+  bool slab;
+  size_t vl_num;
+  value_list_t vl[];
 };
 
+/* A value list on its way to the write callbacks. It is shared by the queues
+ * of all writers it is sent to, is not modified once queued and is freed by
+ * the last writer done with it. */
+struct write_value_s {
+  value_list_t vl;
+  const data_set_t *ds;
+  plugin_ctx_t ctx;
+  int refs;
+  bool slab;
+};
+typedef struct write_value_s write_value_t;
+
+struct write_entry_s;
+typedef struct write_entry_s write_entry_t;
+struct write_entry_s {
+  write_value_t *value;
+  write_entry_t *next;
+};
+
+struct write_func_s {
+/* `write_func_t' "inherits" from `callback_func_t'.
+ * The `wf_super' member MUST be the first one in this structure! */
+#define wf_callback wf_super.cf_callback
+#define wf_udata wf_super.cf_udata
+#define wf_ctx wf_super.cf_ctx
+  callback_func_t wf_super;
+  /* `wf_callback' is a plugin_write_batch_cb rather than a plugin_write_cb. */
+  bool wf_batch;
+
+  /* Queue of the writer, protected by `wf_lock'. */
+  pthread_mutex_t wf_lock;
+  pthread_cond_t wf_cond;
+  write_entry_t *wf_queue_head;
+  write_entry_t *wf_queue_tail;
+  long wf_queue_length;
+  long wf_limit_high;
+  long wf_limit_low;
+  derive_t wf_dropped;
+  c_complain_t wf_complaint;
+  bool wf_loop;
+  /* Once stopped, queued values are written until this time. */
+  cdtime_t wf_drain_deadline;
+
+  pthread_t *wf_threads;
+  size_t wf_threads_num;
+};
+typedef struct write_func_s write_func_t;
+
 struct flush_callback_s {
   char *name;
   cdtime_t timeout;
@@ -114,6 +167,16 @@ static char *plugindir;
 #ifndef DEFAULT_MAX_READ_INTERVAL
 #define DEFAULT_MAX_READ_INTERVAL TIME_T_TO_CDTIME_T_STATIC(86400)
 #endif
+#ifndef WRITE_DRAIN_TIMEOUT
+#define WRITE_DRAIN_TIMEOUT TIME_T_TO_CDTIME_T_STATIC(5)
+#endif
+#ifndef DEFAULT_WRITE_QUEUE_SIZE
+#define DEFAULT_WRITE_QUEUE_SIZE 262144
+#endif
+/* Value lists a write thread takes from its queue at once. */
+#ifndef WRITE_BATCH_SIZE
+#define WRITE_BATCH_SIZE 64
+#endif
 static c_heap_t *read_heap;
 static llist_t *read_list;
 static int read_loop = 1;
@@ -123,12 +186,22 @@ static pthread_t *read_threads;
 static size_t read_threads_num;
 static cdtime_t max_read_interval = DEFAULT_MAX_READ_INTERVAL;
 
-static write_queue_t *write_queue_head;
-static write_queue_t *write_queue_tail;
+/* Holds `write_queue_t' pointers. Used without locks by the read and write
+ * threads. */
+static ring_t *write_ring;
+/* Number of value lists in `write_ring', which holds batches of them. */
 static long write_queue_length;
+
+/* Most types have few data sources. Single value lists with up to this many
+ * values, and the structures queueing them, come from per-thread caches
+ * instead of malloc(3). */
+#ifndef WRITE_VALUES_INLINE
+#define WRITE_VALUES_INLINE 4
+#endif
+static slab_t *write_queue_slab;
+static slab_t *write_value_slab;
+static slab_t *write_entry_slab;
 static bool write_loop = true;
-static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t write_cond = PTHREAD_COND_INITIALIZER;
 static pthread_t *write_threads;
 static size_t write_threads_num;
 
@@ -154,7 +227,8 @@ static const char *plugin_get_dir(void) {
 }
 
 static int plugin_update_internal_statistics(void) { /* {{{ */
-  gauge_t copy_write_queue_length = (gauge_t)write_queue_length;
+  gauge_t copy_write_queue_length =
+      (gauge_t)__atomic_load_n(&write_queue_length, __ATOMIC_RELAXED);
 
   /* Initialize `vl' */
   value_list_t vl = VALUE_LIST_INIT;
@@ -178,6 +252,31 @@ static int plugin_update_internal_statistics(void) { /* {{{ */
   sstrncpy(vl.type_instance, "dropped", sizeof(vl.type_instance));
   plugin_dispatch_values(&vl);
 
+  /* Queues of the write plugins */
+  for (llentry_t *le = llist_head(list_write); le != NULL; le = le->next) {
+    write_func_t *wf = le->value;
+
+    pthread_mutex_lock(&wf->wf_lock);
+    gauge_t queue_length = (gauge_t)wf->wf_queue_length;
+    derive_t dropped = wf->wf_dropped;
+    pthread_mutex_unlock(&wf->wf_lock);
+
+    snprintf(vl.plugin_instance, sizeof(vl.plugin_instance), "write-%s",
+             le->key);
+
+    vl.values = &(value_t){.gauge = queue_length};
+    vl.values_len = 1;
+    sstrncpy(vl.type, "queue_length", sizeof(vl.type));
+    vl.type_instance[0] = 0;
+    plugin_dispatch_values(&vl);
+
+    vl.values = &(value_t){.derive = dropped};
+    vl.values_len = 1;
+    sstrncpy(vl.type, "derive", sizeof(vl.type));
+    sstrncpy(vl.type_instance, "dropped", sizeof(vl.type_instance));
+    plugin_dispatch_values(&vl);
+  }
+
   /* Cache */
   sstrncpy(vl.plugin_instance, "cache", sizeof(vl.plugin_instance));
 
@@ -676,6 +775,37 @@ static void plugin_value_list_free(value_list_t *vl) /* {{{ */
   sfree(vl);
 } /* }}} void plugin_value_list_free */
 
+/* Fills in the fields a plugin may leave unset. */
+static void plugin_value_list_defaults(value_list_t *vl) /* {{{ */
+{
+  if (vl->host[0] == 0)
+    sstrncpy(vl->host, hostname_g, sizeof(vl->host));
+
+  if (vl->time == 0)
+    vl->time = cdtime();
+
+  /* Fill in the interval from the thread context, if it is zero. */
+  if (vl->interval == 0) {
+    plugin_ctx_t ctx = plugin_get_ctx();
+
+    if (ctx.interval != 0)
+      vl->interval = ctx.interval;
+    else {
+      char name[6 * DATA_MAX_NAME_LEN];
+      FORMAT_VL(name, sizeof(name), vl);
+      ERROR("plugin_value_list_defaults: Unable to determine "
+            "interval from context for "
+            "value list \"%s\". "
+            "This indicates a broken plugin. "
+            "Please report this problem to the "
+            "collectd mailing list or at "
+            "<http://collectd.org/bugs/>.",
+            name);
+      vl->interval = cf_get_default_interval();
+    }
+  }
+} /* }}} void plugin_value_list_defaults */
+
 static value_list_t *
 plugin_value_list_clone(value_list_t const *vl_orig) /* {{{ */
 {
@@ -689,9 +819,6 @@ plugin_value_list_clone(value_list_t const *vl_orig) /* {{{ */
     return NULL;
   memcpy(vl, vl_orig, sizeof(*vl));
 
-  if (vl->host[0] == 0)
-    sstrncpy(vl->host, hostname_g, sizeof(vl->host));
-
   vl->values = calloc(vl_orig->values_len, sizeof(*vl->values));
   if (vl->values == NULL) {
     plugin_value_list_free(vl);
@@ -706,46 +833,104 @@ plugin_value_list_clone(value_list_t const *vl_orig) /* {{{ */
     return NULL;
   }
 
-  if (vl->time == 0)
-    vl->time = cdtime();
+  plugin_value_list_defaults(vl);
+  return vl;
+} /* }}} value_list_t *plugin_value_list_clone */
 
-  /* Fill in the interval from the thread context, if it is zero. */
-  if (vl->interval == 0) {
-    plugin_ctx_t ctx = plugin_get_ctx();
+static void write_queue_destroy(write_queue_t *q) /* {{{ */
+{
+  if (q == NULL)
+    return;
 
-    if (ctx.interval != 0)
-      vl->interval = ctx.interval;
-    else {
-      char name[6 * DATA_MAX_NAME_LEN];
-      FORMAT_VL(name, sizeof(name), vl);
-      ERROR("plugin_value_list_clone: Unable to determine "
-            "interval from context for "
-            "value list \"%s\". "
-            "This indicates a broken plugin. "
-            "Please report this problem to the "
-            "collectd mailing list or at "
-            "<http://collectd.org/bugs/>.",
-            name);
-      vl->interval = cf_get_default_interval();
+  for (size_t i = 0; i < q->vl_num; i++)
+    meta_data_destroy(q->vl[i].meta);
+
+  if (q->slab)
+    slab_free(write_queue_slab, q);
+  else
+    free(q);
+} /* }}} void write_queue_destroy */
+
+static bool check_drop_value(void);
+
+/* Copies `vl_num' value lists into one block and queues it for the write
+ * threads. If `dropped' is not NULL, value lists are dropped as configured
+ * with WriteQueueLimitHigh and WriteQueueLimitLow and their number is stored
+ * there. Returns EAGAIN, without copying anything, if the queue has no room
+ * for `vl_num' more value lists. */
+static int plugin_write_enqueue(value_list_t const *vl, size_t vl_num,
+                                size_t *dropped) /* {{{ */
+{
+  write_queue_t *q;
+  value_t *values;
+  size_t values_num = 0;
+
+  if (write_ring == NULL)
+    return EINVAL;
+
+  /* The queue is limited in value lists, not in blocks. Room is reserved
+   * before copying, so that a full queue costs no allocation. */
+  if (__atomic_add_fetch(&write_queue_length, (long)vl_num,
+                         __ATOMIC_RELAXED) > (long)ring_size(write_ring)) {
+    __atomic_sub_fetch(&write_queue_length, (long)vl_num, __ATOMIC_RELAXED);
+    return EAGAIN;
+  }
+
+  for (size_t i = 0; i < vl_num; i++)
+    values_num += vl[i].values_len;
+
+  if ((write_queue_slab != NULL) && (vl_num == 1) &&
+      (values_num <= WRITE_VALUES_INLINE)) {
+    q = slab_alloc(write_queue_slab);
+    if (q == NULL) {
+      __atomic_sub_fetch(&write_queue_length, (long)vl_num, __ATOMIC_RELAXED);
+      return ENOMEM;
+    }
+    q->slab = true;
+  } else {
+    q = malloc(sizeof(*q) + vl_num * sizeof(*q->vl) +
+               values_num * sizeof(*values));
+    if (q == NULL) {
+      __atomic_sub_fetch(&write_queue_length, (long)vl_num, __ATOMIC_RELAXED);
+      return ENOMEM;
     }
+    q->slab = false;
   }
+  q->vl_num = 0;
+  values = (value_t *)(q->vl + vl_num);
 
-  return vl;
-} /* }}} value_list_t *plugin_value_list_clone */
+  for (size_t i = 0; i < vl_num; i++) {
+    if ((dropped != NULL) && check_drop_value()) {
+      (*dropped)++;
+      continue;
+    }
 
-static int plugin_write_enqueue(value_list_t const *vl) /* {{{ */
-{
-  write_queue_t *q;
+    value_list_t *copy = q->vl + q->vl_num;
+    memcpy(copy, vl + i, sizeof(*copy));
 
-  q = malloc(sizeof(*q));
-  if (q == NULL)
-    return ENOMEM;
-  q->next = NULL;
+    copy->values = values;
+    memcpy(values, vl[i].values, vl[i].values_len * sizeof(*values));
+    values += vl[i].values_len;
 
-  q->vl = plugin_value_list_clone(vl);
-  if (q->vl == NULL) {
-    sfree(q);
-    return ENOMEM;
+    copy->meta = meta_data_clone(vl[i].meta);
+    if ((vl[i].meta != NULL) && (copy->meta == NULL)) {
+      __atomic_sub_fetch(&write_queue_length, (long)vl_num, __ATOMIC_RELAXED);
+      write_queue_destroy(q);
+      return ENOMEM;
+    }
+    q->vl_num++;
+
+    plugin_value_list_defaults(copy);
+  }
+
+  /* Give back the room of value lists dropped above. */
+  if (q->vl_num < vl_num)
+    __atomic_sub_fetch(&write_queue_length, (long)(vl_num - q->vl_num),
+                       __ATOMIC_RELAXED);
+
+  if (q->vl_num == 0) {
+    write_queue_destroy(q);
+    return 0;
   }
 
   /* Store context of caller (read plugin); otherwise, it would not be
@@ -753,71 +938,324 @@ static int plugin_write_enqueue(value_list_t const *vl) /* {{{ */
    * value-list later on. */
   q->ctx = plugin_get_ctx();
 
-  pthread_mutex_lock(&write_lock);
-
-  if (write_queue_tail == NULL) {
-    write_queue_head = q;
-    write_queue_tail = q;
-    write_queue_length = 1;
-  } else {
-    write_queue_tail->next = q;
-    write_queue_tail = q;
-    write_queue_length += 1;
+  /* Every block holds at least one value list, so the ring, sized like the
+   * limit, always has room for the reserved ones. */
+  int status = ring_push(write_ring, q);
+  if (status != 0) {
+    __atomic_sub_fetch(&write_queue_length, (long)q->vl_num, __ATOMIC_RELAXED);
+    write_queue_destroy(q);
+    return status;
   }
 
-  pthread_cond_signal(&write_cond);
-  pthread_mutex_unlock(&write_lock);
-
   return 0;
 } /* }}} int plugin_write_enqueue */
 
-static value_list_t *plugin_write_dequeue(void) /* {{{ */
+static write_queue_t *plugin_write_dequeue(void) /* {{{ */
 {
   write_queue_t *q;
-  value_list_t *vl;
 
-  pthread_mutex_lock(&write_lock);
+  /* Returns NULL once the write threads are being stopped. */
+  q = ring_pop_wait(write_ring);
+  if (q == NULL)
+    return NULL;
 
-  while (write_loop && (write_queue_head == NULL))
-    pthread_cond_wait(&write_cond, &write_lock);
+  __atomic_sub_fetch(&write_queue_length, (long)q->vl_num, __ATOMIC_RELAXED);
 
-  if (write_queue_head == NULL) {
-    pthread_mutex_unlock(&write_lock);
-    return NULL;
+  (void)plugin_set_ctx(q->ctx);
+  return q;
+} /* }}} write_queue_t *plugin_write_dequeue */
+
+static void *plugin_write_thread(void __attribute__((unused)) * args) /* {{{ */
+{
+  while (write_loop) {
+    write_queue_t *q = plugin_write_dequeue();
+    if (q == NULL)
+      continue;
+
+    for (size_t i = 0; i < q->vl_num; i++)
+      plugin_dispatch_values_internal(q->vl + i);
+
+    write_queue_destroy(q);
   }
 
-  q = write_queue_head;
-  write_queue_head = q->next;
-  write_queue_length -= 1;
-  if (write_queue_head == NULL) {
-    write_queue_tail = NULL;
-    assert(0 == write_queue_length);
+  pthread_exit(NULL);
+  return (void *)0;
+} /* }}} void *plugin_write_thread */
+
+static void write_value_free(write_value_t *wv) /* {{{ */
+{
+  if (wv->slab)
+    slab_free(write_value_slab, wv);
+  else
+    free(wv);
+} /* }}} void write_value_free */
+
+static write_value_t *write_value_create(const data_set_t *ds, /* {{{ */
+                                         const value_list_t *vl) {
+  write_value_t *wv;
+
+  /* The values are stored in the same allocation. */
+  if ((write_value_slab != NULL) && (vl->values_len <= WRITE_VALUES_INLINE)) {
+    wv = slab_alloc(write_value_slab);
+    if (wv == NULL)
+      return NULL;
+    wv->slab = true;
+  } else {
+    wv = malloc(sizeof(*wv) + vl->values_len * sizeof(*vl->values));
+    if (wv == NULL)
+      return NULL;
+    wv->slab = false;
   }
 
-  pthread_mutex_unlock(&write_lock);
+  wv->vl = *vl;
+  wv->vl.values = (value_t *)(wv + 1);
+  memcpy(wv->vl.values, vl->values, vl->values_len * sizeof(*vl->values));
 
-  (void)plugin_set_ctx(q->ctx);
+  wv->vl.meta = meta_data_clone(vl->meta);
+  if ((vl->meta != NULL) && (wv->vl.meta == NULL)) {
+    write_value_free(wv);
+    return NULL;
+  }
 
-  vl = q->vl;
-  sfree(q);
-  return vl;
-} /* }}} value_list_t *plugin_write_dequeue */
+  wv->ds = ds;
+  /* Keep the context (interval) information of the calling read plugin. */
+  wv->ctx = plugin_get_ctx();
+  wv->refs = 1;
 
-static void *plugin_write_thread(void __attribute__((unused)) * args) /* {{{ */
+  return wv;
+} /* }}} write_value_t *write_value_create */
+
+static void write_value_release(write_value_t *wv) /* {{{ */
 {
-  while (write_loop) {
-    value_list_t *vl = plugin_write_dequeue();
-    if (vl == NULL)
+  if (wv == NULL)
+    return;
+
+  if (__sync_sub_and_fetch(&wv->refs, 1) > 0)
+    return;
+
+  meta_data_destroy(wv->vl.meta);
+  write_value_free(wv);
+} /* }}} void write_value_release */
+
+/* Returns zero if the value has been queued and EAGAIN if the queue's limits
+ * have it dropped. */
+static int write_func_enqueue(write_func_t *wf, /* {{{ */
+                              write_value_t *wv, const char *name) {
+  write_entry_t *e;
+
+  e = slab_alloc(write_entry_slab);
+  if (e == NULL)
+    return ENOMEM;
+  e->value = wv;
+  e->next = NULL;
+
+  pthread_mutex_lock(&wf->wf_lock);
+
+  if (wf->wf_limit_high > 0) {
+    double p = 0.0;
+    if (wf->wf_queue_length >= wf->wf_limit_high)
+      p = 1.0;
+    else if (wf->wf_queue_length >= wf->wf_limit_low)
+      p = (double)(1 + wf->wf_queue_length - wf->wf_limit_low) /
+          (double)(1 + wf->wf_limit_high - wf->wf_limit_low);
+
+    if ((p > 0.0) && ((p == 1.0) || (cdrand_d() < p))) {
+      wf->wf_dropped++;
+      c_complain(LOG_WARNING, &wf->wf_complaint,
+                 "plugin: The write queue of \"%s\" holds %ld values. "
+                 "Dropping %.0f%% of new values.",
+                 name, wf->wf_queue_length, 100.0 * p);
+      pthread_mutex_unlock(&wf->wf_lock);
+      slab_free(write_entry_slab, e);
+      return EAGAIN;
+    }
+
+    if (wf->wf_queue_length == 0)
+      c_release(LOG_INFO, &wf->wf_complaint,
+                "plugin: The write queue of \"%s\" has been emptied.", name);
+  }
+
+  __sync_add_and_fetch(&wv->refs, 1);
+  if (wf->wf_queue_tail == NULL)
+    wf->wf_queue_head = e;
+  else
+    wf->wf_queue_tail->next = e;
+  wf->wf_queue_tail = e;
+  wf->wf_queue_length++;
+
+  pthread_cond_signal(&wf->wf_cond);
+  pthread_mutex_unlock(&wf->wf_lock);
+
+  return 0;
+} /* }}} int write_func_enqueue */
+
+/* Hands `wv_num' values to the writer, in one call if it takes batches. */
+static void plugin_write_func_call(write_func_t *wf, /* {{{ */
+                                   write_value_t **wv, size_t wv_num) {
+  if (!wf->wf_batch) {
+    plugin_write_cb callback = wf->wf_callback;
+
+    for (size_t i = 0; i < wv_num; i++) {
+      (void)plugin_set_ctx(wv[i]->ctx);
+      (*callback)(wv[i]->ds, &wv[i]->vl, &wf->wf_udata);
+    }
+    return;
+  }
+
+  plugin_write_batch_cb callback = wf->wf_callback;
+  const data_set_t *ds[WRITE_BATCH_SIZE];
+  const value_list_t *vl[WRITE_BATCH_SIZE];
+
+  /* One call per run of values from plugins with the same interval, so that
+   * the context is right for all of them. */
+  size_t first = 0;
+  for (size_t i = 0; i < wv_num; i++) {
+    ds[i] = wv[i]->ds;
+    vl[i] = &wv[i]->vl;
+
+    if ((i + 1 < wv_num) &&
+        (wv[i + 1]->ctx.interval == wv[first]->ctx.interval))
       continue;
 
-    plugin_dispatch_values_internal(vl);
+    (void)plugin_set_ctx(wv[first]->ctx);
+    (*callback)(ds + first, vl + first, i + 1 - first, &wf->wf_udata);
+    first = i + 1;
+  }
+} /* }}} void plugin_write_func_call */
 
-    plugin_value_list_free(vl);
+static void *plugin_write_func_thread(void *args) /* {{{ */
+{
+  write_func_t *wf = args;
+
+  while (42) {
+    write_value_t *wv[WRITE_BATCH_SIZE];
+    size_t wv_num = 0;
+
+    pthread_mutex_lock(&wf->wf_lock);
+    while (wf->wf_loop && (wf->wf_queue_head == NULL))
+      pthread_cond_wait(&wf->wf_cond, &wf->wf_lock);
+
+    /* Values already queued are written before shutting down, unless the
+     * writer is too slow to get rid of them. */
+    if ((wf->wf_queue_head == NULL) ||
+        (!wf->wf_loop && (cdtime() > wf->wf_drain_deadline))) {
+      pthread_mutex_unlock(&wf->wf_lock);
+      break;
+    }
+
+    while ((wf->wf_queue_head != NULL) && (wv_num < WRITE_BATCH_SIZE)) {
+      write_entry_t *e = wf->wf_queue_head;
+      wf->wf_queue_head = e->next;
+      wf->wf_queue_length--;
+      wv[wv_num++] = e->value;
+      slab_free(write_entry_slab, e);
+    }
+    if (wf->wf_queue_head == NULL)
+      wf->wf_queue_tail = NULL;
+    pthread_mutex_unlock(&wf->wf_lock);
+
+    plugin_write_func_call(wf, wv, wv_num);
+
+    for (size_t i = 0; i < wv_num; i++)
+      write_value_release(wv[i]);
   }
 
   pthread_exit(NULL);
   return (void *)0;
-} /* }}} void *plugin_write_thread */
+} /* }}} void *plugin_write_func_thread */
+
+static void start_write_func(write_func_t *wf, const char *name) /* {{{ */
+{
+  if (wf->wf_threads != NULL)
+    return;
+
+  /* Limits of the plugin, falling back to the global ones. */
+  wf->wf_limit_high = wf->wf_ctx.write_queue_limit_high;
+  wf->wf_limit_low = wf->wf_ctx.write_queue_limit_low;
+  if (wf->wf_limit_high <= 0) {
+    wf->wf_limit_high = write_limit_high;
+    if (wf->wf_limit_low <= 0)
+      wf->wf_limit_low = write_limit_low;
+  }
+  if (wf->wf_limit_high <= 0) {
+    /* Without limits, a stalled plugin would still grow its queue without
+     * bound. Values are only dropped once the queue is full. */
+    wf->wf_limit_high = DEFAULT_WRITE_QUEUE_SIZE;
+    wf->wf_limit_low = DEFAULT_WRITE_QUEUE_SIZE;
+  }
+  if ((wf->wf_limit_low <= 0) || (wf->wf_limit_low > wf->wf_limit_high))
+    wf->wf_limit_low = wf->wf_limit_high / 2;
+
+  size_t num = (wf->wf_ctx.write_threads > 0)
+                   ? (size_t)wf->wf_ctx.write_threads
+                   : 1;
+  wf->wf_threads = calloc(num, sizeof(*wf->wf_threads));
+  if (wf->wf_threads == NULL) {
+    ERROR("plugin: start_write_func: calloc failed.");
+    return;
+  }
+
+  wf->wf_loop = true;
+  for (size_t i = 0; i < num; i++) {
+    int status = pthread_create(wf->wf_threads + wf->wf_threads_num,
+                                /* attr = */ NULL, plugin_write_func_thread,
+                                /* arg = */ wf);
+    if (status != 0) {
+      ERROR("plugin: start_write_func: pthread_create failed with status %i "
+            "(%s).",
+            status, STRERROR(status));
+      break;
+    }
+
+    char thread_name[THREAD_NAME_MAX];
+    snprintf(thread_name, sizeof(thread_name), "w:%s", name);
+    set_thread_name(wf->wf_threads[wf->wf_threads_num], thread_name);
+
+    wf->wf_threads_num++;
+  } /* for (i) */
+
+  /* Without threads, values are written synchronously. */
+  if (wf->wf_threads_num == 0)
+    sfree(wf->wf_threads);
+} /* }}} void start_write_func */
+
+static void stop_write_func(write_func_t *wf, const char *name) /* {{{ */
+{
+  if (wf->wf_threads == NULL)
+    return;
+
+  pthread_mutex_lock(&wf->wf_lock);
+  wf->wf_loop = false;
+  wf->wf_drain_deadline = cdtime() + WRITE_DRAIN_TIMEOUT;
+  pthread_cond_broadcast(&wf->wf_cond);
+  pthread_mutex_unlock(&wf->wf_lock);
+
+  for (size_t i = 0; i < wf->wf_threads_num; i++) {
+    if (pthread_join(wf->wf_threads[i], NULL) != 0) {
+      ERROR("plugin: stop_write_func: pthread_join failed.");
+    }
+  }
+  sfree(wf->wf_threads);
+  wf->wf_threads_num = 0;
+
+  pthread_mutex_lock(&wf->wf_lock);
+  long num = wf->wf_queue_length;
+  while (wf->wf_queue_head != NULL) {
+    write_entry_t *e = wf->wf_queue_head;
+    wf->wf_queue_head = e->next;
+    write_value_release(e->value);
+    slab_free(write_entry_slab, e);
+  }
+  wf->wf_queue_tail = NULL;
+  wf->wf_queue_length = 0;
+  pthread_mutex_unlock(&wf->wf_lock);
+
+  if (num > 0) {
+    WARNING("plugin: %ld value list%s left in the queue of \"%s\" after "
+            "shutting down its write threads.",
+            num, (num == 1) ? " was" : "s were", name);
+  }
+} /* }}} void stop_write_func */
 
 static void start_write_threads(size_t num) /* {{{ */
 {
@@ -848,6 +1286,9 @@ static void start_write_threads(size_t num) /* {{{ */
 
     write_threads_num++;
   } /* for (i) */
+
+  for (llentry_t *le = llist_head(list_write); le != NULL; le = le->next)
+    start_write_func(le->value, le->key);
 } /* }}} void start_write_threads */
 
 static void stop_write_threads(void) /* {{{ */
@@ -860,11 +1301,9 @@ static void stop_write_threads(void) /* {{{ */
 
   INFO("collectd: Stopping %" PRIsz " write threads.", write_threads_num);
 
-  pthread_mutex_lock(&write_lock);
   write_loop = false;
-  DEBUG("plugin: stop_write_threads: Signalling `write_cond'");
-  pthread_cond_broadcast(&write_cond);
-  pthread_mutex_unlock(&write_lock);
+  DEBUG("plugin: stop_write_threads: Waking the write threads");
+  ring_shutdown(write_ring);
 
   for (i = 0; i < write_threads_num; i++) {
     if (pthread_join(write_threads[i], NULL) != 0) {
@@ -875,25 +1314,21 @@ static void stop_write_threads(void) /* {{{ */
   sfree(write_threads);
   write_threads_num = 0;
 
-  pthread_mutex_lock(&write_lock);
   i = 0;
-  for (q = write_queue_head; q != NULL;) {
-    write_queue_t *q1 = q;
-    plugin_value_list_free(q->vl);
-    q = q->next;
-    sfree(q1);
-    i++;
-  }
-  write_queue_head = NULL;
-  write_queue_tail = NULL;
-  write_queue_length = 0;
-  pthread_mutex_unlock(&write_lock);
+  while ((q = ring_pop(write_ring)) != NULL) {
+    i += q->vl_num;
+    write_queue_destroy(q);
+  }
 
   if (i > 0) {
     WARNING("plugin: %" PRIsz " value list%s left after shutting down "
             "the write threads.",
             i, (i == 1) ? " was" : "s were");
   }
+
+  /* Nothing is added to the queues of the writers any more. */
+  for (llentry_t *le = llist_head(list_write); le != NULL; le = le->next)
+    stop_write_func(le->value, le->key);
 } /* }}} void stop_write_threads */
 
 /*
@@ -1211,11 +1646,62 @@ int plugin_register_complex_read(const char *group, const char *name,
   return status;
 } /* int plugin_register_complex_read */
 
+static int plugin_register_write_func(const char *name, /* {{{ */
+                                      void *callback, bool batch,
+                                      user_data_t const *ud) {
+  write_func_t *wf;
+  int status;
+
+  wf = calloc(1, sizeof(*wf));
+  if (wf == NULL) {
+    free_userdata(ud);
+    ERROR("plugin_register_write: calloc failed.");
+    return -1;
+  }
+
+  wf->wf_callback = callback;
+  wf->wf_batch = batch;
+  if (ud == NULL) {
+    wf->wf_udata.data = NULL;
+    wf->wf_udata.free_func = NULL;
+  } else {
+    wf->wf_udata = *ud;
+  }
+  wf->wf_ctx = plugin_get_ctx();
+
+  pthread_mutex_init(&wf->wf_lock, /* attr = */ NULL);
+  pthread_cond_init(&wf->wf_cond, /* attr = */ NULL);
+  C_COMPLAIN_INIT(&wf->wf_complaint);
+
+  /* The threads of a writer being replaced must not outlive it. */
+  llentry_t *le = llist_search(list_write, name);
+  if (le != NULL)
+    stop_write_func(le->value, le->key);
+
+  status = register_callback(&list_write, name, (callback_func_t *)wf);
+  if (status != 0)
+    return status;
+
+  /* Registered after the write threads have been started. */
+  if (write_threads != NULL)
+    start_write_func(wf, name);
+
+  return 0;
+} /* }}} int plugin_register_write_func */
+
 int plugin_register_write(const char *name, plugin_write_cb callback,
                           user_data_t const *ud) {
-  return create_register_callback(&list_write, name, (void *)callback, ud);
+  return plugin_register_write_func(name, (void *)callback, /* batch = */ false,
+                                    ud);
 } /* int plugin_register_write */
 
+int plugin_register_write_batch(const char *name,
+                                plugin_write_batch_cb callback,
+                                user_data_t const *ud) {
+  return plugin_register_write_func(name, (void *)callback, /* batch = */ true,
+                                    ud);
+} /* int plugin_register_write_batch */
+
 static int plugin_flush_timeout_callback(user_data_t *ud) {
   flush_callback_t *cb = ud->data;
 
@@ -1485,6 +1971,10 @@ int plugin_unregister_read_group(const char *group) /* {{{ */
 } /* }}} int plugin_unregister_read_group */
 
 int plugin_unregister_write(const char *name) {
+  llentry_t *le = llist_search(list_write, name);
+  if (le != NULL)
+    stop_write_func(le->value, le->key);
+
   return plugin_unregister(list_write, name);
 }
 
@@ -1581,6 +2071,33 @@ int plugin_init_all(void) {
     write_threads_num = 5;
   }
 
+  if (write_queue_slab == NULL) {
+    write_queue_slab =
+        slab_create(sizeof(write_queue_t) + sizeof(value_list_t) +
+                    WRITE_VALUES_INLINE * sizeof(value_t));
+    write_value_slab = slab_create(sizeof(write_value_t) +
+                                   WRITE_VALUES_INLINE * sizeof(value_t));
+    write_entry_slab = slab_create(sizeof(write_entry_t));
+    if ((write_queue_slab == NULL) || (write_value_slab == NULL) ||
+        (write_entry_slab == NULL)) {
+      ERROR("plugin_init_all: Allocating the write caches failed.");
+      return -1;
+    }
+  }
+
+  /* The size of the ring limits the number of queued value lists, see
+   * plugin_write_enqueue(). It is WriteQueueLimitHigh if set and the default
+   * size otherwise. */
+  if (write_ring == NULL) {
+    write_ring = ring_create((write_limit_high > 0)
+                                 ? (size_t)write_limit_high
+                                 : DEFAULT_WRITE_QUEUE_SIZE);
+    if (write_ring == NULL) {
+      ERROR("plugin_init_all: Allocating the write queue failed.");
+      return -1;
+    }
+  }
+
   if ((list_init == NULL) && (read_heap == NULL))
     return ret;
 
@@ -1686,9 +2203,58 @@ int plugin_read_all_once(void) {
   return return_status;
 } /* int plugin_read_all_once */
 
+/* Data sets passed in by the caller may live on its stack. Only registered
+ * ones outlive the call and can be queued. */
+static bool plugin_ds_is_registered(const data_set_t *ds) /* {{{ */
+{
+  data_set_t *registered = NULL;
+
+  if (data_sets == NULL)
+    return false;
+  if (c_avl_get(data_sets, ds->type, (void *)&registered) != 0)
+    return false;
+
+  return registered == ds;
+} /* }}} bool plugin_ds_is_registered */
+
+/* Queues the value for the writer or, if it has no threads, calls it
+ * directly. `*wv' is created on first use and shared between writers. */
+static int plugin_write_func(write_func_t *wf, const char *name, /* {{{ */
+                             const data_set_t *ds, const value_list_t *vl,
+                             bool queue, write_value_t **wv) {
+  if (!queue || (wf->wf_threads_num == 0)) {
+    /* do not switch plugin context; rather keep the context (interval)
+     * information of the calling read plugin */
+
+    DEBUG("plugin: plugin_write: Writing values via %s.", name);
+    if (wf->wf_batch) {
+      plugin_write_batch_cb callback = wf->wf_callback;
+      return (*callback)(&ds, &vl, 1, &wf->wf_udata);
+    }
+
+    plugin_write_cb callback = wf->wf_callback;
+    return (*callback)(ds, vl, &wf->wf_udata);
+  }
+
+  if (*wv == NULL) {
+    *wv = write_value_create(ds, vl);
+    if (*wv == NULL) {
+      ERROR("plugin_write: write_value_create failed.");
+      return ENOMEM;
+    }
+  }
+
+  DEBUG("plugin: plugin_write: Queueing values for %s.", name);
+  int status = write_func_enqueue(wf, *wv, name);
+  if (status == EAGAIN) /* dropped */
+    return 0;
+  return status;
+} /* }}} int plugin_write_func */
+
 int plugin_write(const char *plugin, /* {{{ */
                  const data_set_t *ds, const value_list_t *vl) {
   llentry_t *le;
+  write_value_t *wv = NULL;
   int status;
 
   if (vl == NULL)
@@ -1705,21 +2271,15 @@ int plugin_write(const char *plugin, /* {{{ */
     }
   }
 
+  bool queue = plugin_ds_is_registered(ds);
+
   if (plugin == NULL) {
     int success = 0;
     int failure = 0;
 
     le = llist_head(list_write);
     while (le != NULL) {
-      callback_func_t *cf = le->value;
-      plugin_write_cb callback;
-
-      /* do not switch plugin context; rather keep the context (interval)
-       * information of the calling read plugin */
-
-      DEBUG("plugin: plugin_write: Writing values via %s.", le->key);
-      callback = cf->cf_callback;
-      status = (*callback)(ds, vl, &cf->cf_udata);
+      status = plugin_write_func(le->value, le->key, ds, vl, queue, &wv);
       if (status != 0)
         failure++;
       else
@@ -1734,9 +2294,6 @@ int plugin_write(const char *plugin, /* {{{ */
       status = 0;
   } else /* plugin != NULL */
   {
-    callback_func_t *cf;
-    plugin_write_cb callback;
-
     le = llist_head(list_write);
     while (le != NULL) {
       if (strcasecmp(plugin, le->key) == 0)
@@ -1748,16 +2305,12 @@ int plugin_write(const char *plugin, /* {{{ */
     if (le == NULL)
       return ENOENT;
 
-    cf = le->value;
-
-    /* do not switch plugin context; rather keep the context (interval)
-     * information of the calling read plugin */
-
-    DEBUG("plugin: plugin_write: Writing values via %s.", le->key);
-    callback = cf->cf_callback;
-    status = (*callback)(ds, vl, &cf->cf_udata);
+    status = plugin_write_func(le->value, le->key, ds, vl, queue, &wv);
   }
 
+  /* Drop the reference taken on creation, the queues hold their own. */
+  write_value_release(wv);
+
   return status;
 } /* }}} int plugin_write */
 
@@ -2008,9 +2561,7 @@ static double get_drop_probability(void) /* {{{ */
   long size;
   long wql;
 
-  pthread_mutex_lock(&write_lock);
-  wql = write_queue_length;
-  pthread_mutex_unlock(&write_lock);
+  wql = __atomic_load_n(&write_queue_length, __ATOMIC_RELAXED);
 
   if (wql < write_limit_low)
     return 0.0;
@@ -2064,29 +2615,115 @@ static bool check_drop_value(void) /* {{{ */
 } /* }}} bool check_drop_value */
 
 int plugin_dispatch_values(value_list_t const *vl) {
-  int status;
+  return plugin_dispatch_values_batch(vl, 1);
+}
+
+int plugin_dispatch_values_batch(value_list_t const *vl, size_t vl_num) {
   static pthread_mutex_t statistics_lock = PTHREAD_MUTEX_INITIALIZER;
+  size_t dropped = 0;
+  int status;
 
-  if (check_drop_value()) {
-    if (record_statistics) {
-      pthread_mutex_lock(&statistics_lock);
-      stats_values_dropped++;
-      pthread_mutex_unlock(&statistics_lock);
-    }
+  if (vl_num == 0)
     return 0;
+
+  status = plugin_write_enqueue(vl, vl_num, &dropped);
+  if (status == EAGAIN) {
+    static c_complain_t full_complaint = C_COMPLAIN_INIT_STATIC;
+
+    c_complain(LOG_WARNING, &full_complaint,
+               "plugin_dispatch_values: The write queue is full. Values are "
+               "being dropped.");
+    dropped = vl_num;
   }
 
-  status = plugin_write_enqueue(vl);
-  if (status != 0) {
+  if ((dropped > 0) && record_statistics) {
+    pthread_mutex_lock(&statistics_lock);
+    stats_values_dropped += (derive_t)dropped;
+    pthread_mutex_unlock(&statistics_lock);
+  }
+
+  if ((status != 0) && (status != EAGAIN)) {
     ERROR("plugin_dispatch_values: plugin_write_enqueue failed with status %i "
           "(%s).",
           status, STRERROR(status));
-    return status;
   }
 
-  return 0;
+  return status;
 }
 
+int plugin_batch_add(plugin_batch_t *batch, value_list_t const *vl) /* {{{ */
+{
+  if (batch->vl_num == batch->vl_size) {
+    size_t size = (batch->vl_size == 0) ? 16 : 2 * batch->vl_size;
+    value_list_t *tmp = realloc(batch->vl, size * sizeof(*tmp));
+    if (tmp == NULL)
+      return plugin_dispatch_values(vl);
+    batch->vl = tmp;
+    batch->vl_size = size;
+  }
+
+  if (batch->values_num + vl->values_len > batch->values_size) {
+    size_t size = (batch->values_size == 0) ? 32 : 2 * batch->values_size;
+    while (size < batch->values_num + vl->values_len)
+      size *= 2;
+    value_t *tmp = realloc(batch->values, size * sizeof(*tmp));
+    if (tmp == NULL)
+      return plugin_dispatch_values(vl);
+    batch->values = tmp;
+    batch->values_size = size;
+  }
+
+  /* The caller may free or reuse the meta data before the batch is
+   * dispatched. */
+  meta_data_t *meta = meta_data_clone(vl->meta);
+  if ((meta == NULL) && (vl->meta != NULL))
+    return plugin_dispatch_values(vl);
+
+  /* The values pointers are set when dispatching, the array may still move. */
+  batch->vl[batch->vl_num] = *vl;
+  batch->vl[batch->vl_num].values = NULL;
+  batch->vl[batch->vl_num].meta = meta;
+  batch->vl_num++;
+
+  memcpy(batch->values + batch->values_num, vl->values,
+         vl->values_len * sizeof(*batch->values));
+  batch->values_num += vl->values_len;
+
+  return 0;
+} /* }}} int plugin_batch_add */
+
+int plugin_batch_dispatch(plugin_batch_t *batch) /* {{{ */
+{
+  value_t *values = batch->values;
+  for (size_t i = 0; i < batch->vl_num; i++) {
+    batch->vl[i].values = values;
+    values += batch->vl[i].values_len;
+  }
+
+  int status = plugin_dispatch_values_batch(batch->vl, batch->vl_num);
+
+  /* The write queue holds copies of the meta data. */
+  for (size_t i = 0; i < batch->vl_num; i++) {
+    meta_data_destroy(batch->vl[i].meta);
+    batch->vl[i].meta = NULL;
+  }
+
+  batch->vl_num = 0;
+  batch->values_num = 0;
+  return status;
+} /* }}} int plugin_batch_dispatch */
+
+void plugin_batch_free(plugin_batch_t *batch) /* {{{ */
+{
+  for (size_t i = 0; i < batch->vl_num; i++)
+    meta_data_destroy(batch->vl[i].meta);
+
+  sfree(batch->vl);
+  sfree(batch->values);
+  batch->vl_num = batch->vl_size = 0;
+  batch->values_num = batch->values_size = 0;
+} /* }}} void plugin_batch_free */
+
 __attribute__((sentinel)) int
 plugin_dispatch_multivalue(value_list_t const *template, /* {{{ */
                            bool store_percentage, int store_type, ...) {
@@ -2152,7 +2789,7 @@ plugin_dispatch_multivalue(value_list_t const *template, /* {{{ */
       failed++;
     }
 
-    status = plugin_write_enqueue(vl);
+    status = plugin_write_enqueue(vl, 1, /* dropped = */ NULL);
     if (status != 0)
       failed++;
   }
@@ -174,6 +174,11 @@ struct plugin_ctx_s {
   cdtime_t interval;
   cdtime_t flush_interval;
   cdtime_t flush_timeout;
+  /* Worker threads and queue limits of the plugin's write callbacks. Zero
+   * selects the default. */
+  int write_threads;
+  int write_queue_limit_high;
+  int write_queue_limit_low;
 };
 typedef struct plugin_ctx_s plugin_ctx_t;
 
@@ -184,6 +189,10 @@ typedef int (*plugin_init_cb)(void);
 typedef int (*plugin_read_cb)(user_data_t *);
 typedef int (*plugin_write_cb)(const data_set_t *, const value_list_t *,
                                user_data_t *);
+/* Receives `num' value lists and their data sets at once. */
+typedef int (*plugin_write_batch_cb)(const data_set_t *const *ds,
+                                     const value_list_t *const *vl, size_t num,
+                                     user_data_t *);
 typedef int (*plugin_flush_cb)(cdtime_t timeout, const char *identifier,
                                user_data_t *);
 /* "missing" callback. Returns less than zero on failure, zero if other
@@ -245,8 +254,14 @@ int plugin_shutdown_all(void);
  *  Calls the write function of the given plugin with the provided data set and
  *  value list. It differs from `plugin_dispatch_value' in that it does not
  *  update the cache, does not do threshold checking, call the chain subsystem
- *  and so on. It looks up the requested plugin and invokes the function, end
- *  of story.
+ *  and so on. It looks up the requested plugin and hands the value to its
+ *  write function.
+ *
+ *  Each write callback has a queue and threads of its own, so that a slow
+ *  plugin does not hold up the others. The value list is copied once and
+ *  shared by the queues it is added to. Write callbacks without running
+ *  threads, and data sets which have not been registered, are called
+ *  directly.
  *
  * ARGUMENTS
  *  plugin     Name of the plugin. If NULL, the value is sent to all registered
@@ -258,7 +273,7 @@ int plugin_shutdown_all(void);
  * RETURN VALUE
  *  Returns zero upon success or non-zero if an error occurred. If `plugin' is
  *  NULL and more than one plugin is called, an error is only returned if *all*
- *  plugins fail.
+ *  plugins fail. A value dropped because a queue is full is not an error.
  *
  * NOTES
  *  This is the function used by the `write' built-in target. May be used by
@@ -288,6 +303,14 @@ int plugin_register_complex_read(const char *group, const char *name,
                                  user_data_t const *user_data);
 int plugin_register_write(const char *name, plugin_write_cb callback,
                           user_data_t const *user_data);
+/* Like plugin_register_write, but the write threads hand the callback up to
+ * 64 queued value lists at once, so that it can format and send them
+ * together. All value lists of a batch come from read plugins with the same
+ * interval, and the plugin context is theirs. Values that cannot be queued
+ * (see plugin_write) are passed one at a time. */
+int plugin_register_write_batch(const char *name,
+                                plugin_write_batch_cb callback,
+                                user_data_t const *user_data);
 int plugin_register_flush(const char *name, plugin_flush_cb callback,
                           user_data_t const *user_data);
 int plugin_register_missing(const char *name, plugin_missing_cb callback,
@@ -341,6 +364,50 @@ void plugin_log_available_writers(void);
  */
 int plugin_dispatch_values(value_list_t const *vl);
 
+/*
+ * NAME
+ *  plugin_dispatch_values_batch
+ *
+ * DESCRIPTION
+ *  Dispatches `vl_num' value lists, like calling `plugin_dispatch_values' for
+ *  each of them. The value lists are copied into a single block of memory and
+ *  handed to the write threads at once, which is considerably cheaper for
+ *  plugins dispatching many value lists per read.
+ *
+ * ARGUMENTS
+ *  `vl'        Array of value lists.
+ *  `vl_num'    Number of value lists in `vl'.
+ *
+ * RETURN VALUE
+ *  Zero on success, EAGAIN if the write queue is full and the value lists were
+ *  dropped, another error code otherwise.
+ */
+int plugin_dispatch_values_batch(value_list_t const *vl, size_t vl_num);
+
+/*
+ * Collects value lists for `plugin_dispatch_values_batch', so that plugins
+ * need not know in advance how many value lists they dispatch. Zero
+ * initialize it; the memory is kept across dispatches for reuse.
+ */
+typedef struct plugin_batch_s {
+  value_list_t *vl;
+  size_t vl_num;
+  size_t vl_size;
+  value_t *values;
+  size_t values_num;
+  size_t values_size;
+} plugin_batch_t;
+
+/* Copies the value list, its values and its meta data into the batch. If
+ * memory cannot be allocated, the value list is dispatched right away. */
+int plugin_batch_add(plugin_batch_t *batch, value_list_t const *vl);
+
+/* Dispatches the value lists collected so far and empties the batch. */
+int plugin_batch_dispatch(plugin_batch_t *batch);
+
+/* Frees the memory of a batch, discarding value lists not dispatched yet. */
+void plugin_batch_free(plugin_batch_t *batch);
+
 /*
  * NAME
  *  plugin_dispatch_multivalue
@@ -31,13 +31,23 @@
 #include "common.h"
 #include "meta_data.h"
 #include "plugin.h"
-#include "utils_avltree.h"
 #include "utils_cache.h"
+#include "utils_intern.h"
 
 #include <assert.h>
 
 typedef struct cache_entry_s {
-  char name[6 * DATA_MAX_NAME_LEN];
+  /* Next entry in the same bucket */
+  struct cache_entry_s *next;
+  uint64_t hash;
+
+  /* Parts of the identifier, interned. See utils_intern.h. */
+  const char *host;
+  const char *plugin;
+  const char *plugin_instance;
+  const char *type;
+  const char *type_instance;
+
   size_t values_num;
   gauge_t *values_gauge;
   value_t *values_raw;
@@ -69,22 +79,176 @@ typedef struct cache_entry_s {
   meta_data_t *meta;
 } cache_entry_t;
 
+/* The cache is split into partitions by a hash of the identifier, each with
+ * its own lock and hash table, so that threads updating or reading different
+ * values rarely wait for each other. Must be a power of two. */
+#ifndef UC_SHARDS_NUM
+#define UC_SHARDS_NUM 64
+#endif
+
+/* Initial number of buckets of a shard, must be a power of two. The table
+ * doubles whenever it holds more entries than buckets. */
+#define UC_BUCKETS_INITIAL 16
+
+/* Aligned, so that the locks of neighbouring shards do not share a cache
+ * line. */
+typedef struct cache_shard_s {
+  pthread_mutex_t lock;
+  cache_entry_t **buckets;
+  size_t buckets_num;
+  size_t entries_num;
+} __attribute__((aligned(64))) cache_shard_t;
+
 struct uc_iter_s {
-  c_avl_iterator_t *iter;
+  /* Shard being iterated, its lock is held while `locked' is true. */
+  size_t shard;
+  _Bool locked;
+  /* Next bucket to look at */
+  size_t bucket;
 
-  char *name;
   cache_entry_t *entry;
+  char name[6 * DATA_MAX_NAME_LEN];
 };
 
-static c_avl_tree_t *cache_tree;
-static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_shard_t cache_shards[UC_SHARDS_NUM];
+static _Bool cache_initialized;
+
+/* An identifier as the pieces of its name, "host/plugin-plugin_instance/type-
+ * type_instance". Identifiers are compared and hashed by the characters of the
+ * name, so that a value list and the name of its entry, as used by the
+ * "_by_name" functions, refer to the same entry without formatting the name.
+ * Unused pieces are empty strings. */
+#define UC_IDENT_PIECES 9
+#define UC_IDENT_FORMAT "%s%s%s%s%s%s%s%s%s"
+#define UC_IDENT_ARGS(id)                                                      \
+  (id)->pieces[0], (id)->pieces[1], (id)->pieces[2], (id)->pieces[3],          \
+      (id)->pieces[4], (id)->pieces[5], (id)->pieces[6], (id)->pieces[7],      \
+      (id)->pieces[8]
+
+typedef struct {
+  const char *pieces[UC_IDENT_PIECES];
+} uc_ident_t;
+
+static void ident_from_parts(uc_ident_t *id, const char *host,
+                             const char *plugin, const char *plugin_instance,
+                             const char *type, const char *type_instance) {
+  _Bool have_pi = (plugin_instance != NULL) && (plugin_instance[0] != 0);
+  _Bool have_ti = (type_instance != NULL) && (type_instance[0] != 0);
+
+  *id = (uc_ident_t){{
+      host, "/", plugin, have_pi ? "-" : "", have_pi ? plugin_instance : "",
+      "/", type, have_ti ? "-" : "", have_ti ? type_instance : "",
+  }};
+} /* void ident_from_parts */
+
+static void ident_from_vl(uc_ident_t *id, const value_list_t *vl) {
+  ident_from_parts(id, vl->host, vl->plugin, vl->plugin_instance, vl->type,
+                   vl->type_instance);
+} /* void ident_from_vl */
+
+static void ident_from_entry(uc_ident_t *id, const cache_entry_t *ce) {
+  ident_from_parts(id, ce->host, ce->plugin, ce->plugin_instance, ce->type,
+                   ce->type_instance);
+} /* void ident_from_entry */
+
+static void ident_from_name(uc_ident_t *id, const char *name) {
+  *id = (uc_ident_t){{name, "", "", "", "", "", "", "", ""}};
+} /* void ident_from_name */
+
+/* 64 bit FNV-1a hash of the name. The upper half selects the shard, the lower
+ * half the bucket within it. */
+static uint64_t ident_hash(const uc_ident_t *id) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (size_t i = 0; i < UC_IDENT_PIECES; i++) {
+    for (const unsigned char *c = (const unsigned char *)id->pieces[i];
+         *c != 0; c++) {
+      hash ^= *c;
+      hash *= 1099511628211ULL;
+    }
+  }
 
-static int cache_compare(const cache_entry_t *a, const cache_entry_t *b) {
-#if COLLECT_DEBUG
-  assert((a != NULL) && (b != NULL));
-#endif
-  return strcmp(a->name, b->name);
-} /* int cache_compare */
+  return hash;
+} /* uint64_t ident_hash */
+
+static _Bool ident_equal(const uc_ident_t *a, const uc_ident_t *b) {
+  size_t a_idx = 0;
+  size_t b_idx = 0;
+  const char *a_ptr = a->pieces[0];
+  const char *b_ptr = b->pieces[0];
+
+  while (1) {
+    while ((*a_ptr == 0) && (a_idx + 1 < UC_IDENT_PIECES))
+      a_ptr = a->pieces[++a_idx];
+    while ((*b_ptr == 0) && (b_idx + 1 < UC_IDENT_PIECES))
+      b_ptr = b->pieces[++b_idx];
+
+    if (*a_ptr != *b_ptr)
+      return 0;
+    if (*a_ptr == 0)
+      return 1;
+
+    a_ptr++;
+    b_ptr++;
+  }
+} /* _Bool ident_equal */
+
+static cache_shard_t *cache_shard(uint64_t hash) {
+  return cache_shards + ((hash >> 32) & (UC_SHARDS_NUM - 1));
+} /* cache_shard_t *cache_shard */
+
+/* Must hold `shard->lock' */
+static cache_entry_t *cache_lookup(cache_shard_t *shard, const uc_ident_t *id,
+                                   uint64_t hash) {
+  for (cache_entry_t *ce = shard->buckets[hash & (shard->buckets_num - 1)];
+       ce != NULL; ce = ce->next) {
+    if (ce->hash != hash)
+      continue;
+
+    uc_ident_t ce_id;
+    ident_from_entry(&ce_id, ce);
+    if (ident_equal(&ce_id, id))
+      return ce;
+  }
+
+  return NULL;
+} /* cache_entry_t *cache_lookup */
+
+/* Must hold `shard->lock' */
+static void cache_grow(cache_shard_t *shard) {
+  size_t buckets_num = 2 * shard->buckets_num;
+  cache_entry_t **buckets = calloc(buckets_num, sizeof(*buckets));
+  /* Longer chains are slower, but work just as well. */
+  if (buckets == NULL)
+    return;
+
+  for (size_t i = 0; i < shard->buckets_num; i++) {
+    cache_entry_t *ce = shard->buckets[i];
+    while (ce != NULL) {
+      cache_entry_t *next = ce->next;
+      ce->next = buckets[ce->hash & (buckets_num - 1)];
+      buckets[ce->hash & (buckets_num - 1)] = ce;
+      ce = next;
+    }
+  }
+
+  sfree(shard->buckets);
+  shard->buckets = buckets;
+  shard->buckets_num = buckets_num;
+} /* void cache_grow */
+
+/* Must hold `shard->lock' */
+static void cache_unlink(cache_shard_t *shard, cache_entry_t *ce) {
+  cache_entry_t **prev = &shard->buckets[ce->hash & (shard->buckets_num - 1)];
+
+  while (*prev != ce) {
+    assert(*prev != NULL);
+    prev = &(*prev)->next;
+  }
+  *prev = ce->next;
+  ce->next = NULL;
+  shard->entries_num--;
+} /* void cache_unlink */
 
 static cache_entry_t *cache_alloc(size_t values_num) {
   cache_entry_t *ce;
@@ -117,6 +281,12 @@ static void cache_free(cache_entry_t *ce) {
   if (ce == NULL)
     return;
 
+  intern_put(ce->host);
+  intern_put(ce->plugin);
+  intern_put(ce->plugin_instance);
+  intern_put(ce->type);
+  intern_put(ce->type_instance);
+
   sfree(ce->values_gauge);
   sfree(ce->values_raw);
   sfree(ce->history);
@@ -138,27 +308,31 @@ static void uc_check_range(const data_set_t *ds, cache_entry_t *ce) {
   }
 } /* void uc_check_range */
 
-static int uc_insert(const data_set_t *ds, const value_list_t *vl,
-                     const char *key) {
-  char *key_copy;
+static int uc_insert(cache_shard_t *shard, const data_set_t *ds,
+                     const value_list_t *vl, uint64_t hash) {
   cache_entry_t *ce;
 
-  /* `cache_lock' has been locked by `uc_update' */
-
-  key_copy = strdup(key);
-  if (key_copy == NULL) {
-    ERROR("uc_insert: strdup failed.");
-    return -1;
-  }
+  /* `shard->lock' has been locked by `uc_update' */
 
   ce = cache_alloc(ds->ds_num);
   if (ce == NULL) {
-    sfree(key_copy);
     ERROR("uc_insert: cache_alloc (%" PRIsz ") failed.", ds->ds_num);
     return -1;
   }
 
-  sstrncpy(ce->name, key, sizeof(ce->name));
+  ce->hash = hash;
+  ce->host = intern_get(vl->host);
+  ce->plugin = intern_get(vl->plugin);
+  ce->plugin_instance = intern_get(vl->plugin_instance);
+  ce->type = intern_get(vl->type);
+  ce->type_instance = intern_get(vl->type_instance);
+  if ((ce->host == NULL) || (ce->plugin == NULL) ||
+      (ce->plugin_instance == NULL) || (ce->type == NULL) ||
+      (ce->type_instance == NULL)) {
+    ERROR("uc_insert: intern_get failed.");
+    cache_free(ce);
+    return -1;
+  }
 
   for (size_t i = 0; i < ds->ds_num; i++) {
     switch (ds->ds[i].type) {
@@ -189,7 +363,6 @@ static int uc_insert(const data_set_t *ds, const value_list_t *vl,
       /* This shouldn't happen. */
       ERROR("uc_insert: Don't know how to handle data source type %i.",
             ds->ds[i].type);
-      sfree(key_copy);
       cache_free(ce);
       return -1;
     } /* switch (ds->ds[i].type) */
@@ -203,65 +376,88 @@ static int uc_insert(const data_set_t *ds, const value_list_t *vl,
   ce->interval = vl->interval;
   ce->state = STATE_OKAY;
 
-  if (c_avl_insert(cache_tree, key_copy, ce) != 0) {
-    sfree(key_copy);
-    ERROR("uc_insert: c_avl_insert failed.");
-    return -1;
-  }
+  if (shard->entries_num >= shard->buckets_num)
+    cache_grow(shard);
+
+  ce->next = shard->buckets[hash & (shard->buckets_num - 1)];
+  shard->buckets[hash & (shard->buckets_num - 1)] = ce;
+  shard->entries_num++;
 
-  DEBUG("uc_insert: Added %s to the cache.", key);
+  DEBUG("uc_insert: Added %s/%s-%s/%s-%s to the cache.", vl->host, vl->plugin,
+        vl->plugin_instance, vl->type, vl->type_instance);
   return 0;
 } /* int uc_insert */
 
 int uc_init(void) {
-  if (cache_tree == NULL)
-    cache_tree =
-        c_avl_create((int (*)(const void *, const void *))cache_compare);
+  if (cache_initialized)
+    return 0;
+
+  for (size_t i = 0; i < UC_SHARDS_NUM; i++) {
+    pthread_mutex_init(&cache_shards[i].lock, /* attr = */ NULL);
+    cache_shards[i].buckets =
+        calloc(UC_BUCKETS_INITIAL, sizeof(*cache_shards[i].buckets));
+    if (cache_shards[i].buckets == NULL) {
+      ERROR("uc_init: calloc failed.");
+      return -1;
+    }
+    cache_shards[i].buckets_num = UC_BUCKETS_INITIAL;
+  }
 
+  cache_initialized = 1;
   return 0;
 } /* int uc_init */
 
 int uc_check_timeout(void) {
   struct {
     char *key;
+    uint64_t hash;
     cdtime_t time;
     cdtime_t interval;
   } *expired = NULL;
   size_t expired_num = 0;
 
-  pthread_mutex_lock(&cache_lock);
   cdtime_t now = cdtime();
 
-  /* Build a list of entries to be flushed */
-  c_avl_iterator_t *iter = c_avl_get_iterator(cache_tree);
-  char *key = NULL;
-  cache_entry_t *ce = NULL;
-  while (c_avl_iterator_next(iter, (void *)&key, (void *)&ce) == 0) {
-    /* If the entry is fresh enough, continue. */
-    if ((now - ce->last_update) < (ce->interval * timeout_g))
-      continue;
+  /* Build a list of entries to be flushed, one shard at a time. */
+  for (size_t i = 0; i < UC_SHARDS_NUM; i++) {
+    cache_shard_t *shard = cache_shards + i;
 
-    void *tmp = realloc(expired, (expired_num + 1) * sizeof(*expired));
-    if (tmp == NULL) {
-      ERROR("uc_check_timeout: realloc failed.");
-      continue;
-    }
-    expired = tmp;
+    pthread_mutex_lock(&shard->lock);
 
-    expired[expired_num].key = strdup(key);
-    expired[expired_num].time = ce->last_time;
-    expired[expired_num].interval = ce->interval;
+    for (size_t j = 0; j < shard->buckets_num; j++) {
+      for (cache_entry_t *ce = shard->buckets[j]; ce != NULL; ce = ce->next) {
+        /* If the entry is fresh enough, continue. */
+        if ((now - ce->last_update) < (ce->interval * timeout_g))
+          continue;
 
-    if (expired[expired_num].key == NULL) {
-      ERROR("uc_check_timeout: strdup failed.");
-      continue;
-    }
+        void *tmp = realloc(expired, (expired_num + 1) * sizeof(*expired));
+        if (tmp == NULL) {
+          ERROR("uc_check_timeout: realloc failed.");
+          continue;
+        }
+        expired = tmp;
+
+        uc_ident_t id;
+        char name[6 * DATA_MAX_NAME_LEN];
+        ident_from_entry(&id, ce);
+        snprintf(name, sizeof(name), UC_IDENT_FORMAT, UC_IDENT_ARGS(&id));
+
+        expired[expired_num].key = strdup(name);
+        expired[expired_num].hash = ce->hash;
+        expired[expired_num].time = ce->last_time;
+        expired[expired_num].interval = ce->interval;
 
-    expired_num++;
-  } /* while (c_avl_iterator_next) */
+        if (expired[expired_num].key == NULL) {
+          ERROR("uc_check_timeout: strdup failed.");
+          continue;
+        }
 
-  c_avl_iterator_destroy(iter);
-  pthread_mutex_unlock(&cache_lock);
+        expired_num++;
+      } /* for (ce) */
+    }   /* for (j = 0; j < shard->buckets_num; j++) */
+
+    pthread_mutex_unlock(&shard->lock);
+  } /* for (i = 0; i < UC_SHARDS_NUM; i++) */
 
   if (expired_num == 0) {
     sfree(expired);
@@ -290,56 +486,57 @@ int uc_check_timeout(void) {
   /* Now actually remove all the values from the cache. We don't re-evaluate
    * the timestamp again, so in theory it is possible we remove a value after
    * it is updated here. */
-  pthread_mutex_lock(&cache_lock);
   for (size_t i = 0; i < expired_num; i++) {
-    char *key = NULL;
-    cache_entry_t *value = NULL;
+    cache_shard_t *shard = cache_shard(expired[i].hash);
+    uc_ident_t id;
+
+    ident_from_name(&id, expired[i].key);
+
+    pthread_mutex_lock(&shard->lock);
+    cache_entry_t *ce = cache_lookup(shard, &id, expired[i].hash);
+    if (ce != NULL)
+      cache_unlink(shard, ce);
+    pthread_mutex_unlock(&shard->lock);
 
-    if (c_avl_remove(cache_tree, expired[i].key, (void *)&key,
-                     (void *)&value) != 0) {
-      ERROR("uc_check_timeout: c_avl_remove (\"%s\") failed.", expired[i].key);
+    if (ce == NULL) {
+      ERROR("uc_check_timeout: removing \"%s\" failed.", expired[i].key);
       sfree(expired[i].key);
       continue;
     }
-    sfree(key);
-    cache_free(value);
+    cache_free(ce);
 
     sfree(expired[i].key);
   } /* for (i = 0; i < expired_num; i++) */
-  pthread_mutex_unlock(&cache_lock);
 
   sfree(expired);
   return 0;
 } /* int uc_check_timeout */
 
 int uc_update(const data_set_t *ds, const value_list_t *vl) {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
+  uc_ident_t id;
   int status;
 
-  if (FORMAT_VL(name, sizeof(name), vl) != 0) {
-    ERROR("uc_update: FORMAT_VL failed.");
-    return -1;
-  }
+  ident_from_vl(&id, vl);
+  uint64_t hash = ident_hash(&id);
 
-  pthread_mutex_lock(&cache_lock);
+  cache_shard_t *shard = cache_shard(hash);
+  pthread_mutex_lock(&shard->lock);
 
-  status = c_avl_get(cache_tree, name, (void *)&ce);
-  if (status != 0) /* entry does not yet exist */
+  cache_entry_t *ce = cache_lookup(shard, &id, hash);
+  if (ce == NULL) /* entry does not yet exist */
   {
-    status = uc_insert(ds, vl, name);
-    pthread_mutex_unlock(&cache_lock);
+    status = uc_insert(shard, ds, vl, hash);
+    pthread_mutex_unlock(&shard->lock);
     return status;
   }
 
-  assert(ce != NULL);
   assert(ce->values_num == ds->ds_num);
 
   if (ce->last_time >= vl->time) {
-    pthread_mutex_unlock(&cache_lock);
-    NOTICE("uc_update: Value too old: name = %s; value time = %.3f; "
-           "last cache update = %.3f;",
-           name, CDTIME_T_TO_DOUBLE(vl->time),
+    pthread_mutex_unlock(&shard->lock);
+    NOTICE("uc_update: Value too old: name = " UC_IDENT_FORMAT "; "
+           "value time = %.3f; last cache update = %.3f;",
+           UC_IDENT_ARGS(&id), CDTIME_T_TO_DOUBLE(vl->time),
            CDTIME_T_TO_DOUBLE(ce->last_time));
     return -1;
   }
@@ -375,13 +572,14 @@ int uc_update(const data_set_t *ds, const value_list_t *vl) {
 
     default:
       /* This shouldn't happen. */
-      pthread_mutex_unlock(&cache_lock);
+      pthread_mutex_unlock(&shard->lock);
       ERROR("uc_update: Don't know how to handle data source type %i.",
             ds->ds[i].type);
       return -1;
     } /* switch (ds->ds[i].type) */
 
-    DEBUG("uc_update: %s: ds[%" PRIsz "] = %lf", name, i, ce->values_gauge[i]);
+    DEBUG("uc_update: " UC_IDENT_FORMAT ": ds[%" PRIsz "] = %lf",
+          UC_IDENT_ARGS(&id), i, ce->values_gauge[i]);
   } /* for (i) */
 
   /* Update the history if it exists. */
@@ -403,28 +601,28 @@ int uc_update(const data_set_t *ds, const value_list_t *vl) {
   ce->last_update = cdtime();
   ce->interval = vl->interval;
 
-  pthread_mutex_unlock(&cache_lock);
+  pthread_mutex_unlock(&shard->lock);
 
   return 0;
 } /* int uc_update */
 
-int uc_get_rate_by_name(const char *name, gauge_t **ret_values,
-                        size_t *ret_values_num) {
+static int uc_get_rate_by_ident(const uc_ident_t *id, gauge_t **ret_values,
+                                size_t *ret_values_num) {
   gauge_t *ret = NULL;
   size_t ret_num = 0;
-  cache_entry_t *ce = NULL;
   int status = 0;
 
-  pthread_mutex_lock(&cache_lock);
-
-  if (c_avl_get(cache_tree, name, (void *)&ce) == 0) {
-    assert(ce != NULL);
+  uint64_t hash = ident_hash(id);
+  cache_shard_t *shard = cache_shard(hash);
+  pthread_mutex_lock(&shard->lock);
 
+  cache_entry_t *ce = cache_lookup(shard, id, hash);
+  if (ce != NULL) {
     /* remove missing values from getval */
     if (ce->state == STATE_MISSING) {
-      DEBUG("utils_cache: uc_get_rate_by_name: requested metric \"%s\" is in "
-            "state \"missing\".",
-            name);
+      DEBUG("utils_cache: uc_get_rate_by_name: requested metric "
+            "\"" UC_IDENT_FORMAT "\" is in state \"missing\".",
+            UC_IDENT_ARGS(id));
       status = -1;
     } else {
       ret_num = ce->values_num;
@@ -437,11 +635,12 @@ int uc_get_rate_by_name(const char *name, gauge_t **ret_values,
       }
     }
   } else {
-    DEBUG("utils_cache: uc_get_rate_by_name: No such value: %s", name);
+    DEBUG("utils_cache: uc_get_rate_by_name: No such value: " UC_IDENT_FORMAT,
+          UC_IDENT_ARGS(id));
     status = -1;
   }
 
-  pthread_mutex_unlock(&cache_lock);
+  pthread_mutex_unlock(&shard->lock);
 
   if (status == 0) {
     *ret_values = ret;
@@ -449,20 +648,24 @@ int uc_get_rate_by_name(const char *name, gauge_t **ret_values,
   }
 
   return status;
+} /* int uc_get_rate_by_ident */
+
+int uc_get_rate_by_name(const char *name, gauge_t **ret_values,
+                        size_t *ret_values_num) {
+  uc_ident_t id;
+
+  ident_from_name(&id, name);
+  return uc_get_rate_by_ident(&id, ret_values, ret_values_num);
 } /* gauge_t *uc_get_rate_by_name */
 
 gauge_t *uc_get_rate(const data_set_t *ds, const value_list_t *vl) {
-  char name[6 * DATA_MAX_NAME_LEN];
+  uc_ident_t id;
   gauge_t *ret = NULL;
   size_t ret_num = 0;
   int status;
 
-  if (FORMAT_VL(name, sizeof(name), vl) != 0) {
-    ERROR("utils_cache: uc_get_rate: FORMAT_VL failed.");
-    return NULL;
-  }
-
-  status = uc_get_rate_by_name(name, &ret, &ret_num);
+  ident_from_vl(&id, vl);
+  status = uc_get_rate_by_ident(&id, &ret, &ret_num);
   if (status != 0)
     return NULL;
 
@@ -479,18 +682,18 @@ gauge_t *uc_get_rate(const data_set_t *ds, const value_list_t *vl) {
   return ret;
 } /* gauge_t *uc_get_rate */
 
-int uc_get_value_by_name(const char *name, value_t **ret_values,
-                         size_t *ret_values_num) {
+static int uc_get_value_by_ident(const uc_ident_t *id, value_t **ret_values,
+                                 size_t *ret_values_num) {
   value_t *ret = NULL;
   size_t ret_num = 0;
-  cache_entry_t *ce = NULL;
   int status = 0;
 
-  pthread_mutex_lock(&cache_lock);
-
-  if (c_avl_get(cache_tree, name, (void *)&ce) == 0) {
-    assert(ce != NULL);
+  uint64_t hash = ident_hash(id);
+  cache_shard_t *shard = cache_shard(hash);
+  pthread_mutex_lock(&shard->lock);
 
+  cache_entry_t *ce = cache_lookup(shard, id, hash);
+  if (ce != NULL) {
     /* remove missing values from getval */
     if (ce->state == STATE_MISSING) {
       status = -1;
@@ -505,11 +708,12 @@ int uc_get_value_by_name(const char *name, value_t **ret_values,
       }
     }
   } else {
-    DEBUG("utils_cache: uc_get_value_by_name: No such value: %s", name);
+    DEBUG("utils_cache: uc_get_value_by_name: No such value: " UC_IDENT_FORMAT,
+          UC_IDENT_ARGS(id));
     status = -1;
   }
 
-  pthread_mutex_unlock(&cache_lock);
+  pthread_mutex_unlock(&shard->lock);
 
   if (status == 0) {
     *ret_values = ret;
@@ -517,20 +721,24 @@ int uc_get_value_by_name(const char *name, value_t **ret_values,
   }
 
   return (status);
+} /* int uc_get_value_by_ident */
+
+int uc_get_value_by_name(const char *name, value_t **ret_values,
+                         size_t *ret_values_num) {
+  uc_ident_t id;
+
+  ident_from_name(&id, name);
+  return uc_get_value_by_ident(&id, ret_values, ret_values_num);
 } /* int uc_get_value_by_name */
 
 value_t *uc_get_value(const data_set_t *ds, const value_list_t *vl) {
-  char name[6 * DATA_MAX_NAME_LEN];
+  uc_ident_t id;
   value_t *ret = NULL;
   size_t ret_num = 0;
   int status;
 
-  if (FORMAT_VL(name, sizeof(name), vl) != 0) {
-    ERROR("utils_cache: uc_get_value: FORMAT_VL failed.");
-    return (NULL);
-  }
-
-  status = uc_get_value_by_name(name, &ret, &ret_num);
+  ident_from_vl(&id, vl);
+  status = uc_get_value_by_ident(&id, &ret, &ret_num);
   if (status != 0)
     return (NULL);
 
@@ -550,20 +758,26 @@ value_t *uc_get_value(const data_set_t *ds, const value_list_t *vl) {
 size_t uc_get_size(void) {
   size_t size_arrays = 0;
 
-  pthread_mutex_lock(&cache_lock);
-  size_arrays = (size_t)c_avl_size(cache_tree);
-  pthread_mutex_unlock(&cache_lock);
+  for (size_t i = 0; i < UC_SHARDS_NUM; i++) {
+    pthread_mutex_lock(&cache_shards[i].lock);
+    size_arrays += cache_shards[i].entries_num;
+    pthread_mutex_unlock(&cache_shards[i].lock);
+  }
 
   return size_arrays;
 }
 
-int uc_get_names(char ***ret_names, cdtime_t **ret_times, size_t *ret_number) {
-  c_avl_iterator_t *iter;
-  char *key;
-  cache_entry_t *value;
+typedef struct {
+  char *name;
+  cdtime_t time;
+} uc_name_t;
 
-  char **names = NULL;
-  cdtime_t *times = NULL;
+static int uc_name_compare(const void *a, const void *b) {
+  return strcmp(((const uc_name_t *)a)->name, ((const uc_name_t *)b)->name);
+} /* int uc_name_compare */
+
+int uc_get_names(char ***ret_names, cdtime_t **ret_times, size_t *ret_number) {
+  uc_name_t *entries = NULL;
   size_t number = 0;
   size_t size_arrays = 0;
 
@@ -572,61 +786,87 @@ int uc_get_names(char ***ret_names, cdtime_t **ret_times, size_t *ret_number) {
   if ((ret_names == NULL) || (ret_number == NULL))
     return -1;
 
-  pthread_mutex_lock(&cache_lock);
+  for (size_t i = 0; (i < UC_SHARDS_NUM) && (status == 0); i++) {
+    cache_shard_t *shard = cache_shards + i;
 
-  size_arrays = (size_t)c_avl_size(cache_tree);
-  if (size_arrays < 1) {
-    /* Handle the "no values" case here, to avoid the error message when
-     * calloc() returns NULL. */
-    pthread_mutex_unlock(&cache_lock);
-    return 0;
-  }
+    pthread_mutex_lock(&shard->lock);
 
-  names = calloc(size_arrays, sizeof(*names));
-  times = calloc(size_arrays, sizeof(*times));
-  if ((names == NULL) || (times == NULL)) {
-    ERROR("uc_get_names: calloc failed.");
-    sfree(names);
-    sfree(times);
-    pthread_mutex_unlock(&cache_lock);
-    return ENOMEM;
-  }
+    if (number + shard->entries_num > size_arrays) {
+      uc_name_t *tmp =
+          realloc(entries, (number + shard->entries_num) * sizeof(*entries));
+      if (tmp == NULL) {
+        ERROR("uc_get_names: realloc failed.");
+        pthread_mutex_unlock(&shard->lock);
+        status = ENOMEM;
+        break;
+      }
+      entries = tmp;
+      size_arrays = number + shard->entries_num;
+    }
 
-  iter = c_avl_get_iterator(cache_tree);
-  while (c_avl_iterator_next(iter, (void *)&key, (void *)&value) == 0) {
-    /* remove missing values when list values */
-    if (value->state == STATE_MISSING)
-      continue;
+    for (size_t j = 0; (j < shard->buckets_num) && (status == 0); j++) {
+      for (cache_entry_t *ce = shard->buckets[j]; ce != NULL; ce = ce->next) {
+        /* remove missing values when list values */
+        if (ce->state == STATE_MISSING)
+          continue;
 
-    /* c_avl_size does not return a number smaller than the number of elements
-     * returned by c_avl_iterator_next. */
-    assert(number < size_arrays);
+        assert(number < size_arrays);
 
-    if (ret_times != NULL)
-      times[number] = value->last_time;
+        uc_ident_t id;
+        char name[6 * DATA_MAX_NAME_LEN];
+        ident_from_entry(&id, ce);
+        snprintf(name, sizeof(name), UC_IDENT_FORMAT, UC_IDENT_ARGS(&id));
 
-    names[number] = strdup(key);
-    if (names[number] == NULL) {
-      status = -1;
-      break;
-    }
+        entries[number].time = ce->last_time;
+        entries[number].name = strdup(name);
+        if (entries[number].name == NULL) {
+          status = -1;
+          break;
+        }
+
+        number++;
+      } /* for (ce) */
+    }   /* for (j = 0; j < shard->buckets_num; j++) */
 
-    number++;
-  } /* while (c_avl_iterator_next) */
+    pthread_mutex_unlock(&shard->lock);
+  } /* for (i = 0; i < UC_SHARDS_NUM; i++) */
 
-  c_avl_iterator_destroy(iter);
-  pthread_mutex_unlock(&cache_lock);
+  char **names = NULL;
+  cdtime_t *times = NULL;
+  if ((status == 0) && (number > 0)) {
+    names = calloc(number, sizeof(*names));
+    times = calloc(number, sizeof(*times));
+    if ((names == NULL) || (times == NULL)) {
+      ERROR("uc_get_names: calloc failed.");
+      sfree(names);
+      sfree(times);
+      status = ENOMEM;
+    }
+  }
 
   if (status != 0) {
     for (size_t i = 0; i < number; i++) {
-      sfree(names[i]);
+      sfree(entries[i].name);
     }
-    sfree(names);
-    sfree(times);
+    sfree(entries);
 
-    return -1;
+    return status;
+  }
+
+  /* Handle the "no values" case here, leaving the return values untouched. */
+  if (number == 0) {
+    sfree(entries);
+    return 0;
   }
 
+  /* The hash tables are not ordered, callers expect the names sorted. */
+  qsort(entries, number, sizeof(*entries), uc_name_compare);
+  for (size_t i = 0; i < number; i++) {
+    names[i] = entries[i].name;
+    times[i] = entries[i].time;
+  }
+  sfree(entries);
+
   *ret_names = names;
   if (ret_times != NULL)
     *ret_times = times;
@@ -638,65 +878,59 @@ int uc_get_names(char ***ret_names, cdtime_t **ret_times, size_t *ret_number) {
 } /* int uc_get_names */
 
 int uc_get_state(const data_set_t *ds, const value_list_t *vl) {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
+  uc_ident_t id;
   int ret = STATE_ERROR;
 
-  if (FORMAT_VL(name, sizeof(name), vl) != 0) {
-    ERROR("uc_get_state: FORMAT_VL failed.");
-    return STATE_ERROR;
-  }
+  ident_from_vl(&id, vl);
+  uint64_t hash = ident_hash(&id);
 
-  pthread_mutex_lock(&cache_lock);
+  cache_shard_t *shard = cache_shard(hash);
+  pthread_mutex_lock(&shard->lock);
 
-  if (c_avl_get(cache_tree, name, (void *)&ce) == 0) {
-    assert(ce != NULL);
+  cache_entry_t *ce = cache_lookup(shard, &id, hash);
+  if (ce != NULL)
     ret = ce->state;
-  }
 
-  pthread_mutex_unlock(&cache_lock);
+  pthread_mutex_unlock(&shard->lock);
 
   return ret;
 } /* int uc_get_state */
 
 int uc_set_state(const data_set_t *ds, const value_list_t *vl, int state) {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
+  uc_ident_t id;
   int ret = -1;
 
-  if (FORMAT_VL(name, sizeof(name), vl) != 0) {
-    ERROR("uc_set_state: FORMAT_VL failed.");
-    return STATE_ERROR;
-  }
+  ident_from_vl(&id, vl);
+  uint64_t hash = ident_hash(&id);
 
-  pthread_mutex_lock(&cache_lock);
+  cache_shard_t *shard = cache_shard(hash);
+  pthread_mutex_lock(&shard->lock);
 
-  if (c_avl_get(cache_tree, name, (void *)&ce) == 0) {
-    assert(ce != NULL);
+  cache_entry_t *ce = cache_lookup(shard, &id, hash);
+  if (ce != NULL) {
     ret = ce->state;
     ce->state = state;
   }
 
-  pthread_mutex_unlock(&cache_lock);
+  pthread_mutex_unlock(&shard->lock);
 
   return ret;
 } /* int uc_set_state */
 
-int uc_get_history_by_name(const char *name, gauge_t *ret_history,
-                           size_t num_steps, size_t num_ds) {
-  cache_entry_t *ce = NULL;
-  int status = 0;
-
-  pthread_mutex_lock(&cache_lock);
+static int uc_get_history_by_ident(const uc_ident_t *id, gauge_t *ret_history,
+                                   size_t num_steps, size_t num_ds) {
+  uint64_t hash = ident_hash(id);
+  cache_shard_t *shard = cache_shard(hash);
+  pthread_mutex_lock(&shard->lock);
 
-  status = c_avl_get(cache_tree, name, (void *)&ce);
-  if (status != 0) {
-    pthread_mutex_unlock(&cache_lock);
+  cache_entry_t *ce = cache_lookup(shard, id, hash);
+  if (ce == NULL) {
+    pthread_mutex_unlock(&shard->lock);
     return -ENOENT;
   }
 
   if (((size_t)ce->values_num) != num_ds) {
-    pthread_mutex_unlock(&cache_lock);
+    pthread_mutex_unlock(&shard->lock);
     return -EINVAL;
   }
 
@@ -708,7 +942,7 @@ int uc_get_history_by_name(const char *name, gauge_t *ret_history,
     tmp =
         realloc(ce->history, sizeof(*ce->history) * num_steps * ce->values_num);
     if (tmp == NULL) {
-      pthread_mutex_unlock(&cache_lock);
+      pthread_mutex_unlock(&shard->lock);
       return -ENOMEM;
     }
 
@@ -737,87 +971,84 @@ int uc_get_history_by_name(const char *name, gauge_t *ret_history,
            sizeof(*ret_history) * num_ds);
   }
 
-  pthread_mutex_unlock(&cache_lock);
+  pthread_mutex_unlock(&shard->lock);
 
   return 0;
+} /* int uc_get_history_by_ident */
+
+int uc_get_history_by_name(const char *name, gauge_t *ret_history,
+                           size_t num_steps, size_t num_ds) {
+  uc_ident_t id;
+
+  ident_from_name(&id, name);
+  return uc_get_history_by_ident(&id, ret_history, num_steps, num_ds);
 } /* int uc_get_history_by_name */
 
 int uc_get_history(const data_set_t *ds, const value_list_t *vl,
                    gauge_t *ret_history, size_t num_steps, size_t num_ds) {
-  char name[6 * DATA_MAX_NAME_LEN];
-
-  if (FORMAT_VL(name, sizeof(name), vl) != 0) {
-    ERROR("utils_cache: uc_get_history: FORMAT_VL failed.");
-    return -1;
-  }
+  uc_ident_t id;
 
-  return uc_get_history_by_name(name, ret_history, num_steps, num_ds);
+  ident_from_vl(&id, vl);
+  return uc_get_history_by_ident(&id, ret_history, num_steps, num_ds);
 } /* int uc_get_history */
 
 int uc_get_hits(const data_set_t *ds, const value_list_t *vl) {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
+  uc_ident_t id;
   int ret = STATE_ERROR;
 
-  if (FORMAT_VL(name, sizeof(name), vl) != 0) {
-    ERROR("uc_get_hits: FORMAT_VL failed.");
-    return STATE_ERROR;
-  }
+  ident_from_vl(&id, vl);
+  uint64_t hash = ident_hash(&id);
 
-  pthread_mutex_lock(&cache_lock);
+  cache_shard_t *shard = cache_shard(hash);
+  pthread_mutex_lock(&shard->lock);
 
-  if (c_avl_get(cache_tree, name, (void *)&ce) == 0) {
-    assert(ce != NULL);
+  cache_entry_t *ce = cache_lookup(shard, &id, hash);
+  if (ce != NULL)
     ret = ce->hits;
-  }
 
-  pthread_mutex_unlock(&cache_lock);
+  pthread_mutex_unlock(&shard->lock);
 
   return ret;
 } /* int uc_get_hits */
 
 int uc_set_hits(const data_set_t *ds, const value_list_t *vl, int hits) {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
+  uc_ident_t id;
   int ret = -1;
 
-  if (FORMAT_VL(name, sizeof(name), vl) != 0) {
-    ERROR("uc_set_hits: FORMAT_VL failed.");
-    return STATE_ERROR;
-  }
+  ident_from_vl(&id, vl);
+  uint64_t hash = ident_hash(&id);
 
-  pthread_mutex_lock(&cache_lock);
+  cache_shard_t *shard = cache_shard(hash);
+  pthread_mutex_lock(&shard->lock);
 
-  if (c_avl_get(cache_tree, name, (void *)&ce) == 0) {
-    assert(ce != NULL);
+  cache_entry_t *ce = cache_lookup(shard, &id, hash);
+  if (ce != NULL) {
     ret = ce->hits;
     ce->hits = hits;
   }
 
-  pthread_mutex_unlock(&cache_lock);
+  pthread_mutex_unlock(&shard->lock);
 
   return ret;
 } /* int uc_set_hits */
 
 int uc_inc_hits(const data_set_t *ds, const value_list_t *vl, int step) {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
+  uc_ident_t id;
   int ret = -1;
 
-  if (FORMAT_VL(name, sizeof(name), vl) != 0) {
-    ERROR("uc_inc_hits: FORMAT_VL failed.");
-    return STATE_ERROR;
-  }
+  ident_from_vl(&id, vl);
+  uint64_t hash = ident_hash(&id);
 
-  pthread_mutex_lock(&cache_lock);
+  cache_shard_t *shard = cache_shard(hash);
+  pthread_mutex_lock(&shard->lock);
 
-  if (c_avl_get(cache_tree, name, (void *)&ce) == 0) {
-    assert(ce != NULL);
+  cache_entry_t *ce = cache_lookup(shard, &id, hash);
+  if (ce != NULL) {
     ret = ce->hits;
     ce->hits = ret + step;
   }
 
-  pthread_mutex_unlock(&cache_lock);
+  pthread_mutex_unlock(&shard->lock);
 
   return ret;
 } /* int uc_inc_hits */
@@ -832,38 +1063,57 @@ uc_iter_t *uc_get_iterator(void) {
   if (iter == NULL)
     return NULL;
 
-  pthread_mutex_lock(&cache_lock);
-
-  iter->iter = c_avl_get_iterator(cache_tree);
-  if (iter->iter == NULL) {
-    free(iter);
-    return NULL;
-  }
+  pthread_mutex_lock(&cache_shards[0].lock);
+  iter->locked = 1;
 
   return iter;
 } /* uc_iter_t *uc_get_iterator */
 
 int uc_iterator_next(uc_iter_t *iter, char **ret_name) {
-  int status;
-
-  if (iter == NULL)
+  if ((iter == NULL) || !iter->locked)
     return -1;
 
-  while ((status = c_avl_iterator_next(iter->iter, (void *)&iter->name,
-                                       (void *)&iter->entry)) == 0) {
-    if (iter->entry->state == STATE_MISSING)
-      continue;
+  cache_entry_t *ce = (iter->entry != NULL) ? iter->entry->next : NULL;
+  while (1) {
+    cache_shard_t *shard = cache_shards + iter->shard;
 
-    break;
+    while ((ce == NULL) && (iter->bucket < shard->buckets_num))
+      ce = shard->buckets[iter->bucket++];
+
+    if (ce != NULL) {
+      if (ce->state == STATE_MISSING) {
+        ce = ce->next;
+        continue;
+      }
+      break;
+    }
+
+    /* Move on to the next shard. */
+    pthread_mutex_unlock(&shard->lock);
+    iter->locked = 0;
+
+    iter->shard++;
+    if (iter->shard >= UC_SHARDS_NUM)
+      break;
+
+    pthread_mutex_lock(&cache_shards[iter->shard].lock);
+    iter->locked = 1;
+    iter->bucket = 0;
   }
-  if (status != 0) {
-    iter->name = NULL;
-    iter->entry = NULL;
+
+  iter->entry = ce;
+  if (ce == NULL) {
+    iter->name[0] = 0;
     return -1;
   }
 
-  if (ret_name != NULL)
+  if (ret_name != NULL) {
+    uc_ident_t id;
+    ident_from_entry(&id, ce);
+    snprintf(iter->name, sizeof(iter->name), UC_IDENT_FORMAT,
+             UC_IDENT_ARGS(&id));
     *ret_name = iter->name;
+  }
 
   return 0;
 } /* int uc_iterator_next */
@@ -872,8 +1122,8 @@ void uc_iterator_destroy(uc_iter_t *iter) {
   if (iter == NULL)
     return;
 
-  c_avl_iterator_destroy(iter->iter);
-  pthread_mutex_unlock(&cache_lock);
+  if (iter->locked)
+    pthread_mutex_unlock(&cache_shards[iter->shard].lock);
 
   free(iter);
 } /* void uc_iterator_destroy */
@@ -924,48 +1174,48 @@ int uc_iterator_get_meta(uc_iter_t *iter, meta_data_t **ret_meta) {
 /*
  * Meta data interface
  */
-/* XXX: This function will acquire `cache_lock' but will not free it! */
-static meta_data_t *uc_get_meta(const value_list_t *vl) /* {{{ */
+/* XXX: This function will acquire the lock of `*ret_shard' but will not free
+ * it! */
+static meta_data_t *uc_get_meta(const value_list_t *vl,
+                                cache_shard_t **ret_shard) /* {{{ */
 {
-  char name[6 * DATA_MAX_NAME_LEN];
-  cache_entry_t *ce = NULL;
-  int status;
+  uc_ident_t id;
 
-  status = FORMAT_VL(name, sizeof(name), vl);
-  if (status != 0) {
-    ERROR("utils_cache: uc_get_meta: FORMAT_VL failed.");
-    return NULL;
-  }
+  ident_from_vl(&id, vl);
+  uint64_t hash = ident_hash(&id);
 
-  pthread_mutex_lock(&cache_lock);
+  cache_shard_t *shard = cache_shard(hash);
+  pthread_mutex_lock(&shard->lock);
 
-  status = c_avl_get(cache_tree, name, (void *)&ce);
-  if (status != 0) {
-    pthread_mutex_unlock(&cache_lock);
+  cache_entry_t *ce = cache_lookup(shard, &id, hash);
+  if (ce == NULL) {
+    pthread_mutex_unlock(&shard->lock);
     return NULL;
   }
-  assert(ce != NULL);
 
   if (ce->meta == NULL)
     ce->meta = meta_data_create();
 
   if (ce->meta == NULL)
-    pthread_mutex_unlock(&cache_lock);
+    pthread_mutex_unlock(&shard->lock);
 
+  *ret_shard = shard;
   return ce->meta;
 } /* }}} meta_data_t *uc_get_meta */
 
+
 /* Sorry about this preprocessor magic, but it really makes this file much
  * shorter.. */
 #define UC_WRAP(wrap_function)                                                 \
   {                                                                            \
+    cache_shard_t *shard;                                                      \
     meta_data_t *meta;                                                         \
     int status;                                                                \
-    meta = uc_get_meta(vl);                                                    \
+    meta = uc_get_meta(vl, &shard);                                            \
     if (meta == NULL)                                                          \
       return -1;                                                               \
     status = wrap_function(meta, key);                                         \
-    pthread_mutex_unlock(&cache_lock);                                         \
+    pthread_mutex_unlock(&shard->lock);                                        \
     return status;                                                             \
   }
 int uc_meta_data_exists(const value_list_t *vl,
@@ -979,13 +1229,14 @@ int uc_meta_data_exists(const value_list_t *vl,
  * two argumetns. */
 #define UC_WRAP(wrap_function)                                                 \
   {                                                                            \
+    cache_shard_t *shard;                                                      \
     meta_data_t *meta;                                                         \
     int status;                                                                \
-    meta = uc_get_meta(vl);                                                    \
+    meta = uc_get_meta(vl, &shard);                                            \
     if (meta == NULL)                                                          \
       return -1;                                                               \
     status = wrap_function(meta, key, value);                                  \
-    pthread_mutex_unlock(&cache_lock);                                         \
+    pthread_mutex_unlock(&shard->lock);                                        \
     return status;                                                             \
   }
         int uc_meta_data_add_string(const value_list_t *vl, const char *key,
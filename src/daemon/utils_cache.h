@@ -71,8 +71,9 @@ typedef struct uc_iter_s uc_iter_t;
  *   uc_get_iterator
  *
  * DESCRIPTION
- *   Create an iterator for the cache. It will hold the cache lock until it's
- *   destroyed.
+ *   Create an iterator for the cache. It will hold the lock of one partition
+ *   of the cache at a time until it's destroyed. Entries are not returned in
+ *   any particular order.
  *
  * RETURN VALUE
  *   An iterator object on success or NULL else.
@@ -90,8 +91,9 @@ uc_iter_t *uc_get_iterator(void);
  * PARAMETERS
  *   `iter'     The iterator object to advance.
  *   `ret_name' Optional pointer to a string where to store the name. If not
- *              NULL, the returned value is a copy of the value and has to be
- *              freed by the caller.
+ *              NULL, the returned string belongs to the iterator and is valid
+ *              until the next call to `uc_iterator_next' or
+ *              `uc_iterator_destroy'.
  *
  * RETURN VALUE
  *   Zero upon success or non-zero if the iterator ie NULL or no further
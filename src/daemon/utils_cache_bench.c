@@ -0,0 +1,167 @@
+/**
+ * collectd - src/daemon/utils_cache_bench.c
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **/
+
+/* Measures how the value cache scales with the number of threads using it.
+ * Every thread updates its own series and reads their rates back, as read
+ * threads dispatching values and write plugins storing rates do.
+ * bench_utils_cache_single is built with a single shard, i.e. one global
+ * lock, for comparison.
+ *
+ * Usage: bench_utils_cache [max threads] [operations per thread] */
+
+#include "collectd.h"
+#include "common.h"
+
+#include "utils_cache.h"
+
+#include <time.h>
+
+#define BENCH_DEFAULT_THREADS 8
+#define BENCH_DEFAULT_OPERATIONS 200000
+#define BENCH_SERIES_PER_THREAD 1000
+
+int timeout_g = 2;
+
+int plugin_dispatch_missing(const value_list_t *vl) { return 0; }
+
+static data_source_t dsrc = {"value", DS_TYPE_DERIVE, 0, NAN};
+static data_set_t ds = {"derive", 1, &dsrc};
+
+typedef struct {
+  pthread_t thread;
+  long operations;
+  /* Continues where the previous run left off, times must increase. */
+  value_t *values;
+  value_list_t *vl;
+  long failed;
+} bench_thread_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void *bench_thread(void *arg) {
+  bench_thread_t *t = arg;
+
+  for (long i = 0; i < t->operations; i++) {
+    value_list_t *vl = t->vl + (i % BENCH_SERIES_PER_THREAD);
+
+    vl->values[0].derive += 100;
+    vl->time += TIME_T_TO_CDTIME_T(10);
+    if (uc_update(&ds, vl) != 0) {
+      t->failed++;
+      continue;
+    }
+
+    gauge_t *rate = uc_get_rate(&ds, vl);
+    if (rate == NULL)
+      t->failed++;
+    sfree(rate);
+  }
+
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int threads_max = (argc > 1) ? atoi(argv[1]) : BENCH_DEFAULT_THREADS;
+  long operations = (argc > 2) ? atol(argv[2]) : BENCH_DEFAULT_OPERATIONS;
+  if ((threads_max <= 0) || (operations <= 0)) {
+    fprintf(stderr, "Usage: %s [max threads] [operations per thread]\n",
+            argv[0]);
+    return 1;
+  }
+
+  if (uc_init() != 0) {
+    fprintf(stderr, "uc_init failed\n");
+    return 1;
+  }
+
+  bench_thread_t *threads = calloc((size_t)threads_max, sizeof(*threads));
+  if (threads == NULL) {
+    fprintf(stderr, "calloc failed\n");
+    return 1;
+  }
+
+  for (int i = 0; i < threads_max; i++) {
+    bench_thread_t *t = threads + i;
+    t->operations = operations;
+    t->values = calloc(BENCH_SERIES_PER_THREAD, sizeof(*t->values));
+    t->vl = calloc(BENCH_SERIES_PER_THREAD, sizeof(*t->vl));
+    if ((t->values == NULL) || (t->vl == NULL)) {
+      fprintf(stderr, "calloc failed\n");
+      return 1;
+    }
+
+    for (int j = 0; j < BENCH_SERIES_PER_THREAD; j++) {
+      value_list_t *vl = t->vl + j;
+      vl->values = t->values + j;
+      vl->values_len = 1;
+      vl->time = TIME_T_TO_CDTIME_T(1000);
+      vl->interval = TIME_T_TO_CDTIME_T(10);
+      snprintf(vl->host, sizeof(vl->host), "host-%02d.example.com", i);
+      sstrncpy(vl->plugin, "bench", sizeof(vl->plugin));
+      snprintf(vl->plugin_instance, sizeof(vl->plugin_instance), "%d", j);
+      sstrncpy(vl->type, "derive", sizeof(vl->type));
+    }
+  }
+
+  double single = 0.0;
+  /* Powers of two, and the maximum */
+  for (int n = 1;; n = (2 * n < threads_max) ? 2 * n : threads_max) {
+    double start = now_seconds();
+    for (int i = 0; i < n; i++) {
+      threads[i].failed = 0;
+      if (pthread_create(&threads[i].thread, NULL, bench_thread,
+                         threads + i) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        return 1;
+      }
+    }
+
+    long failed = 0;
+    for (int i = 0; i < n; i++) {
+      pthread_join(threads[i].thread, NULL);
+      failed += threads[i].failed;
+    }
+    double elapsed = now_seconds() - start;
+
+    double rate = (double)n * (double)operations / elapsed;
+    if (n == 1)
+      single = rate;
+    printf("%3d threads: %.0f updates/s, %.2fx one thread, %ld failed\n", n,
+           rate, rate / single, failed);
+
+    if (n == threads_max)
+      break;
+  }
+
+  printf("%zu series cached\n", uc_get_size());
+
+  for (int i = 0; i < threads_max; i++) {
+    sfree(threads[i].values);
+    sfree(threads[i].vl);
+  }
+  sfree(threads);
+  return 0;
+}
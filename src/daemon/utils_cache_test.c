@@ -0,0 +1,214 @@
+/**
+ * collectd - src/daemon/utils_cache_test.c
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **/
+
+/* Before utils_time.h, for cdtime_mock */
+#include "testing.h"
+
+#include "collectd.h"
+#include "common.h"
+
+#include "utils_cache.h"
+#include "utils_intern.h"
+
+/* Enough values to populate every shard */
+#define VALUES_NUM 1000
+
+int timeout_g = 2;
+
+static int missing_num;
+int plugin_dispatch_missing(const value_list_t *vl) {
+  missing_num++;
+  return 0;
+}
+
+static data_source_t dsrc_derive = {"value", DS_TYPE_DERIVE, 0, NAN};
+static data_set_t ds_derive = {"derive", 1, &dsrc_derive};
+
+static void init_value_list(value_list_t *vl, value_t *value, int i) {
+  *vl = (value_list_t){
+      .values = value,
+      .values_len = 1,
+      .time = TIME_T_TO_CDTIME_T(1000),
+      .interval = TIME_T_TO_CDTIME_T(10),
+  };
+  sstrncpy(vl->host, "example.com", sizeof(vl->host));
+  sstrncpy(vl->plugin, "test", sizeof(vl->plugin));
+  snprintf(vl->plugin_instance, sizeof(vl->plugin_instance), "%04d", i);
+  sstrncpy(vl->type, "derive", sizeof(vl->type));
+}
+
+DEF_TEST(update) {
+  value_t value;
+  value_list_t vl;
+
+  for (int i = 0; i < VALUES_NUM; i++) {
+    init_value_list(&vl, &value, i);
+    value.derive = 100 * i;
+    CHECK_ZERO(uc_update(&ds_derive, &vl));
+  }
+  EXPECT_EQ_INT(VALUES_NUM, uc_get_size());
+
+  int failed = 0;
+  for (int i = 0; i < VALUES_NUM; i++) {
+    init_value_list(&vl, &value, i);
+    vl.time += TIME_T_TO_CDTIME_T(10);
+    value.derive = 100 * i + 10 * i;
+    if (uc_update(&ds_derive, &vl) != 0)
+      failed++;
+
+    gauge_t *rate = uc_get_rate(&ds_derive, &vl);
+    if ((rate == NULL) || (rate[0] != (gauge_t)i))
+      failed++;
+    sfree(rate);
+  }
+  EXPECT_EQ_INT(0, failed);
+
+  /* Values must be newer than the cached one. */
+  init_value_list(&vl, &value, 0);
+  OK(uc_update(&ds_derive, &vl) != 0);
+
+  /* Host, plugin, type and the empty type instance are shared. */
+  EXPECT_EQ_INT(VALUES_NUM + 4, intern_size());
+
+  return 0;
+}
+
+DEF_TEST(by_name) {
+  gauge_t *rates = NULL;
+  size_t rates_num = 0;
+
+  CHECK_ZERO(uc_get_rate_by_name("example.com/test-0007/derive", &rates,
+                                 &rates_num));
+  EXPECT_EQ_INT(1, rates_num);
+  EXPECT_EQ_DOUBLE(7.0, rates[0]);
+  sfree(rates);
+
+  OK(uc_get_rate_by_name("example.com/test-0007/gauge", &rates,
+                         &rates_num) != 0);
+  OK(uc_get_rate_by_name("example.com/test/derive-0007", &rates,
+                         &rates_num) != 0);
+  OK(uc_get_rate_by_name("example.com/test-0007", &rates, &rates_num) != 0);
+
+  return 0;
+}
+
+DEF_TEST(names) {
+  char **names = NULL;
+  cdtime_t *times = NULL;
+  size_t number = 0;
+
+  CHECK_ZERO(uc_get_names(&names, &times, &number));
+  EXPECT_EQ_INT(VALUES_NUM, number);
+
+  /* Sorted, although spread over several shards */
+  int unsorted = 0;
+  for (size_t i = 0; i < number; i++) {
+    if ((i > 0) && (strcmp(names[i - 1], names[i]) >= 0))
+      unsorted++;
+    if (times[i] != TIME_T_TO_CDTIME_T(1010))
+      unsorted++;
+  }
+  EXPECT_EQ_INT(0, unsorted);
+  EXPECT_EQ_STR("example.com/test-0000/derive", names[0]);
+
+  for (size_t i = 0; i < number; i++)
+    sfree(names[i]);
+  sfree(names);
+  sfree(times);
+
+  return 0;
+}
+
+DEF_TEST(iterator) {
+  uc_iter_t *iter;
+  char *name;
+  int count = 0;
+  int failed = 0;
+
+  CHECK_NOT_NULL(iter = uc_get_iterator());
+  while (uc_iterator_next(iter, &name) == 0) {
+    cdtime_t interval = 0;
+    if ((uc_iterator_get_interval(iter, &interval) != 0) ||
+        (interval != TIME_T_TO_CDTIME_T(10)))
+      failed++;
+    count++;
+  }
+  OK(uc_iterator_next(iter, &name) != 0);
+  uc_iterator_destroy(iter);
+  EXPECT_EQ_INT(VALUES_NUM, count);
+  EXPECT_EQ_INT(0, failed);
+
+  /* Destroying an unfinished iterator releases its lock. */
+  CHECK_NOT_NULL(iter = uc_get_iterator());
+  CHECK_ZERO(uc_iterator_next(iter, &name));
+  uc_iterator_destroy(iter);
+  EXPECT_EQ_INT(VALUES_NUM, uc_get_size());
+
+  return 0;
+}
+
+DEF_TEST(meta_data) {
+  value_t value;
+  value_list_t vl;
+  int64_t got = 0;
+
+  init_value_list(&vl, &value, 42);
+  CHECK_ZERO(uc_meta_data_add_signed_int(&vl, "key", 1337));
+  CHECK_ZERO(uc_meta_data_get_signed_int(&vl, "key", &got));
+  EXPECT_EQ_INT(1337, (int)got);
+
+  init_value_list(&vl, &value, 43);
+  OK(uc_meta_data_get_signed_int(&vl, "key", &got) != 0);
+
+  init_value_list(&vl, &value, VALUES_NUM);
+  OK(uc_meta_data_add_signed_int(&vl, "key", 1) != 0);
+
+  return 0;
+}
+
+DEF_TEST(timeout) {
+  CHECK_ZERO(uc_check_timeout());
+  EXPECT_EQ_INT(0, missing_num);
+  EXPECT_EQ_INT(VALUES_NUM, uc_get_size());
+
+  /* Twice the interval later every value is missing. */
+  cdtime_mock += TIME_T_TO_CDTIME_T(20);
+  CHECK_ZERO(uc_check_timeout());
+  EXPECT_EQ_INT(VALUES_NUM, missing_num);
+  EXPECT_EQ_INT(0, uc_get_size());
+  EXPECT_EQ_INT(0, intern_size());
+
+  return 0;
+}
+
+int main(void) {
+  uc_init();
+
+  RUN_TEST(update);
+  RUN_TEST(by_name);
+  RUN_TEST(names);
+  RUN_TEST(iterator);
+  RUN_TEST(meta_data);
+  RUN_TEST(timeout);
+
+  END_TEST;
+}
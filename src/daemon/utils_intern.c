@@ -0,0 +1,162 @@
+/**
+ * collectd - src/daemon/utils_intern.c
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **/
+
+#include "collectd.h"
+
+#include "utils_intern.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+
+/* Must be a power of two. */
+#define INTERN_INITIAL_SIZE 256
+
+/* Allocated in one block with the string. */
+typedef struct intern_entry_s {
+  struct intern_entry_s *next;
+  uint32_t hash;
+  size_t refs;
+  char str[];
+} intern_entry_t;
+
+static intern_entry_t **intern_table;
+static size_t intern_table_size;
+static size_t intern_table_num;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a */
+static uint32_t intern_hash(const char *str) {
+  uint32_t hash = 2166136261U;
+
+  for (const unsigned char *c = (const unsigned char *)str; *c != 0; c++) {
+    hash ^= *c;
+    hash *= 16777619U;
+  }
+
+  return hash;
+} /* uint32_t intern_hash */
+
+/* Must hold intern_lock */
+static int intern_grow(void) {
+  size_t size = (intern_table_size == 0) ? INTERN_INITIAL_SIZE
+                                         : 2 * intern_table_size;
+  intern_entry_t **table = calloc(size, sizeof(*table));
+  if (table == NULL)
+    return -1;
+
+  for (size_t i = 0; i < intern_table_size; i++) {
+    intern_entry_t *e = intern_table[i];
+    while (e != NULL) {
+      intern_entry_t *next = e->next;
+      e->next = table[e->hash & (size - 1)];
+      table[e->hash & (size - 1)] = e;
+      e = next;
+    }
+  }
+
+  free(intern_table);
+  intern_table = table;
+  intern_table_size = size;
+  return 0;
+} /* int intern_grow */
+
+const char *intern_get(const char *str) {
+  if (str == NULL)
+    return NULL;
+
+  uint32_t hash = intern_hash(str);
+
+  pthread_mutex_lock(&intern_lock);
+
+  if (intern_table_size == 0) {
+    if (intern_grow() != 0) {
+      pthread_mutex_unlock(&intern_lock);
+      return NULL;
+    }
+  }
+
+  for (intern_entry_t *e = intern_table[hash & (intern_table_size - 1)];
+       e != NULL; e = e->next) {
+    if ((e->hash == hash) && (strcmp(e->str, str) == 0)) {
+      e->refs++;
+      pthread_mutex_unlock(&intern_lock);
+      return e->str;
+    }
+  }
+
+  /* A longer chain is better than failing. */
+  if (intern_table_num >= intern_table_size)
+    intern_grow();
+
+  size_t len = strlen(str);
+  intern_entry_t *e = malloc(sizeof(*e) + len + 1);
+  if (e == NULL) {
+    pthread_mutex_unlock(&intern_lock);
+    return NULL;
+  }
+  e->hash = hash;
+  e->refs = 1;
+  memcpy(e->str, str, len + 1);
+
+  e->next = intern_table[hash & (intern_table_size - 1)];
+  intern_table[hash & (intern_table_size - 1)] = e;
+  intern_table_num++;
+
+  pthread_mutex_unlock(&intern_lock);
+  return e->str;
+} /* const char *intern_get */
+
+void intern_put(const char *str) {
+  if (str == NULL)
+    return;
+
+  intern_entry_t *entry =
+      (intern_entry_t *)(str - offsetof(intern_entry_t, str));
+
+  pthread_mutex_lock(&intern_lock);
+
+  assert(entry->refs > 0);
+  entry->refs--;
+  if (entry->refs > 0) {
+    pthread_mutex_unlock(&intern_lock);
+    return;
+  }
+
+  intern_entry_t **prev = &intern_table[entry->hash & (intern_table_size - 1)];
+  while (*prev != entry)
+    prev = &(*prev)->next;
+  *prev = entry->next;
+  intern_table_num--;
+
+  pthread_mutex_unlock(&intern_lock);
+
+  free(entry);
+} /* void intern_put */
+
+size_t intern_size(void) {
+  pthread_mutex_lock(&intern_lock);
+  size_t size = intern_table_num;
+  pthread_mutex_unlock(&intern_lock);
+
+  return size;
+} /* size_t intern_size */
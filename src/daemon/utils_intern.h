@@ -0,0 +1,63 @@
+/**
+ * collectd - src/daemon/utils_intern.h
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **/
+
+#ifndef UTILS_INTERN_H
+#define UTILS_INTERN_H 1
+
+#include "collectd.h"
+
+/*
+ * String table of the daemon: host names, plugin names, types and instances
+ * are shared by many identifiers, so each distinct string is stored once and
+ * reference counted. Interned strings are immutable. The table is thread
+ * safe.
+ */
+
+/*
+ * NAME
+ *   intern_get
+ *
+ * DESCRIPTION
+ *   Returns the interned copy of `str', adding it to the table if necessary,
+ *   and takes a reference to it. Equal strings are interned to the same
+ *   pointer.
+ *
+ * RETURN VALUE
+ *   The interned string or NULL if memory could not be allocated.
+ */
+const char *intern_get(const char *str);
+
+/*
+ * NAME
+ *   intern_put
+ *
+ * DESCRIPTION
+ *   Releases a reference taken with `intern_get'. The string is removed from
+ *   the table when the last reference is released. Does nothing if `str' is
+ *   NULL.
+ */
+void intern_put(const char *str);
+
+/* Returns the number of distinct strings in the table. */
+size_t intern_size(void);
+
+#endif /* UTILS_INTERN_H */
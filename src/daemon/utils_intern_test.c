@@ -0,0 +1,101 @@
+/**
+ * collectd - src/daemon/utils_intern.c
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **/
+
+#include "collectd.h"
+
+#include "testing.h"
+#include "utils_intern.h"
+
+#define STRINGS_NUM 2000
+
+DEF_TEST(get_put) {
+  char buffer[16];
+  const char *a;
+  const char *b;
+
+  OK((a = intern_get("example.com")) != NULL);
+  EXPECT_EQ_STR("example.com", a);
+  EXPECT_EQ_INT(1, intern_size());
+
+  /* Equal strings share one copy, independent of the caller's buffer. */
+  snprintf(buffer, sizeof(buffer), "example.com");
+  OK((b = intern_get(buffer)) != NULL);
+  OK(a == b);
+  buffer[0] = 0;
+  EXPECT_EQ_STR("example.com", b);
+  EXPECT_EQ_INT(1, intern_size());
+
+  OK((b = intern_get("")) != NULL);
+  OK(a != b);
+  EXPECT_EQ_INT(2, intern_size());
+  intern_put(b);
+  EXPECT_EQ_INT(1, intern_size());
+
+  /* Removed with the last reference only. */
+  intern_put(a);
+  EXPECT_EQ_INT(1, intern_size());
+  intern_put(a);
+  EXPECT_EQ_INT(0, intern_size());
+
+  OK(intern_get(NULL) == NULL);
+  intern_put(NULL);
+
+  return 0;
+}
+
+DEF_TEST(many) {
+  const char *strings[STRINGS_NUM];
+  char buffer[16];
+
+  /* Enough to grow the table several times. */
+  int failed = 0;
+  for (size_t i = 0; i < STRINGS_NUM; i++) {
+    snprintf(buffer, sizeof(buffer), "string-%zu", i);
+    strings[i] = intern_get(buffer);
+    if (strings[i] == NULL)
+      failed++;
+  }
+  EXPECT_EQ_INT(0, failed);
+  EXPECT_EQ_INT(STRINGS_NUM, intern_size());
+
+  for (size_t i = 0; i < STRINGS_NUM; i++) {
+    snprintf(buffer, sizeof(buffer), "string-%zu", i);
+    const char *str = intern_get(buffer);
+    if (str != strings[i])
+      failed++;
+    intern_put(str);
+  }
+  EXPECT_EQ_INT(0, failed);
+
+  for (size_t i = 0; i < STRINGS_NUM; i++)
+    intern_put(strings[i]);
+  EXPECT_EQ_INT(0, intern_size());
+
+  return 0;
+}
+
+int main(void) {
+  RUN_TEST(get_put);
+  RUN_TEST(many);
+
+  END_TEST;
+}
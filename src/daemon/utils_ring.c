@@ -0,0 +1,215 @@
+/**
+ * collectd - src/daemon/utils_ring.c
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **/
+
+#include "collectd.h"
+
+#include "utils_ring.h"
+
+#include <pthread.h>
+
+/* Bounded MPMC queue as described by Dmitry Vyukov: every cell carries a
+ * sequence number telling producers and consumers whether it is their turn,
+ * so that claiming a position is a single compare-and-swap. */
+
+/* Times an empty ring is checked again before a consumer parks. */
+#define RING_SPIN 64
+
+#define RING_CACHE_LINE 64
+
+typedef struct {
+  size_t seq;
+  void *ptr;
+} ring_cell_t;
+
+struct ring_s {
+  ring_cell_t *cells;
+  size_t mask;
+
+  /* Written by producers and consumers respectively, padded so that they do
+   * not share a cache line. */
+  char pad0[RING_CACHE_LINE];
+  size_t tail;
+  char pad1[RING_CACHE_LINE];
+  size_t head;
+  char pad2[RING_CACHE_LINE];
+
+  /* Parking of idle consumers, see `ring_pop_wait'. */
+  int waiters;
+  unsigned int epoch;
+  bool shutdown;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+ring_t *ring_create(size_t size) {
+  size_t cells_num = 2;
+  while (cells_num < size)
+    cells_num *= 2;
+
+  ring_t *r = calloc(1, sizeof(*r));
+  if (r == NULL)
+    return NULL;
+
+  r->cells = calloc(cells_num, sizeof(*r->cells));
+  if (r->cells == NULL) {
+    free(r);
+    return NULL;
+  }
+  for (size_t i = 0; i < cells_num; i++)
+    r->cells[i].seq = i;
+  r->mask = cells_num - 1;
+
+  pthread_mutex_init(&r->lock, /* attr = */ NULL);
+  pthread_cond_init(&r->cond, /* attr = */ NULL);
+
+  return r;
+} /* ring_t *ring_create */
+
+void ring_destroy(ring_t *r) {
+  if (r == NULL)
+    return;
+
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->cond);
+  free(r->cells);
+  free(r);
+} /* void ring_destroy */
+
+static void ring_wake(ring_t *r) {
+  /* Pairs with the increment of `waiters' in `ring_pop_wait': either the
+   * consumer sees the pushed pointer, or the producer sees the consumer. */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&r->waiters, __ATOMIC_RELAXED) == 0)
+    return;
+
+  pthread_mutex_lock(&r->lock);
+  r->epoch++;
+  pthread_cond_signal(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+} /* void ring_wake */
+
+int ring_push(ring_t *r, void *ptr) {
+  ring_cell_t *cell;
+  size_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+  while (1) {
+    cell = r->cells + (pos & r->mask);
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1,
+                                      /* weak = */ 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      /* The cell still holds the pointer pushed one round earlier. */
+      return EAGAIN;
+    } else {
+      pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->ptr = ptr;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+  ring_wake(r);
+  return 0;
+} /* int ring_push */
+
+void *ring_pop(ring_t *r) {
+  ring_cell_t *cell;
+  size_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+  while (1) {
+    cell = r->cells + (pos & r->mask);
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1,
+                                      /* weak = */ 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  void *ptr = cell->ptr;
+  /* Hand the cell to the producer of the next round. */
+  __atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+
+  return ptr;
+} /* void *ring_pop */
+
+void *ring_pop_wait(ring_t *r) {
+  while (1) {
+    for (int i = 0; i < RING_SPIN; i++) {
+      void *ptr = ring_pop(r);
+      if (ptr != NULL)
+        return ptr;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    unsigned int epoch = r->epoch;
+    bool shutdown = r->shutdown;
+    pthread_mutex_unlock(&r->lock);
+
+    /* Announce the intent to sleep, then look once more: a producer either
+     * pushed before that and the pointer is found, or it sees `waiters' and
+     * bumps the epoch. */
+    __atomic_add_fetch(&r->waiters, 1, __ATOMIC_SEQ_CST);
+
+    void *ptr = ring_pop(r);
+    if ((ptr != NULL) || shutdown) {
+      __atomic_sub_fetch(&r->waiters, 1, __ATOMIC_SEQ_CST);
+      return ptr;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    while ((r->epoch == epoch) && !r->shutdown)
+      pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+
+    __atomic_sub_fetch(&r->waiters, 1, __ATOMIC_SEQ_CST);
+  }
+} /* void *ring_pop_wait */
+
+void ring_shutdown(ring_t *r) {
+  pthread_mutex_lock(&r->lock);
+  r->shutdown = true;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+} /* void ring_shutdown */
+
+size_t ring_length(ring_t *r) {
+  size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+  /* Both are read separately, the head may have passed the tail read. */
+  return (tail > head) ? (tail - head) : 0;
+} /* size_t ring_length */
+
+size_t ring_size(ring_t *r) { return r->mask + 1; }
@@ -0,0 +1,95 @@
+/**
+ * collectd - src/daemon/utils_ring.h
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **/
+
+#ifndef UTILS_RING_H
+#define UTILS_RING_H 1
+
+#include "collectd.h"
+
+/*
+ * Bounded multi-producer, multi-consumer queue of pointers. Pushing and
+ * popping do not take any lock. Consumers finding the ring empty can park in
+ * `ring_pop_wait'; producers only take the parking lock if a consumer is
+ * parked.
+ */
+struct ring_s;
+typedef struct ring_s ring_t;
+
+/*
+ * NAME
+ *   ring_create
+ *
+ * DESCRIPTION
+ *   Allocates a ring holding at least `size' pointers. The size is rounded up
+ *   to a power of two.
+ *
+ * RETURN VALUE
+ *   The new ring or NULL if memory could not be allocated.
+ */
+ring_t *ring_create(size_t size);
+
+/* Frees the ring. Pointers still queued are not freed. */
+void ring_destroy(ring_t *r);
+
+/*
+ * NAME
+ *   ring_push
+ *
+ * DESCRIPTION
+ *   Adds `ptr', which must not be NULL, to the ring and wakes a parked
+ *   consumer, if any.
+ *
+ * RETURN VALUE
+ *   Zero on success, EAGAIN if the ring is full.
+ */
+int ring_push(ring_t *r, void *ptr);
+
+/* Removes the oldest pointer from the ring. Returns NULL if the ring is
+ * empty. */
+void *ring_pop(ring_t *r);
+
+/*
+ * NAME
+ *   ring_pop_wait
+ *
+ * DESCRIPTION
+ *   Like `ring_pop', but waits for a pointer to be pushed if the ring is
+ *   empty.
+ *
+ * RETURN VALUE
+ *   The oldest pointer, or NULL once `ring_shutdown' has been called and the
+ *   ring is empty.
+ */
+void *ring_pop_wait(ring_t *r);
+
+/* Wakes all consumers parked in `ring_pop_wait' and makes it return NULL
+ * instead of waiting from now on. */
+void ring_shutdown(ring_t *r);
+
+/* Returns the number of pointers in the ring. Other threads may change it at
+ * any time, so the value is a snapshot only. */
+size_t ring_length(ring_t *r);
+
+/* Returns the number of pointers the ring can hold. */
+size_t ring_size(ring_t *r);
+
+#endif /* UTILS_RING_H */
@@ -0,0 +1,213 @@
+/**
+ * collectd - src/daemon/utils_ring_bench.c
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **/
+
+/* Compares the write queue of the daemon, a ring with parked consumers,
+ * with the linked list protected by a mutex and a condition variable it
+ * replaced. Producers stand for read threads dispatching values, consumers
+ * for write threads.
+ *
+ * Usage: bench_utils_ring [producers] [consumers] [items per producer] */
+
+#include "collectd.h"
+
+#include "utils_ring.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_PRODUCERS 4
+#define BENCH_DEFAULT_CONSUMERS 5
+#define BENCH_DEFAULT_ITEMS 500000
+#define BENCH_RING_SIZE 65536
+
+typedef struct item_s {
+  struct item_s *next;
+} item_t;
+
+/* The previous write queue */
+static item_t *list_head;
+static item_t *list_tail;
+static bool list_loop = true;
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t list_cond = PTHREAD_COND_INITIALIZER;
+
+static ring_t *ring;
+
+typedef struct {
+  pthread_t thread;
+  item_t *items;
+  long items_num;
+} bench_thread_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void *list_producer(void *arg) {
+  bench_thread_t *t = arg;
+
+  for (long i = 0; i < t->items_num; i++) {
+    item_t *item = t->items + i;
+    item->next = NULL;
+
+    pthread_mutex_lock(&list_lock);
+    if (list_tail == NULL)
+      list_head = item;
+    else
+      list_tail->next = item;
+    list_tail = item;
+    pthread_cond_signal(&list_cond);
+    pthread_mutex_unlock(&list_lock);
+  }
+  return NULL;
+}
+
+static void *list_consumer(void *arg) {
+  bench_thread_t *t = arg;
+
+  while (1) {
+    pthread_mutex_lock(&list_lock);
+    while (list_loop && (list_head == NULL))
+      pthread_cond_wait(&list_cond, &list_lock);
+    item_t *item = list_head;
+    if (item == NULL) {
+      pthread_mutex_unlock(&list_lock);
+      break;
+    }
+    list_head = item->next;
+    if (list_head == NULL)
+      list_tail = NULL;
+    pthread_mutex_unlock(&list_lock);
+
+    t->items_num++;
+  }
+  return NULL;
+}
+
+static void *ring_producer(void *arg) {
+  bench_thread_t *t = arg;
+
+  for (long i = 0; i < t->items_num; i++) {
+    while (ring_push(ring, t->items + i) == EAGAIN)
+      sched_yield();
+  }
+  return NULL;
+}
+
+static void *ring_consumer(void *arg) {
+  bench_thread_t *t = arg;
+
+  while (ring_pop_wait(ring) != NULL)
+    t->items_num++;
+  return NULL;
+}
+
+static void list_stop(void) {
+  pthread_mutex_lock(&list_lock);
+  list_loop = false;
+  pthread_cond_broadcast(&list_cond);
+  pthread_mutex_unlock(&list_lock);
+}
+
+static void ring_stop(void) { ring_shutdown(ring); }
+
+static int run(const char *name, void *(*producer)(void *),
+               void *(*consumer)(void *), void (*stop)(void),
+               bench_thread_t *producers, int producers_num,
+               bench_thread_t *consumers, int consumers_num, long items) {
+  double start = now_seconds();
+
+  for (int i = 0; i < consumers_num; i++) {
+    consumers[i].items_num = 0;
+    if (pthread_create(&consumers[i].thread, NULL, consumer, consumers + i) !=
+        0) {
+      fprintf(stderr, "pthread_create failed\n");
+      return -1;
+    }
+  }
+  for (int i = 0; i < producers_num; i++) {
+    producers[i].items_num = items;
+    if (pthread_create(&producers[i].thread, NULL, producer, producers + i) !=
+        0) {
+      fprintf(stderr, "pthread_create failed\n");
+      return -1;
+    }
+  }
+
+  for (int i = 0; i < producers_num; i++)
+    pthread_join(producers[i].thread, NULL);
+  (*stop)();
+
+  long consumed = 0;
+  for (int i = 0; i < consumers_num; i++) {
+    pthread_join(consumers[i].thread, NULL);
+    consumed += consumers[i].items_num;
+  }
+  double elapsed = now_seconds() - start;
+
+  printf("%-6s %d producers, %d consumers: %.0f items/s, %ld of %ld "
+         "consumed\n",
+         name, producers_num, consumers_num, (double)consumed / elapsed,
+         consumed, (long)producers_num * items);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int producers_num = (argc > 1) ? atoi(argv[1]) : BENCH_DEFAULT_PRODUCERS;
+  int consumers_num = (argc > 2) ? atoi(argv[2]) : BENCH_DEFAULT_CONSUMERS;
+  long items = (argc > 3) ? atol(argv[3]) : BENCH_DEFAULT_ITEMS;
+  if ((producers_num <= 0) || (consumers_num <= 0) || (items <= 0)) {
+    fprintf(stderr, "Usage: %s [producers] [consumers] [items per producer]\n",
+            argv[0]);
+    return 1;
+  }
+
+  bench_thread_t *producers = calloc((size_t)producers_num, sizeof(*producers));
+  bench_thread_t *consumers = calloc((size_t)consumers_num, sizeof(*consumers));
+  ring = ring_create(BENCH_RING_SIZE);
+  if ((producers == NULL) || (consumers == NULL) || (ring == NULL)) {
+    fprintf(stderr, "Allocation failed\n");
+    return 1;
+  }
+  for (int i = 0; i < producers_num; i++) {
+    producers[i].items = calloc((size_t)items, sizeof(item_t));
+    if (producers[i].items == NULL) {
+      fprintf(stderr, "calloc failed\n");
+      return 1;
+    }
+  }
+
+  if ((run("list", list_producer, list_consumer, list_stop, producers,
+           producers_num, consumers, consumers_num, items) != 0) ||
+      (run("ring", ring_producer, ring_consumer, ring_stop, producers,
+           producers_num, consumers, consumers_num, items) != 0))
+    return 1;
+
+  for (int i = 0; i < producers_num; i++)
+    free(producers[i].items);
+  free(producers);
+  free(consumers);
+  ring_destroy(ring);
+  return 0;
+}
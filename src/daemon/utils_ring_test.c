@@ -0,0 +1,175 @@
+/**
+ * collectd - src/daemon/utils_ring_test.c
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **/
+
+#include "collectd.h"
+
+#include "testing.h"
+#include "utils_ring.h"
+
+#include <pthread.h>
+
+#define THREADS_NUM 4
+#define ITEMS_PER_THREAD 100000
+
+DEF_TEST(single) {
+  ring_t *r;
+  int values[8];
+
+  OK((r = ring_create(5)) != NULL);
+  EXPECT_EQ_INT(8, ring_size(r));
+  EXPECT_EQ_INT(0, ring_length(r));
+  OK(ring_pop(r) == NULL);
+
+  for (int i = 0; i < 8; i++)
+    CHECK_ZERO(ring_push(r, values + i));
+  EXPECT_EQ_INT(8, ring_length(r));
+  EXPECT_EQ_INT(EAGAIN, ring_push(r, values));
+
+  /* First in, first out, also after wrapping around. */
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 8; i++) {
+      OK(ring_pop(r) == values + i);
+      CHECK_ZERO(ring_push(r, values + i));
+    }
+  }
+  EXPECT_EQ_INT(8, ring_length(r));
+
+  for (int i = 0; i < 8; i++)
+    OK(ring_pop(r) == values + i);
+  OK(ring_pop(r) == NULL);
+  EXPECT_EQ_INT(0, ring_length(r));
+
+  ring_destroy(r);
+  return 0;
+}
+
+typedef struct {
+  ring_t *ring;
+  pthread_t thread;
+  size_t first;
+  uint64_t sum;
+  size_t count;
+} worker_t;
+
+static void *producer(void *arg) {
+  worker_t *w = arg;
+
+  for (size_t i = w->first; i < w->first + ITEMS_PER_THREAD; i++) {
+    /* Never NULL: items are numbered from one. */
+    while (ring_push(w->ring, (void *)(i + 1)) == EAGAIN)
+      sched_yield();
+  }
+  return NULL;
+}
+
+static void *consumer(void *arg) {
+  worker_t *w = arg;
+  void *ptr;
+
+  while ((ptr = ring_pop_wait(w->ring)) != NULL) {
+    w->sum += (uint64_t)(uintptr_t)ptr;
+    w->count++;
+  }
+  return NULL;
+}
+
+DEF_TEST(threads) {
+  worker_t producers[THREADS_NUM] = {{0}};
+  worker_t consumers[THREADS_NUM] = {{0}};
+  ring_t *r;
+
+  /* Small, so that producers find it full now and then. */
+  OK((r = ring_create(64)) != NULL);
+
+  for (int i = 0; i < THREADS_NUM; i++) {
+    consumers[i].ring = r;
+    CHECK_ZERO(pthread_create(&consumers[i].thread, NULL, consumer,
+                              consumers + i));
+  }
+  for (int i = 0; i < THREADS_NUM; i++) {
+    producers[i].ring = r;
+    producers[i].first = (size_t)i * ITEMS_PER_THREAD;
+    CHECK_ZERO(pthread_create(&producers[i].thread, NULL, producer,
+                              producers + i));
+  }
+
+  for (int i = 0; i < THREADS_NUM; i++)
+    pthread_join(producers[i].thread, NULL);
+
+  /* Consumers return NULL only once the ring is empty. */
+  ring_shutdown(r);
+
+  uint64_t sum = 0;
+  size_t count = 0;
+  for (int i = 0; i < THREADS_NUM; i++) {
+    pthread_join(consumers[i].thread, NULL);
+    sum += consumers[i].sum;
+    count += consumers[i].count;
+  }
+
+  uint64_t n = (uint64_t)THREADS_NUM * ITEMS_PER_THREAD;
+  EXPECT_EQ_INT(THREADS_NUM * ITEMS_PER_THREAD, count);
+  EXPECT_EQ_UINT64(n * (n + 1) / 2, sum);
+  EXPECT_EQ_INT(0, ring_length(r));
+
+  ring_destroy(r);
+  return 0;
+}
+
+static void *waiter(void *arg) { return ring_pop_wait(arg); }
+
+DEF_TEST(shutdown) {
+  pthread_t thread;
+  void *ret = &thread;
+  ring_t *r;
+  int value;
+
+  OK((r = ring_create(4)) != NULL);
+
+  /* A parked consumer is woken by a push ... */
+  CHECK_ZERO(pthread_create(&thread, NULL, waiter, r));
+  CHECK_ZERO(ring_push(r, &value));
+  pthread_join(thread, &ret);
+  OK(ret == &value);
+
+  /* ... and by the shutdown. */
+  CHECK_ZERO(pthread_create(&thread, NULL, waiter, r));
+  ring_shutdown(r);
+  pthread_join(thread, &ret);
+  OK(ret == NULL);
+
+  /* Queued pointers are still returned after the shutdown. */
+  CHECK_ZERO(ring_push(r, &value));
+  OK(ring_pop_wait(r) == &value);
+  OK(ring_pop_wait(r) == NULL);
+
+  ring_destroy(r);
+  return 0;
+}
+
+int main(void) {
+  RUN_TEST(single);
+  RUN_TEST(threads);
+  RUN_TEST(shutdown);
+
+  END_TEST;
+}
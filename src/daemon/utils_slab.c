@@ -0,0 +1,175 @@
+/**
+ * collectd - src/daemon/utils_slab.c
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **/
+
+#include "collectd.h"
+
+#include "utils_slab.h"
+
+#include <pthread.h>
+
+/* Objects cached per thread, and exchanged with the depot at once. */
+#ifndef SLAB_MAGAZINE_SIZE
+#define SLAB_MAGAZINE_SIZE 64
+#endif
+
+/* Full magazines kept in the depot. Objects beyond that are freed. */
+#ifndef SLAB_DEPOT_SIZE
+#define SLAB_DEPOT_SIZE 64
+#endif
+
+typedef struct slab_magazine_s {
+  struct slab_magazine_s *next;
+  size_t num;
+  void *objects[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+struct slab_s {
+  size_t size;
+  pthread_key_t key;
+
+  pthread_mutex_t lock;
+  slab_magazine_t *full;
+  size_t full_num;
+  slab_magazine_t *empty;
+};
+
+static void slab_magazine_free(slab_magazine_t *m) {
+  for (size_t i = 0; i < m->num; i++)
+    free(m->objects[i]);
+  free(m);
+} /* void slab_magazine_free */
+
+/* Called on thread exit. Does not use the slab, which may be gone. */
+static void slab_thread_destructor(void *arg) { slab_magazine_free(arg); }
+
+slab_t *slab_create(size_t size) {
+  slab_t *s = calloc(1, sizeof(*s));
+  if (s == NULL)
+    return NULL;
+
+  s->size = size;
+  if (pthread_key_create(&s->key, slab_thread_destructor) != 0) {
+    free(s);
+    return NULL;
+  }
+  pthread_mutex_init(&s->lock, /* attr = */ NULL);
+
+  return s;
+} /* slab_t *slab_create */
+
+void slab_destroy(slab_t *s) {
+  if (s == NULL)
+    return;
+
+  slab_magazine_t *m = pthread_getspecific(s->key);
+  if (m != NULL) {
+    pthread_setspecific(s->key, NULL);
+    slab_magazine_free(m);
+  }
+  pthread_key_delete(s->key);
+
+  while ((m = s->full) != NULL) {
+    s->full = m->next;
+    slab_magazine_free(m);
+  }
+  while ((m = s->empty) != NULL) {
+    s->empty = m->next;
+    free(m);
+  }
+
+  pthread_mutex_destroy(&s->lock);
+  free(s);
+} /* void slab_destroy */
+
+void *slab_alloc(slab_t *s) {
+  slab_magazine_t *m = pthread_getspecific(s->key);
+
+  if ((m != NULL) && (m->num > 0))
+    return m->objects[--m->num];
+
+  /* Swap the empty magazine for a full one. */
+  pthread_mutex_lock(&s->lock);
+  slab_magazine_t *full = s->full;
+  if (full != NULL) {
+    s->full = full->next;
+    s->full_num--;
+    if (m != NULL) {
+      m->next = s->empty;
+      s->empty = m;
+    }
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  if (full == NULL)
+    return malloc(s->size);
+
+  pthread_setspecific(s->key, full);
+  return full->objects[--full->num];
+} /* void *slab_alloc */
+
+void slab_free(slab_t *s, void *ptr) {
+  if (ptr == NULL)
+    return;
+
+  slab_magazine_t *m = pthread_getspecific(s->key);
+  if ((m != NULL) && (m->num < SLAB_MAGAZINE_SIZE)) {
+    m->objects[m->num++] = ptr;
+    return;
+  }
+
+  /* Swap the full magazine for an empty one. */
+  slab_magazine_t *empty = NULL;
+  pthread_mutex_lock(&s->lock);
+  if (m != NULL) {
+    if (s->full_num < SLAB_DEPOT_SIZE) {
+      m->next = s->full;
+      s->full = m;
+      s->full_num++;
+    } else {
+      /* The depot is full; the magazine is emptied outside the lock. */
+      empty = m;
+    }
+  }
+  if ((empty == NULL) && (s->empty != NULL)) {
+    empty = s->empty;
+    s->empty = empty->next;
+  }
+  pthread_mutex_unlock(&s->lock);
+
+  if (empty == NULL) {
+    empty = malloc(sizeof(*empty));
+    if (empty == NULL) {
+      /* `m', if any, has been handed to the depot. */
+      pthread_setspecific(s->key, NULL);
+      free(ptr);
+      return;
+    }
+  } else {
+    for (size_t i = 0; i < empty->num; i++)
+      free(empty->objects[i]);
+  }
+  empty->num = 0;
+
+  if (empty != m)
+    pthread_setspecific(s->key, empty);
+  empty->objects[empty->num++] = ptr;
+} /* void slab_free */
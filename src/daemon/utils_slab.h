@@ -0,0 +1,70 @@
+/**
+ * collectd - src/daemon/utils_slab.h
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **/
+
+#ifndef UTILS_SLAB_H
+#define UTILS_SLAB_H 1
+
+#include "collectd.h"
+
+/*
+ * Cache of equally sized objects. Every thread keeps freed objects in a
+ * small cache of its own, so that allocating and freeing usually takes no
+ * lock and no call to malloc(3). Objects are often freed by another thread
+ * than the one allocating them; full and empty caches are therefore
+ * exchanged through a shared depot, which is locked once per
+ * SLAB_MAGAZINE_SIZE objects.
+ */
+struct slab_s;
+typedef struct slab_s slab_t;
+
+/*
+ * NAME
+ *   slab_create
+ *
+ * DESCRIPTION
+ *   Creates a cache of objects of `size' bytes each.
+ *
+ * RETURN VALUE
+ *   The new cache or NULL on failure.
+ */
+slab_t *slab_create(size_t size);
+
+/*
+ * NAME
+ *   slab_destroy
+ *
+ * DESCRIPTION
+ *   Frees the cache and the objects cached by it. Other threads must not use
+ *   the cache any more; objects still cached by threads that have not exited
+ *   yet are leaked.
+ */
+void slab_destroy(slab_t *s);
+
+/* Returns an uninitialized object, or NULL if memory could not be
+ * allocated. */
+void *slab_alloc(slab_t *s);
+
+/* Returns an object allocated with `slab_alloc' to the cache. Does nothing if
+ * `ptr' is NULL. */
+void slab_free(slab_t *s, void *ptr);
+
+#endif /* UTILS_SLAB_H */
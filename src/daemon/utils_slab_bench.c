@@ -0,0 +1,157 @@
+/**
+ * collectd - src/daemon/utils_slab_bench.c
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **/
+
+/* Compares malloc(3) with the slab cache for objects that are allocated by
+ * one thread and freed by another, as value lists are allocated by the read
+ * threads and freed by the write threads. Objects are handed over through a
+ * ring.
+ *
+ * Usage: bench_utils_slab [producers] [consumers] [objects per producer] */
+
+#include "collectd.h"
+
+#include "utils_ring.h"
+#include "utils_slab.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_PRODUCERS 4
+#define BENCH_DEFAULT_CONSUMERS 4
+#define BENCH_DEFAULT_OBJECTS 500000
+#define BENCH_RING_SIZE 4096
+/* About a queued value list */
+#define BENCH_OBJECT_SIZE 720
+
+static ring_t *ring;
+static slab_t *slab;
+static long objects_num;
+
+typedef struct {
+  pthread_t thread;
+  long freed;
+} bench_thread_t;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void *producer(void *arg) {
+  for (long i = 0; i < objects_num; i++) {
+    char *ptr = (slab != NULL) ? slab_alloc(slab) : malloc(BENCH_OBJECT_SIZE);
+    if (ptr == NULL)
+      continue;
+    /* Touch the object like a value list copy would. */
+    memset(ptr, 0, 64);
+
+    while (ring_push(ring, ptr) == EAGAIN)
+      sched_yield();
+  }
+  return NULL;
+}
+
+static void *consumer(void *arg) {
+  bench_thread_t *t = arg;
+  void *ptr;
+
+  while ((ptr = ring_pop_wait(ring)) != NULL) {
+    if (slab != NULL)
+      slab_free(slab, ptr);
+    else
+      free(ptr);
+    t->freed++;
+  }
+  return NULL;
+}
+
+static int run(const char *name, int producers_num, int consumers_num) {
+  bench_thread_t producers[producers_num];
+  bench_thread_t consumers[consumers_num];
+
+  ring = ring_create(BENCH_RING_SIZE);
+  if (ring == NULL) {
+    fprintf(stderr, "ring_create failed\n");
+    return -1;
+  }
+
+  double start = now_seconds();
+  for (int i = 0; i < consumers_num; i++) {
+    consumers[i].freed = 0;
+    if (pthread_create(&consumers[i].thread, NULL, consumer, consumers + i) !=
+        0) {
+      fprintf(stderr, "pthread_create failed\n");
+      return -1;
+    }
+  }
+  for (int i = 0; i < producers_num; i++) {
+    if (pthread_create(&producers[i].thread, NULL, producer, producers + i) !=
+        0) {
+      fprintf(stderr, "pthread_create failed\n");
+      return -1;
+    }
+  }
+
+  for (int i = 0; i < producers_num; i++)
+    pthread_join(producers[i].thread, NULL);
+  ring_shutdown(ring);
+
+  long freed = 0;
+  for (int i = 0; i < consumers_num; i++) {
+    pthread_join(consumers[i].thread, NULL);
+    freed += consumers[i].freed;
+  }
+  double elapsed = now_seconds() - start;
+
+  printf("%-6s %d producers, %d consumers: %.0f objects/s, %ld freed\n", name,
+         producers_num, consumers_num, (double)freed / elapsed, freed);
+
+  ring_destroy(ring);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int producers_num = (argc > 1) ? atoi(argv[1]) : BENCH_DEFAULT_PRODUCERS;
+  int consumers_num = (argc > 2) ? atoi(argv[2]) : BENCH_DEFAULT_CONSUMERS;
+  objects_num = (argc > 3) ? atol(argv[3]) : BENCH_DEFAULT_OBJECTS;
+  if ((producers_num <= 0) || (consumers_num <= 0) || (objects_num <= 0)) {
+    fprintf(stderr,
+            "Usage: %s [producers] [consumers] [objects per producer]\n",
+            argv[0]);
+    return 1;
+  }
+
+  if (run("malloc", producers_num, consumers_num) != 0)
+    return 1;
+
+  slab = slab_create(BENCH_OBJECT_SIZE);
+  if (slab == NULL) {
+    fprintf(stderr, "slab_create failed\n");
+    return 1;
+  }
+  if (run("slab", producers_num, consumers_num) != 0)
+    return 1;
+
+  slab_destroy(slab);
+  return 0;
+}
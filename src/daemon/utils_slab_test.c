@@ -0,0 +1,111 @@
+/**
+ * collectd - src/daemon/utils_slab_test.c
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **/
+
+#include "collectd.h"
+
+#include "testing.h"
+#include "utils_slab.h"
+
+#include <pthread.h>
+
+#define OBJECT_SIZE 100
+/* More than the depot holds, so that some objects are freed for real. */
+#define OBJECTS_NUM 10000
+
+static slab_t *slab;
+static void *objects[OBJECTS_NUM];
+
+DEF_TEST(reuse) {
+  void *a;
+  void *b;
+
+  OK((a = slab_alloc(slab)) != NULL);
+  memset(a, 0xff, OBJECT_SIZE);
+  slab_free(slab, a);
+
+  /* The object is taken from the thread's cache again. */
+  OK((b = slab_alloc(slab)) != NULL);
+  OK(a == b);
+  slab_free(slab, b);
+
+  slab_free(slab, NULL);
+
+  return 0;
+}
+
+static void *alloc_thread(void *arg) {
+  for (size_t i = 0; i < OBJECTS_NUM; i++) {
+    objects[i] = slab_alloc(slab);
+    if (objects[i] != NULL)
+      memset(objects[i], (int)i, OBJECT_SIZE);
+  }
+  return NULL;
+}
+
+static void *free_thread(void *arg) {
+  for (size_t i = 0; i < OBJECTS_NUM; i++)
+    slab_free(slab, objects[i]);
+  return NULL;
+}
+
+DEF_TEST(threads) {
+  pthread_t thread;
+
+  /* Objects allocated by one thread and freed by another reach a third one
+   * through the depot. */
+  for (int round = 0; round < 3; round++) {
+    CHECK_ZERO(pthread_create(&thread, NULL, alloc_thread, NULL));
+    pthread_join(thread, NULL);
+
+    int failed = 0;
+    for (size_t i = 0; i < OBJECTS_NUM; i++) {
+      if (objects[i] == NULL)
+        failed++;
+      for (size_t j = i + 1; (j < i + 64) && (j < OBJECTS_NUM); j++)
+        if (objects[i] == objects[j])
+          failed++;
+    }
+    EXPECT_EQ_INT(0, failed);
+
+    CHECK_ZERO(pthread_create(&thread, NULL, free_thread, NULL));
+    pthread_join(thread, NULL);
+  }
+
+  /* This thread's cache is empty, but the depot is not. */
+  void *ptr;
+  OK((ptr = slab_alloc(slab)) != NULL);
+  memset(ptr, 0, OBJECT_SIZE);
+  slab_free(slab, ptr);
+
+  return 0;
+}
+
+int main(void) {
+  OK((slab = slab_create(OBJECT_SIZE)) != NULL);
+
+  RUN_TEST(reuse);
+  RUN_TEST(threads);
+
+  slab_destroy(slab);
+
+  END_TEST;
+}
@@ -155,6 +155,9 @@ static int config_keys_num = STATIC_ARRAY_SIZE(config_keys);
 
 static ignorelist_t *ignorelist;
 
+/* Value lists of one read, dispatched at once. */
+static plugin_batch_t disk_batch;
+
 static int disk_config(const char *key, const char *value) {
   if (ignorelist == NULL)
     ignorelist = ignorelist_create(/* invert = */ 1);
@@ -284,7 +287,7 @@ static void disk_submit(const char *plugin_instance, const char *type,
   sstrncpy(vl.plugin_instance, plugin_instance, sizeof(vl.plugin_instance));
   sstrncpy(vl.type, type, sizeof(vl.type));
 
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&disk_batch, &vl);
 } /* void disk_submit */
 
 #if KERNEL_FREEBSD || KERNEL_LINUX
@@ -301,7 +304,7 @@ static void submit_io_time(char const *plugin_instance, derive_t io_time,
   sstrncpy(vl.plugin_instance, plugin_instance, sizeof(vl.plugin_instance));
   sstrncpy(vl.type, "disk_io_time", sizeof(vl.type));
 
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&disk_batch, &vl);
 } /* void submit_io_time */
 #endif /* KERNEL_FREEBSD || KERNEL_LINUX */
 
@@ -315,7 +318,7 @@ static void submit_in_progress(char const *disk_name, gauge_t in_progress) {
   sstrncpy(vl.plugin_instance, disk_name, sizeof(vl.plugin_instance));
   sstrncpy(vl.type, "pending_operations", sizeof(vl.type));
 
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&disk_batch, &vl);
 }
 
 static counter_t disk_calc_time_incr(counter_t delta_time,
@@ -1018,6 +1021,7 @@ static int disk_read(void) {
   }
 #endif /* defined(HAVE_PERFSTAT) */
 
+  plugin_batch_dispatch(&disk_batch);
   return 0;
 } /* int disk_read */
 
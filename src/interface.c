@@ -90,6 +90,9 @@ static ignorelist_t *ignorelist;
 
 static bool report_inactive = true;
 
+/* Value lists of one read, dispatched at once. */
+static plugin_batch_t if_batch;
+
 #ifdef HAVE_LIBKSTAT
 #if HAVE_KSTAT_H
 #include <kstat.h>
@@ -172,7 +175,7 @@ static void if_submit(const char *dev, const char *type, derive_t rx,
   sstrncpy(vl.plugin_instance, dev, sizeof(vl.plugin_instance));
   sstrncpy(vl.type, type, sizeof(vl.type));
 
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&if_batch, &vl);
 } /* void if_submit */
 
 static int interface_read(void) {
@@ -383,6 +386,7 @@ static int interface_read(void) {
   }
 #endif /* HAVE_PERFSTAT */
 
+  plugin_batch_dispatch(&if_batch);
   return 0;
 } /* int interface_read */
 
@@ -295,6 +295,9 @@ typedef struct procstat {
 
 static procstat_t *list_head_g;
 
+/* Value lists of one read, dispatched at once. */
+static plugin_batch_t ps_batch;
+
 static bool want_init = true;
 static bool report_ctx_switch;
 static bool report_fd_num;
@@ -796,7 +799,7 @@ static void ps_submit_state(const char *state, double value) {
   sstrncpy(vl.type, "ps_state", sizeof(vl.type));
   sstrncpy(vl.type_instance, state, sizeof(vl.type_instance));
 
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&ps_batch, &vl);
 }
 
 /* submit info about specific process (e.g.: memory taken, cpu usage, etc..) */
@@ -811,52 +814,52 @@ static void ps_submit_proc_list(procstat_t *ps) {
   sstrncpy(vl.type, "ps_vm", sizeof(vl.type));
   vl.values[0].gauge = ps->vmem_size;
   vl.values_len = 1;
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&ps_batch, &vl);
 
   sstrncpy(vl.type, "ps_rss", sizeof(vl.type));
   vl.values[0].gauge = ps->vmem_rss;
   vl.values_len = 1;
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&ps_batch, &vl);
 
   sstrncpy(vl.type, "ps_data", sizeof(vl.type));
   vl.values[0].gauge = ps->vmem_data;
   vl.values_len = 1;
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&ps_batch, &vl);
 
   sstrncpy(vl.type, "ps_code", sizeof(vl.type));
   vl.values[0].gauge = ps->vmem_code;
   vl.values_len = 1;
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&ps_batch, &vl);
 
   sstrncpy(vl.type, "ps_stacksize", sizeof(vl.type));
   vl.values[0].gauge = ps->stack_size;
   vl.values_len = 1;
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&ps_batch, &vl);
 
   sstrncpy(vl.type, "ps_cputime", sizeof(vl.type));
   vl.values[0].derive = ps->cpu_user_counter;
   vl.values[1].derive = ps->cpu_system_counter;
   vl.values_len = 2;
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&ps_batch, &vl);
 
   sstrncpy(vl.type, "ps_count", sizeof(vl.type));
   vl.values[0].gauge = ps->num_proc;
   vl.values[1].gauge = ps->num_lwp;
   vl.values_len = 2;
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&ps_batch, &vl);
 
   sstrncpy(vl.type, "ps_pagefaults", sizeof(vl.type));
   vl.values[0].derive = ps->vmem_minflt_counter;
   vl.values[1].derive = ps->vmem_majflt_counter;
   vl.values_len = 2;
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&ps_batch, &vl);
 
   if ((ps->io_rchar != -1) && (ps->io_wchar != -1)) {
     sstrncpy(vl.type, "io_octets", sizeof(vl.type));
     vl.values[0].derive = ps->io_rchar;
     vl.values[1].derive = ps->io_wchar;
     vl.values_len = 2;
-    plugin_dispatch_values(&vl);
+    plugin_batch_add(&ps_batch, &vl);
   }
 
   if ((ps->io_syscr != -1) && (ps->io_syscw != -1)) {
@@ -864,7 +867,7 @@ static void ps_submit_proc_list(procstat_t *ps) {
     vl.values[0].derive = ps->io_syscr;
     vl.values[1].derive = ps->io_syscw;
     vl.values_len = 2;
-    plugin_dispatch_values(&vl);
+    plugin_batch_add(&ps_batch, &vl);
   }
 
   if ((ps->io_diskr != -1) && (ps->io_diskw != -1)) {
@@ -872,14 +875,14 @@ static void ps_submit_proc_list(procstat_t *ps) {
     vl.values[0].derive = ps->io_diskr;
     vl.values[1].derive = ps->io_diskw;
     vl.values_len = 2;
-    plugin_dispatch_values(&vl);
+    plugin_batch_add(&ps_batch, &vl);
   }
 
   if (ps->num_fd > 0) {
     sstrncpy(vl.type, "file_handles", sizeof(vl.type));
     vl.values[0].gauge = ps->num_fd;
     vl.values_len = 1;
-    plugin_dispatch_values(&vl);
+    plugin_batch_add(&ps_batch, &vl);
   }
 
   if (ps->num_maps > 0) {
@@ -887,7 +890,7 @@ static void ps_submit_proc_list(procstat_t *ps) {
     sstrncpy(vl.type_instance, "mapped", sizeof(vl.type_instance));
     vl.values[0].gauge = ps->num_maps;
     vl.values_len = 1;
-    plugin_dispatch_values(&vl);
+    plugin_batch_add(&ps_batch, &vl);
   }
 
   if ((ps->cswitch_vol != -1) && (ps->cswitch_invol != -1)) {
@@ -895,13 +898,13 @@ static void ps_submit_proc_list(procstat_t *ps) {
     sstrncpy(vl.type_instance, "voluntary", sizeof(vl.type_instance));
     vl.values[0].derive = ps->cswitch_vol;
     vl.values_len = 1;
-    plugin_dispatch_values(&vl);
+    plugin_batch_add(&ps_batch, &vl);
 
     sstrncpy(vl.type, "contextswitch", sizeof(vl.type));
     sstrncpy(vl.type_instance, "involuntary", sizeof(vl.type_instance));
     vl.values[0].derive = ps->cswitch_invol;
     vl.values_len = 1;
-    plugin_dispatch_values(&vl);
+    plugin_batch_add(&ps_batch, &vl);
   }
 
   /* The ps->delay_* metrics are in nanoseconds per second. Convert to seconds
@@ -926,7 +929,7 @@ static void ps_submit_proc_list(procstat_t *ps) {
              sizeof(vl.type_instance));
     vl.values[0].gauge = delay_metrics[i].rate_ns * delay_factor;
     vl.values_len = 1;
-    plugin_dispatch_values(&vl);
+    plugin_batch_add(&ps_batch, &vl);
   }
 
   DEBUG(
@@ -2632,6 +2635,8 @@ static int ps_read(void) {
   read_fork_rate();
 #endif /* KERNEL_SOLARIS */
 
+  plugin_batch_dispatch(&ps_batch);
+
   want_init = false;
 
   return 0;
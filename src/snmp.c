@@ -93,6 +93,8 @@ struct host_definition_s {
   cdtime_t interval;
   data_definition_t **data_list;
   int data_list_len;
+  /* Value lists of one read, dispatched at once. */
+  plugin_batch_t batch;
 };
 typedef struct host_definition_s host_definition_t;
 
@@ -195,6 +197,7 @@ static void csnmp_host_definition_destroy(void *arg) /* {{{ */
   sfree(hd->priv_passphrase);
   sfree(hd->context);
   sfree(hd->data_list);
+  plugin_batch_free(&hd->batch);
 
   sfree(hd);
 } /* }}} void csnmp_host_definition_destroy */
@@ -1239,7 +1242,7 @@ static int csnmp_dispatch_table(host_definition_t *host,
      * switch if you're using IF-MIB::ifDescr as Instance.
      */
     if (vl.type_instance[0] != '\0')
-      plugin_dispatch_values(&vl);
+      plugin_batch_add(&host->batch, &vl);
 
     /* prevent leakage of pointer to local variable. */
     vl.values_len = 0;
@@ -1650,8 +1653,7 @@ static int csnmp_read_value(host_definition_t *host, data_definition_t *data) {
 
   snmp_free_pdu(res);
 
-  DEBUG("snmp plugin: -> plugin_dispatch_values (&vl);");
-  plugin_dispatch_values(&vl);
+  plugin_batch_add(&host->batch, &vl);
   sfree(vl.values);
 
   return 0;
@@ -1687,6 +1689,8 @@ static int csnmp_read_host(user_data_t *ud) {
       success++;
   }
 
+  plugin_batch_dispatch(&host->batch);
+
   if (success == 0)
     return -1;
 
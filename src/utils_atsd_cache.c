@@ -0,0 +1,447 @@
+/**
+ * collectd - src/utils_atsd_cache.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+#include "collectd.h"
+
+#include "common.h"
+#include "plugin.h"
+
+#include "utils_atsd_cache.h"
+#include "utils_intern.h"
+
+/* Both must be powers of two. */
+#define CACHE_SHARDS_BITS 4
+#define CACHE_SHARDS (1 << CACHE_SHARDS_BITS)
+#define CACHE_INITIAL_SIZE 64
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/* Open addressing with linear probing. A hash of zero marks a free slot. */
+typedef struct {
+  pthread_mutex_t lock;
+
+  atsd_series_t *series;
+  size_t series_size;
+  size_t series_num;
+
+  /* Time of the next sweep for expired series */
+  cdtime_t expires;
+} cache_shard_t;
+
+struct atsd_cache_s {
+  cdtime_t ttl;
+  cache_shard_t shards[CACHE_SHARDS];
+};
+
+/* `host' and `entity' share one allocation. */
+typedef struct {
+  uint64_t hash;
+  char *host;
+  char *entity;
+} entity_entry_t;
+
+struct atsd_entity_cache_s {
+  pthread_rwlock_t lock;
+
+  const char *entity;
+  _Bool short_hostname;
+  cdtime_t ttl;
+  cdtime_t expires;
+
+  entity_entry_t *entries;
+  size_t entries_size;
+  size_t entries_num;
+};
+
+static uint64_t hash_add(uint64_t hash, const char *str) {
+  for (const unsigned char *s = (const unsigned char *)str; *s != 0; s++) {
+    hash ^= *s;
+    hash *= FNV_PRIME;
+  }
+
+  /* Terminate every string, so that "ab","c" and "a","bc" differ. */
+  hash *= FNV_PRIME;
+  return hash;
+}
+
+static uint64_t hash_finish(uint64_t hash) { return (hash == 0) ? 1 : hash; }
+
+static cache_shard_t *shard_of(atsd_cache_t *cache, uint64_t hash) {
+  return &cache->shards[hash >> (64 - CACHE_SHARDS_BITS)];
+}
+
+/* The table is grown once it is three quarters full. */
+static _Bool needs_grow(size_t num, size_t size) {
+  return (4 * (num + 1)) > (3 * size);
+}
+
+static int series_grow(cache_shard_t *shard) {
+  size_t size =
+      (shard->series_size == 0) ? CACHE_INITIAL_SIZE : 2 * shard->series_size;
+  atsd_series_t *series = calloc(size, sizeof(*series));
+  if (series == NULL)
+    return -1;
+
+  for (size_t i = 0; i < shard->series_size; i++) {
+    atsd_series_t *old = shard->series + i;
+    if (old->hash == 0)
+      continue;
+
+    size_t j = old->hash & (size - 1);
+    while (series[j].hash != 0)
+      j = (j + 1) & (size - 1);
+    series[j] = *old;
+  }
+
+  sfree(shard->series);
+  shard->series = series;
+  shard->series_size = size;
+  return 0;
+}
+
+static void series_destroy(atsd_series_t *series) {
+  format_atsd_template_destroy(series->tmpl);
+  intern_put(series->host);
+  intern_put(series->plugin);
+  intern_put(series->plugin_instance);
+  intern_put(series->type);
+  intern_put(series->type_instance);
+  intern_put(series->data_source);
+}
+
+/* Removes the series not seen since `before'. Slots cannot simply be freed
+ * with linear probing, so the remaining series are moved to a new table,
+ * which shrinks with them. If that table cannot be allocated, nothing is
+ * removed until the next time. */
+static void series_expire(cache_shard_t *shard, cdtime_t before) {
+  size_t num = 0;
+
+  for (size_t i = 0; i < shard->series_size; i++)
+    if ((shard->series[i].hash != 0) && (shard->series[i].last_seen >= before))
+      num++;
+
+  if (num == shard->series_num)
+    return;
+
+  size_t size = CACHE_INITIAL_SIZE;
+  while (needs_grow(num, size))
+    size *= 2;
+
+  atsd_series_t *series = calloc(size, sizeof(*series));
+  if (series == NULL)
+    return;
+
+  for (size_t i = 0; i < shard->series_size; i++) {
+    atsd_series_t *old = shard->series + i;
+    if (old->hash == 0)
+      continue;
+
+    if (old->last_seen < before) {
+      series_destroy(old);
+      continue;
+    }
+
+    size_t j = old->hash & (size - 1);
+    while (series[j].hash != 0)
+      j = (j + 1) & (size - 1);
+    series[j] = *old;
+  }
+
+  sfree(shard->series);
+  shard->series = series;
+  shard->series_size = size;
+  shard->series_num = num;
+}
+
+static _Bool series_matches(const atsd_series_t *series,
+                            const value_list_t *vl, const char *data_source) {
+  return (strcmp(series->host, vl->host) == 0) &&
+         (strcmp(series->plugin, vl->plugin) == 0) &&
+         (strcmp(series->plugin_instance, vl->plugin_instance) == 0) &&
+         (strcmp(series->type, vl->type) == 0) &&
+         (strcmp(series->type_instance, vl->type_instance) == 0) &&
+         (strcmp(series->data_source, data_source) == 0);
+}
+
+atsd_cache_t *atsd_cache_create(cdtime_t ttl) {
+  atsd_cache_t *cache = calloc(1, sizeof(*cache));
+  if (cache == NULL)
+    return NULL;
+
+  cache->ttl = ttl;
+
+  for (size_t i = 0; i < CACHE_SHARDS; i++)
+    pthread_mutex_init(&cache->shards[i].lock, NULL);
+
+  return cache;
+}
+
+void atsd_cache_destroy(atsd_cache_t *cache) {
+  if (cache == NULL)
+    return;
+
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    cache_shard_t *shard = cache->shards + i;
+
+    for (size_t j = 0; j < shard->series_size; j++)
+      if (shard->series[j].hash != 0)
+        series_destroy(shard->series + j);
+    sfree(shard->series);
+
+    pthread_mutex_destroy(&shard->lock);
+  }
+
+  sfree(cache);
+}
+
+atsd_series_t *atsd_cache_acquire(atsd_cache_t *cache, const value_list_t *vl,
+                                  const char *data_source) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  hash = hash_add(hash, vl->host);
+  hash = hash_add(hash, vl->plugin);
+  hash = hash_add(hash, vl->plugin_instance);
+  hash = hash_add(hash, vl->type);
+  hash = hash_add(hash, vl->type_instance);
+  hash = hash_add(hash, data_source);
+  hash = hash_finish(hash);
+
+  cdtime_t now = cdtime();
+
+  cache_shard_t *shard = shard_of(cache, hash);
+  pthread_mutex_lock(&shard->lock);
+
+  if (now >= shard->expires) {
+    if (shard->expires != 0)
+      series_expire(shard, now - cache->ttl);
+    shard->expires = now + cache->ttl;
+  }
+
+  if (shard->series_size > 0) {
+    size_t i = hash & (shard->series_size - 1);
+    while (shard->series[i].hash != 0) {
+      if ((shard->series[i].hash == hash) &&
+          series_matches(shard->series + i, vl, data_source)) {
+        shard->series[i].last_seen = now;
+        return shard->series + i;
+      }
+      i = (i + 1) & (shard->series_size - 1);
+    }
+  }
+
+  /* Not found, add it. Growing moves the series, so look for a free slot
+   * afterwards. */
+  if (needs_grow(shard->series_num, shard->series_size) &&
+      (series_grow(shard) != 0)) {
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+  }
+
+  atsd_series_t new_series = {
+      .hash = hash,
+      .host = intern_get(vl->host),
+      .plugin = intern_get(vl->plugin),
+      .plugin_instance = intern_get(vl->plugin_instance),
+      .type = intern_get(vl->type),
+      .type_instance = intern_get(vl->type_instance),
+      .data_source = intern_get(data_source),
+      .last_seen = now,
+  };
+  if ((new_series.host == NULL) || (new_series.plugin == NULL) ||
+      (new_series.plugin_instance == NULL) || (new_series.type == NULL) ||
+      (new_series.type_instance == NULL) || (new_series.data_source == NULL)) {
+    series_destroy(&new_series);
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+  }
+
+  size_t i = hash & (shard->series_size - 1);
+  while (shard->series[i].hash != 0)
+    i = (i + 1) & (shard->series_size - 1);
+
+  shard->series[i] = new_series;
+  shard->series_num++;
+
+  return shard->series + i;
+}
+
+void atsd_cache_release(atsd_cache_t *cache, atsd_series_t *series) {
+  pthread_mutex_unlock(&shard_of(cache, series->hash)->lock);
+}
+
+size_t atsd_cache_size(atsd_cache_t *cache) {
+  size_t size = 0;
+
+  for (size_t i = 0; i < CACHE_SHARDS; i++) {
+    pthread_mutex_lock(&cache->shards[i].lock);
+    size += cache->shards[i].series_num;
+    pthread_mutex_unlock(&cache->shards[i].lock);
+  }
+
+  return size;
+}
+
+atsd_entity_cache_t *atsd_entity_cache_create(const char *entity,
+                                              _Bool short_hostname,
+                                              cdtime_t ttl) {
+  atsd_entity_cache_t *cache = calloc(1, sizeof(*cache));
+  if (cache == NULL)
+    return NULL;
+
+  pthread_rwlock_init(&cache->lock, NULL);
+  cache->entity = entity;
+  cache->short_hostname = short_hostname;
+  cache->ttl = ttl;
+
+  return cache;
+}
+
+static void entity_cache_clear(atsd_entity_cache_t *cache) {
+  for (size_t i = 0; i < cache->entries_size; i++)
+    sfree(cache->entries[i].host);
+  sfree(cache->entries);
+  cache->entries_size = 0;
+  cache->entries_num = 0;
+}
+
+void atsd_entity_cache_destroy(atsd_entity_cache_t *cache) {
+  if (cache == NULL)
+    return;
+
+  entity_cache_clear(cache);
+  pthread_rwlock_destroy(&cache->lock);
+  sfree(cache);
+}
+
+static entity_entry_t *entity_cache_find(atsd_entity_cache_t *cache,
+                                         uint64_t hash, const char *host) {
+  if (cache->entries_size == 0)
+    return NULL;
+
+  size_t i = hash & (cache->entries_size - 1);
+  while (cache->entries[i].hash != 0) {
+    if ((cache->entries[i].hash == hash) &&
+        (strcmp(cache->entries[i].host, host) == 0))
+      return cache->entries + i;
+    i = (i + 1) & (cache->entries_size - 1);
+  }
+
+  return NULL;
+}
+
+static int entity_cache_grow(atsd_entity_cache_t *cache) {
+  size_t size = (cache->entries_size == 0) ? CACHE_INITIAL_SIZE
+                                           : 2 * cache->entries_size;
+  entity_entry_t *entries = calloc(size, sizeof(*entries));
+  if (entries == NULL)
+    return -1;
+
+  for (size_t i = 0; i < cache->entries_size; i++) {
+    entity_entry_t *old = cache->entries + i;
+    if (old->hash == 0)
+      continue;
+
+    size_t j = old->hash & (size - 1);
+    while (entries[j].hash != 0)
+      j = (j + 1) & (size - 1);
+    entries[j] = *old;
+  }
+
+  sfree(cache->entries);
+  cache->entries = entries;
+  cache->entries_size = size;
+  return 0;
+}
+
+/* Must hold the lock for writing. Failing to add an entry is not an error,
+ * the entity is resolved again next time. */
+static void entity_cache_add(atsd_entity_cache_t *cache, uint64_t hash,
+                             const char *host, const char *entity) {
+  if (entity_cache_find(cache, hash, host) != NULL)
+    return;
+
+  if (needs_grow(cache->entries_num, cache->entries_size) &&
+      (entity_cache_grow(cache) != 0))
+    return;
+
+  size_t host_len = strlen(host) + 1;
+  size_t entity_len = strlen(entity) + 1;
+  char *data = malloc(host_len + entity_len);
+  if (data == NULL)
+    return;
+  memcpy(data, host, host_len);
+  memcpy(data + host_len, entity, entity_len);
+
+  size_t i = hash & (cache->entries_size - 1);
+  while (cache->entries[i].hash != 0)
+    i = (i + 1) & (cache->entries_size - 1);
+
+  cache->entries[i] = (entity_entry_t){
+      .hash = hash, .host = data, .entity = data + host_len,
+  };
+  cache->entries_num++;
+}
+
+int atsd_entity_cache_get(atsd_entity_cache_t *cache, const char *host,
+                          char *ret, size_t ret_len) {
+  uint64_t hash = hash_finish(hash_add(FNV_OFFSET_BASIS, host));
+  cdtime_t now = cdtime();
+
+  pthread_rwlock_rdlock(&cache->lock);
+  if (now < cache->expires) {
+    entity_entry_t *entry = entity_cache_find(cache, hash, host);
+    if (entry != NULL) {
+      sstrncpy(ret, entry->entity, ret_len);
+      pthread_rwlock_unlock(&cache->lock);
+      return 0;
+    }
+  }
+  pthread_rwlock_unlock(&cache->lock);
+
+  int status = format_entity(ret, (int)ret_len, cache->entity, host,
+                             cache->short_hostname);
+  if (status != 0)
+    return status;
+
+  pthread_rwlock_wrlock(&cache->lock);
+  if (now >= cache->expires) {
+    entity_cache_clear(cache);
+    cache->expires = now + cache->ttl;
+  }
+  entity_cache_add(cache, hash, host, ret);
+  pthread_rwlock_unlock(&cache->lock);
+
+  return 0;
+}
+
+int atsd_entity_cache_foreach(atsd_entity_cache_t *cache,
+                              int (*callback)(const char *host,
+                                              const char *entity,
+                                              void *user_data),
+                              void *user_data) {
+  int status = 0;
+
+  pthread_rwlock_rdlock(&cache->lock);
+  for (size_t i = 0; (i < cache->entries_size) && (status == 0); i++)
+    if (cache->entries[i].hash != 0)
+      status = callback(cache->entries[i].host, cache->entries[i].entity,
+                        user_data);
+  pthread_rwlock_unlock(&cache->lock);
+
+  return status;
+}
@@ -0,0 +1,108 @@
+/**
+ * collectd - src/utils_atsd_cache.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+#ifndef UTILS_ATSD_CACHE_H
+#define UTILS_ATSD_CACHE_H 1
+
+#include "collectd.h"
+#include "plugin.h"
+
+#include "utils_format_atsd.h"
+
+/* Per-series state of the write_atsd plugin, keyed by the value list
+ * identifier (without the host's entity mapping) and the data source name.
+ *
+ * The cache is split into shards by a 64-bit hash of the key. Every shard has
+ * its own lock and an open addressing table of series. The identifier strings
+ * are interned in the string table of the daemon, so a series costs a few
+ * pointers rather than copies of its names. Every `ttl', each shard removes
+ * the series that have not been acquired for that long. */
+struct atsd_cache_s;
+typedef struct atsd_cache_s atsd_cache_t;
+
+typedef struct {
+  uint64_t hash;
+
+  /* Interned with intern_get(), owned by the cache */
+  const char *host;
+  const char *plugin;
+  const char *plugin_instance;
+  const char *type;
+  const char *type_instance;
+  const char *data_source;
+
+  /* Pre-rendered commands, NULL until the series is first sent. Destroyed
+   * with the cache. */
+  format_template_t *tmpl;
+
+  /* Deadband rule of the series, looked up by the user on first use. Opaque
+   * to the cache. */
+  _Bool cache_rule_resolved;
+  const void *cache_rule;
+
+  /* Last value let through by the value cache */
+  _Bool has_value;
+  uint64_t value_time;
+  double value;
+
+  /* Time of the last atsd_cache_acquire() */
+  cdtime_t last_seen;
+} atsd_series_t;
+
+atsd_cache_t *atsd_cache_create(cdtime_t ttl);
+void atsd_cache_destroy(atsd_cache_t *cache);
+
+/* Returns the series of `vl' and `data_source', adding a zeroed one if it does
+ * not exist yet. The shard of the series stays locked until
+ * atsd_cache_release() is called; the returned pointer must not be used after
+ * that. Returns NULL when out of memory. */
+atsd_series_t *atsd_cache_acquire(atsd_cache_t *cache, const value_list_t *vl,
+                                  const char *data_source);
+void atsd_cache_release(atsd_cache_t *cache, atsd_series_t *series);
+
+/* Number of series in the cache. */
+size_t atsd_cache_size(atsd_cache_t *cache);
+
+/* Memo of format_entity() for the hosts of the value lists, so that resolving
+ * the entity is a hash lookup rather than a gethostname() call and string
+ * handling per value list. All entries are dropped every `ttl', so that a
+ * changed hostname is picked up. */
+struct atsd_entity_cache_s;
+typedef struct atsd_entity_cache_s atsd_entity_cache_t;
+
+/* `entity' and `short_hostname' are passed to format_entity(), `entity' must
+ * stay valid until the cache is destroyed. */
+atsd_entity_cache_t *atsd_entity_cache_create(const char *entity,
+                                              _Bool short_hostname,
+                                              cdtime_t ttl);
+void atsd_entity_cache_destroy(atsd_entity_cache_t *cache);
+
+/* Copies the entity of `host' to `ret'. */
+int atsd_entity_cache_get(atsd_entity_cache_t *cache, const char *host,
+                          char *ret, size_t ret_len);
+
+/* Calls `callback' for every cached host and its entity, while holding a read
+ * lock on the cache. Stops and returns the status of the callback if it is not
+ * zero. */
+int atsd_entity_cache_foreach(atsd_entity_cache_t *cache,
+                              int (*callback)(const char *host,
+                                              const char *entity,
+                                              void *user_data),
+                              void *user_data);
+
+#endif /* UTILS_ATSD_CACHE_H */
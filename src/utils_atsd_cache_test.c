@@ -0,0 +1,223 @@
+/**
+ * collectd - src/utils_atsd_cache_test.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+/* Before utils_time.h, for cdtime_mock */
+#include "testing.h"
+
+#include "collectd.h"
+#include "common.h"
+
+#include "utils_atsd_cache.h"
+#include "utils_intern.h"
+
+static void set_identifier(value_list_t *vl, const char *host,
+                           const char *plugin, const char *plugin_instance,
+                           const char *type, const char *type_instance) {
+  sstrncpy(vl->host, host, sizeof(vl->host));
+  sstrncpy(vl->plugin, plugin, sizeof(vl->plugin));
+  sstrncpy(vl->plugin_instance, plugin_instance, sizeof(vl->plugin_instance));
+  sstrncpy(vl->type, type, sizeof(vl->type));
+  sstrncpy(vl->type_instance, type_instance, sizeof(vl->type_instance));
+}
+
+DEF_TEST(acquire) {
+  value_list_t vl = VALUE_LIST_INIT;
+  atsd_cache_t *cache;
+  atsd_series_t *series;
+
+  CHECK_NOT_NULL(cache = atsd_cache_create(TIME_T_TO_CDTIME_T(60)));
+
+  set_identifier(&vl, "host", "cpu", "0", "percent", "idle");
+  CHECK_NOT_NULL(series = atsd_cache_acquire(cache, &vl, "value"));
+  EXPECT_EQ_STR("host", series->host);
+  EXPECT_EQ_STR("cpu", series->plugin);
+  EXPECT_EQ_STR("0", series->plugin_instance);
+  EXPECT_EQ_STR("percent", series->type);
+  EXPECT_EQ_STR("idle", series->type_instance);
+  EXPECT_EQ_STR("value", series->data_source);
+  OK(!series->has_value);
+  series->has_value = 1;
+  series->value = 42.0;
+  atsd_cache_release(cache, series);
+
+  /* The same series is found again, a different data source is not. */
+  CHECK_NOT_NULL(series = atsd_cache_acquire(cache, &vl, "value"));
+  OK(series->has_value);
+  EXPECT_EQ_DOUBLE(42.0, series->value);
+  atsd_cache_release(cache, series);
+
+  CHECK_NOT_NULL(series = atsd_cache_acquire(cache, &vl, "rx"));
+  OK(!series->has_value);
+  atsd_cache_release(cache, series);
+
+  /* Fields must not run into each other. */
+  set_identifier(&vl, "host", "cpu", "0", "percen", "tidle");
+  CHECK_NOT_NULL(series = atsd_cache_acquire(cache, &vl, "value"));
+  OK(!series->has_value);
+  atsd_cache_release(cache, series);
+
+  EXPECT_EQ_INT(3, atsd_cache_size(cache));
+
+  atsd_cache_destroy(cache);
+  EXPECT_EQ_INT(0, intern_size());
+  return 0;
+}
+
+DEF_TEST(many_series) {
+  value_list_t vl = VALUE_LIST_INIT;
+  atsd_cache_t *cache;
+  atsd_series_t *series;
+  char instance[DATA_MAX_NAME_LEN];
+
+  CHECK_NOT_NULL(cache = atsd_cache_create(TIME_T_TO_CDTIME_T(60)));
+
+  /* Enough series to grow every shard several times. */
+  int failed = 0;
+  for (int i = 0; i < 20000; i++) {
+    snprintf(instance, sizeof(instance), "%d", i);
+    set_identifier(&vl, "host", "interface", instance, "if_octets", "");
+    series = atsd_cache_acquire(cache, &vl, "rx");
+    if (series == NULL) {
+      failed++;
+      continue;
+    }
+    if (series->has_value)
+      failed++;
+    series->has_value = 1;
+    series->value = (double)i;
+    atsd_cache_release(cache, series);
+  }
+  EXPECT_EQ_INT(0, failed);
+  EXPECT_EQ_INT(20000, atsd_cache_size(cache));
+
+  for (int i = 0; i < 20000; i++) {
+    snprintf(instance, sizeof(instance), "%d", i);
+    set_identifier(&vl, "host", "interface", instance, "if_octets", "");
+    series = atsd_cache_acquire(cache, &vl, "rx");
+    if (series == NULL) {
+      failed++;
+      continue;
+    }
+    if (!series->has_value || (series->value != (double)i))
+      failed++;
+    atsd_cache_release(cache, series);
+  }
+  EXPECT_EQ_INT(0, failed);
+  EXPECT_EQ_INT(20000, atsd_cache_size(cache));
+
+  atsd_cache_destroy(cache);
+  return 0;
+}
+
+DEF_TEST(expire) {
+  value_list_t vl = VALUE_LIST_INIT;
+  atsd_cache_t *cache;
+  atsd_series_t *series;
+  char instance[DATA_MAX_NAME_LEN];
+
+  CHECK_NOT_NULL(cache = atsd_cache_create(TIME_T_TO_CDTIME_T(60)));
+
+  /* Series 0 to 999 are seen every 40 seconds, 1000 to 1999 only in the
+   * first round and are removed in the third. */
+  int failed = 0;
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < ((round == 0) ? 2000 : 1000); i++) {
+      snprintf(instance, sizeof(instance), "%d", i);
+      set_identifier(&vl, "host", "interface", instance, "if_octets", "");
+      series = atsd_cache_acquire(cache, &vl, "rx");
+      if (series == NULL) {
+        failed++;
+        continue;
+      }
+      if (series->has_value != (round > 0))
+        failed++;
+      series->has_value = 1;
+      atsd_cache_release(cache, series);
+    }
+    cdtime_mock += TIME_T_TO_CDTIME_T(40);
+  }
+  EXPECT_EQ_INT(0, failed);
+  EXPECT_EQ_INT(1000, atsd_cache_size(cache));
+
+  /* A removed series starts over. */
+  set_identifier(&vl, "host", "interface", "1999", "if_octets", "");
+  CHECK_NOT_NULL(series = atsd_cache_acquire(cache, &vl, "rx"));
+  OK(!series->has_value);
+  atsd_cache_release(cache, series);
+
+  /* Only the strings of the remaining series are left. */
+  OK(intern_size() < 1100);
+
+  atsd_cache_destroy(cache);
+  EXPECT_EQ_INT(0, intern_size());
+  return 0;
+}
+
+DEF_TEST(entity_cache) {
+  atsd_entity_cache_t *cache;
+  char entity[DATA_MAX_NAME_LEN];
+  char host[DATA_MAX_NAME_LEN];
+
+  CHECK_NOT_NULL(cache = atsd_entity_cache_create(
+                     /* entity = */ NULL, /* short_hostname = */ 1,
+                     TIME_T_TO_CDTIME_T(60)));
+
+  /* Twice, the second time from the cache. */
+  for (int i = 0; i < 2; i++) {
+    CHECK_ZERO(atsd_entity_cache_get(cache, "web01.example.com", entity,
+                                     sizeof(entity)));
+    EXPECT_EQ_STR("web01", entity);
+    CHECK_ZERO(atsd_entity_cache_get(cache, "db01", entity, sizeof(entity)));
+    EXPECT_EQ_STR("db01", entity);
+  }
+
+  /* Many hosts, as seen by a network proxy, across an expiry. */
+  int failed = 0;
+  for (int round = 0; round < 2; round++) {
+    for (int i = 0; i < 5000; i++) {
+      snprintf(host, sizeof(host), "host%d.example.com", i);
+      if ((atsd_entity_cache_get(cache, host, entity, sizeof(entity)) != 0) ||
+          (strcmp(entity, host) == 0) ||
+          (strncmp(entity, host, strlen(entity)) != 0))
+        failed++;
+    }
+    cdtime_mock += TIME_T_TO_CDTIME_T(61);
+  }
+  EXPECT_EQ_INT(0, failed);
+
+  atsd_entity_cache_destroy(cache);
+
+  /* A configured entity replaces every host. */
+  CHECK_NOT_NULL(cache = atsd_entity_cache_create("proxy",
+                                                  /* short_hostname = */ 0,
+                                                  TIME_T_TO_CDTIME_T(60)));
+  CHECK_ZERO(atsd_entity_cache_get(cache, "db01", entity, sizeof(entity)));
+  EXPECT_EQ_STR("proxy", entity);
+  atsd_entity_cache_destroy(cache);
+
+  return 0;
+}
+
+int main(void) {
+  RUN_TEST(acquire);
+  RUN_TEST(many_series);
+  RUN_TEST(expire);
+  RUN_TEST(entity_cache);
+
+  END_TEST;
+}
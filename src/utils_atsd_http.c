@@ -0,0 +1,448 @@
+/**
+ * collectd - src/utils_atsd_http.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+#include "collectd.h"
+
+#include "common.h"
+#include "plugin.h"
+
+#include "utils_atsd_http.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#if HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#if HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define HTTP_PATH "/api/v1/command"
+
+/* Batches are compressed with fast settings, they are small and sent often. */
+#define HTTP_GZIP_LEVEL 1
+#define HTTP_ZSTD_LEVEL 1
+
+/* ATSD answers with a short JSON document. */
+#define HTTP_RESPONSE_MAX 16384
+
+struct atsd_http_s {
+  int compression;
+  char *authorization;
+
+  char *body;
+  size_t body_size;
+
+#if HAVE_LIBZ
+  z_stream zs;
+  _Bool zs_initialized;
+#endif
+#if HAVE_LIBZSTD
+  ZSTD_CCtx *zstd;
+#endif
+
+  char response[HTTP_RESPONSE_MAX + 1];
+};
+
+static const char base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static char *base64_encode(const char *in, size_t len) {
+  char *out = malloc(4 * ((len + 2) / 3) + 1);
+  if (out == NULL)
+    return NULL;
+
+  const unsigned char *s = (const unsigned char *)in;
+  char *d = out;
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t v = (uint32_t)s[i] << 16;
+    if (i + 1 < len)
+      v |= (uint32_t)s[i + 1] << 8;
+    if (i + 2 < len)
+      v |= (uint32_t)s[i + 2];
+
+    *d++ = base64_chars[(v >> 18) & 0x3f];
+    *d++ = base64_chars[(v >> 12) & 0x3f];
+    *d++ = (i + 1 < len) ? base64_chars[(v >> 6) & 0x3f] : '=';
+    *d++ = (i + 2 < len) ? base64_chars[v & 0x3f] : '=';
+  }
+  *d = 0;
+
+  return out;
+}
+
+atsd_http_t *atsd_http_create(int compression, size_t max_body,
+                              const char *user, const char *password) {
+  atsd_http_t *http = calloc(1, sizeof(*http));
+  if (http == NULL)
+    return NULL;
+
+  http->compression = compression;
+
+  if (user != NULL) {
+    char credentials[512];
+    int n = snprintf(credentials, sizeof(credentials), "%s:%s", user,
+                     (password != NULL) ? password : "");
+    if ((n < 0) || ((size_t)n >= sizeof(credentials)) ||
+        ((http->authorization = base64_encode(credentials, (size_t)n)) ==
+         NULL)) {
+      atsd_http_destroy(http);
+      return NULL;
+    }
+  }
+
+  switch (compression) {
+  case ATSD_HTTP_COMPRESSION_NONE:
+    return http;
+#if HAVE_LIBZ
+  case ATSD_HTTP_COMPRESSION_GZIP:
+    /* 16 + 15: gzip wrapper, 32 KiB window */
+    if (deflateInit2(&http->zs, HTTP_GZIP_LEVEL, Z_DEFLATED, 16 + 15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      atsd_http_destroy(http);
+      return NULL;
+    }
+    http->zs_initialized = 1;
+    http->body_size = (size_t)deflateBound(&http->zs, (uLong)max_body);
+    break;
+#endif
+#if HAVE_LIBZSTD
+  case ATSD_HTTP_COMPRESSION_ZSTD:
+    http->zstd = ZSTD_createCCtx();
+    if (http->zstd == NULL) {
+      atsd_http_destroy(http);
+      return NULL;
+    }
+    http->body_size = ZSTD_compressBound(max_body);
+    break;
+#endif
+  default:
+    atsd_http_destroy(http);
+    return NULL;
+  }
+
+  http->body = malloc(http->body_size);
+  if (http->body == NULL) {
+    atsd_http_destroy(http);
+    return NULL;
+  }
+
+  return http;
+}
+
+void atsd_http_destroy(atsd_http_t *http) {
+  if (http == NULL)
+    return;
+
+#if HAVE_LIBZ
+  if (http->zs_initialized)
+    deflateEnd(&http->zs);
+#endif
+#if HAVE_LIBZSTD
+  if (http->zstd != NULL)
+    ZSTD_freeCCtx(http->zstd);
+#endif
+
+  sfree(http->authorization);
+  sfree(http->body);
+  sfree(http);
+}
+
+/* compress_body compresses the commands into http->body. Returns the length
+ * of the compressed body, or zero on failure. */
+static size_t compress_body(atsd_http_t *http, const char *data, size_t len) {
+#if HAVE_LIBZ
+  if (http->compression == ATSD_HTTP_COMPRESSION_GZIP) {
+    if (deflateReset(&http->zs) != Z_OK)
+      return 0;
+
+    http->zs.next_in = (Bytef *)data;
+    http->zs.avail_in = (uInt)len;
+    http->zs.next_out = (Bytef *)http->body;
+    http->zs.avail_out = (uInt)http->body_size;
+    if (deflate(&http->zs, Z_FINISH) != Z_STREAM_END)
+      return 0;
+
+    return http->body_size - http->zs.avail_out;
+  }
+#endif
+#if HAVE_LIBZSTD
+  if (http->compression == ATSD_HTTP_COMPRESSION_ZSTD) {
+    size_t n = ZSTD_compressCCtx(http->zstd, http->body, http->body_size, data,
+                                 len, HTTP_ZSTD_LEVEL);
+    return ZSTD_isError(n) ? 0 : n;
+  }
+#endif
+
+  return 0;
+}
+
+static int send_all(int fd, struct iovec *iov, int iov_num) {
+  while (iov_num > 0) {
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = (size_t)iov_num};
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+      if ((errno == EINTR) || (errno == EAGAIN))
+        continue;
+      return -1;
+    }
+
+    while ((iov_num > 0) && ((size_t)n >= iov->iov_len)) {
+      n -= (ssize_t)iov->iov_len;
+      iov++;
+      iov_num--;
+    }
+    if (iov_num > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= (size_t)n;
+    }
+  }
+
+  return 0;
+}
+
+/* header_value returns the value of a header field within the header block
+ * [headers, end), or NULL. */
+static const char *header_value(const char *headers, const char *end,
+                                const char *name) {
+  size_t name_len = strlen(name);
+
+  for (const char *line = headers; line < end;) {
+    const char *eol = strstr(line, "\r\n");
+    if ((eol == NULL) || (eol > end))
+      eol = end;
+
+    if (((size_t)(eol - line) > name_len) &&
+        (strncasecmp(line, name, name_len) == 0) && (line[name_len] == ':')) {
+      const char *value = line + name_len + 1;
+      while ((*value == ' ') || (*value == '\t'))
+        value++;
+      return value;
+    }
+
+    line = eol + 2;
+  }
+
+  return NULL;
+}
+
+static _Bool value_has_token(const char *value, const char *token) {
+  size_t token_len = strlen(token);
+
+  while ((*value != 0) && (*value != '\r')) {
+    if (strncasecmp(value, token, token_len) == 0)
+      return 1;
+    value++;
+  }
+
+  return 0;
+}
+
+/* chunked_complete checks whether a chunked body starting at `body' has been
+ * received completely. Returns 1 when complete, 0 when more data is needed
+ * and -1 when the body is malformed. */
+static int chunked_complete(const char *body, const char *end) {
+  const char *pos = body;
+
+  while (pos < end) {
+    const char *eol = strstr(pos, "\r\n");
+    if ((eol == NULL) || (eol + 2 > end))
+      return 0;
+
+    char *endptr = NULL;
+    unsigned long chunk_len = strtoul(pos, &endptr, 16);
+    if (endptr == pos)
+      return -1;
+
+    if (chunk_len == 0) {
+      /* Optional trailer fields, then an empty line */
+      if ((end - (eol + 2) >= 2) && (strncmp(eol + 2, "\r\n", 2) == 0))
+        return 1;
+      return (strstr(eol, "\r\n\r\n") != NULL) ? 1 : 0;
+    }
+
+    if ((size_t)(end - (eol + 2)) < chunk_len + 2)
+      return 0;
+    pos = eol + 2 + chunk_len + 2;
+  }
+
+  return 0;
+}
+
+/* parse_response examines the response received so far, `len' bytes in a
+ * null terminated buffer. Returns 1 when the response is complete, 0 when
+ * more data is needed and -1 when it is malformed. */
+static int parse_response(const char *buf, size_t len, _Bool eof, int *status,
+                          _Bool *keep_alive) {
+  const char *end = buf + len;
+
+  const char *headers_end = strstr(buf, "\r\n\r\n");
+  if (headers_end == NULL)
+    return eof ? -1 : 0;
+
+  int major = 0;
+  int minor = 0;
+  if (sscanf(buf, "HTTP/%d.%d %d", &major, &minor, status) != 3)
+    return -1;
+
+  const char *headers = strstr(buf, "\r\n") + 2;
+  const char *body = headers_end + 4;
+
+  *keep_alive = (major > 1) || ((major == 1) && (minor >= 1));
+  const char *connection = header_value(headers, headers_end, "Connection");
+  if (connection != NULL) {
+    if (value_has_token(connection, "close"))
+      *keep_alive = 0;
+    else if (value_has_token(connection, "keep-alive"))
+      *keep_alive = 1;
+  }
+
+  if (((*status >= 100) && (*status < 200)) || (*status == 204) ||
+      (*status == 304))
+    return 1;
+
+  const char *encoding =
+      header_value(headers, headers_end, "Transfer-Encoding");
+  if ((encoding != NULL) && value_has_token(encoding, "chunked")) {
+    int complete = chunked_complete(body, end);
+    return ((complete == 0) && eof) ? -1 : complete;
+  }
+
+  const char *length = header_value(headers, headers_end, "Content-Length");
+  if (length != NULL) {
+    char *endptr = NULL;
+    unsigned long long content_length = strtoull(length, &endptr, 10);
+    if (endptr == length)
+      return -1;
+    if ((unsigned long long)(end - body) >= content_length)
+      return 1;
+    return eof ? -1 : 0;
+  }
+
+  /* The body ends when the server closes the connection. */
+  *keep_alive = 0;
+  return eof ? 1 : 0;
+}
+
+static int read_response(atsd_http_t *http, int fd, cdtime_t timeout,
+                         int *status, _Bool *keep_alive) {
+  cdtime_t deadline = cdtime() + timeout;
+  size_t len = 0;
+
+  while (1) {
+    cdtime_t now = cdtime();
+    if (now >= deadline) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int n = poll(&pfd, 1, (int)CDTIME_T_TO_MS(deadline - now));
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    } else if (n == 0) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+
+    if (len >= HTTP_RESPONSE_MAX) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+
+    ssize_t received = recv(fd, http->response + len, HTTP_RESPONSE_MAX - len,
+                            /* flags = */ 0);
+    if (received < 0) {
+      if ((errno == EINTR) || (errno == EAGAIN))
+        continue;
+      return -1;
+    }
+    len += (size_t)received;
+    http->response[len] = 0;
+
+    int complete =
+        parse_response(http->response, len, received == 0, status, keep_alive);
+    if (complete != 0) {
+      if (complete < 0)
+        errno = EPROTO;
+      return (complete > 0) ? 0 : -1;
+    }
+  }
+}
+
+int atsd_http_post(atsd_http_t *http, int fd, const char *host,
+                   const char *data, size_t len, cdtime_t timeout,
+                   _Bool *keep_alive) {
+  const char *body = data;
+  size_t body_len = len;
+  const char *encoding = NULL;
+
+  if (http->compression != ATSD_HTTP_COMPRESSION_NONE) {
+    body = http->body;
+    body_len = compress_body(http, data, len);
+    if (body_len == 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    encoding =
+        (http->compression == ATSD_HTTP_COMPRESSION_GZIP) ? "gzip" : "zstd";
+  }
+
+  char header[1024];
+  int header_len = snprintf(
+      header, sizeof(header),
+      "POST " HTTP_PATH " HTTP/1.1\r\n"
+      "Host: %s\r\n"
+      "User-Agent: " PACKAGE_NAME "/" PACKAGE_VERSION "\r\n"
+      "Content-Type: text/plain\r\n"
+      "Content-Length: %zu\r\n"
+      "%s%s%s"
+      "%s%s%s"
+      "\r\n",
+      host, body_len, (encoding != NULL) ? "Content-Encoding: " : "",
+      (encoding != NULL) ? encoding : "", (encoding != NULL) ? "\r\n" : "",
+      (http->authorization != NULL) ? "Authorization: Basic " : "",
+      (http->authorization != NULL) ? http->authorization : "",
+      (http->authorization != NULL) ? "\r\n" : "");
+  if ((header_len < 0) || ((size_t)header_len >= sizeof(header))) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct iovec iov[2] = {
+      {.iov_base = header, .iov_len = (size_t)header_len},
+      {.iov_base = (void *)body, .iov_len = body_len},
+  };
+  if (send_all(fd, iov, STATIC_ARRAY_SIZE(iov)) != 0)
+    return -1;
+
+  int status = -1;
+  if (read_response(http, fd, timeout, &status, keep_alive) != 0)
+    return -1;
+
+  return status;
+}
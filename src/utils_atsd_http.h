@@ -0,0 +1,52 @@
+/**
+ * collectd - src/utils_atsd_http.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+#ifndef UTILS_ATSD_HTTP_H
+#define UTILS_ATSD_HTTP_H 1
+
+#include "collectd.h"
+
+/* Minimal HTTP/1.1 client posting batches of network commands to the
+ * /api/v1/command endpoint of ATSD, over a connection opened by the caller.
+ * The request body can be compressed with gzip (zlib) or zstd, if collectd
+ * was built with the respective library. Connections are kept alive unless
+ * the server closes them. */
+struct atsd_http_s;
+typedef struct atsd_http_s atsd_http_t;
+
+#define ATSD_HTTP_COMPRESSION_NONE 0
+#define ATSD_HTTP_COMPRESSION_GZIP 1
+#define ATSD_HTTP_COMPRESSION_ZSTD 2
+
+/* Returns NULL when out of memory or when `compression' is not supported by
+ * this build. Requests carry at most `max_body' bytes of commands. `user' may
+ * be NULL for no authentication. */
+atsd_http_t *atsd_http_create(int compression, size_t max_body,
+                              const char *user, const char *password);
+void atsd_http_destroy(atsd_http_t *http);
+
+/* Posts `len' bytes of commands over the connected socket `fd' and waits up
+ * to `timeout' for the response. Returns the HTTP status code, or -1 on
+ * network and protocol errors, after which the connection must be closed.
+ * `keep_alive' is cleared when the server closes the connection after the
+ * response. */
+int atsd_http_post(atsd_http_t *http, int fd, const char *host,
+                   const char *data, size_t len, cdtime_t timeout,
+                   _Bool *keep_alive);
+
+#endif /* UTILS_ATSD_HTTP_H */
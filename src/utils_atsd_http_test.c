@@ -0,0 +1,192 @@
+/**
+ * collectd - src/utils_atsd_http_test.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+#include "collectd.h"
+#include "common.h"
+
+#include "testing.h"
+#include "utils_atsd_http.h"
+
+#include <sys/socket.h>
+
+#if HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#define COMMANDS                                                               \
+  "series e:\"host\" m:\"collectd.cpu.percent.idle\"=97.5 ms:1500000000000\n"  \
+  "series e:\"host\" m:\"collectd.cpu.percent.user\"=2.5 ms:1500000000000\n"
+
+/* The stub server: a socket pair whose peer already holds the response, so
+ * the request can be read back after the post returned. */
+static int stub_post(atsd_http_t *http, const char *response, char *request,
+                     size_t request_size, _Bool close_peer, _Bool *keep_alive) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return -2;
+
+  swrite(fds[1], response, strlen(response));
+  if (close_peer)
+    shutdown(fds[1], SHUT_WR);
+
+  int status = atsd_http_post(http, fds[0], "atsd:8088", COMMANDS,
+                              strlen(COMMANDS), TIME_T_TO_CDTIME_T(1),
+                              keep_alive);
+
+  shutdown(fds[0], SHUT_WR);
+  size_t len = 0;
+  ssize_t n;
+  while ((len < request_size - 1) &&
+         ((n = read(fds[1], request + len, request_size - 1 - len)) > 0))
+    len += (size_t)n;
+  request[len] = 0;
+
+  close(fds[0]);
+  close(fds[1]);
+  return status;
+}
+
+static const char *request_body(const char *request) {
+  const char *body = strstr(request, "\r\n\r\n");
+  return (body != NULL) ? body + 4 : "";
+}
+
+DEF_TEST(plain) {
+  char request[4096];
+  _Bool keep_alive = 0;
+  atsd_http_t *http;
+
+  CHECK_NOT_NULL(http = atsd_http_create(ATSD_HTTP_COMPRESSION_NONE, 4096,
+                                         /* user = */ NULL, NULL));
+
+  EXPECT_EQ_INT(200, stub_post(http, "HTTP/1.1 200 OK\r\n"
+                                     "Content-Type: application/json\r\n"
+                                     "Content-Length: 32\r\n"
+                                     "\r\n"
+                                     "{\"fail\":0,\"success\":2,\"total\":2}",
+                               request, sizeof(request), 0, &keep_alive));
+  OK(keep_alive);
+
+  OK(strncmp(request, "POST /api/v1/command HTTP/1.1\r\n", 31) == 0);
+  OK(strstr(request, "\r\nHost: atsd:8088\r\n") != NULL);
+  OK(strstr(request, "\r\nContent-Encoding:") == NULL);
+  OK(strstr(request, "\r\nAuthorization:") == NULL);
+  EXPECT_EQ_STR(COMMANDS, request_body(request));
+
+  atsd_http_destroy(http);
+  return 0;
+}
+
+DEF_TEST(responses) {
+  char request[4096];
+  _Bool keep_alive = 1;
+  atsd_http_t *http;
+
+  CHECK_NOT_NULL(http = atsd_http_create(ATSD_HTTP_COMPRESSION_NONE, 4096,
+                                         "user", "secret"));
+
+  /* Chunked error response */
+  EXPECT_EQ_INT(500, stub_post(http, "HTTP/1.1 500 Server Error\r\n"
+                                     "Transfer-Encoding: chunked\r\n"
+                                     "\r\n"
+                                     "5\r\nerror\r\n0\r\n\r\n",
+                               request, sizeof(request), 0, &keep_alive));
+  OK(keep_alive);
+  OK(strstr(request, "\r\nAuthorization: Basic dXNlcjpzZWNyZXQ=\r\n") != NULL);
+
+  EXPECT_EQ_INT(200, stub_post(http, "HTTP/1.1 200 OK\r\n"
+                                     "Connection: close\r\n"
+                                     "Content-Length: 0\r\n"
+                                     "\r\n",
+                               request, sizeof(request), 0, &keep_alive));
+  OK(!keep_alive);
+
+  /* Body delimited by the end of the connection */
+  keep_alive = 1;
+  EXPECT_EQ_INT(200, stub_post(http, "HTTP/1.0 200 OK\r\n\r\n{}", request,
+                               sizeof(request), 1, &keep_alive));
+  OK(!keep_alive);
+
+  /* Truncated and malformed responses */
+  EXPECT_EQ_INT(-1, stub_post(http, "HTTP/1.1 200 OK\r\n"
+                                    "Content-Length: 10\r\n"
+                                    "\r\n"
+                                    "{}",
+                              request, sizeof(request), 1, &keep_alive));
+  EXPECT_EQ_INT(-1, stub_post(http, "garbage\r\n\r\n", request,
+                              sizeof(request), 1, &keep_alive));
+
+  /* No response at all */
+  EXPECT_EQ_INT(-1,
+                stub_post(http, "", request, sizeof(request), 0, &keep_alive));
+
+  atsd_http_destroy(http);
+  return 0;
+}
+
+#if HAVE_LIBZ
+DEF_TEST(gzip) {
+  char request[4096];
+  char inflated[4096];
+  _Bool keep_alive = 0;
+  atsd_http_t *http;
+
+  CHECK_NOT_NULL(http = atsd_http_create(ATSD_HTTP_COMPRESSION_GZIP, 4096,
+                                         /* user = */ NULL, NULL));
+
+  /* Twice, the compressor is reused. */
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ_INT(200, stub_post(http, "HTTP/1.1 200 OK\r\n"
+                                       "Content-Length: 0\r\n"
+                                       "\r\n",
+                                 request, sizeof(request), 0, &keep_alive));
+    OK(strstr(request, "\r\nContent-Encoding: gzip\r\n") != NULL);
+
+    const char *body = request_body(request);
+    char *length = strstr(request, "\r\nContent-Length: ");
+    CHECK_NOT_NULL(length);
+    size_t body_len = (size_t)atoi(length + strlen("\r\nContent-Length: "));
+    OK(body_len < strlen(COMMANDS));
+
+    z_stream zs = {0};
+    CHECK_ZERO(inflateInit2(&zs, 16 + 15));
+    zs.next_in = (Bytef *)body;
+    zs.avail_in = (uInt)body_len;
+    zs.next_out = (Bytef *)inflated;
+    zs.avail_out = sizeof(inflated) - 1;
+    EXPECT_EQ_INT(Z_STREAM_END, inflate(&zs, Z_FINISH));
+    inflated[sizeof(inflated) - 1 - zs.avail_out] = 0;
+    inflateEnd(&zs);
+
+    EXPECT_EQ_STR(COMMANDS, inflated);
+  }
+
+  atsd_http_destroy(http);
+  return 0;
+}
+#endif
+
+int main(void) {
+  RUN_TEST(plain);
+  RUN_TEST(responses);
+#if HAVE_LIBZ
+  RUN_TEST(gzip);
+#endif
+
+  END_TEST;
+}
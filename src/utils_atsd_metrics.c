@@ -0,0 +1,333 @@
+/**
+ * collectd - src/utils_atsd_metrics.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+#include "collectd.h"
+
+#include "common.h"
+#include "plugin.h"
+
+#include "utils_atsd_metrics.h"
+
+#include <sys/mman.h>
+
+/* Must be a power of two. */
+#define METRICS_INITIAL_SIZE 256
+
+/* The snapshot is a header followed by `count' hashes in ascending order, in
+ * host byte order. */
+#define SNAPSHOT_MAGIC "ATSDMTR2"
+
+typedef struct {
+  char magic[8];
+  uint64_t version;
+  uint64_t count;
+} snapshot_header_t;
+
+struct atsd_metrics_s {
+  pthread_mutex_t lock;
+
+  char *path;
+  uint64_t version;
+
+  /* Mapped snapshot of the previous run */
+  _Bool loaded;
+  void *map;
+  size_t map_size;
+  const uint64_t *snapshot;
+  size_t snapshot_num;
+
+  /* Open addressing with linear probing. A hash of zero marks a free slot. */
+  uint64_t *table;
+  size_t table_size;
+  size_t table_num;
+};
+
+static void metrics_load(atsd_metrics_t *metrics) {
+  metrics->loaded = 1;
+
+  int fd = open(metrics->path, O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT)
+      WARNING("utils_atsd_metrics: open (%s) failed: %s", metrics->path,
+              STRERRNO);
+    return;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) != 0) ||
+      (st.st_size < (off_t)sizeof(snapshot_header_t))) {
+    WARNING("utils_atsd_metrics: Ignoring truncated snapshot %s.",
+            metrics->path);
+    close(fd);
+    return;
+  }
+
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    WARNING("utils_atsd_metrics: mmap (%s) failed: %s", metrics->path,
+            STRERRNO);
+    return;
+  }
+
+  const snapshot_header_t *header = map;
+  size_t size = (size_t)st.st_size;
+  if ((memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) ||
+      ((size - sizeof(*header)) / sizeof(uint64_t) != header->count) ||
+      ((size - sizeof(*header)) % sizeof(uint64_t) != 0)) {
+    WARNING("utils_atsd_metrics: Ignoring invalid snapshot %s.",
+            metrics->path);
+    munmap(map, size);
+    return;
+  }
+
+  if (header->version != metrics->version) {
+    INFO("utils_atsd_metrics: Ignoring snapshot %s of another configuration.",
+         metrics->path);
+    munmap(map, size);
+    return;
+  }
+
+  metrics->map = map;
+  metrics->map_size = size;
+  metrics->snapshot = (const uint64_t *)(header + 1);
+  metrics->snapshot_num = (size_t)header->count;
+}
+
+static _Bool snapshot_contains(const atsd_metrics_t *metrics, uint64_t hash) {
+  size_t lo = 0;
+  size_t hi = metrics->snapshot_num;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (metrics->snapshot[mid] == hash)
+      return 1;
+    if (metrics->snapshot[mid] < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return 0;
+}
+
+static int table_grow(atsd_metrics_t *metrics) {
+  size_t size = (metrics->table_size == 0) ? METRICS_INITIAL_SIZE
+                                           : 2 * metrics->table_size;
+  uint64_t *table = calloc(size, sizeof(*table));
+  if (table == NULL)
+    return -1;
+
+  for (size_t i = 0; i < metrics->table_size; i++) {
+    uint64_t hash = metrics->table[i];
+    if (hash == 0)
+      continue;
+
+    size_t j = hash & (size - 1);
+    while (table[j] != 0)
+      j = (j + 1) & (size - 1);
+    table[j] = hash;
+  }
+
+  sfree(metrics->table);
+  metrics->table = table;
+  metrics->table_size = size;
+  return 0;
+}
+
+/* Returns true if `hash' was in the table already. */
+static _Bool table_insert(atsd_metrics_t *metrics, uint64_t hash) {
+  if ((4 * (metrics->table_num + 1) > 3 * metrics->table_size) &&
+      (table_grow(metrics) != 0)) {
+    ERROR("utils_atsd_metrics: calloc failed.");
+    return 0;
+  }
+
+  size_t i = hash & (metrics->table_size - 1);
+  while (metrics->table[i] != 0) {
+    if (metrics->table[i] == hash)
+      return 1;
+    i = (i + 1) & (metrics->table_size - 1);
+  }
+
+  metrics->table[i] = hash;
+  metrics->table_num++;
+  return 0;
+}
+
+atsd_metrics_t *atsd_metrics_create(const char *path, uint64_t version) {
+  if (path == NULL)
+    return NULL;
+
+  atsd_metrics_t *metrics = calloc(1, sizeof(*metrics));
+  if (metrics == NULL)
+    return NULL;
+
+  metrics->path = strdup(path);
+  if (metrics->path == NULL) {
+    sfree(metrics);
+    return NULL;
+  }
+  metrics->version = version;
+  pthread_mutex_init(&metrics->lock, NULL);
+
+  return metrics;
+}
+
+void atsd_metrics_destroy(atsd_metrics_t *metrics) {
+  if (metrics == NULL)
+    return;
+
+  if (metrics->map != NULL)
+    munmap(metrics->map, metrics->map_size);
+  sfree(metrics->table);
+  sfree(metrics->path);
+  pthread_mutex_destroy(&metrics->lock);
+  sfree(metrics);
+}
+
+static _Bool table_contains(const atsd_metrics_t *metrics, uint64_t hash) {
+  if (metrics->table_size == 0)
+    return 0;
+
+  size_t i = hash & (metrics->table_size - 1);
+  while (metrics->table[i] != 0) {
+    if (metrics->table[i] == hash)
+      return 1;
+    i = (i + 1) & (metrics->table_size - 1);
+  }
+
+  return 0;
+}
+
+_Bool atsd_metrics_check(atsd_metrics_t *metrics, uint64_t hash) {
+  /* Zero marks free slots. */
+  if (hash == 0)
+    hash = 1;
+
+  pthread_mutex_lock(&metrics->lock);
+
+  if (!metrics->loaded)
+    metrics_load(metrics);
+
+  _Bool found = table_contains(metrics, hash);
+  /* Still in use, so it is carried over to the next snapshot. */
+  if (!found && snapshot_contains(metrics, hash)) {
+    table_insert(metrics, hash);
+    found = 1;
+  }
+
+  pthread_mutex_unlock(&metrics->lock);
+  return found;
+}
+
+void atsd_metrics_add(atsd_metrics_t *metrics, uint64_t hash) {
+  if (hash == 0)
+    hash = 1;
+
+  pthread_mutex_lock(&metrics->lock);
+
+  if (!metrics->loaded)
+    metrics_load(metrics);
+  table_insert(metrics, hash);
+
+  pthread_mutex_unlock(&metrics->lock);
+}
+
+static int compare_hash(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+int atsd_metrics_save(atsd_metrics_t *metrics) {
+  char tmp_path[PATH_MAX];
+
+  pthread_mutex_lock(&metrics->lock);
+
+  /* Not used during this run, the snapshot is still current. */
+  if (!metrics->loaded) {
+    pthread_mutex_unlock(&metrics->lock);
+    return 0;
+  }
+
+  size_t count = 0;
+  uint64_t *hashes = malloc((metrics->table_num + 1) * sizeof(*hashes));
+  if (hashes == NULL) {
+    pthread_mutex_unlock(&metrics->lock);
+    ERROR("utils_atsd_metrics: malloc failed.");
+    return -1;
+  }
+  for (size_t i = 0; i < metrics->table_size; i++)
+    if (metrics->table[i] != 0)
+      hashes[count++] = metrics->table[i];
+
+  pthread_mutex_unlock(&metrics->lock);
+
+  qsort(hashes, count, sizeof(*hashes), compare_hash);
+
+  snapshot_header_t header = {.version = metrics->version, .count = count};
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+
+  if (check_create_dir(metrics->path) != 0) {
+    ERROR("utils_atsd_metrics: Unable to create the directory of %s.",
+          metrics->path);
+    sfree(hashes);
+    return -1;
+  }
+
+  /* Written aside and renamed, so that a crash never leaves a partial
+   * snapshot behind. */
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", metrics->path);
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    ERROR("utils_atsd_metrics: open (%s) failed: %s", tmp_path, STRERRNO);
+    sfree(hashes);
+    return -1;
+  }
+
+  int status = swrite(fd, &header, sizeof(header));
+  if (status == 0)
+    status = swrite(fd, hashes, count * sizeof(*hashes));
+  sfree(hashes);
+
+  if (close(fd) != 0)
+    status = -1;
+
+  if (status != 0) {
+    ERROR("utils_atsd_metrics: Writing %s failed.", tmp_path);
+    unlink(tmp_path);
+    return -1;
+  }
+
+  if (rename(tmp_path, metrics->path) != 0) {
+    ERROR("utils_atsd_metrics: rename (%s) failed: %s", metrics->path,
+          STRERRNO);
+    unlink(tmp_path);
+    return -1;
+  }
+
+  return 0;
+}
+
+size_t atsd_metrics_size(atsd_metrics_t *metrics) {
+  pthread_mutex_lock(&metrics->lock);
+  size_t size = metrics->table_num;
+  pthread_mutex_unlock(&metrics->lock);
+  return size;
+}
@@ -0,0 +1,56 @@
+/**
+ * collectd - src/utils_atsd_metrics.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+#ifndef UTILS_ATSD_METRICS_H
+#define UTILS_ATSD_METRICS_H 1
+
+#include "collectd.h"
+
+/* Set of metric definitions already delivered to ATSD, each identified by a
+ * 64-bit hash of its metric command.
+ *
+ * The definitions delivered by the previous run are read from a snapshot file,
+ * which is memory-mapped and searched in place. Definitions delivered or found
+ * during this run are kept in a hash table and written to the snapshot by
+ * atsd_metrics_save(), so definitions which are no longer used are dropped.
+ * A snapshot written with a different `version', e.g. another metric prefix,
+ * is ignored. The set is thread safe. */
+struct atsd_metrics_s;
+typedef struct atsd_metrics_s atsd_metrics_t;
+
+/* The snapshot is loaded on first use rather than here, so that a relative
+ * `path' is resolved in the daemon's BaseDir. */
+atsd_metrics_t *atsd_metrics_create(const char *path, uint64_t version);
+void atsd_metrics_destroy(atsd_metrics_t *metrics);
+
+/* Returns true if the definition `hash' was delivered before, by this or the
+ * previous run. */
+_Bool atsd_metrics_check(atsd_metrics_t *metrics, uint64_t hash);
+
+/* Records the definition `hash' as delivered. Only call this once the command
+ * has been sent, a definition lost on the way has to be sent again. */
+void atsd_metrics_add(atsd_metrics_t *metrics, uint64_t hash);
+
+/* Replaces the snapshot file with the definitions recorded during this run,
+ * creating its directory if necessary. Does nothing if the set was not used. */
+int atsd_metrics_save(atsd_metrics_t *metrics);
+
+/* Number of definitions recorded during this run. */
+size_t atsd_metrics_size(atsd_metrics_t *metrics);
+
+#endif /* UTILS_ATSD_METRICS_H */
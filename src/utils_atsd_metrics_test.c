@@ -0,0 +1,143 @@
+/**
+ * collectd - src/utils_atsd_metrics_test.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+#include "collectd.h"
+#include "common.h"
+
+#include "testing.h"
+#include "utils_atsd_metrics.h"
+
+static char metrics_dir[] = "/tmp/test_utils_atsd_metrics.XXXXXX";
+static char metrics_path[PATH_MAX];
+
+DEF_TEST(check) {
+  atsd_metrics_t *metrics;
+
+  unlink(metrics_path);
+  CHECK_NOT_NULL(metrics = atsd_metrics_create(metrics_path, 1));
+
+  /* Checking does not record a definition, only delivering it does. */
+  OK(!atsd_metrics_check(metrics, 42));
+  OK(!atsd_metrics_check(metrics, 42));
+  atsd_metrics_add(metrics, 42);
+  OK(atsd_metrics_check(metrics, 42));
+  OK(!atsd_metrics_check(metrics, 0));
+  atsd_metrics_add(metrics, 0);
+  OK(atsd_metrics_check(metrics, 0));
+
+  /* Enough to grow the table several times */
+  int failed = 0;
+  for (uint64_t i = 1; i <= 10000; i++) {
+    if (atsd_metrics_check(metrics, i * 0x9e3779b97f4a7c15ULL))
+      failed++;
+    atsd_metrics_add(metrics, i * 0x9e3779b97f4a7c15ULL);
+  }
+  EXPECT_EQ_INT(0, failed);
+  EXPECT_EQ_INT(10002, atsd_metrics_size(metrics));
+
+  atsd_metrics_destroy(metrics);
+  return 0;
+}
+
+DEF_TEST(snapshot) {
+  atsd_metrics_t *metrics;
+
+  unlink(metrics_path);
+  CHECK_NOT_NULL(metrics = atsd_metrics_create(metrics_path, 7));
+  for (uint64_t i = 1; i <= 1000; i++)
+    atsd_metrics_add(metrics, i * 3);
+  CHECK_ZERO(atsd_metrics_save(metrics));
+  atsd_metrics_destroy(metrics);
+
+  /* The next run finds the definitions of the previous one. */
+  CHECK_NOT_NULL(metrics = atsd_metrics_create(metrics_path, 7));
+  EXPECT_EQ_INT(0, atsd_metrics_size(metrics));
+
+  int failed = 0;
+  for (uint64_t i = 1; i <= 3000; i++)
+    if (atsd_metrics_check(metrics, i) != (i % 3 == 0))
+      failed++;
+  EXPECT_EQ_INT(0, failed);
+  atsd_metrics_destroy(metrics);
+
+  /* Only definitions used since the last start are saved, a definition that
+   * was checked but never delivered is not. */
+  CHECK_NOT_NULL(metrics = atsd_metrics_create(metrics_path, 7));
+  OK(atsd_metrics_check(metrics, 3));
+  OK(!atsd_metrics_check(metrics, 4));
+  OK(!atsd_metrics_check(metrics, 5));
+  atsd_metrics_add(metrics, 4);
+  CHECK_ZERO(atsd_metrics_save(metrics));
+  atsd_metrics_destroy(metrics);
+
+  CHECK_NOT_NULL(metrics = atsd_metrics_create(metrics_path, 7));
+  OK(atsd_metrics_check(metrics, 3));
+  OK(atsd_metrics_check(metrics, 4));
+  OK(!atsd_metrics_check(metrics, 5));
+  OK(!atsd_metrics_check(metrics, 6));
+  atsd_metrics_destroy(metrics);
+
+  /* A snapshot of another version is ignored. */
+  CHECK_NOT_NULL(metrics = atsd_metrics_create(metrics_path, 8));
+  OK(!atsd_metrics_check(metrics, 3));
+  atsd_metrics_destroy(metrics);
+
+  return 0;
+}
+
+DEF_TEST(invalid) {
+  atsd_metrics_t *metrics;
+
+  FILE *fh = fopen(metrics_path, "w");
+  CHECK_NOT_NULL(fh);
+  fputs("ATSDMTR1 but not a snapshot", fh);
+  fclose(fh);
+
+  CHECK_NOT_NULL(metrics = atsd_metrics_create(metrics_path, 7));
+  OK(!atsd_metrics_check(metrics, 3));
+  atsd_metrics_add(metrics, 3);
+  CHECK_ZERO(atsd_metrics_save(metrics));
+  atsd_metrics_destroy(metrics);
+
+  CHECK_NOT_NULL(metrics = atsd_metrics_create(metrics_path, 7));
+  OK(atsd_metrics_check(metrics, 3));
+  atsd_metrics_destroy(metrics);
+
+  return 0;
+}
+
+int main(void) {
+  if (mkdtemp(metrics_dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  snprintf(metrics_path, sizeof(metrics_path), "%s/node/metrics",
+           metrics_dir);
+
+  RUN_TEST(check);
+  RUN_TEST(snapshot);
+  RUN_TEST(invalid);
+
+  char node_dir[PATH_MAX];
+  snprintf(node_dir, sizeof(node_dir), "%s/node", metrics_dir);
+  unlink(metrics_path);
+  rmdir(node_dir);
+  rmdir(metrics_dir);
+
+  END_TEST;
+}
@@ -0,0 +1,369 @@
+/**
+ * collectd - src/utils_atsd_spool.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+#include "collectd.h"
+
+#include "common.h"
+#include "plugin.h"
+
+#include "utils_atsd_spool.h"
+
+#include <dirent.h>
+
+#define SEGMENT_SUFFIX ".spool"
+#define POSITION_FILE "position"
+
+struct atsd_spool_s {
+  char *dir;
+  size_t max_size;
+  size_t segment_size;
+
+  /* Segments read_seq .. write_seq exist on disk. The spool is empty when
+   * both are equal and read_offset has reached write_size. */
+  uint64_t read_seq;
+  off_t read_offset;
+  int read_fd;
+  /* Bytes handed out by the last atsd_spool_read() and not committed yet. */
+  size_t read_pending;
+
+  uint64_t write_seq;
+  off_t write_size;
+  int write_fd;
+
+  size_t size;
+  uint64_t dropped;
+};
+
+static void segment_path(const atsd_spool_t *spool, uint64_t seq, char *buffer,
+                         size_t buffer_len) {
+  snprintf(buffer, buffer_len, "%s/%020" PRIu64 SEGMENT_SUFFIX, spool->dir,
+           seq);
+}
+
+static off_t segment_file_size(const atsd_spool_t *spool, uint64_t seq) {
+  char path[PATH_MAX];
+  struct stat statbuf;
+
+  segment_path(spool, seq, path, sizeof(path));
+  if (stat(path, &statbuf) != 0)
+    return 0;
+
+  return statbuf.st_size;
+}
+
+static int open_write_segment(atsd_spool_t *spool) {
+  char path[PATH_MAX];
+
+  segment_path(spool, spool->write_seq, path, sizeof(path));
+  spool->write_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0640);
+  if (spool->write_fd < 0) {
+    ERROR("utils_atsd_spool: open (%s) failed: %s", path, STRERRNO);
+    return -1;
+  }
+
+  spool->write_size = lseek(spool->write_fd, 0, SEEK_END);
+  return 0;
+}
+
+static int open_read_segment(atsd_spool_t *spool) {
+  char path[PATH_MAX];
+
+  segment_path(spool, spool->read_seq, path, sizeof(path));
+  spool->read_fd = open(path, O_RDONLY);
+  if (spool->read_fd < 0) {
+    ERROR("utils_atsd_spool: open (%s) failed: %s", path, STRERRNO);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Removes the oldest segment, which must not be the one being written. */
+static void remove_read_segment(atsd_spool_t *spool) {
+  char path[PATH_MAX];
+
+  if (spool->read_fd >= 0) {
+    close(spool->read_fd);
+    spool->read_fd = -1;
+  }
+
+  segment_path(spool, spool->read_seq, path, sizeof(path));
+  if (unlink(path) != 0 && errno != ENOENT)
+    WARNING("utils_atsd_spool: unlink (%s) failed: %s", path, STRERRNO);
+
+  spool->read_seq++;
+  spool->read_offset = 0;
+  spool->read_pending = 0;
+}
+
+/* Starts over with an empty segment once everything has been read, so the
+ * spool does not keep a fully consumed file around. */
+static void reset_if_empty(atsd_spool_t *spool) {
+  if ((spool->read_seq != spool->write_seq) ||
+      (spool->read_offset < spool->write_size) || (spool->write_size == 0))
+    return;
+
+  close(spool->write_fd);
+  spool->write_fd = -1;
+  remove_read_segment(spool);
+  spool->write_seq = spool->read_seq;
+  spool->write_size = 0;
+  spool->size = 0;
+
+  if (open_write_segment(spool) != 0)
+    spool->write_fd = -1;
+}
+
+static void load_position(atsd_spool_t *spool) {
+  char path[PATH_MAX];
+  uint64_t seq;
+  int64_t offset;
+
+  snprintf(path, sizeof(path), "%s/" POSITION_FILE, spool->dir);
+  FILE *fh = fopen(path, "r");
+  if (fh == NULL)
+    return;
+
+  if ((fscanf(fh, "%" SCNu64 " %" SCNi64, &seq, &offset) == 2) &&
+      (seq == spool->read_seq) && (offset > 0) &&
+      (offset <= segment_file_size(spool, seq)))
+    spool->read_offset = (off_t)offset;
+
+  fclose(fh);
+  unlink(path);
+}
+
+static void save_position(const atsd_spool_t *spool) {
+  char path[PATH_MAX];
+
+  snprintf(path, sizeof(path), "%s/" POSITION_FILE, spool->dir);
+  if (spool->read_offset == 0) {
+    unlink(path);
+    return;
+  }
+
+  FILE *fh = fopen(path, "w");
+  if (fh == NULL) {
+    WARNING("utils_atsd_spool: fopen (%s) failed: %s", path, STRERRNO);
+    return;
+  }
+
+  fprintf(fh, "%" PRIu64 " %" PRIi64 "\n", spool->read_seq,
+          (int64_t)spool->read_offset);
+  fclose(fh);
+}
+
+atsd_spool_t *atsd_spool_open(const char *dir, size_t max_size,
+                              size_t segment_size) {
+  char dir_slash[PATH_MAX];
+
+  if ((dir == NULL) || (segment_size == 0) || (segment_size > max_size))
+    return NULL;
+
+  snprintf(dir_slash, sizeof(dir_slash), "%s/", dir);
+  if (check_create_dir(dir_slash) != 0) {
+    ERROR("utils_atsd_spool: Unable to create directory %s.", dir);
+    return NULL;
+  }
+
+  atsd_spool_t *spool = calloc(1, sizeof(*spool));
+  if (spool == NULL)
+    return NULL;
+
+  spool->dir = strdup(dir);
+  if (spool->dir == NULL) {
+    sfree(spool);
+    return NULL;
+  }
+  spool->max_size = max_size;
+  spool->segment_size = segment_size;
+  spool->read_fd = -1;
+  spool->write_fd = -1;
+
+  /* Pick up segments left behind by a previous run. */
+  DIR *dh = opendir(dir);
+  if (dh == NULL) {
+    ERROR("utils_atsd_spool: opendir (%s) failed: %s", dir, STRERRNO);
+    atsd_spool_close(spool);
+    return NULL;
+  }
+
+  _Bool found = 0;
+  struct dirent *de;
+  while ((de = readdir(dh)) != NULL) {
+    uint64_t seq;
+    char suffix[sizeof(SEGMENT_SUFFIX) + 1];
+
+    if ((sscanf(de->d_name, "%" SCNu64 "%7s", &seq, suffix) != 2) ||
+        (strcmp(suffix, SEGMENT_SUFFIX) != 0))
+      continue;
+
+    if (!found || (seq < spool->read_seq))
+      spool->read_seq = seq;
+    if (!found || (seq > spool->write_seq))
+      spool->write_seq = seq;
+    found = 1;
+  }
+  closedir(dh);
+
+  for (uint64_t seq = spool->read_seq; found && (seq <= spool->write_seq);
+       seq++)
+    spool->size += (size_t)segment_file_size(spool, seq);
+
+  load_position(spool);
+  spool->size -= (size_t)spool->read_offset;
+
+  if (open_write_segment(spool) != 0) {
+    atsd_spool_close(spool);
+    return NULL;
+  }
+
+  if (spool->size > 0)
+    INFO("utils_atsd_spool: Found %zu bytes spooled in %s.", spool->size, dir);
+
+  return spool;
+}
+
+void atsd_spool_close(atsd_spool_t *spool) {
+  if (spool == NULL)
+    return;
+
+  reset_if_empty(spool);
+
+  if (spool->write_fd >= 0) {
+    fsync(spool->write_fd);
+    close(spool->write_fd);
+  }
+  if (spool->read_fd >= 0)
+    close(spool->read_fd);
+
+  if (spool->size > 0)
+    save_position(spool);
+
+  sfree(spool->dir);
+  sfree(spool);
+}
+
+int atsd_spool_append(atsd_spool_t *spool, const char *buffer, size_t len) {
+  if ((spool == NULL) || (spool->write_fd < 0))
+    return -1;
+
+  if (len > spool->max_size) {
+    spool->dropped += len;
+    return -1;
+  }
+
+  /* Make room by dropping whole segments, oldest first. */
+  while ((spool->size + len > spool->max_size) &&
+         (spool->read_seq != spool->write_seq)) {
+    size_t segment_left = (size_t)(segment_file_size(spool, spool->read_seq) -
+                                   spool->read_offset);
+    spool->size -= segment_left;
+    spool->dropped += segment_left;
+    remove_read_segment(spool);
+  }
+
+  if (spool->size + len > spool->max_size) {
+    spool->dropped += len;
+    return -1;
+  }
+
+  if ((size_t)spool->write_size >= spool->segment_size) {
+    fsync(spool->write_fd);
+    close(spool->write_fd);
+    spool->write_fd = -1;
+    spool->write_seq++;
+    if (open_write_segment(spool) != 0)
+      return -1;
+  }
+
+  if (swrite(spool->write_fd, buffer, len) != 0) {
+    ERROR("utils_atsd_spool: write to %s failed: %s", spool->dir, STRERRNO);
+    return -1;
+  }
+
+  spool->write_size += len;
+  spool->size += len;
+
+  return 0;
+}
+
+ssize_t atsd_spool_read(atsd_spool_t *spool, char *buffer, size_t len) {
+  if (spool == NULL)
+    return -1;
+
+  while (spool->size > 0) {
+    if (spool->read_fd < 0 && open_read_segment(spool) != 0) {
+      /* Skip a segment that vanished or cannot be read. */
+      if (spool->read_seq == spool->write_seq)
+        return -1;
+      spool->size -= (size_t)(segment_file_size(spool, spool->read_seq) -
+                              spool->read_offset);
+      remove_read_segment(spool);
+      continue;
+    }
+
+    ssize_t status = pread(spool->read_fd, buffer, len, spool->read_offset);
+    if (status < 0) {
+      ERROR("utils_atsd_spool: read from %s failed: %s", spool->dir, STRERRNO);
+      return -1;
+    }
+
+    if (status == 0) {
+      if (spool->read_seq == spool->write_seq)
+        return 0;
+      remove_read_segment(spool);
+      continue;
+    }
+
+    /* Only hand out whole commands. */
+    size_t read_len = (size_t)status;
+    while ((read_len > 0) && (buffer[read_len - 1] != '\n'))
+      read_len--;
+    if (read_len == 0)
+      read_len = (size_t)status;
+
+    spool->read_pending = read_len;
+    return (ssize_t)read_len;
+  }
+
+  return 0;
+}
+
+void atsd_spool_commit(atsd_spool_t *spool, size_t len) {
+  if (spool == NULL)
+    return;
+
+  /* The segment read from may have been dropped in the meantime. */
+  if (len > spool->read_pending)
+    len = spool->read_pending;
+
+  spool->read_offset += len;
+  spool->size -= len;
+  spool->read_pending = 0;
+
+  reset_if_empty(spool);
+}
+
+size_t atsd_spool_size(const atsd_spool_t *spool) {
+  return (spool != NULL) ? spool->size : 0;
+}
+
+uint64_t atsd_spool_dropped(const atsd_spool_t *spool) {
+  return (spool != NULL) ? spool->dropped : 0;
+}
@@ -0,0 +1,54 @@
+/**
+ * collectd - src/utils_atsd_spool.h
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+#ifndef UTILS_ATSD_SPOOL_H
+#define UTILS_ATSD_SPOOL_H 1
+
+#include "collectd.h"
+
+/* Append-only on-disk queue of newline terminated commands. Data is written
+ * to numbered segment files which are read back and removed in the order they
+ * were written. The spool is not thread safe. */
+struct atsd_spool_s;
+typedef struct atsd_spool_s atsd_spool_t;
+
+atsd_spool_t *atsd_spool_open(const char *dir, size_t max_size,
+                              size_t segment_size);
+void atsd_spool_close(atsd_spool_t *spool);
+
+/* Appends `len' bytes to the newest segment. When the spool would exceed
+ * `max_size', the oldest segments are removed first. */
+int atsd_spool_append(atsd_spool_t *spool, const char *buffer, size_t len);
+
+/* Reads the oldest complete commands, at most `len' bytes, into `buffer'. The
+ * commands stay at the head of the spool until they are committed, so reading
+ * again returns the same data. Returns the number of bytes read, zero when the
+ * spool is empty, or -1 on error. */
+ssize_t atsd_spool_read(atsd_spool_t *spool, char *buffer, size_t len);
+
+/* Removes the first `len' bytes returned by the last atsd_spool_read() from
+ * the spool, once they have been delivered. */
+void atsd_spool_commit(atsd_spool_t *spool, size_t len);
+
+/* Number of bytes waiting to be read. */
+size_t atsd_spool_size(const atsd_spool_t *spool);
+
+/* Number of bytes discarded because of the size limit. */
+uint64_t atsd_spool_dropped(const atsd_spool_t *spool);
+
+#endif /* UTILS_ATSD_SPOOL_H */
@@ -0,0 +1,173 @@
+/**
+ * collectd - src/utils_atsd_spool_test.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+#include "collectd.h"
+#include "common.h"
+
+#include "testing.h"
+#include "utils_atsd_spool.h"
+
+#include <dirent.h>
+
+static char spool_dir[] = "/tmp/test_utils_atsd_spool.XXXXXX";
+
+static void remove_spool_files(void) {
+  DIR *dh = opendir(spool_dir);
+  if (dh == NULL)
+    return;
+
+  struct dirent *de;
+  while ((de = readdir(dh)) != NULL) {
+    char path[PATH_MAX];
+    if (de->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", spool_dir, de->d_name);
+    unlink(path);
+  }
+  closedir(dh);
+}
+
+static int read_all(atsd_spool_t *spool, char *buffer, size_t buffer_len,
+                    size_t chunk_len) {
+  size_t fill = 0;
+  ssize_t len;
+
+  while ((len = atsd_spool_read(spool, buffer + fill, chunk_len)) > 0) {
+    atsd_spool_commit(spool, (size_t)len);
+    fill += (size_t)len;
+    if (fill + chunk_len >= buffer_len)
+      break;
+  }
+  buffer[fill] = 0;
+
+  return (len < 0) ? -1 : 0;
+}
+
+DEF_TEST(append_read) {
+  char buffer[256];
+  atsd_spool_t *spool;
+
+  remove_spool_files();
+  CHECK_NOT_NULL(spool = atsd_spool_open(spool_dir, 1024, 256));
+
+  EXPECT_EQ_INT(0, atsd_spool_read(spool, buffer, sizeof(buffer)));
+
+  CHECK_ZERO(atsd_spool_append(spool, "series a\n", 9));
+  CHECK_ZERO(atsd_spool_append(spool, "series bb\n", 10));
+  EXPECT_EQ_INT(19, atsd_spool_size(spool));
+
+  /* Only whole commands are returned. */
+  EXPECT_EQ_INT(9, atsd_spool_read(spool, buffer, 12));
+  buffer[9] = 0;
+  EXPECT_EQ_STR("series a\n", buffer);
+
+  /* Commands stay spooled until they are committed. */
+  EXPECT_EQ_INT(19, atsd_spool_size(spool));
+  EXPECT_EQ_INT(19, atsd_spool_read(spool, buffer, sizeof(buffer)));
+  atsd_spool_commit(spool, 9);
+  EXPECT_EQ_INT(10, atsd_spool_size(spool));
+
+  EXPECT_EQ_INT(10, atsd_spool_read(spool, buffer, sizeof(buffer)));
+  buffer[10] = 0;
+  EXPECT_EQ_STR("series bb\n", buffer);
+  atsd_spool_commit(spool, 10);
+
+  EXPECT_EQ_INT(0, atsd_spool_size(spool));
+  EXPECT_EQ_INT(0, atsd_spool_read(spool, buffer, sizeof(buffer)));
+
+  atsd_spool_close(spool);
+  return 0;
+}
+
+DEF_TEST(segments) {
+  char buffer[256];
+  atsd_spool_t *spool;
+
+  remove_spool_files();
+  CHECK_NOT_NULL(spool = atsd_spool_open(spool_dir, 40, 20));
+
+  /* Ten bytes per command, two commands per segment. */
+  CHECK_ZERO(atsd_spool_append(spool, "command 0\n", 10));
+  CHECK_ZERO(atsd_spool_append(spool, "command 1\n", 10));
+  CHECK_ZERO(atsd_spool_append(spool, "command 2\n", 10));
+  CHECK_ZERO(atsd_spool_append(spool, "command 3\n", 10));
+  EXPECT_EQ_INT(40, atsd_spool_size(spool));
+  EXPECT_EQ_INT(0, atsd_spool_dropped(spool));
+
+  /* The oldest segment is discarded to stay within the size limit, also
+   * while it is being read. */
+  EXPECT_EQ_INT(10, atsd_spool_read(spool, buffer, 15));
+  CHECK_ZERO(atsd_spool_append(spool, "command 4\n", 10));
+  EXPECT_EQ_INT(30, atsd_spool_size(spool));
+  EXPECT_EQ_INT(20, atsd_spool_dropped(spool));
+  atsd_spool_commit(spool, 10);
+  EXPECT_EQ_INT(30, atsd_spool_size(spool));
+
+  CHECK_ZERO(read_all(spool, buffer, sizeof(buffer), 15));
+  EXPECT_EQ_STR("command 2\ncommand 3\ncommand 4\n", buffer);
+  EXPECT_EQ_INT(0, atsd_spool_size(spool));
+
+  atsd_spool_close(spool);
+  return 0;
+}
+
+DEF_TEST(reopen) {
+  char buffer[256];
+  atsd_spool_t *spool;
+
+  remove_spool_files();
+  CHECK_NOT_NULL(spool = atsd_spool_open(spool_dir, 1024, 20));
+  CHECK_ZERO(atsd_spool_append(spool, "command 0\n", 10));
+  CHECK_ZERO(atsd_spool_append(spool, "command 1\n", 10));
+  CHECK_ZERO(atsd_spool_append(spool, "command 2\n", 10));
+  EXPECT_EQ_INT(10, atsd_spool_read(spool, buffer, 10));
+  atsd_spool_commit(spool, 10);
+  atsd_spool_close(spool);
+
+  /* Uncommitted commands survive a restart, committed ones are not
+   * replayed. */
+  CHECK_NOT_NULL(spool = atsd_spool_open(spool_dir, 1024, 20));
+  EXPECT_EQ_INT(20, atsd_spool_size(spool));
+  CHECK_ZERO(atsd_spool_append(spool, "command 3\n", 10));
+
+  CHECK_ZERO(read_all(spool, buffer, sizeof(buffer), 64));
+  EXPECT_EQ_STR("command 1\ncommand 2\ncommand 3\n", buffer);
+  atsd_spool_close(spool);
+
+  CHECK_NOT_NULL(spool = atsd_spool_open(spool_dir, 1024, 20));
+  EXPECT_EQ_INT(0, atsd_spool_size(spool));
+  atsd_spool_close(spool);
+
+  return 0;
+}
+
+int main(void) {
+  if (mkdtemp(spool_dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  RUN_TEST(append_read);
+  RUN_TEST(segments);
+  RUN_TEST(reopen);
+
+  remove_spool_files();
+  rmdir(spool_dir);
+
+  END_TEST;
+}
@@ -39,8 +39,14 @@
 #define PART_IS_RAW 5
 #define PART_DS_NAME 6
 
-/* Max number of part in name pattern */
-#define MAX_NAME_PARTS 6
+/* Max number of part in name pattern, including PART_END */
+#define MAX_NAME_PARTS 8
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/* Derived series formatted on the stack; more are allocated. */
+#define SERIES_STACK_NUM 4
 
 typedef struct {
   int part_type;
@@ -49,8 +55,6 @@ typedef struct {
 
 typedef struct { name_part_t name_parts[MAX_NAME_PARTS]; } name_rule_t;
 
-typedef void (*transform_func_t)(char *value);
-
 #define STRING(__str_val)                                                      \
   { .part_type = PART_STR, .str_value = __str_val }
 #define PLUGIN                                                                 \
@@ -74,83 +78,100 @@ typedef void (*transform_func_t)(char *value);
   }
 #define NAME_PATTERN_PTR(...) &(name_rule_t)NAME_PATTERN(__VA_ARGS__)
 
-typedef struct tag_key_val_s {
-  char *key;
-  char *val;
-  struct tag_key_val_s *next;
-} tag_key_val_t;
+/* Enough for every key=value pair that fits into an exec type instance. */
+#define MAX_SERIES_TAGS (DATA_MAX_NAME_LEN / 2)
+
+/* Longest escaped string written, as with escape_atsd_string(). */
+#define MAX_ESCAPED_LEN (6 * DATA_MAX_NAME_LEN - 1)
+
+/* Tags point into the value list or into tag_buffer, nothing is allocated
+ * while formatting. */
+typedef struct {
+  const char *key;
+  const char *val;
+} tag_t;
 
 typedef struct series_s {
-  char entity[6 * DATA_MAX_NAME_LEN];
+  const char *entity;
+  int transform;
+  double factor;
   char metric[6 * DATA_MAX_NAME_LEN];
   char formatted_value[MAX_VALUE_LEN];
-  tag_key_val_t *metric_tags;
-  tag_key_val_t *series_tags;
+  tag_t series_tags[MAX_SERIES_TAGS];
+  size_t series_tags_num;
+  char tag_buffer[2 * DATA_MAX_NAME_LEN];
   uint64_t time;
 } series_t;
 
-typedef struct value_index_t {
-  size_t index;
-  value_list_t *vl;
-  data_set_t *ds;
-} value_index_s;
-
-static int add_tag(tag_key_val_t **tags, const char *key, const char *val) {
-  tag_key_val_t *tag = malloc(sizeof(tag_key_val_t));
-  if (tag == NULL) {
-    ERROR("atsd_write: malloc failed");
-    return -1;
+static uint64_t hash_add(uint64_t hash, const char *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= FNV_PRIME;
   }
+  return hash;
+}
 
-  tag->key = strdup(key);
-  tag->val = strdup(val);
-
-  if (tag->key == NULL || tag->val == NULL) {
-    ERROR("atsd_write: strdup failed");
-    return -1;
+/* Output buffer with a tracked write offset. Once something does not fit,
+ * nothing more is written and `truncated' is set. */
+typedef struct {
+  char *buffer;
+  size_t size;
+  size_t offset;
+  _Bool truncated;
+} output_t;
+
+static void output_add(output_t *out, const char *str, size_t len) {
+  if (out->truncated || (out->offset + len >= out->size)) {
+    out->truncated = 1;
+    return;
   }
 
-  tag->next = *tags;
-  *tags = tag;
-
-  return 0;
+  memcpy(out->buffer + out->offset, str, len);
+  out->offset += len;
 }
 
-static void free_tags(tag_key_val_t *tags) {
-  tag_key_val_t *tag = tags;
-  while (tag != NULL) {
-    tag_key_val_t *next_tag = tag->next;
-    sfree(tag->key);
-    sfree(tag->val);
-    sfree(tag);
-    tag = next_tag;
-  }
-}
+#define OUTPUT_ADD_LITERAL(out, str) output_add(out, str, sizeof(str) - 1)
 
-static size_t stradd(char *dst, const char *src, size_t siz) {
-  char *d = dst;
-  const char *s = src;
-  size_t n = siz;
-  size_t dlen;
+/* Appends `str' in double quotes, doubling any quotes inside. */
+static void output_add_quoted(output_t *out, const char *str) {
+  if (out->truncated || (out->offset + 2 >= out->size)) {
+    out->truncated = 1;
+    return;
+  }
 
-  /* Find the end of dst and adjust bytes left but don't go past end */
-  while (n-- != 0 && *d != '\0')
-    d++;
-  dlen = d - dst;
-  n = siz - dlen;
+  char *d = out->buffer + out->offset;
+  size_t left = out->size - out->offset - 2;
+  size_t escaped_left = MAX_ESCAPED_LEN;
 
-  if (n == 0)
-    return (dlen + strlen(s));
-  while (*s != '\0') {
-    if (n != 1) {
-      *d++ = *s;
-      n--;
+  *d++ = '"';
+  for (const char *s = str; *s != '\0'; s++) {
+    size_t n = (*s == '"') ? 2 : 1;
+    if (n > escaped_left)
+      break;
+    if (n > left) {
+      out->truncated = 1;
+      return;
     }
-    s++;
+    if (*s == '"')
+      *d++ = '"';
+    *d++ = *s;
+    left -= n;
+    escaped_left -= n;
+  }
+  *d++ = '"';
+
+  out->offset = (size_t)(d - out->buffer);
+}
+
+static void add_tag(series_t *series, const char *key, const char *val) {
+  if (series->series_tags_num >= MAX_SERIES_TAGS) {
+    WARNING("utils_format_atsd: Too many tags, ignoring tag \"%s\".", key);
+    return;
   }
-  *d = '\0';
 
-  return (dlen + (s - src)); /* count does not include NUL */
+  series->series_tags[series->series_tags_num].key = key;
+  series->series_tags[series->series_tags_num].val = val;
+  series->series_tags_num++;
 }
 
 char *escape_atsd_string(char *dst_buf, const char *src_buf, size_t n) {
@@ -177,6 +198,103 @@ char *escape_atsd_string(char *dst_buf, const char *src_buf, size_t n) {
   return dst_buf;
 }
 
+/* Writes the decimal representation of `value' followed by a null byte.
+ * `buffer' must hold at least 21 bytes. Returns the number of digits. */
+static size_t format_uint(char *buffer, uint64_t value) {
+  char tmp[20];
+  size_t len = 0;
+
+  do {
+    tmp[len++] = (char)('0' + (value % 10));
+    value /= 10;
+  } while (value != 0);
+
+  for (size_t i = 0; i < len; i++)
+    buffer[i] = tmp[len - i - 1];
+  buffer[len] = '\0';
+
+  return len;
+}
+
+static size_t format_int(char *buffer, int64_t value) {
+  if (value >= 0)
+    return format_uint(buffer, (uint64_t)value);
+
+  buffer[0] = '-';
+  return 1 + format_uint(buffer + 1, -(uint64_t)value);
+}
+
+static const double powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18};
+
+/* Same output as snprintf(buffer, buffer_len, "%.15g", value). Values that
+ * print without an exponent are converted with integer arithmetic; the rest,
+ * and values too close to a rounding boundary to decide reliably, go through
+ * snprintf(). */
+static int format_double(char *buffer, size_t buffer_len, double value) {
+  double abs_value = fabs(value);
+
+  if ((buffer_len >= 24) && (abs_value >= 1e-4) && (abs_value < 1e15)) {
+    int exponent = 14;
+    while ((exponent > 0) && (abs_value < powers_of_ten[exponent]))
+      exponent--;
+    while ((exponent <= 0) && (exponent > -4) &&
+           (abs_value * powers_of_ten[-exponent] < 1.0))
+      exponent--;
+
+    /* 15 significant digits, i.e. 1e14 <= scaled < 1e15. The product is
+     * off by less than 0.1, so the rounding direction is only uncertain
+     * close to .5. */
+    double scaled = abs_value * powers_of_ten[14 - exponent];
+    double integral = floor(scaled);
+    double fraction = scaled - integral;
+
+    if ((fabs(fraction - 0.5) > 0.1) && (integral >= 1e14)) {
+      uint64_t digits = (uint64_t)integral + ((fraction > 0.5) ? 1 : 0);
+
+      if (digits < 1000000000000000ULL) {
+        char digit_buf[21];
+        char *d = buffer;
+
+        format_uint(digit_buf, digits);
+
+        if (value < 0)
+          *d++ = '-';
+        if (exponent >= 0) {
+          memcpy(d, digit_buf, (size_t)exponent + 1);
+          d += exponent + 1;
+          *d++ = '.';
+          memcpy(d, digit_buf + exponent + 1, (size_t)(14 - exponent));
+          d += 14 - exponent;
+        } else {
+          *d++ = '0';
+          *d++ = '.';
+          for (int i = -1; i > exponent; i--)
+            *d++ = '0';
+          memcpy(d, digit_buf, 15);
+          d += 15;
+        }
+
+        /* %g removes trailing zeros and a trailing decimal point. */
+        while (d[-1] == '0')
+          d--;
+        if (d[-1] == '.')
+          d--;
+        *d = '\0';
+
+        return (int)(d - buffer);
+      }
+    }
+  }
+
+  int status = snprintf(buffer, buffer_len, GAUGE_FORMAT, value);
+  if ((status < 1) || ((size_t)status >= buffer_len))
+    return -1;
+
+  return status;
+}
+
 int get_value(format_info_t *format, double *value) {
   if (format->ds->ds[format->index].type == DS_TYPE_GAUGE) {
     *value = format->vl->values[format->index].gauge;
@@ -197,41 +315,29 @@ int get_value(format_info_t *format, double *value) {
 }
 
 static int format_value(char *ret, size_t ret_len, format_info_t *format) {
-  size_t offset = 0;
   int status;
 
-  memset(ret, 0, ret_len);
-
-#define BUFFER_ADD(...)                                                        \
-  do {                                                                         \
-    status = snprintf(ret + offset, ret_len - offset, __VA_ARGS__);            \
-    if (status < 1) {                                                          \
-      return -1;                                                               \
-    } else if (((size_t)status) >= (ret_len - offset)) {                       \
-      return -1;                                                               \
-    } else                                                                     \
-      offset += ((size_t)status);                                              \
-  } while (0)
+  if (ret_len < 21)
+    return -1;
 
   if (format->ds->ds[format->index].type == DS_TYPE_GAUGE) {
-    BUFFER_ADD(GAUGE_FORMAT, format->vl->values[format->index].gauge);
+    status =
+        format_double(ret, ret_len, format->vl->values[format->index].gauge);
   } else if (format->rates != NULL) {
-    BUFFER_ADD("%.15g", format->rates[format->index]);
+    status = format_double(ret, ret_len, format->rates[format->index]);
   } else if (format->ds->ds[format->index].type == DS_TYPE_COUNTER) {
-    BUFFER_ADD("%llu", format->vl->values[format->index].counter);
+    status = (int)format_uint(ret, format->vl->values[format->index].counter);
   } else if (format->ds->ds[format->index].type == DS_TYPE_DERIVE) {
-    BUFFER_ADD("%" PRIi64, format->vl->values[format->index].derive);
+    status = (int)format_int(ret, format->vl->values[format->index].derive);
   } else if (format->ds->ds[format->index].type == DS_TYPE_ABSOLUTE) {
-    BUFFER_ADD("%" PRIu64, format->vl->values[format->index].absolute);
+    status = (int)format_uint(ret, format->vl->values[format->index].absolute);
   } else {
     ERROR("utils_format_atsd: unknown data source type: %d",
           format->ds->ds[format->index].type);
     return -1;
   }
 
-#undef BUFFER_ADD
-
-  return 0;
+  return (status < 0) ? -1 : 0;
 }
 
 static int starts_with(const char *pre, const char *str) {
@@ -241,77 +347,82 @@ static int starts_with(const char *pre, const char *str) {
 
 int format_entity(char *ret, const int ret_len, const char *entity,
                   const char *host_name, _Bool short_hostname) {
-  char *host;
-  char buf[HOST_NAME_MAX];
-
   if (entity != NULL && strlen(entity) != 0 && strchr(entity, ' ') == NULL) {
     sstrncpy(ret, entity, ret_len);
-  } else {
-    if (strcasecmp("localhost", host_name) == 0 ||
-        starts_with(host_name, "localhost.")) {
-      gethostname(buf, sizeof(buf));
-      host = strdup(buf);
-    } else {
-      host = strdup(host_name);
-    }
-
-    if (host == NULL) {
-      ERROR("utils_format_atsd: strdup failed");
-      return -1;
-    }
+    return 0;
+  }
 
-    if (short_hostname) {
-      char *c = strchr(host + 1, '.');
-      if (c != NULL && *c == '.')
-        *c = '\0';
-    }
+  if (strcasecmp("localhost", host_name) == 0 ||
+      starts_with(host_name, "localhost.")) {
+    char buf[HOST_NAME_MAX];
+    gethostname(buf, sizeof(buf));
+    buf[sizeof(buf) - 1] = '\0';
+    sstrncpy(ret, buf, ret_len);
+  } else {
+    sstrncpy(ret, host_name, ret_len);
+  }
 
-    sstrncpy(ret, host, ret_len);
-    sfree(host);
+  if (short_hostname && ret[0] != '\0') {
+    char *c = strchr(ret + 1, '.');
+    if (c != NULL)
+      *c = '\0';
   }
 
   return 0;
 }
 
-static void metric_name_append(char *metric_name, const char *str, size_t n) {
-  if (*str != '\0') {
-    if (*metric_name != '\0')
-      stradd(metric_name, ".", n);
-    stradd(metric_name, str, n);
-  }
+/* Appends "." and `str' to the metric name, truncating at `size' - 1. */
+static void metric_name_append(char *metric_name, size_t *len, size_t size,
+                               const char *str) {
+  if (*str == '\0')
+    return;
+
+  if (*len != 0 && *len + 1 < size)
+    metric_name[(*len)++] = '.';
+
+  size_t str_len = strlen(str);
+  if (*len + str_len >= size)
+    str_len = size - *len - 1;
+
+  memcpy(metric_name + *len, str, str_len);
+  *len += str_len;
+  metric_name[*len] = '\0';
 }
 
-static int format_metric_name(char *buffer, size_t len, format_info_t *format,
-                              name_rule_t *rule) {
-  memset(buffer, 0, len);
-  metric_name_append(buffer, format->prefix, len);
+static int format_metric_name(char *buffer, size_t size, format_info_t *format,
+                              const name_rule_t *rule) {
+  size_t len = 0;
+
+  buffer[0] = '\0';
+  metric_name_append(buffer, &len, size, format->prefix);
   for (size_t i = 0; rule->name_parts[i].part_type != PART_END; i++) {
     name_part_t name_part = rule->name_parts[i];
     switch (name_part.part_type) {
     case PART_STR:
-      metric_name_append(buffer, name_part.str_value, len);
+      metric_name_append(buffer, &len, size, name_part.str_value);
       break;
     case PART_VL_PLUGIN:
-      metric_name_append(buffer, format->vl->plugin, len);
+      metric_name_append(buffer, &len, size, format->vl->plugin);
       break;
     case PART_VL_PLUGIN_INSTANCE:
-      metric_name_append(buffer, format->vl->plugin_instance, len);
+      metric_name_append(buffer, &len, size, format->vl->plugin_instance);
       break;
     case PART_VL_TYPE:
-      metric_name_append(buffer, format->vl->type, len);
+      metric_name_append(buffer, &len, size, format->vl->type);
       break;
     case PART_VL_TYPE_INSTANCE:
-      metric_name_append(buffer, format->vl->type_instance, len);
+      metric_name_append(buffer, &len, size, format->vl->type_instance);
       break;
     case PART_IS_RAW:
       if (format->ds->ds[format->index].type != DS_TYPE_GAUGE &&
           format->rates == NULL) {
-        metric_name_append(buffer, "raw", len);
+        metric_name_append(buffer, &len, size, "raw");
       }
       break;
     case PART_DS_NAME:
       if (strcasecmp(format->ds->ds[format->index].name, "value") != 0) {
-        metric_name_append(buffer, format->ds->ds[format->index].name, len);
+        metric_name_append(buffer, &len, size,
+                           format->ds->ds[format->index].name);
       }
       break;
     default:
@@ -322,21 +433,96 @@ static int format_metric_name(char *buffer, size_t len, format_info_t *format,
   return 0;
 }
 
-static void invert_percent(char *value) {
-  char tmp[MAX_VALUE_LEN];
-  snprintf(tmp, sizeof(tmp), "%.15g", (100.0 - atof(value)));
-  strncpy(value, tmp, MAX_VALUE_LEN);
+/* Formats the value of the data source, transformed as the series requires. */
+static int format_series_value(char *ret, size_t ret_len,
+                               format_info_t *format, int transform,
+                               double factor) {
+  if (transform == FORMAT_TRANSFORM_NONE)
+    return format_value(ret, ret_len, format);
+
+  double value = 0.0;
+  if (transform == FORMAT_TRANSFORM_SUM) {
+    size_t index = format->index;
+    for (size_t i = 0; i < format->ds->ds_num; i++) {
+      double ds_value;
+      format->index = i;
+      int status = get_value(format, &ds_value);
+      if (status != 0) {
+        format->index = index;
+        return -1;
+      }
+      value += ds_value;
+    }
+    format->index = index;
+  } else {
+    if (get_value(format, &value) != 0)
+      return -1;
+    if (transform == FORMAT_TRANSFORM_INVERT)
+      value = factor - value;
+    else
+      value = factor * value;
+  }
+
+  return (format_double(ret, ret_len, value) < 0) ? -1 : 0;
+}
+
+static void add_series_tags(series_t *series, format_info_t *format,
+                            int tags) {
+  if (tags == FORMAT_TAGS_NONE)
+    return;
+
+  if (tags == FORMAT_TAGS_KEY_VALUE) {
+    /* Tags from the type instance of the exec plugin in
+     * key1=val1;key2=val2;... format, if possible */
+    if (strchr(format->vl->type_instance, ';') == NULL) {
+      add_tag(series, "instance", format->vl->type_instance);
+      return;
+    }
+
+    char *key, *strtok_ctx;
+    char *tmp_strtok_ptr = series->tag_buffer;
+
+    sstrncpy(series->tag_buffer, format->vl->type_instance,
+             sizeof(series->tag_buffer));
+    while ((key = strtok_r(tmp_strtok_ptr, ";", &strtok_ctx)) != NULL) {
+      /* Make tmp_tok_ptr NULL, as strtok_r
+       * requires it to be null on subsequent calls */
+      tmp_strtok_ptr = NULL;
+      char *value = strchr(key, '=');
+      if (value) {
+        *value++ = '\0';
+        add_tag(series, key, value);
+      }
+    }
+    return;
+  }
+
+  if (*format->vl->plugin_instance != '\0')
+    add_tag(series, "instance", format->vl->plugin_instance);
+
+  /* Fetch original unescaped disk name from meta, because slash
+   * is replaced with dash in plugin_instance */
+  if ((tags == FORMAT_TAGS_DISK_NAME) && (format->vl->meta != NULL)) {
+    char *disk_name;
+    if (meta_data_get_string(format->vl->meta, "df:unescaped_plugin_instance",
+                             &disk_name) == 0) {
+      sstrncpy(series->tag_buffer, disk_name, sizeof(series->tag_buffer));
+      add_tag(series, "disk_name", series->tag_buffer);
+      sfree(disk_name);
+    }
+  }
 }
 
 static int format_series(series_t *series, format_info_t *format,
-                         name_rule_t *name_rule, _Bool add_instance_tag,
-                         transform_func_t transform) {
+                         const name_rule_t *name_rule, int tags,
+                         int transform, double factor) {
   int ret;
 
-  series->metric_tags = NULL;
-  series->series_tags = NULL;
+  series->series_tags_num = 0;
   series->time = CDTIME_T_TO_MS(format->vl->time);
-  strncpy(series->entity, format->entity, sizeof(series->entity));
+  series->entity = format->entity;
+  series->transform = transform;
+  series->factor = factor;
 
   ret = format_metric_name(series->metric, sizeof(series->metric), format,
                            name_rule);
@@ -344,242 +530,783 @@ static int format_series(series_t *series, format_info_t *format,
     return -1;
   }
 
-  format_value(series->formatted_value, sizeof(series->formatted_value),
-               format);
+  ret = format_series_value(series->formatted_value,
+                            sizeof(series->formatted_value), format, transform,
+                            factor);
+  if (ret != 0) {
+    return -1;
+  }
+
+  add_series_tags(series, format, tags);
+
+  return 0;
+}
+
+typedef struct {
+  char *plugin;
+  char *type;
+  char *type_instance;
+  _Bool rates_only;
+
+  /* The literal parts of `name' point into `metric'. */
+  char *metric;
+  name_rule_t name;
+  int transform;
+  double factor;
+  int tags;
+
+  _Bool keep_original;
+  _Bool final;
+} derive_rule_t;
+
+/* The rules of one plugin, followed by the rules matching any plugin, in the
+ * order they were added. */
+typedef struct {
+  uint64_t hash;
+  const char *plugin;
+  derive_rule_t **rules;
+  size_t rules_num;
+} rule_bucket_t;
+
+struct format_rules_s {
+  derive_rule_t **rules;
+  size_t rules_num;
+
+  /* Open addressing with linear probing, keyed by the plugin name. A hash of
+   * zero marks a free slot. */
+  rule_bucket_t *buckets;
+  size_t buckets_size;
+  size_t buckets_num;
+
+  /* Rules without a plugin, used for plugins without a bucket */
+  derive_rule_t **any;
+  size_t any_num;
+
+  /* Hash of all rules, for format_atsd_naming_hash() */
+  uint64_t hash;
+};
+
+static const name_rule_t original_name = NAME_PATTERN(
+    PLUGIN, TYPE, TYPE_INSTANCE, DATA_SOURCE, IS_RAW);
+
+static const format_rule_t default_rules[] = {
+    /* busy = 100% - idle, because the cpu plugin with ReportByState false
+     * doesn't produce detailed statistics: system, user, wait, etc. */
+    {.plugin = "cpu",
+     .type_instance = "idle",
+     .rates_only = 1,
+     .metric = "%{plugin}.%{type}.busy",
+     .transform = FORMAT_TRANSFORM_INVERT,
+     .factor = 100.0,
+     .tags = FORMAT_TAGS_INSTANCE,
+     .keep_original = 1},
+    /* df.percent_bytes: used_reserved = 100% - free */
+    {.plugin = "df",
+     .type = "percent_bytes",
+     .type_instance = "free",
+     .metric = "%{plugin}.%{type}.used_reserved",
+     .transform = FORMAT_TRANSFORM_INVERT,
+     .factor = 100.0,
+     .tags = FORMAT_TAGS_DISK_NAME,
+     .keep_original = 1,
+     .final = 1},
+    {.plugin = "df", .tags = FORMAT_TAGS_DISK_NAME},
+    {.plugin = "exec",
+     .metric = "%{plugin_instance}.%{raw}",
+     .tags = FORMAT_TAGS_KEY_VALUE},
+};
+
+static uint64_t hash_add_string(uint64_t hash, const char *str) {
+  if (str == NULL)
+    return hash_add(hash, "", 1) * FNV_PRIME;
+  return hash_add(hash, str, strlen(str) + 1);
+}
+
+static uint64_t hash_plugin(const char *plugin) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (const char *c = plugin; *c != '\0'; c++) {
+    hash ^= (unsigned char)tolower((unsigned char)*c);
+    hash *= FNV_PRIME;
+  }
+  return (hash == 0) ? 1 : hash;
+}
+
+static int parse_metric_pattern(derive_rule_t *rule) {
+  static const struct {
+    const char *key;
+    int part_type;
+  } placeholders[] = {
+      {"%{plugin}", PART_VL_PLUGIN},
+      {"%{plugin_instance}", PART_VL_PLUGIN_INSTANCE},
+      {"%{type}", PART_VL_TYPE},
+      {"%{type_instance}", PART_VL_TYPE_INSTANCE},
+      {"%{data_source}", PART_DS_NAME},
+      {"%{raw}", PART_IS_RAW},
+  };
+
+  size_t parts_num = 0;
+  char *saveptr = NULL;
+  for (char *part = strtok_r(rule->metric, ".", &saveptr); part != NULL;
+       part = strtok_r(NULL, ".", &saveptr)) {
+    if (parts_num >= MAX_NAME_PARTS - 1) {
+      ERROR("utils_format_atsd: Metric pattern has more than %d parts.",
+            MAX_NAME_PARTS - 1);
+      return -1;
+    }
 
-  if (transform != NULL)
-    transform(series->formatted_value);
+    name_part_t *name_part = rule->name.name_parts + parts_num;
+    *name_part = (name_part_t){.part_type = PART_STR, .str_value = part};
+    for (size_t i = 0; i < STATIC_ARRAY_SIZE(placeholders); i++)
+      if (strcasecmp(placeholders[i].key, part) == 0)
+        name_part->part_type = placeholders[i].part_type;
 
-  if (*format->vl->plugin_instance != '\0' && add_instance_tag) {
-    ret =
-        add_tag(&series->series_tags, "instance", format->vl->plugin_instance);
-    if (ret != 0) {
+    if ((name_part->part_type == PART_STR) && (strstr(part, "%{") != NULL)) {
+      ERROR("utils_format_atsd: Unknown placeholder in metric part \"%s\".",
+            part);
       return -1;
     }
+    parts_num++;
   }
 
-  ret = add_tag(&series->metric_tags, "plugin", format->vl->plugin);
-  if (ret != 0) {
+  if (parts_num == 0) {
+    ERROR("utils_format_atsd: Metric pattern is empty.");
     return -1;
   }
 
-  ret = add_tag(&series->metric_tags, "type", format->vl->type);
-  if (ret != 0) {
-    return -1;
+  rule->name.name_parts[parts_num].part_type = PART_END;
+  return 0;
+}
+
+static void derive_rule_free(derive_rule_t *rule) {
+  if (rule == NULL)
+    return;
+
+  sfree(rule->plugin);
+  sfree(rule->type);
+  sfree(rule->type_instance);
+  sfree(rule->metric);
+  sfree(rule);
+}
+
+static char *strdup_or_null(const char *str, _Bool *failed) {
+  if (str == NULL)
+    return NULL;
+
+  char *copy = strdup(str);
+  if (copy == NULL)
+    *failed = 1;
+  return copy;
+}
+
+static derive_rule_t *derive_rule_create(const format_rule_t *config) {
+  derive_rule_t *rule = calloc(1, sizeof(*rule));
+  if (rule == NULL)
+    return NULL;
+
+  _Bool failed = 0;
+  rule->plugin = strdup_or_null(config->plugin, &failed);
+  rule->type = strdup_or_null(config->type, &failed);
+  rule->type_instance = strdup_or_null(config->type_instance, &failed);
+  rule->metric = strdup_or_null(config->metric, &failed);
+  if (failed) {
+    ERROR("utils_format_atsd: strdup failed.");
+    derive_rule_free(rule);
+    return NULL;
   }
 
-  ret =
-      add_tag(&series->metric_tags, "type_instance", format->vl->type_instance);
-  if (ret != 0) {
-    return -1;
+  rule->rates_only = config->rates_only;
+  rule->transform = config->transform;
+  rule->factor = config->factor;
+  rule->tags = config->tags;
+  rule->keep_original = config->keep_original;
+  rule->final = config->final;
+
+  if (rule->metric == NULL)
+    rule->name = original_name;
+  else if (parse_metric_pattern(rule) != 0) {
+    derive_rule_free(rule);
+    return NULL;
   }
 
-  ret = add_tag(&series->metric_tags, "data_source",
-                format->ds->ds[format->index].name);
-  if (ret != 0) {
+  return rule;
+}
+
+static int rule_list_append(derive_rule_t ***list, size_t *num,
+                            derive_rule_t *rule) {
+  derive_rule_t **tmp = realloc(*list, (*num + 1) * sizeof(*tmp));
+  if (tmp == NULL)
     return -1;
+
+  tmp[*num] = rule;
+  *list = tmp;
+  (*num)++;
+  return 0;
+}
+
+static rule_bucket_t *rules_find_bucket(const format_rules_t *rules,
+                                        uint64_t hash, const char *plugin) {
+  if (rules->buckets_size == 0)
+    return NULL;
+
+  size_t i = hash & (rules->buckets_size - 1);
+  while (rules->buckets[i].hash != 0) {
+    if ((rules->buckets[i].hash == hash) &&
+        (strcasecmp(rules->buckets[i].plugin, plugin) == 0))
+      return rules->buckets + i;
+    i = (i + 1) & (rules->buckets_size - 1);
   }
 
-  ret = add_tag(&series->metric_tags, "data_type",
-                DS_TYPE_TO_STRING(format->ds->ds[format->index].type));
-  if (ret != 0) {
+  return NULL;
+}
+
+static int rules_grow_buckets(format_rules_t *rules) {
+  size_t size = (rules->buckets_size == 0) ? 16 : 2 * rules->buckets_size;
+  rule_bucket_t *buckets = calloc(size, sizeof(*buckets));
+  if (buckets == NULL)
     return -1;
+
+  for (size_t i = 0; i < rules->buckets_size; i++) {
+    rule_bucket_t *old = rules->buckets + i;
+    if (old->hash == 0)
+      continue;
+
+    size_t j = old->hash & (size - 1);
+    while (buckets[j].hash != 0)
+      j = (j + 1) & (size - 1);
+    buckets[j] = *old;
   }
 
+  sfree(rules->buckets);
+  rules->buckets = buckets;
+  rules->buckets_size = size;
   return 0;
 }
 
-static int derive_series(series_t *series_buffer, format_info_t *format) {
-  int ret;
+/* Returns the bucket of `plugin', adding one that starts with the rules
+ * matching any plugin. */
+static rule_bucket_t *rules_get_bucket(format_rules_t *rules,
+                                       const char *plugin) {
+  uint64_t hash = hash_plugin(plugin);
+  rule_bucket_t *bucket = rules_find_bucket(rules, hash, plugin);
+  if (bucket != NULL)
+    return bucket;
+
+  if ((4 * (rules->buckets_num + 1) > 3 * rules->buckets_size) &&
+      (rules_grow_buckets(rules) != 0))
+    return NULL;
+
+  size_t i = hash & (rules->buckets_size - 1);
+  while (rules->buckets[i].hash != 0)
+    i = (i + 1) & (rules->buckets_size - 1);
+
+  bucket = rules->buckets + i;
+  *bucket = (rule_bucket_t){.hash = hash, .plugin = plugin};
+  if (rules->any_num > 0) {
+    bucket->rules = calloc(rules->any_num, sizeof(*bucket->rules));
+    if (bucket->rules == NULL) {
+      bucket->hash = 0;
+      return NULL;
+    }
+    memcpy(bucket->rules, rules->any, rules->any_num * sizeof(*rules->any));
+    bucket->rules_num = rules->any_num;
+  }
+  rules->buckets_num++;
 
-  _Bool preserve_original = true;
-  size_t count = 0;
+  return bucket;
+}
 
-  /* Create derived series for cpu: busy=100%-idle,
-   * becuase cpu plugin option ReportByState=false doesn't
-   * produce detailed statistics: system, user, wait, etc. */
-  if (format->rates != NULL && strcasecmp(format->vl->plugin, "cpu") == 0 &&
-      strcasecmp(format->vl->type_instance, "idle") == 0) {
-    ret =
-        format_series(series_buffer, format,
-                      &(name_rule_t)NAME_PATTERN(PLUGIN, TYPE, STRING("busy")),
-                      true, invert_percent);
-    if (ret != 0)
-      return -1;
+format_rules_t *format_rules_create(void) {
+  format_rules_t *rules = calloc(1, sizeof(*rules));
+  if (rules == NULL)
+    return NULL;
 
-    count++;
-    series_buffer++;
-  } else if (strcasecmp(format->vl->plugin, "df") == 0) {
-    /* Create derived series for df.percent_bytes: used_reserved=100%-free*/
-    if (strcasecmp(format->vl->type, "percent_bytes") == 0 &&
-        strcasecmp(format->vl->type_instance, "free") == 0) {
-      ret =
-          format_series(series_buffer, format,
-                        NAME_PATTERN_PTR(PLUGIN, TYPE, STRING("used_reserved")),
-                        true, invert_percent);
-      if (ret != 0)
-        return -1;
-    } else {
-      ret = format_series(
-          series_buffer, format,
-          NAME_PATTERN_PTR(PLUGIN, TYPE, TYPE_INSTANCE, DATA_SOURCE, IS_RAW),
-          true, NULL);
-      if (ret != 0)
-        return -1;
-      preserve_original = false;
-    }
+  rules->hash = FNV_OFFSET_BASIS;
+  return rules;
+}
+
+void format_rules_destroy(format_rules_t *rules) {
+  if (rules == NULL)
+    return;
+
+  for (size_t i = 0; i < rules->buckets_size; i++)
+    sfree(rules->buckets[i].rules);
+  sfree(rules->buckets);
+  sfree(rules->any);
+
+  for (size_t i = 0; i < rules->rules_num; i++)
+    derive_rule_free(rules->rules[i]);
+  sfree(rules->rules);
+
+  sfree(rules);
+}
 
-    /* Fetch original unescaped disk name from meta, because slash
-     * is replaced with dash in plugin_instance */
-    if (format->vl->meta != NULL) {
-      char *disk_name;
-      ret = meta_data_get_string(format->vl->meta,
-                                 "df:unescaped_plugin_instance", &disk_name);
-      if (ret == 0) {
-        add_tag(&series_buffer->series_tags, "disk_name", disk_name);
-        sfree(disk_name);
+int format_rules_add(format_rules_t *rules, const format_rule_t *config) {
+  derive_rule_t *rule = derive_rule_create(config);
+  if (rule == NULL)
+    return -1;
+
+  if (rule_list_append(&rules->rules, &rules->rules_num, rule) != 0) {
+    ERROR("utils_format_atsd: realloc failed.");
+    derive_rule_free(rule);
+    return -1;
+  }
+
+  if (rule->plugin != NULL) {
+    rule_bucket_t *bucket = rules_get_bucket(rules, rule->plugin);
+    if ((bucket == NULL) ||
+        (rule_list_append(&bucket->rules, &bucket->rules_num, rule) != 0)) {
+      ERROR("utils_format_atsd: Adding the rule of plugin \"%s\" failed.",
+            rule->plugin);
+      return -1;
+    }
+  } else {
+    if (rule_list_append(&rules->any, &rules->any_num, rule) != 0) {
+      ERROR("utils_format_atsd: realloc failed.");
+      return -1;
+    }
+    for (size_t i = 0; i < rules->buckets_size; i++) {
+      rule_bucket_t *bucket = rules->buckets + i;
+      if ((bucket->hash != 0) &&
+          (rule_list_append(&bucket->rules, &bucket->rules_num, rule) != 0)) {
+        ERROR("utils_format_atsd: realloc failed.");
+        return -1;
       }
     }
+  }
 
-    count++;
-    series_buffer++;
-  }
-  /* Fetch additional tags from type instance of exec plugin in
-   * key1=val1;key2=val2;... format, if possible */
-  else if (strcasecmp(format->vl->plugin, "exec") == 0) {
-    ret = format_series(series_buffer, format,
-                        NAME_PATTERN_PTR(PLUGIN_INSTANCE, IS_RAW), false, NULL);
-    if (ret != 0)
+  char number[64];
+  uint64_t hash = rules->hash;
+  hash = hash_add_string(hash, config->plugin);
+  hash = hash_add_string(hash, config->type);
+  hash = hash_add_string(hash, config->type_instance);
+  hash = hash_add_string(hash, config->metric);
+  snprintf(number, sizeof(number), "%d %d %.17g %d %d %d",
+           (int)config->rates_only, config->transform, config->factor,
+           config->tags, (int)config->keep_original, (int)config->final);
+  rules->hash = hash_add_string(hash, number);
+
+  return 0;
+}
+
+int format_rules_add_defaults(format_rules_t *rules) {
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(default_rules); i++)
+    if (format_rules_add(rules, default_rules + i) != 0)
       return -1;
 
-    if (strchr(format->vl->type_instance, ';')) {
-      char *key, *strtok_ctx;
-      char tmp[DATA_MAX_NAME_LEN], *tmp_strtok_ptr;
-
-      tmp_strtok_ptr = tmp;
-      strncpy(tmp, format->vl->type_instance, sizeof(tmp));
-      while ((key = strtok_r(tmp_strtok_ptr, ";", &strtok_ctx)) != NULL) {
-        /* Make tmp_tok_ptr NULL, as strtok_r
-         * requires it to be null on subsequent calls */
-        tmp_strtok_ptr = NULL;
-        char *value = strchr(key, '=');
-        if (value) {
-          *value++ = '\0';
-          ret = add_tag(&series_buffer->series_tags, key, value);
-          if (ret != 0)
-            return -1;
-        }
-      }
-    } else {
-      ret = add_tag(&series_buffer->series_tags, "instance",
-                    format->vl->type_instance);
-      if (ret != 0)
-        return -1;
-    }
+  return 0;
+}
 
-    count++;
-    series_buffer++;
-    preserve_original = false;
+static format_rules_t *builtin_rules;
+static pthread_once_t builtin_rules_once = PTHREAD_ONCE_INIT;
+
+static void builtin_rules_init(void) {
+  format_rules_t *rules = format_rules_create();
+  if ((rules == NULL) || (format_rules_add_defaults(rules) != 0)) {
+    format_rules_destroy(rules);
+    return;
   }
+  builtin_rules = rules;
+}
 
-  if (preserve_original) {
-    ret = format_series(
-        series_buffer, format,
-        NAME_PATTERN_PTR(PLUGIN, TYPE, TYPE_INSTANCE, DATA_SOURCE, IS_RAW),
-        true, NULL);
-    if (ret != 0) {
-      return -1;
-    }
+static const format_rules_t *format_rules_of(const format_info_t *format) {
+  if (format->rules != NULL)
+    return format->rules;
 
-    count++;
-    series_buffer++;
+  pthread_once(&builtin_rules_once, builtin_rules_init);
+  return builtin_rules;
+}
+
+/* Returns the rules that may match a value list of `plugin'. */
+static derive_rule_t *const *rules_lookup(const format_rules_t *rules,
+                                          const char *plugin, size_t *num) {
+  *num = 0;
+  if (rules == NULL)
+    return NULL;
+
+  rule_bucket_t *bucket = rules_find_bucket(rules, hash_plugin(plugin), plugin);
+  if (bucket != NULL) {
+    *num = bucket->rules_num;
+    return bucket->rules;
   }
 
-  return count;
+  *num = rules->any_num;
+  return rules->any;
+}
+
+static _Bool rule_matches(const derive_rule_t *rule,
+                          const format_info_t *format) {
+  return ((rule->type == NULL) ||
+          (strcasecmp(rule->type, format->vl->type) == 0)) &&
+         ((rule->type_instance == NULL) ||
+          (strcasecmp(rule->type_instance, format->vl->type_instance) == 0)) &&
+         (!rule->rates_only || (format->rates != NULL)) &&
+         /* The sum is reported once per value list. */
+         ((rule->transform != FORMAT_TRANSFORM_SUM) || (format->index == 0));
+}
+
+/* Upper bound for the number of series derive_series() returns. */
+static size_t derive_series_max(const format_info_t *format) {
+  size_t rules_num;
+  rules_lookup(format_rules_of(format), format->vl->plugin, &rules_num);
+  return rules_num + 1;
 }
 
-static size_t format_tags(char *buffer, size_t buffer_len,
-                          tag_key_val_t *tags) {
-  char escape_buffer[6 * DATA_MAX_NAME_LEN];
+static int derive_series(series_t *series_buffer, size_t buffer_num,
+                         format_info_t *format) {
+  size_t rules_num;
+  derive_rule_t *const *rules =
+      rules_lookup(format_rules_of(format), format->vl->plugin, &rules_num);
+
+  _Bool keep_original = true;
+  size_t count = 0;
+
+  for (size_t i = 0; (i < rules_num) && (count < buffer_num); i++) {
+    const derive_rule_t *rule = rules[i];
+    if (!rule_matches(rule, format))
+      continue;
+
+    if (format_series(series_buffer + count, format, &rule->name, rule->tags,
+                      rule->transform, rule->factor) != 0)
+      return -1;
+    count++;
 
-  size_t written = 0;
-  for (tag_key_val_t *tag = tags; tag != NULL; tag = tag->next) {
-    escape_atsd_string(escape_buffer, tag->key, sizeof escape_buffer);
-    written += snprintf(buffer + written, buffer_len - written,
-                        " t:\"%s\"=", escape_buffer);
+    if (!rule->keep_original)
+      keep_original = false;
+    if (rule->final)
+      break;
+  }
 
-    escape_atsd_string(escape_buffer, tag->val, sizeof escape_buffer);
-    written += snprintf(buffer + written, buffer_len - written, "\"%s\"",
-                        escape_buffer);
+  if (keep_original && (count < buffer_num)) {
+    if (format_series(series_buffer + count, format, &original_name,
+                      FORMAT_TAGS_INSTANCE, FORMAT_TRANSFORM_NONE, 0.0) != 0)
+      return -1;
+    count++;
   }
 
-  return written;
+  return (int)count;
+}
+
+/* Returns a buffer for the derived series of `format', `stack' if it is large
+ * enough. */
+static series_t *series_buffer_get(format_info_t *format, series_t *stack,
+                                   size_t *num) {
+  *num = derive_series_max(format);
+  if (*num <= SERIES_STACK_NUM)
+    return stack;
+
+  series_t *buffer = calloc(*num, sizeof(*buffer));
+  if (buffer == NULL)
+    ERROR("utils_format_atsd: calloc failed.");
+  return buffer;
+}
+
+static void series_buffer_put(series_t *buffer, series_t *stack) {
+  if (buffer != stack)
+    sfree(buffer);
+}
+
+static void format_tag(output_t *out, const char *key, const char *val) {
+  OUTPUT_ADD_LITERAL(out, " t:");
+  output_add_quoted(out, key);
+  OUTPUT_ADD_LITERAL(out, "=");
+  output_add_quoted(out, val);
 }
 
 /* Series command documentation:
- * https://github.com/axibase/atsd/blob/master/api/network/series.md */
-static size_t format_series_command(char *buffer, size_t buffer_len,
-                                    series_t *series) {
-  char escape_buffer[6 * DATA_MAX_NAME_LEN];
-
-  size_t written = 0;
-  written += snprintf(buffer, buffer_len, "series");
-  escape_atsd_string(escape_buffer, series->entity, sizeof escape_buffer);
-  written += snprintf(buffer + written, buffer_len - written, " e:\"%s\"",
-                      escape_buffer);
-  escape_atsd_string(escape_buffer, series->metric, sizeof escape_buffer);
-  written += snprintf(buffer + written, buffer_len - written, " m:\"%s\"=%s",
-                      escape_buffer, series->formatted_value);
-  written +=
-      format_tags(buffer + written, buffer_len - written, series->series_tags);
-  written += snprintf(buffer + written, buffer_len - written, " ms:%" PRIu64,
-                      series->time);
-  written += snprintf(buffer + written, buffer_len - written, " \n");
-
-  return written;
+ * https://github.com/axibase/atsd/blob/master/api/network/series.md
+ *
+ * A series command is written as a head, the value, the tags and the time.
+ * Only the value and the time change from one interval to the next. */
+static void format_series_head(output_t *out, series_t *series) {
+  OUTPUT_ADD_LITERAL(out, "series e:");
+  output_add_quoted(out, series->entity);
+  OUTPUT_ADD_LITERAL(out, " m:");
+  output_add_quoted(out, series->metric);
+  OUTPUT_ADD_LITERAL(out, "=");
+}
+
+static void format_series_tags(output_t *out, series_t *series) {
+  /* Most recently added tags first. */
+  for (size_t i = series->series_tags_num; i > 0; i--)
+    format_tag(out, series->series_tags[i - 1].key,
+               series->series_tags[i - 1].val);
+
+  OUTPUT_ADD_LITERAL(out, " ms:");
+}
+
+static void format_series_time(output_t *out, uint64_t time) {
+  char time_buf[21];
+
+  output_add(out, time_buf, format_uint(time_buf, time));
+  OUTPUT_ADD_LITERAL(out, " \n");
+}
+
+static void format_series_command(output_t *out, series_t *series) {
+  format_series_head(out, series);
+  output_add(out, series->formatted_value, strlen(series->formatted_value));
+  format_series_tags(out, series);
+  format_series_time(out, series->time);
 }
 
 /* Metric command documentation:
  * https://github.com/axibase/atsd/blob/master/api/network/metric.md */
-static size_t format_metric_command(char *buffer, size_t buffer_len,
-                                    series_t *series) {
-  char escape_buffer[6 * DATA_MAX_NAME_LEN];
+static void format_metric_command(output_t *out, series_t *series,
+                                  format_info_t *format) {
+  OUTPUT_ADD_LITERAL(out, "metric m:");
+  output_add_quoted(out, series->metric);
+  format_tag(out, "data_type",
+             DS_TYPE_TO_STRING(format->ds->ds[format->index].type));
+  format_tag(out, "data_source", format->ds->ds[format->index].name);
+  format_tag(out, "type_instance", format->vl->type_instance);
+  format_tag(out, "type", format->vl->type);
+  format_tag(out, "plugin", format->vl->plugin);
+  OUTPUT_ADD_LITERAL(out, " \n");
+}
 
-  size_t written = 0;
-  written += snprintf(buffer, buffer_len, "metric");
-  escape_atsd_string(escape_buffer, series->metric, sizeof escape_buffer);
-  written += snprintf(buffer + written, buffer_len - written, " m:\"%s\"",
-                      escape_buffer);
-  written +=
-      format_tags(buffer + written, buffer_len - written, series->metric_tags);
-  written += snprintf(buffer + written, buffer_len - written, " \n");
+static int format_output_finish(format_info_t *format, output_t *out) {
+  if (out->truncated) {
+    ERROR("utils_format_atsd: Buffer of %zu bytes is too small for the "
+          "commands of %s/%s.",
+          format->buffer_len, format->vl->plugin, format->vl->type);
+    if (format->buffer_len > 0)
+      format->buffer[0] = '\0';
+    return -1;
+  }
 
-  return written;
+  format->buffer[out->offset] = '\0';
+  return 0;
 }
 
 int format_atsd_command(format_info_t *format, _Bool append_metrics) {
-  series_t series_buffer[MAX_DERIVED_SERIES];
-  int series_count = derive_series(series_buffer, format);
+  series_t series_stack[SERIES_STACK_NUM];
+  size_t series_num;
+  series_t *series_buffer =
+      series_buffer_get(format, series_stack, &series_num);
+  if (series_buffer == NULL)
+    return -1;
+
+  int series_count = derive_series(series_buffer, series_num, format);
+  if (series_count < 0) {
+    series_buffer_put(series_buffer, series_stack);
+    return -1;
+  }
+
+  output_t out = {
+      .buffer = format->buffer, .size = format->buffer_len,
+  };
+
+  for (size_t i = 0; i < (size_t)series_count; i++) {
+    if (append_metrics)
+      format_metric_command(&out, &series_buffer[i], format);
+
+    format_series_command(&out, &series_buffer[i]);
+  }
+
+  series_buffer_put(series_buffer, series_stack);
+  return format_output_finish(format, &out);
+}
+
+/* Upper bound for the rendered parts of one template. */
+#define TEMPLATE_SCRATCH_SIZE 16384
+
+/* Offsets into format_template_s.data */
+typedef struct {
+  size_t offset;
+  size_t len;
+} template_part_t;
+
+typedef struct {
+  template_part_t metric;
+  template_part_t head;
+  template_part_t tags;
+  int transform;
+  double factor;
+} template_series_t;
+
+/* Allocated in one block: the template, the series and the data. */
+struct format_template_s {
+  size_t series_num;
+  template_series_t *series;
+
+  template_part_t entity;
+  template_part_t prefix;
+  char *data;
+};
+
+static template_part_t template_add(output_t *out, const char *str,
+                                    size_t len) {
+  template_part_t part = {.offset = out->offset, .len = len};
+  output_add(out, str, len);
+  return part;
+}
+
+format_template_t *format_atsd_template_create(format_info_t *format) {
+  series_t series_stack[SERIES_STACK_NUM];
+  char scratch[TEMPLATE_SCRATCH_SIZE];
+
+  size_t series_max;
+  series_t *series_buffer =
+      series_buffer_get(format, series_stack, &series_max);
+  if (series_buffer == NULL)
+    return NULL;
+
+  int series_count = derive_series(series_buffer, series_max, format);
+  if (series_count < 0) {
+    series_buffer_put(series_buffer, series_stack);
+    return NULL;
+  }
+  size_t series_num = (size_t)series_count;
+
+  template_series_t template_series[series_num];
+  output_t out = {.buffer = scratch, .size = sizeof(scratch)};
+
+  template_part_t entity =
+      template_add(&out, format->entity, strlen(format->entity));
+  template_part_t prefix =
+      template_add(&out, format->prefix, strlen(format->prefix));
+
+  for (size_t i = 0; i < series_num; i++) {
+    size_t start = out.offset;
+    format_metric_command(&out, &series_buffer[i], format);
+    template_series[i].metric =
+        (template_part_t){.offset = start, .len = out.offset - start};
+
+    start = out.offset;
+    format_series_head(&out, &series_buffer[i]);
+    template_series[i].head =
+        (template_part_t){.offset = start, .len = out.offset - start};
+
+    start = out.offset;
+    format_series_tags(&out, &series_buffer[i]);
+    template_series[i].tags =
+        (template_part_t){.offset = start, .len = out.offset - start};
+
+    template_series[i].transform = series_buffer[i].transform;
+    template_series[i].factor = series_buffer[i].factor;
+  }
+
+  if (out.truncated) {
+    ERROR("utils_format_atsd: Commands of metric \"%s\" are too long.",
+          series_buffer[0].metric);
+    series_buffer_put(series_buffer, series_stack);
+    return NULL;
+  }
+  series_buffer_put(series_buffer, series_stack);
+
+  format_template_t *ret =
+      malloc(sizeof(*ret) + sizeof(template_series) + out.offset);
+  if (ret == NULL) {
+    ERROR("utils_format_atsd: malloc failed.");
+    return NULL;
+  }
+
+  ret->series_num = series_num;
+  ret->series = (template_series_t *)(ret + 1);
+  ret->entity = entity;
+  ret->prefix = prefix;
+  ret->data = (char *)(ret->series + series_num);
+  memcpy(ret->series, template_series, sizeof(template_series));
+  memcpy(ret->data, scratch, out.offset);
+
+  return ret;
+}
+
+void format_atsd_template_destroy(format_template_t *tmpl) { sfree(tmpl); }
+
+static _Bool template_part_equals(const format_template_t *tmpl,
+                                  template_part_t part, const char *str) {
+  return (strlen(str) == part.len) &&
+         (memcmp(tmpl->data + part.offset, str, part.len) == 0);
+}
+
+_Bool format_atsd_template_matches(const format_template_t *tmpl,
+                                   const format_info_t *format) {
+  return template_part_equals(tmpl, tmpl->entity, format->entity) &&
+         template_part_equals(tmpl, tmpl->prefix, format->prefix);
+}
+
+int format_atsd_template_command(const format_template_t *tmpl,
+                                 format_info_t *format, _Bool append_metrics) {
+  char value[MAX_VALUE_LEN];
+  char formatted_value[MAX_VALUE_LEN];
 
-  if (series_count < 0)
+  if (format_value(value, sizeof(value), format) != 0)
     return -1;
 
-  memset(format->buffer, 0, format->buffer_len);
-  size_t written = 0;
-  for (size_t i = 0; i < series_count; i++) {
-    if (append_metrics) {
-      written += format_metric_command(format->buffer + written,
-                                       format->buffer_len - written,
-                                       &series_buffer[i]);
+  output_t out = {
+      .buffer = format->buffer, .size = format->buffer_len,
+  };
+  uint64_t time = CDTIME_T_TO_MS(format->vl->time);
+
+#define TEMPLATE_ADD(part)                                                     \
+  output_add(&out, tmpl->data + (part).offset, (part).len)
+
+  for (size_t i = 0; i < tmpl->series_num; i++) {
+    const char *series_value = value;
+    if (tmpl->series[i].transform != FORMAT_TRANSFORM_NONE) {
+      if (format_series_value(formatted_value, sizeof(formatted_value), format,
+                              tmpl->series[i].transform,
+                              tmpl->series[i].factor) != 0)
+        return -1;
+      series_value = formatted_value;
     }
 
-    written +=
-        format_series_command(format->buffer + written,
-                              format->buffer_len - written, &series_buffer[i]);
+    if (append_metrics)
+      TEMPLATE_ADD(tmpl->series[i].metric);
 
-    free_tags(series_buffer[i].metric_tags);
-    free_tags(series_buffer[i].series_tags);
+    TEMPLATE_ADD(tmpl->series[i].head);
+    output_add(&out, series_value, strlen(series_value));
+    TEMPLATE_ADD(tmpl->series[i].tags);
+    format_series_time(&out, time);
   }
 
-  return 0;
+#undef TEMPLATE_ADD
+
+  return format_output_finish(format, &out);
+}
+
+size_t format_atsd_template_command_size(const format_template_t *tmpl,
+                                         _Bool append_metrics) {
+  /* The terminating null byte */
+  size_t size = 1;
+
+  for (size_t i = 0; i < tmpl->series_num; i++) {
+    if (append_metrics)
+      size += tmpl->series[i].metric.len;
+    /* The value, the time and " \n" */
+    size += tmpl->series[i].head.len + MAX_VALUE_LEN +
+            tmpl->series[i].tags.len + 20 + 2;
+  }
+
+  return size;
+}
+
+size_t format_atsd_template_series_num(const format_template_t *tmpl) {
+  return tmpl->series_num;
+}
+
+uint64_t format_atsd_template_metric_hash(const format_template_t *tmpl,
+                                          size_t index) {
+  template_part_t metric = tmpl->series[index].metric;
+  return hash_add(FNV_OFFSET_BASIS, tmpl->data + metric.offset, metric.len);
+}
+
+uint64_t format_atsd_hash(uint64_t hash, const char *data, size_t len) {
+  return hash_add(hash, data, len);
+}
+
+uint64_t format_atsd_naming_hash(const format_rules_t *rules,
+                                 const char *prefix) {
+  char version[32];
+
+  if (rules == NULL) {
+    pthread_once(&builtin_rules_once, builtin_rules_init);
+    rules = builtin_rules;
+  }
+
+  snprintf(version, sizeof(version), "%d %" PRIu64, FORMAT_ATSD_NAMING_VERSION,
+           (rules != NULL) ? rules->hash : 0);
+
+  uint64_t hash = hash_add(FNV_OFFSET_BASIS, version, strlen(version) + 1);
+  return hash_add(hash, prefix, strlen(prefix));
 }
@@ -22,15 +22,73 @@
 #include "collectd.h"
 #include "plugin.h"
 
-#define MAX_DERIVED_SERIES 2
 #define MAX_VALUE_LEN 64
 
+/* Must be incremented whenever the metric names or the metric tags rendered
+ * for a value list change. */
+#define FORMAT_ATSD_NAMING_VERSION 1
+
+/* Derived series rules
+ *
+ * Every value list produces its original series, named
+ * <prefix>.<plugin>.<type>.<type instance>.<data source>, plus one series per
+ * matching rule. Rules are matched in the order they were added; a rule that
+ * does not keep the original series replaces it, a final rule stops matching.
+ * Rules are kept in a table keyed by the plugin name, so a value list is only
+ * compared against the rules of its plugin and those matching any plugin. */
+#define FORMAT_TRANSFORM_NONE 0
+#define FORMAT_TRANSFORM_INVERT 1 /* factor - value */
+#define FORMAT_TRANSFORM_SCALE 2  /* factor * value */
+#define FORMAT_TRANSFORM_SUM 3    /* Sum of all data sources */
+
+#define FORMAT_TAGS_INSTANCE 0  /* instance=<plugin instance> */
+#define FORMAT_TAGS_NONE 1      /* No tags */
+#define FORMAT_TAGS_DISK_NAME 2 /* As instance, plus the disk name of df */
+#define FORMAT_TAGS_KEY_VALUE 3 /* key=value pairs of the type instance */
+
+typedef struct {
+  /* Exact, case insensitive matches. NULL matches anything. */
+  const char *plugin;
+  const char *type;
+  const char *type_instance;
+  /* Only match when rates are stored */
+  _Bool rates_only;
+
+  /* Dot separated parts of the metric name after the prefix: literals or
+   * %{plugin}, %{plugin_instance}, %{type}, %{type_instance}, %{data_source}
+   * (empty for "value") and %{raw} ("raw" for counters stored as such).
+   * NULL for the name of the original series. */
+  const char *metric;
+  int transform;
+  double factor;
+  int tags;
+
+  _Bool keep_original;
+  _Bool final;
+} format_rule_t;
+
+struct format_rules_s;
+typedef struct format_rules_s format_rules_t;
+
+format_rules_t *format_rules_create(void);
+void format_rules_destroy(format_rules_t *rules);
+
+/* Compiles `rule' and appends it to the rules. The rule is copied. */
+int format_rules_add(format_rules_t *rules, const format_rule_t *rule);
+
+/* Appends the built-in rules: cpu busy = 100 - idle, df used_reserved =
+ * 100 - free plus the disk name tag, and exec metrics named after the plugin
+ * instance with tags from the type instance. */
+int format_rules_add_defaults(format_rules_t *rules);
+
 struct format_info_s {
   char *buffer;
   size_t buffer_len;
 
   char *entity;
   char *prefix;
+  /* NULL for the built-in rules */
+  const format_rules_t *rules;
 
   size_t index;
   const data_set_t *ds;
@@ -48,4 +106,46 @@ int format_entity(char *ret, const int ret_len, const char *entity,
 
 int format_atsd_command(format_info_t *format, _Bool append_metrics);
 
+/* Pre-rendered metric and series commands of one data source, with
+ * placeholders for the value and the time. A template depends on the value
+ * list identifier, the data source, the entity and the prefix. */
+struct format_template_s;
+typedef struct format_template_s format_template_t;
+
+format_template_t *format_atsd_template_create(format_info_t *format);
+void format_atsd_template_destroy(format_template_t *tmpl);
+
+/* Returns true if the template was rendered for the entity and prefix of
+ * `format'. */
+_Bool format_atsd_template_matches(const format_template_t *tmpl,
+                                   const format_info_t *format);
+
+/* Same output as format_atsd_command() for the value list the template was
+ * created from. */
+int format_atsd_template_command(const format_template_t *tmpl,
+                                 format_info_t *format, _Bool append_metrics);
+
+/* Upper bound for the size of the buffer format_atsd_template_command() needs
+ * for the template, including the terminating null byte. */
+size_t format_atsd_template_command_size(const format_template_t *tmpl,
+                                         _Bool append_metrics);
+
+/* Number of series of the template, each with its own metric command. */
+size_t format_atsd_template_series_num(const format_template_t *tmpl);
+
+/* format_atsd_hash() of the metric command, including the newline, of the
+ * series `index' of the template. */
+uint64_t format_atsd_template_metric_hash(const format_template_t *tmpl,
+                                          size_t index);
+
+/* 64-bit FNV-1a hash of commands, which may be added in several pieces.
+ * Start with FORMAT_ATSD_HASH_INIT. */
+#define FORMAT_ATSD_HASH_INIT 0xcbf29ce484222325ULL
+uint64_t format_atsd_hash(uint64_t hash, const char *data, size_t len);
+
+/* 64-bit hash of the naming rules, the derived series `rules' and `prefix'.
+ * Metric commands rendered with different rules have unrelated hashes. */
+uint64_t format_atsd_naming_hash(const format_rules_t *rules,
+                                 const char *prefix);
+
 #endif // UTILS_FORMAT_ATSD_H
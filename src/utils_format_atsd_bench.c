@@ -0,0 +1,159 @@
+/**
+ * collectd - src/utils_format_atsd_bench.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+/* Measures how many value lists per second format_atsd_command() and the
+ * cached series templates can turn into commands, for a mix of typical value
+ * lists.
+ *
+ * Usage: bench_format_atsd [iterations] */
+
+#include "collectd.h"
+#include "common.h"
+#include "plugin.h"
+
+#include "utils_format_atsd.h"
+
+#include <time.h>
+
+#define BENCH_DEFAULT_ITERATIONS 1000000
+
+typedef struct {
+  const char *plugin;
+  const char *plugin_instance;
+  const char *type;
+  const char *type_instance;
+  int ds_type;
+  _Bool rates;
+} bench_case_t;
+
+static bench_case_t cases[] = {
+    {"cpu", "0", "percent", "idle", DS_TYPE_GAUGE, 1},
+    {"cpu", "0", "percent", "user", DS_TYPE_GAUGE, 1},
+    {"memory", "", "memory", "used", DS_TYPE_GAUGE, 0},
+    {"df", "root", "percent_bytes", "free", DS_TYPE_GAUGE, 0},
+    {"interface", "eth0", "if_octets", "", DS_TYPE_DERIVE, 1},
+    {"interface", "eth0", "if_octets", "", DS_TYPE_DERIVE, 0},
+    {"exec", "script", "gauge", "host=db;role=primary", DS_TYPE_GAUGE, 0},
+    {"load", "", "load", "", DS_TYPE_GAUGE, 0},
+};
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void setup_case(bench_case_t *c, long i, value_list_t *vl,
+                       data_source_t *dsrc, format_info_t *format,
+                       gauge_t *rate) {
+  sstrncpy(vl->plugin, c->plugin, sizeof(vl->plugin));
+  sstrncpy(vl->plugin_instance, c->plugin_instance,
+           sizeof(vl->plugin_instance));
+  sstrncpy(vl->type, c->type, sizeof(vl->type));
+  sstrncpy(vl->type_instance, c->type_instance, sizeof(vl->type_instance));
+  vl->time += MS_TO_CDTIME_T(10);
+
+  dsrc->type = c->ds_type;
+  if (c->ds_type == DS_TYPE_GAUGE)
+    vl->values[0].gauge = 1024.0 * (double)i + 0.25;
+  else
+    vl->values[0].derive = (derive_t)i * 1500;
+
+  *rate = 12.5 + (double)(i % 1000) / 7.0;
+  format->rates = c->rates ? rate : NULL;
+}
+
+static void report(const char *name, long iterations, double elapsed,
+                   size_t bytes) {
+  printf("%-10s %ld value lists in %.3f s: %.0f per second, %.1f MB/s\n",
+         name, iterations, elapsed, (double)iterations / elapsed,
+         (double)bytes / elapsed / (1024.0 * 1024.0));
+}
+
+int main(int argc, char **argv) {
+  long iterations = BENCH_DEFAULT_ITERATIONS;
+  if (argc > 1)
+    iterations = atol(argv[1]);
+  if (iterations <= 0) {
+    fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  data_source_t dsrc = {"value", DS_TYPE_GAUGE, 0.0, NAN};
+  data_set_t ds = {"bench", 1, &dsrc};
+
+  value_t value;
+  gauge_t rate;
+  value_list_t vl = VALUE_LIST_INIT;
+  vl.values = &value;
+  vl.values_len = 1;
+  vl.time = TIME_T_TO_CDTIME_T(1500000000);
+  sstrncpy(vl.host, "web-01.example.com", sizeof(vl.host));
+
+  char buffer[4096];
+  format_info_t format = {
+      .buffer = buffer,
+      .buffer_len = sizeof(buffer),
+      .entity = vl.host,
+      .prefix = "collectd",
+      .index = 0,
+      .ds = &ds,
+      .vl = &vl,
+  };
+
+  size_t cases_num = STATIC_ARRAY_SIZE(cases);
+  format_template_t *templates[STATIC_ARRAY_SIZE(cases)] = {NULL};
+
+  /* Formatting every command from scratch */
+  size_t bytes = 0;
+  double start = now_seconds();
+  for (long i = 0; i < iterations; i++) {
+    setup_case(cases + (i % cases_num), i, &vl, &dsrc, &format, &rate);
+    if (format_atsd_command(&format, /* append_metrics = */ (i % 16) == 0) !=
+        0) {
+      fprintf(stderr, "format_atsd_command failed\n");
+      return 1;
+    }
+    bytes += strlen(buffer);
+  }
+  report("command", iterations, now_seconds() - start, bytes);
+
+  /* Rendering from cached templates, as write_atsd does */
+  bytes = 0;
+  start = now_seconds();
+  for (long i = 0; i < iterations; i++) {
+    size_t n = i % cases_num;
+    setup_case(cases + n, i, &vl, &dsrc, &format, &rate);
+    if (templates[n] == NULL)
+      templates[n] = format_atsd_template_create(&format);
+    if ((templates[n] == NULL) ||
+        (format_atsd_template_command(templates[n], &format,
+                                      /* append_metrics = */ (i % 16) == 0) !=
+         0)) {
+      fprintf(stderr, "format_atsd_template_command failed\n");
+      return 1;
+    }
+    bytes += strlen(buffer);
+  }
+  report("template", iterations, now_seconds() - start, bytes);
+
+  for (size_t n = 0; n < cases_num; n++)
+    format_atsd_template_destroy(templates[n]);
+
+  return 0;
+}
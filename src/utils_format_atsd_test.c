@@ -0,0 +1,341 @@
+/**
+ * collectd - src/utils_format_atsd_test.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+#include "collectd.h"
+#include "common.h"
+
+#include "testing.h"
+#include "utils_format_atsd.h"
+
+#define TIME_MS "ms:1500000000250 \n"
+
+static data_source_t dsrc_gauge = {"value", DS_TYPE_GAUGE, 0, NAN};
+static data_set_t ds_gauge = {"gauge", 1, &dsrc_gauge};
+
+static data_source_t dsrc_octets[] = {
+    {"rx", DS_TYPE_DERIVE, 0, NAN}, {"tx", DS_TYPE_DERIVE, 0, NAN},
+};
+static data_set_t ds_octets = {"if_octets", 2, dsrc_octets};
+
+typedef struct {
+  const char *plugin;
+  const char *plugin_instance;
+  const char *type;
+  const char *type_instance;
+  gauge_t value;
+  _Bool rates;
+  _Bool append_metrics;
+  const char *want;
+} command_case_t;
+
+static command_case_t command_cases[] = {
+    {"memory", "", "memory", "used", 42.5, 0, 0,
+     "series e:\"web-01\" m:\"collectd.memory.memory.used\"=42.5 " TIME_MS},
+    {"memory", "", "memory", "used", 42.5, 0, 1,
+     "metric m:\"collectd.memory.memory.used\" t:\"data_type\"=\"gauge\" "
+     "t:\"data_source\"=\"value\" t:\"type_instance\"=\"used\" "
+     "t:\"type\"=\"memory\" t:\"plugin\"=\"memory\" \n"
+     "series e:\"web-01\" m:\"collectd.memory.memory.used\"=42.5 " TIME_MS},
+    /* Quotes are doubled */
+    {"test", "a \"b\"", "gauge", "", 42.5, 0, 0,
+     "series e:\"web-01\" m:\"collectd.test.gauge\"=42.5 "
+     "t:\"instance\"=\"a \"\"b\"\"\" " TIME_MS},
+    /* Built-in rules: cpu busy, only with rates */
+    {"cpu", "0", "percent", "idle", 97.5, 1, 0,
+     "series e:\"web-01\" m:\"collectd.cpu.percent.busy\"=2.5 "
+     "t:\"instance\"=\"0\" " TIME_MS
+     "series e:\"web-01\" m:\"collectd.cpu.percent.idle\"=97.5 "
+     "t:\"instance\"=\"0\" " TIME_MS},
+    {"cpu", "0", "percent", "idle", 97.5, 0, 0,
+     "series e:\"web-01\" m:\"collectd.cpu.percent.idle\"=97.5 "
+     "t:\"instance\"=\"0\" " TIME_MS},
+    /* df used_reserved */
+    {"df", "root", "percent_bytes", "free", 20, 0, 0,
+     "series e:\"web-01\" m:\"collectd.df.percent_bytes.used_reserved\"=80 "
+     "t:\"instance\"=\"root\" " TIME_MS
+     "series e:\"web-01\" m:\"collectd.df.percent_bytes.free\"=20 "
+     "t:\"instance\"=\"root\" " TIME_MS},
+    /* exec metrics named after the plugin instance */
+    {"exec", "script", "gauge", "host=db;role=primary", 42.5, 0, 0,
+     "series e:\"web-01\" m:\"collectd.script\"=42.5 t:\"role\"=\"primary\" "
+     "t:\"host\"=\"db\" " TIME_MS},
+};
+
+static void init_value_list(value_list_t *vl, const char *plugin,
+                            const char *plugin_instance, const char *type,
+                            const char *type_instance) {
+  vl->time = TIME_T_TO_CDTIME_T(1500000000) + MS_TO_CDTIME_T(250);
+  vl->interval = TIME_T_TO_CDTIME_T(10);
+  sstrncpy(vl->host, "web-01.example.com", sizeof(vl->host));
+  sstrncpy(vl->plugin, plugin, sizeof(vl->plugin));
+  sstrncpy(vl->plugin_instance, plugin_instance, sizeof(vl->plugin_instance));
+  sstrncpy(vl->type, type, sizeof(vl->type));
+  sstrncpy(vl->type_instance, type_instance, sizeof(vl->type_instance));
+}
+
+DEF_TEST(command) {
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(command_cases); i++) {
+    command_case_t *c = command_cases + i;
+    value_list_t vl = {.values = &(value_t){.gauge = c->value},
+                       .values_len = 1};
+    gauge_t rate = c->value;
+    char got[4096];
+
+    init_value_list(&vl, c->plugin, c->plugin_instance, c->type,
+                    c->type_instance);
+    format_info_t format = {
+        .buffer = got,
+        .buffer_len = sizeof(got),
+        .entity = "web-01",
+        .prefix = "collectd",
+        .ds = &ds_gauge,
+        .vl = &vl,
+        .rates = c->rates ? &rate : NULL,
+    };
+
+    EXPECT_EQ_INT(0, format_atsd_command(&format, c->append_metrics));
+    EXPECT_EQ_STR(c->want, got);
+  }
+
+  return 0;
+}
+
+DEF_TEST(data_sources) {
+  value_list_t vl = {
+      .values = (value_t[]){{.derive = 1000}, {.derive = 3000}},
+      .values_len = 2,
+  };
+  gauge_t rates[] = {10, 30};
+  char got[4096];
+
+  init_value_list(&vl, "interface", "eth0", "if_octets", "");
+  format_info_t format = {
+      .buffer = got,
+      .buffer_len = sizeof(got),
+      .entity = "web-01",
+      .prefix = "collectd",
+      .index = 1,
+      .ds = &ds_octets,
+      .vl = &vl,
+      .rates = rates,
+  };
+
+  EXPECT_EQ_INT(0, format_atsd_command(&format, 0));
+  EXPECT_EQ_STR("series e:\"web-01\" m:\"collectd.interface.if_octets.tx\"=30 "
+                "t:\"instance\"=\"eth0\" " TIME_MS,
+                got);
+
+  /* Counters stored as such get a "raw" suffix. */
+  format.rates = NULL;
+  EXPECT_EQ_INT(0, format_atsd_command(&format, 0));
+  EXPECT_EQ_STR("series e:\"web-01\" "
+                "m:\"collectd.interface.if_octets.tx.raw\"=3000 "
+                "t:\"instance\"=\"eth0\" " TIME_MS,
+                got);
+
+  return 0;
+}
+
+DEF_TEST(rules) {
+  format_rules_t *rules;
+  CHECK_NOT_NULL(rules = format_rules_create());
+
+  format_rule_t sum = {
+      .plugin = "interface",
+      .type = "if_octets",
+      .metric = "%{plugin}.%{type}.total",
+      .transform = FORMAT_TRANSFORM_SUM,
+      .keep_original = 1,
+  };
+  format_rule_t scale = {
+      .plugin = "memory",
+      .metric = "%{plugin}.%{type_instance}.kb",
+      .transform = FORMAT_TRANSFORM_SCALE,
+      .factor = 0.5,
+      .final = 1,
+  };
+  format_rule_t after_final = {.plugin = "memory", .metric = "never"};
+  format_rule_t unknown = {.metric = "%{nope}"};
+
+  CHECK_ZERO(format_rules_add(rules, &sum));
+  CHECK_ZERO(format_rules_add(rules, &scale));
+  CHECK_ZERO(format_rules_add(rules, &after_final));
+  OK(format_rules_add(rules, &unknown) != 0);
+
+  char got[4096];
+  value_list_t vl = {
+      .values = (value_t[]){{.derive = 1000}, {.derive = 3000}},
+      .values_len = 2,
+  };
+  gauge_t rates[] = {10, 30};
+  init_value_list(&vl, "interface", "eth0", "if_octets", "");
+  format_info_t format = {
+      .buffer = got,
+      .buffer_len = sizeof(got),
+      .entity = "web-01",
+      .prefix = "collectd",
+      .rules = rules,
+      .ds = &ds_octets,
+      .vl = &vl,
+      .rates = rates,
+  };
+
+  /* The sum is sent with the first data source only. */
+  EXPECT_EQ_INT(0, format_atsd_command(&format, 0));
+  EXPECT_EQ_STR("series e:\"web-01\" "
+                "m:\"collectd.interface.if_octets.total\"=40 "
+                "t:\"instance\"=\"eth0\" " TIME_MS
+                "series e:\"web-01\" m:\"collectd.interface.if_octets.rx\"=10 "
+                "t:\"instance\"=\"eth0\" " TIME_MS,
+                got);
+  format.index = 1;
+  EXPECT_EQ_INT(0, format_atsd_command(&format, 0));
+  EXPECT_EQ_STR("series e:\"web-01\" m:\"collectd.interface.if_octets.tx\"=30 "
+                "t:\"instance\"=\"eth0\" " TIME_MS,
+                got);
+
+  /* Replaces the original series, the rule after it is never reached. */
+  vl.values = &(value_t){.gauge = 42.5};
+  vl.values_len = 1;
+  init_value_list(&vl, "memory", "", "memory", "used");
+  format.index = 0;
+  format.ds = &ds_gauge;
+  format.rates = NULL;
+  EXPECT_EQ_INT(0, format_atsd_command(&format, 0));
+  EXPECT_EQ_STR(
+      "series e:\"web-01\" m:\"collectd.memory.used.kb\"=21.25 " TIME_MS, got);
+
+  /* Custom rules replace the built-in ones. */
+  gauge_t rate = 97.5;
+  vl.values = &(value_t){.gauge = 97.5};
+  init_value_list(&vl, "cpu", "0", "percent", "idle");
+  format.rates = &rate;
+  EXPECT_EQ_INT(0, format_atsd_command(&format, 0));
+  EXPECT_EQ_STR("series e:\"web-01\" m:\"collectd.cpu.percent.idle\"=97.5 "
+                "t:\"instance\"=\"0\" " TIME_MS,
+                got);
+
+  OK(format_atsd_naming_hash(rules, "collectd") !=
+     format_atsd_naming_hash(NULL, "collectd"));
+  OK(format_atsd_naming_hash(NULL, "collectd") !=
+     format_atsd_naming_hash(NULL, "other"));
+
+  format_rules_destroy(rules);
+  return 0;
+}
+
+DEF_TEST(template) {
+  for (size_t i = 0; i < STATIC_ARRAY_SIZE(command_cases); i++) {
+    command_case_t *c = command_cases + i;
+    value_list_t vl = {.values = &(value_t){.gauge = c->value},
+                       .values_len = 1};
+    gauge_t rate = c->value;
+    char want[4096];
+    char got[4096];
+
+    init_value_list(&vl, c->plugin, c->plugin_instance, c->type,
+                    c->type_instance);
+    format_info_t format = {
+        .buffer = want,
+        .buffer_len = sizeof(want),
+        .entity = "web-01",
+        .prefix = "collectd",
+        .ds = &ds_gauge,
+        .vl = &vl,
+        .rates = c->rates ? &rate : NULL,
+    };
+
+    format_template_t *tmpl;
+    CHECK_NOT_NULL(tmpl = format_atsd_template_create(&format));
+    OK(format_atsd_template_matches(tmpl, &format));
+
+    /* The template is reused for later values. */
+    vl.values[0].gauge = c->value / 2;
+    rate = c->value / 2;
+    vl.time += TIME_T_TO_CDTIME_T(10);
+
+    for (int append_metrics = 0; append_metrics <= 1; append_metrics++) {
+      format.buffer = want;
+      EXPECT_EQ_INT(0, format_atsd_command(&format, append_metrics));
+      format.buffer = got;
+      EXPECT_EQ_INT(
+          0, format_atsd_template_command(tmpl, &format, append_metrics));
+      EXPECT_EQ_STR(want, got);
+      OK(strlen(got) <
+         format_atsd_template_command_size(tmpl, append_metrics));
+    }
+
+    format.entity = "other";
+    OK(!format_atsd_template_matches(tmpl, &format));
+
+    format_atsd_template_destroy(tmpl);
+  }
+
+  return 0;
+}
+
+DEF_TEST(truncation) {
+  value_list_t vl = {.values = &(value_t){.gauge = 42.5}, .values_len = 1};
+  char got[32];
+
+  init_value_list(&vl, "memory", "", "memory", "used");
+  format_info_t format = {
+      .buffer = got,
+      .buffer_len = sizeof(got),
+      .entity = "web-01",
+      .prefix = "collectd",
+      .ds = &ds_gauge,
+      .vl = &vl,
+  };
+
+  OK(format_atsd_command(&format, 0) != 0);
+  EXPECT_EQ_STR("", got);
+
+  return 0;
+}
+
+DEF_TEST(entity) {
+  char entity[64];
+
+  CHECK_ZERO(format_entity(entity, sizeof(entity), NULL, "web-01.example.com",
+                           /* short_hostname = */ 1));
+  EXPECT_EQ_STR("web-01", entity);
+  CHECK_ZERO(format_entity(entity, sizeof(entity), NULL, "web-01.example.com",
+                           /* short_hostname = */ 0));
+  EXPECT_EQ_STR("web-01.example.com", entity);
+  CHECK_ZERO(format_entity(entity, sizeof(entity), "fixed",
+                           "web-01.example.com", /* short_hostname = */ 1));
+  EXPECT_EQ_STR("fixed", entity);
+
+  char escaped[64];
+  EXPECT_EQ_STR("a \"\"q\"\" b",
+                escape_atsd_string(escaped, "a \"q\" b", sizeof(escaped)));
+
+  return 0;
+}
+
+int main(void) {
+  RUN_TEST(command);
+  RUN_TEST(data_sources);
+  RUN_TEST(rules);
+  RUN_TEST(template);
+  RUN_TEST(truncation);
+  RUN_TEST(entity);
+
+  END_TEST;
+}
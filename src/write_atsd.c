@@ -17,18 +17,52 @@
  * Based on the write_graphite plugin.
  **/
 
+#define _GNU_SOURCE /* For sendmmsg */
+
 /* write_atsd plugin configuration example
  *
  * <Plugin write_atsd>
  *   <Node "default">
  *     AtsdUrl "atsd_url"
+ *     AtsdUrl "backup_atsd_url"
+ *     Balance "Failover"
+ *     ReconnectInterval 0
+ *     ConnectTimeout 5
+ *     ResolveInterval 60
+ *     Compression "gzip"
+ *     User "user"
+ *     Password "password"
  *     Entity "entity"
  *     Prefix "collectd"
  *     ShortHostname false
+ *     BufferSize 65536
+ *     Mtu 1500
+ *     FlushInterval 1
+ *     SpoolSize 1048576
+ *     SpoolPolicy "DropOldest"
+ *     DiskSpool false
+ *     DiskSpoolSize 67108864
+ *     DiskSpoolReplayRate 1048576
+ *     MetricSnapshot false
+ *     ReportStats false
+ *     <Latency>
+ *       Percentile 50
+ *       Percentile 99
+ *     </Latency>
  *     <Cache "df">
+ *       Type "percent_bytes"
  *       Interval 300
  *       Threshold 0
+ *       AbsoluteThreshold 0.5
  *     </Cache>
+ *     <Derive>
+ *       Plugin "interface"
+ *       Type "if_octets"
+ *       Metric "%{plugin}.%{type}.total"
+ *       Transform "Sum"
+ *       KeepOriginal true
+ *     </Derive>
+ *     DeriveDefaults true
  *   </Node>
  * </Plugin>
  */
@@ -40,14 +74,24 @@
 #include "utils_avltree.h"
 #include "utils_vl_lookup.h"
 
+#include "utils_atsd_cache.h"
+#include "utils_atsd_http.h"
+#include "utils_atsd_metrics.h"
+#include "utils_atsd_spool.h"
 #include "utils_cache.h"
 #include "utils_complain.h"
 #include "utils_format_atsd.h"
+#include "utils_latency.h"
+#include "utils_latency_config.h"
+#include "utils_random.h"
 
 #include <stdbool.h>
 
+#include <fnmatch.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -65,6 +109,10 @@
 #define WA_DEFAULT_PROTOCOL "tcp"
 #endif
 
+#ifndef WA_DEFAULT_HTTP_SERVICE
+#define WA_DEFAULT_HTTP_SERVICE "8088"
+#endif
+
 #ifndef WA_DEFAULT_PREFIX
 #define WA_DEFAULT_PREFIX "collectd"
 #endif
@@ -78,29 +126,174 @@
 #define WA_SEND_BUF_SIZE 1428
 #endif
 
+/* Commands are batched until this many bytes are spooled or the flush interval
+ * has passed. UDP nodes split a batch into datagrams of at most
+ * Mtu - WA_UDP_HEADER_SIZE bytes. */
+#ifndef WA_DEFAULT_BUFFER_SIZE
+#define WA_DEFAULT_BUFFER_SIZE (64 * 1024)
+#endif
+
+#ifndef WA_DEFAULT_MTU
+#define WA_DEFAULT_MTU 1500
+#endif
+
+/* IPv6 + UDP */
+#define WA_UDP_HEADER_SIZE (40 + 8)
+
+/* Datagrams passed to a single sendmmsg() call */
+#ifndef WA_UDP_BATCH_SIZE
+#define WA_UDP_BATCH_SIZE 64
+#endif
+
+/* Time to wait for the response to an HTTP request */
+#ifndef WA_HTTP_TIMEOUT
+#define WA_HTTP_TIMEOUT TIME_T_TO_CDTIME_T(10)
+#endif
+
+#ifndef WA_DEFAULT_FLUSH_INTERVAL
+#define WA_DEFAULT_FLUSH_INTERVAL TIME_T_TO_CDTIME_T(1)
+#endif
+
 #ifndef WA_MIN_RECONNECT_INTERVAL
 #define WA_MIN_RECONNECT_INTERVAL TIME_T_TO_CDTIME_T(1)
 #endif
 
+#ifndef WA_MAX_RECONNECT_INTERVAL
+#define WA_MAX_RECONNECT_INTERVAL TIME_T_TO_CDTIME_T(60)
+#endif
+
+#ifndef WA_DEFAULT_CONNECT_TIMEOUT
+#define WA_DEFAULT_CONNECT_TIMEOUT TIME_T_TO_CDTIME_T(5)
+#endif
+
+/* Resolved addresses of an endpoint are reused for this long. */
+#ifndef WA_DEFAULT_RESOLVE_INTERVAL
+#define WA_DEFAULT_RESOLVE_INTERVAL TIME_T_TO_CDTIME_T(60)
+#endif
+
+/* Entities resolved from host names are cached for this long. */
+#ifndef WA_ENTITY_CACHE_TTL
+#define WA_ENTITY_CACHE_TTL TIME_T_TO_CDTIME_T(300)
+#endif
+
+/* Series without values for this long are removed from the series cache. */
+#ifndef WA_SERIES_CACHE_TTL
+#define WA_SERIES_CACHE_TTL TIME_T_TO_CDTIME_T(900)
+#endif
+
 #ifndef WA_PROPERTY_INTERVAL
 #define WA_PROPERTY_INTERVAL TIME_T_TO_CDTIME_T(300)
 #endif
 
+/* Memory reserved for commands waiting to be sent by the sender thread. */
+#ifndef WA_DEFAULT_SPOOL_SIZE
+#define WA_DEFAULT_SPOOL_SIZE (1024 * 1024)
+#endif
+
+#define WA_SPOOL_DROP_OLDEST 0
+#define WA_SPOOL_DROP_NEWEST 1
+
+#ifndef WA_DEFAULT_DISK_SPOOL_SIZE
+#define WA_DEFAULT_DISK_SPOOL_SIZE (64 * 1024 * 1024)
+#endif
+
+#ifndef WA_DEFAULT_DISK_SPOOL_SEGMENT_SIZE
+#define WA_DEFAULT_DISK_SPOOL_SEGMENT_SIZE (4 * 1024 * 1024)
+#endif
+
+/* Bytes per second replayed from the disk spool after reconnecting. */
+#ifndef WA_DEFAULT_DISK_SPOOL_REPLAY_RATE
+#define WA_DEFAULT_DISK_SPOOL_REPLAY_RATE (1024 * 1024)
+#endif
+
+/* Initial size of the buffer write callbacks format commands into. It is on
+ * the stack and replaced by a larger one on the heap when needed. */
+#ifndef WA_FORMAT_BUFFER_SIZE
+#define WA_FORMAT_BUFFER_SIZE 4096
+#endif
+
+#ifndef WA_DISK_SPOOL_CHUNK_SIZE
+#define WA_DISK_SPOOL_CHUNK_SIZE (64 * 1024)
+#endif
+
+/* Percentiles of the latencies reported without a <Latency> block. */
+#define WA_DEFAULT_LATENCY_PERCENTILES                                         \
+  { 50.0, 99.0 }
+
+/* A <Cache> block: values of matching series are not sent while they stay
+ * within `threshold' percent or `absolute_threshold' of the last value sent,
+ * for at most `interval'. Plugin, type and type instance are glob patterns,
+ * type and type instance match anything when NULL. */
 struct wa_cache_s {
-  char *name;
-  int interval;
+  char *plugin;
+  char *type;
+  char *type_instance;
+  cdtime_t interval;
   double threshold;
-
-  struct wa_cache_s *next;
+  double absolute_threshold;
 };
 
-struct wa_callback {
+/* One AtsdUrl of a node. Connection attempts to an endpoint that failed are
+ * delayed by up to `backoff', which doubles with every failure up to
+ * WA_MAX_RECONNECT_INTERVAL and is reset by a successful send. */
+struct wa_endpoint {
+  char *node;
+  char *service;
+
+  /* Addresses of node and service, resolved by the sender thread before it
+   * takes send_lock. They are resolved again after ResolveInterval and after
+   * connecting to all of them failed. Only used by the thread connecting. */
+  struct addrinfo *ai_list;
+  cdtime_t resolve_time;
+
   int sock_fd;
+  cdtime_t connect_time;
+  cdtime_t next_attempt;
+  cdtime_t backoff;
+  c_complain_t complaint;
+
+  /* An HTTP request has been answered on this connection before. */
+  _Bool reused;
+};
 
+/* Counters and latencies reported by the read callback when ReportStats is
+ * enabled. The series and spool counters are protected by cb->spool_lock, the
+ * others by cb->send_lock. Latency counters are reset when reported. */
+struct wa_stats {
+  uint64_t series_sent;
+  uint64_t series_suppressed;
+  uint64_t series_failed;
+  uint64_t commands_dropped;
+
+  uint64_t bytes_sent;
+  uint64_t sends;
+  uint64_t send_failures;
+  uint64_t connects;
+  uint64_t connect_failures;
+
+  latency_counter_t *send_lock_latency;
+  latency_counter_t *send_latency;
+  latency_counter_t *connect_latency;
+};
+
+#define WA_BALANCE_FAILOVER 0
+#define WA_BALANCE_ROUND_ROBIN 1
+#define WA_BALANCE_ENTITY 2
+
+struct wa_callback {
   char *name;
 
-  char *node;
-  char *service;
+  /* Endpoints of the node and how batches are spread across them. Only used
+   * by the sender thread, under send_lock. `node' and `service' name the
+   * first endpoint in messages and file names. */
+  struct wa_endpoint *endpoints;
+  size_t endpoints_num;
+  int balance;
+  size_t next_endpoint;
+  char *route_buf;
+
+  const char *node;
+  const char *service;
   char *protocol;
   char *prefix;
   char *entity;
@@ -108,492 +301,1724 @@ struct wa_callback {
   _Bool short_hostname;
   _Bool store_rates;
 
-  char send_buf[WA_SEND_BUF_SIZE];
+  char *send_buf;
+  size_t send_buf_size;
   size_t send_buf_free;
   size_t send_buf_fill;
   cdtime_t send_buf_init_time;
 
+  _Bool udp;
+  int mtu;
+  uint64_t udp_datagrams;
+  uint64_t udp_bytes;
+
+  /* HTTP nodes post every batch to /api/v1/command. */
+  atsd_http_t *http;
+  int compression;
+  char *user;
+  char *password;
+
+  /* Ring buffer of newline terminated commands. Write callbacks append to it,
+   * the sender thread writes it to the socket or drains it into send_buf.
+   * While the first `spool_sending' bytes are written without spool_lock,
+   * they are not dropped. Protected by spool_lock. */
+  char *spool;
+  size_t spool_size;
+  size_t spool_head;
+  size_t spool_fill;
+  size_t spool_sending;
+  cdtime_t spool_first_time;
+  cdtime_t flush_interval;
+  _Bool flush_requested;
+  int spool_policy;
+  uint64_t spool_dropped;
+  c_complain_t spool_complaint;
+  c_complain_t format_complaint;
+
+  /* Commands that could not be delivered are appended to the disk spool and
+   * replayed after reconnecting. Only used by the sender thread, except for
+   * disk_spool_bytes which is protected by spool_lock. */
+  _Bool disk_spool_enabled;
+  atsd_spool_t *disk_spool;
+  char *disk_spool_buf;
+  size_t disk_spool_bytes;
+  int disk_spool_size;
+  int disk_spool_segment_size;
+  int disk_spool_replay_rate;
+  cdtime_t disk_spool_replay_next;
+
+  pthread_mutex_t spool_lock;
+  pthread_cond_t spool_cond;
+  pthread_t sender_thread;
+  _Bool sender_running;
+  _Bool sender_loop;
+  _Bool sender_done;
+  /* Stream socket the sender thread is writing to, or -1. */
+  int send_fd;
+
   pthread_mutex_t send_lock;
-  pthread_mutex_t value_cache_lock;
-  pthread_mutex_t metric_cache_lock;
-  c_complain_t init_complaint;
-  cdtime_t last_connect_time;
-  cdtime_t last_property_time;
 
   struct wa_cache_s *wa_caches;
   int wa_num_caches;
-  c_avl_tree_t *value_cache;
-  c_avl_tree_t *metric_cache;
 
-  /* Force reconnect useful for load balanced environments */
-  cdtime_t last_reconnect_time;
+  /* <Derive> blocks, followed by the built-in rules unless DeriveDefaults is
+   * false. */
+  format_rules_t *rules;
+  _Bool derive_defaults;
+  atsd_cache_t *series_cache;
+  atsd_entity_cache_t *entity_cache;
+
+  /* Property commands are sent by the read callback, for the entities found
+   * in entity_cache. property_times maps entities to the time their
+   * properties were last sent. Only used by the read callback. */
+  char *uname_tags;
+  c_avl_tree_t *property_times;
+  cdtime_t property_time;
+
+  /* Metric definitions delivered by this and the previous run. NULL if
+   * MetricSnapshot is disabled. */
+  _Bool metric_snapshot;
+  atsd_metrics_t *metrics;
+
+  /* Connections are closed and reopened after this long, so that an address
+   * behind a load balancer or in DNS is re-resolved. Zero disables it. */
   cdtime_t reconnect_interval;
-  _Bool reconnect_interval_reached;
-};
 
-struct atsd_key_s {
-  char host[DATA_MAX_NAME_LEN];
-  char plugin[DATA_MAX_NAME_LEN];
-  char plugin_instance[DATA_MAX_NAME_LEN];
-  char type[DATA_MAX_NAME_LEN];
-  char type_instance[DATA_MAX_NAME_LEN];
-  char data_source[DATA_MAX_NAME_LEN];
-};
-typedef struct atsd_key_s atsd_key_t;
+  cdtime_t connect_timeout;
+  cdtime_t resolve_interval;
 
-struct atsd_value_s {
-  uint64_t time;
-  double value;
+  _Bool report_stats;
+  latency_config_t latency;
+  struct wa_stats stats;
+  cdtime_t send_lock_time;
 };
-typedef struct atsd_value_s atsd_value_t;
 
-int compare_atsd_keys(atsd_key_t *key_a, atsd_key_t *key_b) {
-  int p;
+/* wa_send_lock and wa_send_unlock take and release cb->send_lock in the sender
+ * thread, recording for how long it was held. */
+static void wa_send_lock(struct wa_callback *cb) {
+  pthread_mutex_lock(&cb->send_lock);
+  if (cb->report_stats)
+    cb->send_lock_time = cdtime();
+}
 
-#define COMPARE(l, r)                                                          \
-  do {                                                                         \
-    p = strcmp(l, r);                                                          \
-    if (p != 0)                                                                \
-      return p;                                                                \
-  } while (0)
+static void wa_send_unlock(struct wa_callback *cb) {
+  if (cb->report_stats)
+    latency_counter_add(cb->stats.send_lock_latency,
+                        cdtime() - cb->send_lock_time);
+  pthread_mutex_unlock(&cb->send_lock);
+}
 
-  COMPARE(key_a->host, key_b->host);
-  COMPARE(key_a->plugin, key_b->plugin);
-  COMPARE(key_a->type, key_b->type);
-  COMPARE(key_a->plugin_instance, key_b->plugin_instance);
-  COMPARE(key_a->type_instance, key_b->type_instance);
-  COMPARE(key_a->data_source, key_b->data_source);
+/* wa_endpoint_close closes the connection of an endpoint. When `failed' is
+ * set, the next connection attempt is delayed by the endpoint's backoff. Must
+ * hold cb->send_lock. */
+static void wa_endpoint_close(struct wa_endpoint *ep, _Bool failed) {
+  if (ep->sock_fd >= 0) {
+    close(ep->sock_fd);
+    ep->sock_fd = -1;
+  }
 
-#undef COMPARE
+  if (!failed)
+    return;
 
-  return p;
+  /* Randomized, so that many clients do not reconnect in lockstep. */
+  ep->next_attempt =
+      cdtime() + (cdtime_t)((0.5 + 0.5 * cdrand_d()) * (double)ep->backoff);
+  ep->backoff *= 2;
+  if (ep->backoff > WA_MAX_RECONNECT_INTERVAL)
+    ep->backoff = WA_MAX_RECONNECT_INTERVAL;
 }
 
-/* wa_force_reconnect_check closes cb->sock_fd when it was open for longer
- * than cb->reconnect_interval. Must hold cb->send_lock when calling. */
+/* wa_force_reconnect_check closes connections that were open for longer than
+ * cb->reconnect_interval. Must hold cb->send_lock when calling. */
 static void wa_force_reconnect_check(struct wa_callback *cb) {
   if (cb->reconnect_interval == 0)
     return;
 
-  /* check if address changes if addr_timeout */
   cdtime_t now = cdtime();
-  if ((now - cb->last_reconnect_time) < cb->reconnect_interval)
-    return;
-
-  /* here we should close connection on next */
-  close(cb->sock_fd);
-  cb->sock_fd = -1;
-  cb->last_reconnect_time = now;
-  cb->reconnect_interval_reached = 1;
+  for (size_t i = 0; i < cb->endpoints_num; i++) {
+    struct wa_endpoint *ep = cb->endpoints + i;
+    if ((ep->sock_fd < 0) ||
+        ((now - ep->connect_time) < cb->reconnect_interval))
+      continue;
 
-  INFO("write_atsd plugin: Connection closed after %.3f seconds.",
-       CDTIME_T_TO_DOUBLE(now - cb->last_reconnect_time));
+    INFO("write_atsd plugin: Connection to %s:%s closed after %.3f seconds.",
+         ep->node, ep->service, CDTIME_T_TO_DOUBLE(now - ep->connect_time));
+    wa_endpoint_close(ep, /* failed = */ 0);
+  }
 }
 
 static void wa_reset_buffer(struct wa_callback *cb) {
-  memset(cb->send_buf, 0, sizeof(cb->send_buf));
-  cb->send_buf_free = sizeof(cb->send_buf);
+  cb->send_buf_free = cb->send_buf_size;
   cb->send_buf_fill = 0;
   cb->send_buf_init_time = cdtime();
 }
 
-static int wa_send_buffer(struct wa_callback *cb) {
-  ssize_t status;
+/* wa_next_datagram returns the length of the datagram starting at `data':
+ * as many whole commands as fit into `payload' bytes, or a single command
+ * that is larger than that on its own. */
+static size_t wa_next_datagram(const char *data, size_t len, size_t payload) {
+  if (len <= payload)
+    return len;
+
+  size_t end = payload;
+  while ((end > 0) && (data[end - 1] != '\n'))
+    end--;
+  if (end > 0)
+    return end;
+
+  const char *newline = memchr(data + payload, '\n', len - payload);
+  return (newline != NULL) ? (size_t)(newline - data) + 1 : len;
+}
 
-  if (cb->sock_fd < 0)
-    return -1;
+/* wa_send_datagrams sends `data' as a series of datagrams of at most
+ * Mtu - WA_UDP_HEADER_SIZE bytes, using sendmmsg() where available. The number
+ * of bytes sent is stored in `sent', also on failure. Must hold
+ * cb->send_lock. */
+static int wa_send_datagrams(struct wa_callback *cb, struct wa_endpoint *ep,
+                             const char *data, size_t len, size_t *sent) {
+  size_t payload = (size_t)(cb->mtu - WA_UDP_HEADER_SIZE);
+  size_t offset = 0;
+  size_t datagrams = 0;
+  int status = 0;
+
+  while (offset < len) {
+    cb->stats.sends++;
+#if HAVE_SENDMMSG
+    struct mmsghdr msgs[WA_UDP_BATCH_SIZE] = {{{0}}};
+    struct iovec iov[WA_UDP_BATCH_SIZE];
+    unsigned int msgs_num = 0;
+
+    for (size_t pos = offset; (msgs_num < WA_UDP_BATCH_SIZE) && (pos < len);
+         msgs_num++) {
+      iov[msgs_num].iov_base = (void *)(data + pos);
+      iov[msgs_num].iov_len = wa_next_datagram(data + pos, len - pos, payload);
+      msgs[msgs_num].msg_hdr.msg_iov = iov + msgs_num;
+      msgs[msgs_num].msg_hdr.msg_iovlen = 1;
+      pos += iov[msgs_num].iov_len;
+    }
 
-  status = swrite(cb->sock_fd, cb->send_buf, strlen(cb->send_buf));
-  if (status != 0) {
-    char errbuf[1024];
-    ERROR("write_atsd plugin: send failed with status %zi (%s)", status,
-          sstrerror(errno, errbuf, sizeof(errbuf)));
+    int n = sendmmsg(ep->sock_fd, msgs, msgs_num, /* flags = */ 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      status = -1;
+      break;
+    }
 
-    close(cb->sock_fd);
-    cb->sock_fd = -1;
-    return -1;
+    for (int i = 0; i < n; i++)
+      offset += iov[i].iov_len;
+    datagrams += (size_t)n;
+#else
+    size_t datagram_len =
+        wa_next_datagram(data + offset, len - offset, payload);
+    if (send(ep->sock_fd, data + offset, datagram_len, /* flags = */ 0) < 0) {
+      if (errno == EINTR)
+        continue;
+      status = -1;
+      break;
+    }
+
+    offset += datagram_len;
+    datagrams++;
+#endif
+  }
+
+  cb->udp_datagrams += datagrams;
+  cb->udp_bytes += offset;
+  DEBUG("write_atsd plugin: Sent %zu datagrams, %zu bytes to %s:%s.",
+        datagrams, offset, ep->node, ep->service);
+
+  *sent = offset;
+  return status;
+}
+
+/* wa_endpoint_resolve resolves the addresses of an endpoint unless the cached
+ * ones are still valid. A `resolve_time' of zero marks them as stale. When
+ * resolving fails, stale addresses are kept and used until it succeeds. */
+static int wa_endpoint_resolve(struct wa_callback *cb, struct wa_endpoint *ep,
+                               cdtime_t now) {
+  if ((ep->ai_list != NULL) && (ep->resolve_time != 0) &&
+      ((cb->resolve_interval == 0) ||
+       (now < ep->resolve_time + cb->resolve_interval)))
+    return 0;
+
+  struct addrinfo ai_hints = {.ai_family = AF_UNSPEC,
+                              .ai_flags = AI_ADDRCONFIG};
+
+  if (cb->udp)
+    ai_hints.ai_socktype = SOCK_DGRAM;
+  else
+    ai_hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo *ai_list;
+  int status = getaddrinfo(ep->node, ep->service, &ai_hints, &ai_list);
+  if (status != 0) {
+    c_complain(LOG_ERR, &ep->complaint,
+               "write_atsd plugin: getaddrinfo (%s, %s, %s) failed: %s",
+               ep->node, ep->service, cb->protocol, gai_strerror(status));
+    return (ep->ai_list != NULL) ? 0 : -1;
   }
 
+  if (ep->ai_list != NULL)
+    freeaddrinfo(ep->ai_list);
+  ep->ai_list = ai_list;
+  ep->resolve_time = now;
+
   return 0;
 }
 
-/* NOTE: You must hold cb->send_lock when calling this function! */
-static int wa_flush_nolock(cdtime_t timeout, struct wa_callback *cb) {
-  int status;
+/* wa_resolve_endpoints resolves the endpoints about to be connected, so that
+ * DNS lookups do not block while holding cb->send_lock. Only called by the
+ * sender thread. */
+static void wa_resolve_endpoints(struct wa_callback *cb) {
+  cdtime_t now = cdtime();
 
-  DEBUG("write_atsd plugin: wa_flush_nolock: timeout = %.3f; "
-        "send_buf_fill = %zu;",
-        CDTIME_T_TO_DOUBLE(timeout), cb->send_buf_fill);
+  for (size_t i = 0; i < cb->endpoints_num; i++) {
+    struct wa_endpoint *ep = cb->endpoints + i;
+    _Bool reconnect = (ep->sock_fd >= 0) && (cb->reconnect_interval != 0) &&
+                      ((now - ep->connect_time) >= cb->reconnect_interval);
 
-  /* timeout == 0  => flush unconditionally */
-  if (timeout > 0) {
-    cdtime_t now = cdtime();
-    if ((cb->send_buf_init_time + timeout) > now)
-      return 0;
+    if (((ep->sock_fd < 0) && (now >= ep->next_attempt)) || reconnect)
+      wa_endpoint_resolve(cb, ep, now);
   }
+}
 
-  if (cb->send_buf_fill == 0) {
-    cb->send_buf_init_time = cdtime();
-    return 0;
+/* wa_connect_timeout connects `fd' to `ai', giving up at `deadline'. The
+ * socket is in blocking mode again when it returns. */
+static int wa_connect_timeout(int fd, const struct addrinfo *ai,
+                              cdtime_t deadline) {
+  int flags = fcntl(fd, F_GETFL);
+  if ((flags < 0) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0))
+    return -1;
+
+  int status = connect(fd, ai->ai_addr, ai->ai_addrlen);
+  if ((status != 0) && (errno == EINPROGRESS)) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    do {
+      cdtime_t now = cdtime();
+      int timeout = (now < deadline) ? (int)CDTIME_T_TO_MS(deadline - now) : 0;
+      status = poll(&pfd, 1, timeout);
+    } while ((status < 0) && (errno == EINTR));
+
+    if (status == 0) {
+      errno = ETIMEDOUT;
+      status = -1;
+    } else if (status > 0) {
+      int error = 0;
+      socklen_t error_len = sizeof(error);
+      status = getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len);
+      if ((status == 0) && (error != 0)) {
+        errno = error;
+        status = -1;
+      }
+    }
   }
 
-  status = wa_send_buffer(cb);
-  wa_reset_buffer(cb);
+  if (status != 0)
+    return -1;
 
-  return status;
+  return fcntl(fd, F_SETFL, flags);
 }
 
-static int wa_callback_init(struct wa_callback *cb) {
-  int status;
-  char connerr[1024];
+/* wa_endpoint_connect connects an endpoint unless it is connected already.
+ * Connecting to all addresses of the endpoint takes at most ConnectTimeout.
+ * Returns EAGAIN while the endpoint is backing off after a failure. Must hold
+ * cb->send_lock. */
+static int wa_endpoint_connect(struct wa_callback *cb, struct wa_endpoint *ep) {
+  char connerr[1024] = "";
 
-  if (cb->sock_fd > 0)
+  if (ep->sock_fd >= 0)
     return 0;
 
-  /* Don't try to reconnect too often. By default, one reconnection attempt
-   * is made per second. */
   cdtime_t now = cdtime();
-  if ((now - cb->last_connect_time) < WA_MIN_RECONNECT_INTERVAL)
+  if (now < ep->next_attempt)
     return EAGAIN;
-  cb->last_connect_time = now;
-  cb->last_property_time = now;
 
-  struct addrinfo ai_hints = {.ai_family = AF_UNSPEC,
-                              .ai_flags = AI_ADDRCONFIG};
-
-  if (0 == strcasecmp("tcp", cb->protocol))
-    ai_hints.ai_socktype = SOCK_STREAM;
-  else
-    ai_hints.ai_socktype = SOCK_DGRAM;
-
-  struct addrinfo *ai_list;
-  status = getaddrinfo(cb->node, cb->service, &ai_hints, &ai_list);
-  if (status != 0) {
-    ERROR("write_atsd plugin: getaddrinfo (%s, %s, %s) failed: %s", cb->node,
-          cb->service, cb->protocol, gai_strerror(status));
+  if (wa_endpoint_resolve(cb, ep, now) != 0) {
+    wa_endpoint_close(ep, /* failed = */ 1);
+    cb->stats.connect_failures++;
     return -1;
   }
 
-  assert(ai_list != NULL);
-  for (struct addrinfo *ai_ptr = ai_list; ai_ptr != NULL;
+  cdtime_t deadline = now + cb->connect_timeout;
+  for (struct addrinfo *ai_ptr = ep->ai_list; ai_ptr != NULL;
        ai_ptr = ai_ptr->ai_next) {
-    cb->sock_fd =
+    ep->sock_fd =
         socket(ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol);
-    if (cb->sock_fd < 0) {
+    if (ep->sock_fd < 0) {
       char errbuf[1024];
       snprintf(connerr, sizeof(connerr), "failed to open socket: %s",
                sstrerror(errno, errbuf, sizeof(errbuf)));
       continue;
     }
 
-    set_sock_opts(cb->sock_fd);
+    set_sock_opts(ep->sock_fd);
 
-    status = connect(cb->sock_fd, ai_ptr->ai_addr, ai_ptr->ai_addrlen);
-    if (status != 0) {
+    if (wa_connect_timeout(ep->sock_fd, ai_ptr, deadline) != 0) {
       char errbuf[1024];
       snprintf(connerr, sizeof(connerr), "failed to connect to remote "
                                          "host: %s",
                sstrerror(errno, errbuf, sizeof(errbuf)));
-      close(cb->sock_fd);
-      cb->sock_fd = -1;
+      close(ep->sock_fd);
+      ep->sock_fd = -1;
+      if (cdtime() >= deadline)
+        break;
       continue;
     }
     break;
   }
 
-  freeaddrinfo(ai_list);
-
-  if (cb->sock_fd < 0) {
+  if (ep->sock_fd < 0) {
     if (connerr[0] == '\0')
       /* this should not happen but try to get a message anyway */
       sstrerror(errno, connerr, sizeof(connerr));
-    c_complain(LOG_ERR, &cb->init_complaint,
+    c_complain(LOG_ERR, &ep->complaint,
                "write_atsd plugin: Connecting to %s:%s via %s failed. "
                "The last error was: %s",
-               cb->node, cb->service, cb->protocol, connerr);
+               ep->node, ep->service, cb->protocol, connerr);
+    wa_endpoint_close(ep, /* failed = */ 1);
+    cb->stats.connect_failures++;
+
+    /* The addresses may have moved, look them up again next time. */
+    ep->resolve_time = 0;
     return -1;
-  } else {
-    c_release(LOG_INFO, &cb->init_complaint,
-              "write_atsd plugin: Successfully connected to %s:%s via %s.",
-              cb->node, cb->service, cb->protocol);
   }
 
-  /* wa_force_reconnect_check does not flush the buffer before closing a
-   * sending socket, so only call wa_reset_buffer() if the socket was closed
-   * for a different reason (tracked in cb->reconnect_interval_reached). */
-  if (!cb->reconnect_interval_reached || (cb->send_buf_free == 0))
-    wa_reset_buffer(cb);
-  else
-    cb->reconnect_interval_reached = 0;
+  /* A write blocking for longer than ConnectTimeout fails, so that a node
+   * which stopped reading does not stall the sender thread. */
+  if (!cb->udp) {
+    struct timeval tv = CDTIME_T_TO_TIMEVAL(cb->connect_timeout);
+    if (setsockopt(ep->sock_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) !=
+        0) {
+      char errbuf[1024];
+      WARNING("write_atsd plugin: setsockopt (SO_SNDTIMEO) failed: %s",
+              sstrerror(errno, errbuf, sizeof(errbuf)));
+    }
+  }
+
+  cb->stats.connects++;
+  if (cb->report_stats)
+    latency_counter_add(cb->stats.connect_latency, cdtime() - now);
+
+  c_release(LOG_INFO, &ep->complaint,
+            "write_atsd plugin: Successfully connected to %s:%s via %s.",
+            ep->node, ep->service, cb->protocol);
+  ep->connect_time = now;
+  ep->reused = 0;
 
   return 0;
 }
 
-static void wa_cb_free(struct wa_callback *cb) {
-  void *empty;
+/* wa_connect_any makes sure at least one endpoint is connected. Must hold
+ * cb->send_lock. */
+static int wa_connect_any(struct wa_callback *cb) {
+  for (size_t i = 0; i < cb->endpoints_num; i++)
+    if (cb->endpoints[i].sock_fd >= 0)
+      return 0;
 
-  if (cb == NULL)
-    return;
+  for (size_t i = 0; i < cb->endpoints_num; i++)
+    if (wa_endpoint_connect(cb, cb->endpoints + i) == 0)
+      return 0;
 
-  pthread_mutex_lock(&cb->send_lock);
+  return -1;
+}
 
-  wa_flush_nolock(/* timeout = */ 0, cb);
+/* wa_endpoint_pick returns the first endpoint, starting at `start', that is
+ * connected or can be connected, or -1 when none is. Must hold
+ * cb->send_lock. */
+static int wa_endpoint_pick(struct wa_callback *cb, size_t start) {
+  for (size_t k = 0; k < cb->endpoints_num; k++) {
+    size_t i = (start + k) % cb->endpoints_num;
+    if (wa_endpoint_connect(cb, cb->endpoints + i) == 0)
+      return (int)i;
+  }
 
-  if (cb->sock_fd >= 0) {
-    close(cb->sock_fd);
-    cb->sock_fd = -1;
+  return -1;
+}
+
+/* wa_http_send posts commands to an HTTP endpoint. A server may close an idle
+ * keep-alive connection at any time, so a request failing on a reused
+ * connection is retried once on a new one. Must hold cb->send_lock. */
+static int wa_http_send(struct wa_callback *cb, struct wa_endpoint *ep,
+                        const char *data, size_t len, size_t *sent) {
+  char host[1024];
+  snprintf(host, sizeof(host), "%s:%s", ep->node, ep->service);
+
+  _Bool keep_alive = 1;
+  int status = atsd_http_post(cb->http, ep->sock_fd, host, data, len,
+                              WA_HTTP_TIMEOUT, &keep_alive);
+  if ((status < 0) && ep->reused) {
+    wa_endpoint_close(ep, /* failed = */ 0);
+    if (wa_endpoint_connect(cb, ep) != 0)
+      return -1;
+    status = atsd_http_post(cb->http, ep->sock_fd, host, data, len,
+                            WA_HTTP_TIMEOUT, &keep_alive);
   }
 
-  sfree(cb->name);
-  sfree(cb->node);
-  sfree(cb->protocol);
-  sfree(cb->service);
-  sfree(cb->entity);
-  sfree(cb->prefix);
+  if (status < 0) {
+    char errbuf[1024];
+    ERROR("write_atsd plugin: Sending to %s:%s failed: %s", ep->node,
+          ep->service, sstrerror(errno, errbuf, sizeof(errbuf)));
+    wa_endpoint_close(ep, /* failed = */ 1);
+    return -1;
+  } else if ((status < 200) || (status >= 300)) {
+    ERROR("write_atsd plugin: %s:%s responded with HTTP status %d.",
+          ep->node, ep->service, status);
+    wa_endpoint_close(ep, /* failed = */ 1);
+    return -1;
+  }
+
+  *sent = len;
+  ep->reused = 1;
+  ep->backoff = WA_MIN_RECONNECT_INTERVAL;
+  if (!keep_alive)
+    wa_endpoint_close(ep, /* failed = */ 0);
 
-  atsd_key_t *atsd_stored_key;
-  atsd_value_t *atsd_stored_value;
-  if (cb->value_cache != NULL) {
-    while (c_avl_pick(cb->value_cache, (void *)&atsd_stored_key,
-                      (void *)&atsd_stored_value) == 0) {
-      sfree(atsd_stored_key);
-      sfree(atsd_stored_value);
+  return 0;
+}
+
+/* wa_writev writes all of `iov' to a stream socket, storing the number of
+ * bytes written in `sent', also on failure. Must hold cb->send_lock. */
+static int wa_writev(struct wa_callback *cb, int fd, const struct iovec *iov,
+                     int iovcnt, size_t *sent) {
+  struct iovec buf[iovcnt];
+  struct iovec *v = buf;
+
+  memcpy(buf, iov, sizeof(buf));
+  *sent = 0;
+
+  while (iovcnt > 0) {
+    cb->stats.sends++;
+    ssize_t n = writev(fd, v, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      /* SO_SNDTIMEO expired, the node stopped reading. */
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        errno = ETIMEDOUT;
+      return -1;
     }
-    c_avl_destroy(cb->value_cache);
-    cb->value_cache = NULL;
-  }
 
-  if (cb->metric_cache != NULL) {
-    while (c_avl_pick(cb->metric_cache, (void *)&atsd_stored_key, &empty) ==
-           0) {
-      sfree(atsd_stored_key);
+    *sent += (size_t)n;
+    while ((iovcnt > 0) && ((size_t)n >= v->iov_len)) {
+      n -= (ssize_t)v->iov_len;
+      v++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      v->iov_base = (char *)v->iov_base + n;
+      v->iov_len -= (size_t)n;
     }
-    c_avl_destroy(cb->metric_cache);
-    cb->metric_cache = NULL;
   }
 
-  struct wa_cache_s *cache, *next_cache;
-  cache = cb->wa_caches;
-  while (cache != NULL) {
-    next_cache = cache->next;
-    sfree(cache->name);
-    sfree(cache);
-    cache = next_cache;
+  return 0;
+}
+
+/* wa_iov_complete rounds `len' bytes at the start of `iov' down to the end of
+ * the last complete command, so that a command cut off by a failing endpoint is
+ * resent as a whole. */
+static size_t wa_iov_complete(const struct iovec *iov, int iovcnt,
+                              size_t len) {
+  size_t offset = 0;
+  size_t complete = 0;
+
+  for (int i = 0; (i < iovcnt) && (offset < len); i++) {
+    size_t n = iov[i].iov_len;
+    if (n > len - offset)
+      n = len - offset;
+
+    const char *base = iov[i].iov_base;
+    for (size_t j = n; j > 0; j--) {
+      if (base[j - 1] == '\n') {
+        complete = offset + j;
+        break;
+      }
+    }
+    offset += n;
   }
-  cb->wa_caches = NULL;
 
-  pthread_mutex_unlock(&cb->send_lock);
+  return complete;
+}
 
-  pthread_mutex_destroy(&cb->send_lock);
-  pthread_mutex_destroy(&cb->metric_cache_lock);
-  pthread_mutex_destroy(&cb->value_cache_lock);
+/* wa_metrics_delivered records the metric commands among the first `len' bytes
+ * of `iov', which have been delivered, so that their definitions are not sent
+ * again. Must hold cb->send_lock. */
+static void wa_metrics_delivered(struct wa_callback *cb,
+                                 const struct iovec *iov, int iovcnt,
+                                 size_t len) {
+  static const char prefix[] = "metric ";
+  const int prefix_len = (int)sizeof(prefix) - 1;
+  /* Bytes of `prefix' matched at the start of the current command, or -1 once
+   * it is known to be another command. */
+  int matched = 0;
+  uint64_t hash = FORMAT_ATSD_HASH_INIT;
+
+  if (cb->metrics == NULL)
+    return;
 
-  sfree(cb);
-}
+  /* A command may continue in the next iovec. */
+  for (int i = 0; (i < iovcnt) && (len > 0); i++) {
+    const char *p = iov[i].iov_base;
+    const char *end = p + ((iov[i].iov_len < len) ? iov[i].iov_len : len);
+    len -= (size_t)(end - p);
+
+    while (p < end) {
+      if ((matched >= 0) && (matched < prefix_len)) {
+        if (*p != prefix[matched]) {
+          matched = -1;
+          continue;
+        }
+        hash = format_atsd_hash(hash, p, 1);
+        matched++;
+        p++;
+        continue;
+      }
 
-static void wa_callback_free(void *cb) { wa_cb_free((struct wa_callback *)cb); }
+      const char *newline = memchr(p, '\n', (size_t)(end - p));
+      const char *next = (newline != NULL) ? newline + 1 : end;
+      if (matched == prefix_len)
+        hash = format_atsd_hash(hash, p, (size_t)(next - p));
+      p = next;
+
+      if (newline != NULL) {
+        if (matched == prefix_len)
+          atsd_metrics_add(cb->metrics, hash);
+        matched = 0;
+        hash = FORMAT_ATSD_HASH_INIT;
+      }
+    }
+  }
+}
 
-static int wa_send_message(char const *message, struct wa_callback *cb) {
+/* wa_endpoint_send sends whole commands to an endpoint and stores the number
+ * of bytes delivered in `sent'. Stream sockets are written with a single
+ * writev(), UDP and HTTP endpoints are only given one iovec. A failing
+ * endpoint is closed and backs off; `sent' then only counts the commands it
+ * received completely. Must hold cb->send_lock. */
+static int wa_endpoint_send(struct wa_callback *cb, struct wa_endpoint *ep,
+                            const struct iovec *iov, int iovcnt,
+                            size_t *sent) {
   int status;
+  cdtime_t start = cb->report_stats ? cdtime() : 0;
 
-  size_t message_len = strlen(message);
+  *sent = 0;
+  if (cb->http != NULL) {
+    assert(iovcnt == 1);
+    cb->stats.sends++;
+    status = wa_http_send(cb, ep, iov[0].iov_base, iov[0].iov_len, sent);
+  } else {
+    if (cb->udp) {
+      assert(iovcnt == 1);
+      status = wa_send_datagrams(cb, ep, iov[0].iov_base, iov[0].iov_len, sent);
+    } else {
+      /* Published so that wa_sender_stop() can interrupt the write. */
+      pthread_mutex_lock(&cb->spool_lock);
+      cb->send_fd = ep->sock_fd;
+      pthread_mutex_unlock(&cb->spool_lock);
 
-  pthread_mutex_lock(&cb->send_lock);
+      status = wa_writev(cb, ep->sock_fd, iov, iovcnt, sent);
 
-  wa_force_reconnect_check(cb);
+      pthread_mutex_lock(&cb->spool_lock);
+      cb->send_fd = -1;
+      pthread_mutex_unlock(&cb->spool_lock);
+    }
 
-  if (cb->sock_fd < 0) {
-    status = wa_callback_init(cb);
     if (status != 0) {
-      /* An error message has already been printed. */
-      pthread_mutex_unlock(&cb->send_lock);
-      return -1;
-    }
+      char errbuf[1024];
+      ERROR("write_atsd plugin: Sending to %s:%s failed: %s", ep->node,
+            ep->service, sstrerror(errno, errbuf, sizeof(errbuf)));
+      wa_endpoint_close(ep, /* failed = */ 1);
+    } else
+      ep->backoff = WA_MIN_RECONNECT_INTERVAL;
   }
 
-  status = wa_flush_nolock(/* timeout = */ 0, cb);
+  cb->stats.bytes_sent += *sent;
   if (status != 0) {
-    pthread_mutex_unlock(&cb->send_lock);
-    return status;
+    cb->stats.send_failures++;
+    *sent = wa_iov_complete(iov, iovcnt, *sent);
   }
+  wa_metrics_delivered(cb, iov, iovcnt, *sent);
+  if (cb->report_stats)
+    latency_counter_add(cb->stats.send_latency, cdtime() - start);
 
-  /* Assert that we have enough space for this message. */
-  assert(message_len < cb->send_buf_free);
-
-  /* `message_len + 1' because `message_len' does not include the
-   * trailing null byte. Neither does `send_buffer_fill'. */
-  memcpy(cb->send_buf + cb->send_buf_fill, message, message_len + 1);
-  cb->send_buf_fill += message_len;
-  cb->send_buf_free -= message_len;
-
-  DEBUG("write_atsd plugin: [%s]:%s (%s) buf %zu/%zu (%.1f %%) \"%s\"",
-        cb->node, cb->service, cb->protocol, cb->send_buf_fill,
-        sizeof(cb->send_buf),
-        100.0 * ((double)cb->send_buf_fill) / ((double)sizeof(cb->send_buf)),
-        message);
+  return (status == 0) ? 0 : -1;
+}
 
-  pthread_mutex_unlock(&cb->send_lock);
+/* wa_entity_hash hashes the entity of the command starting at `line' (FNV-1a),
+ * so that all series of an entity go to the same endpoint. Commands without an
+ * entity, such as metric commands, hash like an empty entity. */
+static uint32_t wa_entity_hash(const char *line, const char *end) {
+  uint32_t hash = 2166136261U;
+
+  const char *p = memchr(line, ' ', (size_t)(end - line));
+  if ((p == NULL) || (end - p < 4) || (memcmp(p, " e:\"", 4) != 0))
+    return hash;
+
+  /* Quotes within the entity are doubled. */
+  for (p += 4; p < end; p++) {
+    if (*p == '"') {
+      if ((p + 1 >= end) || (p[1] != '"'))
+        break;
+      p++;
+    }
+    hash ^= (unsigned char)*p;
+    hash *= 16777619U;
+  }
 
-  return 0;
+  return hash;
 }
 
-static int wa_update_property(const value_list_t *vl, const char *entity,
-                              struct wa_callback *cb) {
-  int ret;
-  char command[1024];
-  char escape_buffer[6 * DATA_MAX_NAME_LEN];
-
-  cdtime_t now = cdtime();
-  size_t written = 0;
-  if ((now - cb->last_property_time) > WA_PROPERTY_INTERVAL) {
-    cb->last_property_time = now;
-
-    written += snprintf(
-        command, sizeof(command),
-        "property e:\"%s\" ms:%" PRIu64 " t:collectd-atsd v:host=\"%s\"",
-        escape_atsd_string(escape_buffer, entity, sizeof escape_buffer),
-        CDTIME_T_TO_MS(vl->time),
-        escape_atsd_string(escape_buffer, vl->host, sizeof escape_buffer));
-
-    struct utsname uts_buf;
-    ret = uname(&uts_buf);
-    if (!ret) {
-      escape_atsd_string(uts_buf.sysname, uts_buf.sysname,
-                         sizeof(uts_buf.sysname));
-      escape_atsd_string(uts_buf.nodename, uts_buf.nodename,
-                         sizeof(uts_buf.nodename));
-      escape_atsd_string(uts_buf.release, uts_buf.release,
-                         sizeof(uts_buf.release));
-      escape_atsd_string(uts_buf.version, uts_buf.version,
-                         sizeof(uts_buf.version));
-      escape_atsd_string(uts_buf.machine, uts_buf.machine,
-                         sizeof(uts_buf.machine));
-      written += snprintf(command + written, sizeof(command) - written,
-                          " v:OperatingSystem=\"%s\""
-                          " v:Node=\"%s\""
-                          " v:Kernel_Release_Version=\"%s\""
-                          " v:OS_Version=\"%s\""
-                          " v:Hardware=\"%s\"",
-                          uts_buf.sysname, uts_buf.nodename, uts_buf.release,
-                          uts_buf.version, uts_buf.machine);
-    }
-
-    snprintf(command + written, sizeof(command) - written, "\n");
-    return wa_send_message(command, cb);
+/* wa_entity_endpoint returns the endpoint of an entity hash: the endpoint the
+ * hash maps to or, while that one is unavailable, the next available one. */
+static int wa_entity_endpoint(struct wa_callback *cb, uint32_t hash,
+                              cdtime_t now) {
+  for (size_t k = 0; k < cb->endpoints_num; k++) {
+    size_t i = (hash + k) % cb->endpoints_num;
+    struct wa_endpoint *ep = cb->endpoints + i;
+    if ((ep->sock_fd >= 0) || (now >= ep->next_attempt))
+      return (int)i;
   }
-  return 0;
-}
 
-static int check_cache_value(atsd_key_t *ak, atsd_value_t *av,
-                             struct wa_callback *cb, _Bool *update_series,
-                             _Bool *update_metrics) {
-  int status;
+  return -1;
+}
 
-  *update_series = true;
-  *update_metrics = false;
-
-#define COPY_KEY(dst, src)                                                     \
-  do {                                                                         \
-    strncpy(dst->host, src->host, sizeof(dst->host));                          \
-    strncpy(dst->plugin, src->plugin, sizeof(dst->plugin));                    \
-    strncpy(dst->plugin_instance, src->plugin_instance,                        \
-            sizeof(dst->plugin_instance));                                     \
-    strncpy(dst->type, src->type, sizeof(dst->type));                          \
-    strncpy(dst->type_instance, src->type_instance,                            \
-            sizeof(dst->type_instance));                                       \
-    strncpy(dst->data_source, src->data_source, sizeof(dst->data_source));     \
-  } while (0)
-
-  pthread_mutex_lock(&cb->metric_cache_lock);
-  status = c_avl_get(cb->metric_cache, ak, NULL);
-  pthread_mutex_unlock(&cb->metric_cache_lock);
-
-  atsd_key_t *atsd_stored_key;
-  atsd_value_t *atsd_stored_value;
-  if (status != 0) {
-    atsd_stored_key = (atsd_key_t *)malloc(sizeof(atsd_key_t));
-    if (atsd_stored_key == NULL) {
-      ERROR("write_atsd plugin: malloc failed.");
-      return -1;
-    }
-    COPY_KEY(atsd_stored_key, ak);
+/* wa_send_by_entity delivers send_buf endpoint by endpoint: the commands of
+ * one endpoint are gathered in cb->route_buf, the others are compacted at the
+ * front of send_buf. When an endpoint fails, its commands are routed to the
+ * next endpoint in the following round. Returns the number of bytes left in
+ * send_buf. Must hold cb->send_lock. */
+static size_t wa_send_by_entity(struct wa_callback *cb) {
+  _Bool progress = 1;
+
+  while ((cb->send_buf_fill > 0) && progress) {
+    progress = 0;
+
+    for (size_t i = 0; (i < cb->endpoints_num) && (cb->send_buf_fill > 0);
+         i++) {
+      struct wa_endpoint *ep = cb->endpoints + i;
+      cdtime_t now = cdtime();
+      if ((ep->sock_fd < 0) && (now < ep->next_attempt))
+        continue;
+
+      char *end = cb->send_buf + cb->send_buf_fill;
+      size_t route_fill = 0;
+      size_t keep_fill = 0;
+      for (char *line = cb->send_buf; line < end;) {
+        char *newline = memchr(line, '\n', (size_t)(end - line));
+        size_t line_len = (newline != NULL) ? (size_t)(newline - line) + 1
+                                            : (size_t)(end - line);
+
+        uint32_t hash = wa_entity_hash(line, line + line_len);
+        if (wa_entity_endpoint(cb, hash, now) == (int)i) {
+          memcpy(cb->route_buf + route_fill, line, line_len);
+          route_fill += line_len;
+        } else {
+          memmove(cb->send_buf + keep_fill, line, line_len);
+          keep_fill += line_len;
+        }
+        line += line_len;
+      }
 
-    pthread_mutex_lock(&cb->metric_cache_lock);
-    status = c_avl_insert(cb->metric_cache, atsd_stored_key, NULL);
-    pthread_mutex_unlock(&cb->metric_cache_lock);
+      /* Every attempt either delivers the commands or takes the endpoint out
+       * of rotation, so the rounds end. */
+      size_t sent = 0;
+      if (route_fill > 0) {
+        progress = 1;
+        struct iovec iov = {.iov_base = cb->route_buf, .iov_len = route_fill};
+        if (wa_endpoint_connect(cb, ep) == 0)
+          wa_endpoint_send(cb, ep, &iov, 1, &sent);
+      }
 
-    *update_metrics = true;
+      /* Whatever was not delivered goes back to send_buf. */
+      memcpy(cb->send_buf + keep_fill, cb->route_buf + sent, route_fill - sent);
+      cb->send_buf_fill = keep_fill + route_fill - sent;
+    }
   }
 
-  struct wa_cache_s *cache;
-  for (cache = cb->wa_caches; cache != NULL; cache = cache->next)
-    if (strcasecmp(ak->plugin, cache->name) == 0)
-      break;
-  if (cache == NULL)
-    return 0;
-
-  pthread_mutex_lock(&cb->value_cache_lock);
-  status = c_avl_get(cb->value_cache, ak, (void *)&atsd_stored_value);
-  pthread_mutex_unlock(&cb->value_cache_lock);
+  return cb->send_buf_fill;
+}
 
-  if (status == 0) {
-    /* The new value is older than that is stored in cache,
-     * just send it without updating the cache
-     */
-    if (atsd_stored_value->time > av->time) {
-      *update_series = true;
-      return 0;
-    }
+/* wa_send_iov delivers the commands in `iov' according to the Failover or
+ * RoundRobin strategy, moving on to the next endpoint when one fails. Returns
+ * the number of bytes delivered. Must hold cb->send_lock. */
+static size_t wa_send_iov(struct wa_callback *cb, const struct iovec *iov,
+                          int iovcnt) {
+  struct iovec buf[iovcnt];
+  struct iovec *v = buf;
+  size_t offset = 0;
+
+  memcpy(buf, iov, sizeof(buf));
+
+  while (iovcnt > 0) {
+    size_t start = (cb->balance == WA_BALANCE_ROUND_ROBIN) ? cb->next_endpoint
+                                                           : 0;
+    int i = wa_endpoint_pick(cb, start);
+    if (i < 0)
+      break;
 
-    double cur_value = av->value;
-    double stored_value = atsd_stored_value->value;
-    double diff = fabs(cur_value - stored_value);
+    size_t sent = 0;
+    if (wa_endpoint_send(cb, cb->endpoints + i, v, iovcnt, &sent) == 0)
+      cb->next_endpoint = ((size_t)i + 1) % cb->endpoints_num;
+    offset += sent;
 
-    if ((av->time - atsd_stored_value->time >= cache->interval * 1000) ||
-        (diff > (cache->threshold) * stored_value / 100)) {
-      atsd_stored_value->value = av->value;
-      atsd_stored_value->time = av->time;
-    } else {
-      *update_series = false;
+    while ((iovcnt > 0) && (sent >= v->iov_len)) {
+      sent -= v->iov_len;
+      v++;
+      iovcnt--;
     }
-  } else {
-    atsd_stored_key = (atsd_key_t *)malloc(sizeof(atsd_key_t));
-    if (atsd_stored_key == NULL) {
-      ERROR("write_atsd plugin: malloc failed.");
-      return -1;
+    if (iovcnt > 0) {
+      v->iov_base = (char *)v->iov_base + sent;
+      v->iov_len -= sent;
     }
-    COPY_KEY(atsd_stored_key, ak);
+  }
 
-    atsd_stored_value = (atsd_value_t *)malloc(sizeof(atsd_value_t));
-    if (atsd_stored_value == NULL) {
-      ERROR("write_atsd plugin: malloc failed.");
-      free(atsd_stored_key);
-      return -1;
-    }
+  return offset;
+}
 
-    atsd_stored_value->value = av->value;
-    atsd_stored_value->time = av->time;
+/* wa_send_buffer delivers send_buf according to the Balance strategy. On
+ * failure, the commands not delivered are left in send_buf. Must hold
+ * cb->send_lock. */
+static int wa_send_buffer(struct wa_callback *cb) {
+  if (cb->balance == WA_BALANCE_ENTITY) {
+    size_t left = wa_send_by_entity(cb);
+    cb->send_buf_free = cb->send_buf_size - cb->send_buf_fill;
+    return (left == 0) ? 0 : -1;
+  }
 
-    pthread_mutex_lock(&cb->value_cache_lock);
-    status = c_avl_insert(cb->value_cache, atsd_stored_key, atsd_stored_value);
-    pthread_mutex_unlock(&cb->value_cache_lock);
+  struct iovec iov = {.iov_base = cb->send_buf, .iov_len = cb->send_buf_fill};
+  size_t offset = wa_send_iov(cb, &iov, 1);
 
-    if (status != 0) {
-      ERROR("utils_vl_lookup: c_avl_insert(\"%s\") failed with status %i.",
-            ak->plugin, status);
-      return -1;
-    }
-  }
-#undef COPY_KEY
+  memmove(cb->send_buf, cb->send_buf + offset, cb->send_buf_fill - offset);
+  cb->send_buf_fill -= offset;
+  cb->send_buf_free += offset;
 
-  return 0;
+  return (cb->send_buf_fill == 0) ? 0 : -1;
 }
 
-static int wa_write_messages(const data_set_t *ds, const value_list_t *vl,
-                             struct wa_callback *cb) {
+/* NOTE: You must hold cb->send_lock when calling this function! */
+static int wa_flush_nolock(cdtime_t timeout, struct wa_callback *cb) {
   int status;
 
-  char commands[1024];
+  DEBUG("write_atsd plugin: wa_flush_nolock: timeout = %.3f; "
+        "send_buf_fill = %zu;",
+        CDTIME_T_TO_DOUBLE(timeout), cb->send_buf_fill);
+
+  /* timeout == 0  => flush unconditionally */
+  if (timeout > 0) {
+    cdtime_t now = cdtime();
+    if ((cb->send_buf_init_time + timeout) > now)
+      return 0;
+  }
+
+  if (cb->send_buf_fill == 0) {
+    cb->send_buf_init_time = cdtime();
+    return 0;
+  }
+
+  status = wa_send_buffer(cb);
+  if ((status != 0) && (cb->disk_spool != NULL))
+    atsd_spool_append(cb->disk_spool, cb->send_buf, cb->send_buf_fill);
+  wa_reset_buffer(cb);
+
+  return status;
+}
+
+/* wa_spool_drop_oldest discards whole commands from the head of the spool
+ * until at least `need' bytes are free. Commands being sent directly from the
+ * spool are not discarded, the oldest ones behind them are. Must hold
+ * cb->spool_lock. */
+static void wa_spool_drop_oldest(struct wa_callback *cb, size_t need) {
+  size_t keep = cb->spool_sending;
+  size_t drop = 0;
+
+  while ((cb->spool_fill - drop > keep) &&
+         (cb->spool_size - (cb->spool_fill - drop) < need)) {
+    char c;
+    do {
+      c = cb->spool[(cb->spool_head + keep + drop) % cb->spool_size];
+      drop++;
+    } while ((c != '\n') && (keep + drop < cb->spool_fill));
+    cb->spool_dropped++;
+    cb->stats.commands_dropped++;
+  }
+
+  if (drop == 0)
+    return;
+
+  /* The commands in flight stay where they are, the newer ones are moved
+   * back to close the gap. */
+  size_t dst = (cb->spool_head + keep) % cb->spool_size;
+  size_t src = (dst + drop) % cb->spool_size;
+  size_t move = cb->spool_fill - keep - drop;
+  if (keep == 0)
+    cb->spool_head = src;
+  else {
+    while (move > 0) {
+      size_t n = move;
+      if (n > cb->spool_size - src)
+        n = cb->spool_size - src;
+      if (n > cb->spool_size - dst)
+        n = cb->spool_size - dst;
+      memmove(cb->spool + dst, cb->spool + src, n);
+      src = (src + n) % cb->spool_size;
+      dst = (dst + n) % cb->spool_size;
+      move -= n;
+    }
+  }
+  cb->spool_fill -= drop;
+}
+
+/* wa_spool_drop counts the commands in `data' as dropped. Must hold
+ * cb->spool_lock. */
+static void wa_spool_drop(struct wa_callback *cb, const char *data,
+                          size_t len) {
+  for (const char *end = data + len;
+       (data = memchr(data, '\n', (size_t)(end - data))) != NULL; data++) {
+    cb->spool_dropped++;
+    cb->stats.commands_dropped++;
+  }
+}
+
+/* wa_spool_put appends newline terminated commands to the spool, applying the
+ * configured drop policy to the commands that do not fit. Must hold
+ * cb->spool_lock. */
+static int wa_spool_put(struct wa_callback *cb, char const *data, size_t len) {
+  int status = 0;
+
+  /* Of more commands than the whole spool holds, only the newest can be
+   * kept. */
+  if ((len > cb->spool_size) && (cb->spool_policy == WA_SPOOL_DROP_OLDEST)) {
+    /* `start' is past `data', and `data' ends in a newline, so this stops at
+     * the end at the latest. */
+    const char *start = data + len - cb->spool_size;
+    while (start[-1] != '\n')
+      start++;
+    wa_spool_drop(cb, data, (size_t)(start - data));
+    len -= (size_t)(start - data);
+    data = start;
+    status = -1;
+  }
+
+  if (cb->spool_policy == WA_SPOOL_DROP_OLDEST)
+    wa_spool_drop_oldest(cb, len);
+
+  /* What still does not fit is dropped from the end. */
+  if (cb->spool_size - cb->spool_fill < len) {
+    size_t keep = cb->spool_size - cb->spool_fill;
+    while ((keep > 0) && (data[keep - 1] != '\n'))
+      keep--;
+    wa_spool_drop(cb, data + keep, len - keep);
+    len = keep;
+    status = -1;
+  }
+
+  if (len == 0)
+    return status;
+
+  if (cb->spool_fill == 0)
+    cb->spool_first_time = cdtime();
+
+  size_t tail = (cb->spool_head + cb->spool_fill) % cb->spool_size;
+  size_t first = cb->spool_size - tail;
+  if (first > len)
+    first = len;
+
+  memcpy(cb->spool + tail, data, first);
+  memcpy(cb->spool, data + first, len - first);
+  cb->spool_fill += len;
+
+  return status;
+}
+
+/* wa_spool_peek describes complete commands, at most `max_len' bytes, at the
+ * head of the spool in `iov' and marks them as being sent, so that they are
+ * not dropped. Returns the number of iovecs used. Must hold cb->spool_lock. */
+static int wa_spool_peek(struct wa_callback *cb, struct iovec iov[2],
+                         size_t max_len) {
+  size_t len = cb->spool_fill;
+  if (len > max_len)
+    len = max_len;
+
+  /* Only hand out whole commands, the rest stays for the next round. */
+  if (len < cb->spool_fill) {
+    size_t complete = len;
+    while ((complete > 0) &&
+           (cb->spool[(cb->spool_head + complete - 1) % cb->spool_size] !=
+            '\n'))
+      complete--;
+    if (complete > 0)
+      len = complete;
+  }
+
+  size_t first = cb->spool_size - cb->spool_head;
+  if (first > len)
+    first = len;
+
+  iov[0] = (struct iovec){.iov_base = cb->spool + cb->spool_head,
+                          .iov_len = first};
+  iov[1] = (struct iovec){.iov_base = cb->spool, .iov_len = len - first};
+  cb->spool_sending = len;
+
+  return (len > first) ? 2 : 1;
+}
+
+/* wa_spool_consume removes `len' bytes, which end on a command boundary, from
+ * the head of the spool and ends sending from it. Must hold cb->spool_lock. */
+static void wa_spool_consume(struct wa_callback *cb, size_t len) {
+  cb->spool_head = (cb->spool_head + len) % cb->spool_size;
+  cb->spool_fill -= len;
+  cb->spool_sending = 0;
+}
+
+/* wa_spool_take moves complete commands, at most `buffer_len' bytes, from the
+ * head of the spool into `buffer'. Returns the number of bytes moved. Must hold
+ * cb->spool_lock. */
+static size_t wa_spool_take(struct wa_callback *cb, char *buffer,
+                            size_t buffer_len) {
+  struct iovec iov[2];
+  int iovcnt = wa_spool_peek(cb, iov, buffer_len);
+
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    memcpy(buffer + len, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+
+  wa_spool_consume(cb, len);
+  return len;
+}
+
+/* wa_spool_to_disk moves the memory spool to the disk spool while the node is
+ * unreachable. Must hold cb->spool_lock, which is released during disk I/O. */
+static void wa_spool_to_disk(struct wa_callback *cb) {
+  while (cb->spool_fill > 0) {
+    size_t len =
+        wa_spool_take(cb, cb->disk_spool_buf, WA_DISK_SPOOL_CHUNK_SIZE);
+    pthread_mutex_unlock(&cb->spool_lock);
+
+    atsd_spool_append(cb->disk_spool, cb->disk_spool_buf, len);
+
+    pthread_mutex_lock(&cb->spool_lock);
+    cb->disk_spool_bytes = atsd_spool_size(cb->disk_spool);
+  }
+}
+
+/* wa_disk_spool_replay sends the oldest chunk of the disk spool. The chunk is
+ * only removed from the disk spool once it has been delivered; otherwise it
+ * stays at the head and is replayed again later. The replay rate is limited to
+ * cb->disk_spool_replay_rate bytes per second. Must hold cb->send_lock. */
+static int wa_disk_spool_replay(struct wa_callback *cb) {
+  if (cb->send_buf_fill > 0) {
+    int status = wa_flush_nolock(/* timeout = */ 0, cb);
+    if (status != 0)
+      return status;
+  }
+
+  ssize_t len =
+      atsd_spool_read(cb->disk_spool, cb->send_buf, cb->send_buf_free);
+  if (len <= 0)
+    return (int)len;
+
+  cb->send_buf_fill = (size_t)len;
+  cb->send_buf_free -= (size_t)len;
+
+  if (cb->disk_spool_replay_rate > 0)
+    cb->disk_spool_replay_next =
+        cdtime() +
+        DOUBLE_TO_CDTIME_T((double)len / (double)cb->disk_spool_replay_rate);
+
+  int status = wa_send_buffer(cb);
+
+  /* What is left in send_buf is the tail of the chunk, except with the Entity
+   * strategy, which mixes up the order. Its delivered commands are then
+   * replayed again, a repeated sample overwrites itself. */
+  size_t delivered = (size_t)len - cb->send_buf_fill;
+  if ((cb->balance == WA_BALANCE_ENTITY) && (cb->send_buf_fill > 0))
+    delivered = 0;
+  atsd_spool_commit(cb->disk_spool, delivered);
+  wa_reset_buffer(cb);
+
+  return status;
+}
+
+/* wa_state_path returns the path of the node's directory below BaseDir, the
+ * daemon's working directory, or of `file' in that directory. */
+static void wa_state_path(struct wa_callback *cb, char *buffer,
+                          size_t buffer_size, const char *file) {
+  snprintf(buffer, buffer_size, "write_atsd/%s",
+           (cb->name != NULL) ? cb->name : cb->node);
+  for (char *c = buffer + strlen("write_atsd/"); *c != '\0'; c++)
+    if (*c == '/')
+      *c = '_';
+
+  if (file != NULL) {
+    size_t len = strlen(buffer);
+    snprintf(buffer + len, buffer_size - len, "/%s", file);
+  }
+}
+
+static int wa_disk_spool_open(struct wa_callback *cb) {
+  char dir[PATH_MAX];
+
+  wa_state_path(cb, dir, sizeof(dir), /* file = */ NULL);
+
+  cb->disk_spool_buf = malloc(WA_DISK_SPOOL_CHUNK_SIZE);
+  if (cb->disk_spool_buf == NULL) {
+    ERROR("write_atsd plugin: malloc failed.");
+    return -1;
+  }
+
+  cb->disk_spool = atsd_spool_open(dir, (size_t)cb->disk_spool_size,
+                                   (size_t)cb->disk_spool_segment_size);
+  if (cb->disk_spool == NULL) {
+    ERROR("write_atsd plugin: Opening disk spool %s failed.", dir);
+    sfree(cb->disk_spool_buf);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* wa_spool_direct returns true if commands can be sent without copying them
+ * into send_buf first: over TCP, unless they are routed by entity. Must hold
+ * cb->send_lock. */
+static _Bool wa_spool_direct(struct wa_callback *cb) {
+  return !cb->udp && (cb->http == NULL) &&
+         (cb->balance != WA_BALANCE_ENTITY) && (cb->send_buf_fill == 0);
+}
+
+/* wa_next_attempt returns when the first endpoint backing off may be connected
+ * again. Only called by the sender thread. */
+static cdtime_t wa_next_attempt(struct wa_callback *cb) {
+  cdtime_t next = 0;
+
+  for (size_t i = 0; i < cb->endpoints_num; i++)
+    if ((next == 0) || (cb->endpoints[i].next_attempt < next))
+      next = cb->endpoints[i].next_attempt;
+
+  return next;
+}
+
+static void *wa_sender_thread(void *arg) {
+  struct wa_callback *cb = arg;
+
+  /* Opened here rather than during configuration, because the daemon changes
+   * into BaseDir only after reading the configuration. */
+  if (cb->disk_spool_enabled && (wa_disk_spool_open(cb) == 0)) {
+    pthread_mutex_lock(&cb->spool_lock);
+    cb->disk_spool_bytes = atsd_spool_size(cb->disk_spool);
+    pthread_mutex_unlock(&cb->spool_lock);
+  }
+
+  pthread_mutex_lock(&cb->spool_lock);
+  while (cb->sender_loop || (cb->spool_fill > 0)) {
+    cdtime_t now = cdtime();
+
+    if (cb->spool_fill == 0)
+      cb->flush_requested = 0;
+
+    /* Send once a buffer can be filled, the oldest command has waited for
+     * FlushInterval, or a flush has been requested. */
+    _Bool send = (cb->spool_fill > 0) &&
+                 (!cb->sender_loop || cb->flush_requested ||
+                  (cb->spool_fill >= cb->send_buf_size) ||
+                  (now >= cb->spool_first_time + cb->flush_interval));
+    _Bool replay = cb->sender_loop && (cb->disk_spool_bytes > 0) &&
+                   (now >= cb->disk_spool_replay_next);
+
+    if (!send && !replay) {
+      cdtime_t wakeup = 0;
+      if (cb->spool_fill > 0)
+        wakeup = cb->spool_first_time + cb->flush_interval;
+      if ((cb->disk_spool_bytes > 0) &&
+          ((wakeup == 0) || (cb->disk_spool_replay_next < wakeup)))
+        wakeup = cb->disk_spool_replay_next;
+
+      if (wakeup == 0) {
+        pthread_cond_wait(&cb->spool_cond, &cb->spool_lock);
+      } else {
+        struct timespec ts = CDTIME_T_TO_TIMESPEC(wakeup);
+        pthread_cond_timedwait(&cb->spool_cond, &cb->spool_lock, &ts);
+      }
+      continue;
+    }
+
+    if (cb->spool_dropped > 0) {
+      c_complain(LOG_WARNING, &cb->spool_complaint,
+                 "write_atsd plugin: Spool of %s:%s is full, %" PRIu64
+                 " commands dropped.",
+                 cb->node, cb->service, cb->spool_dropped);
+      cb->spool_dropped = 0;
+    }
+
+    /* Commands are delivered in the order they were written: while older
+     * ones wait in the disk spool, new ones are queued behind them. */
+    if (send && (cb->disk_spool != NULL) && (cb->disk_spool_bytes > 0)) {
+      wa_spool_to_disk(cb);
+      continue;
+    }
+
+    pthread_mutex_unlock(&cb->spool_lock);
+
+    wa_resolve_endpoints(cb);
+
+    wa_send_lock(cb);
+    wa_force_reconnect_check(cb);
+    int status = wa_connect_any(cb);
+    wa_send_unlock(cb);
+
+    pthread_mutex_lock(&cb->spool_lock);
+
+    if (status != 0) {
+      /* Keep the commands spooled while no endpoint is reachable. Without a
+       * disk spool they are lost when shutting down. */
+      if (cb->disk_spool != NULL)
+        wa_spool_to_disk(cb);
+      else if (!cb->sender_loop) {
+        WARNING("write_atsd plugin: Discarding %zu spooled bytes for %s:%s.",
+                cb->spool_fill, cb->node, cb->service);
+        cb->spool_head = 0;
+        cb->spool_fill = 0;
+      }
+
+      if (!cb->sender_loop)
+        break;
+
+      struct timespec ts = CDTIME_T_TO_TIMESPEC(wa_next_attempt(cb));
+      pthread_cond_timedwait(&cb->spool_cond, &cb->spool_lock, &ts);
+      continue;
+    }
+
+    if (!send) {
+      pthread_mutex_unlock(&cb->spool_lock);
+      wa_send_lock(cb);
+      wa_disk_spool_replay(cb);
+      wa_send_unlock(cb);
+      pthread_mutex_lock(&cb->spool_lock);
+
+      cb->disk_spool_bytes = atsd_spool_size(cb->disk_spool);
+      continue;
+    }
+
+    wa_send_lock(cb);
+
+    /* Stream sockets are written straight from the spool. Commands which
+     * could not be sent stay spooled. */
+    if (wa_spool_direct(cb)) {
+      struct iovec iov[2];
+      int iovcnt = wa_spool_peek(cb, iov, cb->send_buf_size);
+      pthread_mutex_unlock(&cb->spool_lock);
+
+      size_t sent = wa_send_iov(cb, iov, iovcnt);
+      wa_send_unlock(cb);
+
+      pthread_mutex_lock(&cb->spool_lock);
+      wa_spool_consume(cb, sent);
+      continue;
+    }
+
+    size_t len = wa_spool_take(cb, cb->send_buf + cb->send_buf_fill,
+                               cb->send_buf_free);
+    pthread_mutex_unlock(&cb->spool_lock);
+
+    cb->send_buf_fill += len;
+    cb->send_buf_free -= len;
+
+    DEBUG("write_atsd plugin: [%s]:%s (%s) buf %zu/%zu (%.1f %%)", cb->node,
+          cb->service, cb->protocol, cb->send_buf_fill, cb->send_buf_size,
+          100.0 * ((double)cb->send_buf_fill) / ((double)cb->send_buf_size));
+
+    wa_flush_nolock(/* timeout = */ 0, cb);
+    wa_send_unlock(cb);
+
+    pthread_mutex_lock(&cb->spool_lock);
+    if (cb->disk_spool != NULL)
+      cb->disk_spool_bytes = atsd_spool_size(cb->disk_spool);
+  }
+  cb->sender_done = 1;
+  pthread_cond_broadcast(&cb->spool_cond);
+  pthread_mutex_unlock(&cb->spool_lock);
+
+  return (void *)0;
+}
+
+/* Must hold cb->spool_lock. The sender thread is started lazily, because
+ * threads created during configuration would not survive daemonizing. */
+static int wa_sender_start(struct wa_callback *cb) {
+  if (cb->sender_running)
+    return 0;
+
+  cb->sender_loop = 1;
+  cb->sender_done = 0;
+  int status = plugin_thread_create(&cb->sender_thread, /* attr = */ NULL,
+                                    wa_sender_thread, cb, "write_atsd send");
+  if (status != 0) {
+    ERROR("write_atsd plugin: Starting sender thread failed: %s",
+          STRERROR(status));
+    cb->sender_loop = 0;
+    return -1;
+  }
+
+  cb->sender_running = 1;
+  return 0;
+}
+
+static void wa_sender_stop(struct wa_callback *cb) {
+  pthread_mutex_lock(&cb->spool_lock);
+  if (!cb->sender_running) {
+    pthread_mutex_unlock(&cb->spool_lock);
+    return;
+  }
+  cb->sender_loop = 0;
+  pthread_cond_broadcast(&cb->spool_cond);
+
+  /* The sender thread delivers what is spooled before it exits. A write to a
+   * node that stopped reading is interrupted after ConnectTimeout, so that
+   * shutting down does not hang. */
+  while (!cb->sender_done) {
+    struct timespec ts = CDTIME_T_TO_TIMESPEC(cdtime() + cb->connect_timeout);
+    int status = 0;
+    while (!cb->sender_done && (status != ETIMEDOUT))
+      status = pthread_cond_timedwait(&cb->spool_cond, &cb->spool_lock, &ts);
+    if (!cb->sender_done && (cb->send_fd >= 0))
+      shutdown(cb->send_fd, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&cb->spool_lock);
+
+  pthread_join(cb->sender_thread, /* retval = */ NULL);
+  cb->sender_running = 0;
+}
+
+/* wa_send_commands hands newline terminated commands over to the sender
+ * thread and adds the series counts of the write callback to the statistics,
+ * all with one acquisition of spool_lock. It never touches the network, so a
+ * slow ATSD node cannot stall write threads. */
+static int wa_send_commands(struct wa_callback *cb, const char *data,
+                            size_t len, uint64_t series_sent,
+                            uint64_t series_suppressed,
+                            uint64_t series_failed) {
+  int status;
+
+  pthread_mutex_lock(&cb->spool_lock);
+
+  cb->stats.series_sent += series_sent;
+  cb->stats.series_suppressed += series_suppressed;
+  cb->stats.series_failed += series_failed;
+
+  if (series_failed > 0)
+    c_complain(LOG_ERR, &cb->format_complaint,
+               "write_atsd plugin: Formatting the commands of %" PRIu64
+               " series for %s:%s failed.",
+               series_failed, cb->node, cb->service);
+  else if (series_sent > 0)
+    c_release(LOG_INFO, &cb->format_complaint,
+              "write_atsd plugin: Formatting commands for %s:%s works "
+              "again.",
+              cb->node, cb->service);
+
+  status = (len > 0) ? wa_sender_start(cb) : 0;
+  if ((status == 0) && (len > 0)) {
+    /* Only wake the sender thread when it has to start a flush timer or a
+     * buffer can be filled. */
+    _Bool was_empty = (cb->spool_fill == 0);
+
+    /* Commands dropped due to the spool policy are not a write error. */
+    wa_spool_put(cb, data, len);
+
+    if (was_empty || (cb->spool_fill >= cb->send_buf_size))
+      pthread_cond_signal(&cb->spool_cond);
+  }
+
+  pthread_mutex_unlock(&cb->spool_lock);
+
+  return status;
+}
+
+static int wa_send_message(char const *message, struct wa_callback *cb) {
+  return wa_send_commands(cb, message, strlen(message), 0, 0, 0);
+}
+
+static int wa_flush(cdtime_t timeout,
+                    const char *identifier __attribute__((unused)),
+                    user_data_t *user_data) {
+  struct wa_callback *cb;
+
+  if (user_data == NULL)
+    return -EINVAL;
+
+  cb = user_data->data;
+
+  pthread_mutex_lock(&cb->spool_lock);
+  /* timeout == 0  => flush unconditionally */
+  if ((cb->spool_fill > 0) &&
+      ((timeout == 0) || (cb->spool_first_time + timeout <= cdtime()))) {
+    cb->flush_requested = 1;
+    pthread_cond_signal(&cb->spool_cond);
+  }
+  pthread_mutex_unlock(&cb->spool_lock);
+
+  return 0;
+}
+
+static void wa_cb_free(struct wa_callback *cb) {
+
+  if (cb == NULL)
+    return;
+
+  wa_sender_stop(cb);
+
+  pthread_mutex_lock(&cb->send_lock);
+
+  wa_flush_nolock(/* timeout = */ 0, cb);
+
+  if (cb->metrics != NULL) {
+    atsd_metrics_save(cb->metrics);
+    atsd_metrics_destroy(cb->metrics);
+    cb->metrics = NULL;
+  }
+
+  for (size_t i = 0; i < cb->endpoints_num; i++) {
+    wa_endpoint_close(cb->endpoints + i, /* failed = */ 0);
+    if (cb->endpoints[i].ai_list != NULL)
+      freeaddrinfo(cb->endpoints[i].ai_list);
+    sfree(cb->endpoints[i].node);
+    sfree(cb->endpoints[i].service);
+  }
+  sfree(cb->endpoints);
+  cb->endpoints_num = 0;
+  sfree(cb->route_buf);
+
+  atsd_http_destroy(cb->http);
+  cb->http = NULL;
+  sfree(cb->user);
+  sfree(cb->password);
+
+  sfree(cb->name);
+  sfree(cb->protocol);
+  sfree(cb->entity);
+  sfree(cb->prefix);
+  sfree(cb->spool);
+  sfree(cb->send_buf);
+
+  atsd_spool_close(cb->disk_spool);
+  cb->disk_spool = NULL;
+  sfree(cb->disk_spool_buf);
+
+  atsd_cache_destroy(cb->series_cache);
+  cb->series_cache = NULL;
+  atsd_entity_cache_destroy(cb->entity_cache);
+  cb->entity_cache = NULL;
+
+  if (cb->property_times != NULL) {
+    void *key;
+    void *value;
+    while (c_avl_pick(cb->property_times, &key, &value) == 0) {
+      sfree(key);
+      sfree(value);
+    }
+    c_avl_destroy(cb->property_times);
+    cb->property_times = NULL;
+  }
+  sfree(cb->uname_tags);
+
+  for (int i = 0; i < cb->wa_num_caches; i++) {
+    sfree(cb->wa_caches[i].plugin);
+    sfree(cb->wa_caches[i].type);
+    sfree(cb->wa_caches[i].type_instance);
+  }
+  sfree(cb->wa_caches);
+  cb->wa_num_caches = 0;
+
+  format_rules_destroy(cb->rules);
+  cb->rules = NULL;
+
+  latency_counter_destroy(cb->stats.send_lock_latency);
+  latency_counter_destroy(cb->stats.send_latency);
+  latency_counter_destroy(cb->stats.connect_latency);
+  latency_config_free(cb->latency);
+
+  pthread_mutex_unlock(&cb->send_lock);
+
+  pthread_mutex_destroy(&cb->send_lock);
+  pthread_mutex_destroy(&cb->spool_lock);
+  pthread_cond_destroy(&cb->spool_cond);
+
+  sfree(cb);
+}
+
+static void wa_callback_free(void *cb) { wa_cb_free((struct wa_callback *)cb); }
+
+/* wa_uname_tags renders the property tags describing the local system. Called
+ * once, while configuring the node. */
+static char *wa_uname_tags(void) {
+  char tags[1024] = "";
+  struct utsname uts_buf;
+
+  if (uname(&uts_buf) == 0) {
+    escape_atsd_string(uts_buf.sysname, uts_buf.sysname,
+                       sizeof(uts_buf.sysname));
+    escape_atsd_string(uts_buf.nodename, uts_buf.nodename,
+                       sizeof(uts_buf.nodename));
+    escape_atsd_string(uts_buf.release, uts_buf.release,
+                       sizeof(uts_buf.release));
+    escape_atsd_string(uts_buf.version, uts_buf.version,
+                       sizeof(uts_buf.version));
+    escape_atsd_string(uts_buf.machine, uts_buf.machine,
+                       sizeof(uts_buf.machine));
+    snprintf(tags, sizeof(tags), " v:OperatingSystem=\"%s\""
+                                 " v:Node=\"%s\""
+                                 " v:Kernel_Release_Version=\"%s\""
+                                 " v:OS_Version=\"%s\""
+                                 " v:Hardware=\"%s\"",
+             uts_buf.sysname, uts_buf.nodename, uts_buf.release,
+             uts_buf.version, uts_buf.machine);
+  } else {
+    WARNING("write_atsd plugin: uname failed: %s", STRERRNO);
+  }
+
+  return strdup(tags);
+}
+
+static _Bool wa_is_local_host(const char *host) {
+  return (strcmp(host, hostname_g) == 0) ||
+         (strcasecmp("localhost", host) == 0) ||
+         (strncasecmp("localhost.", host, strlen("localhost.")) == 0);
+}
+
+/* wa_send_property sends the property command of an entity unless it was sent
+ * during the last WA_PROPERTY_INTERVAL. Called for every entry of the entity
+ * cache by wa_send_properties(). */
+static int wa_send_property(const char *host, const char *entity,
+                            void *user_data) {
+  struct wa_callback *cb = user_data;
+  char command[2048];
+  char escaped_entity[6 * DATA_MAX_NAME_LEN];
+  char escaped_host[6 * DATA_MAX_NAME_LEN];
+
+  cdtime_t *last_time = NULL;
+  if (c_avl_get(cb->property_times, entity, (void *)&last_time) == 0) {
+    if ((cb->property_time - *last_time) < WA_PROPERTY_INTERVAL)
+      return 0;
+  } else {
+    char *key = strdup(entity);
+    last_time = malloc(sizeof(*last_time));
+    if ((key == NULL) || (last_time == NULL) ||
+        (c_avl_insert(cb->property_times, key, last_time) != 0)) {
+      ERROR("write_atsd plugin: Adding entity \"%s\" to the property table "
+            "failed.",
+            entity);
+      sfree(key);
+      sfree(last_time);
+      return 0;
+    }
+  }
+  *last_time = cb->property_time;
+
+  snprintf(command, sizeof(command),
+           "property e:\"%s\" ms:%" PRIu64 " t:collectd-atsd v:host=\"%s\"%s\n",
+           escape_atsd_string(escaped_entity, entity, sizeof(escaped_entity)),
+           CDTIME_T_TO_MS(cb->property_time),
+           escape_atsd_string(escaped_host, host, sizeof(escaped_host)),
+           wa_is_local_host(host) ? cb->uname_tags : "");
+
+  return wa_send_message(command, cb);
+}
+
+/* wa_send_properties sends the properties of the entities written to since
+ * they were last sent and forgets entities which have not been written to for
+ * a while. Only called from the read callback. */
+static void wa_send_properties(struct wa_callback *cb) {
+  cb->property_time = cdtime();
+
+  if (atsd_entity_cache_foreach(cb->entity_cache, wa_send_property, cb) != 0)
+    return;
+
+  char *key;
+  cdtime_t *last_time;
+  c_avl_iterator_t *iter = c_avl_get_iterator(cb->property_times);
+  char **expired = NULL;
+  size_t expired_num = 0;
+
+  while (c_avl_iterator_next(iter, (void *)&key, (void *)&last_time) == 0) {
+    if ((cb->property_time - *last_time) < 2 * WA_PROPERTY_INTERVAL)
+      continue;
+
+    char **tmp = realloc(expired, (expired_num + 1) * sizeof(*expired));
+    if (tmp == NULL)
+      break;
+    expired = tmp;
+    expired[expired_num++] = key;
+  }
+  c_avl_iterator_destroy(iter);
+
+  for (size_t i = 0; i < expired_num; i++) {
+    if (c_avl_remove(cb->property_times, expired[i], (void *)&key,
+                     (void *)&last_time) != 0)
+      continue;
+    sfree(key);
+    sfree(last_time);
+  }
+  sfree(expired);
+}
+
+static _Bool wa_cache_pattern_match(const char *pattern, const char *str) {
+  if (pattern == NULL)
+    return true;
+
+  return (strcasecmp(pattern, str) == 0) || (fnmatch(pattern, str, 0) == 0);
+}
+
+/* wa_cache_lookup returns the first <Cache> block matching the series, or
+ * NULL. */
+static const struct wa_cache_s *wa_cache_lookup(const atsd_series_t *series,
+                                                struct wa_callback *cb) {
+  for (int i = 0; i < cb->wa_num_caches; i++) {
+    const struct wa_cache_s *cache = cb->wa_caches + i;
+    if (wa_cache_pattern_match(cache->plugin, series->plugin) &&
+        wa_cache_pattern_match(cache->type, series->type) &&
+        wa_cache_pattern_match(cache->type_instance, series->type_instance))
+      return cache;
+  }
+
+  return NULL;
+}
+
+/* check_cache_value decides whether a value has to be sent, i.e. whether it
+ * left the deadband around the last value sent or the cache interval has
+ * passed. The <Cache> block is looked up once per series. Must hold the
+ * series cache entry. */
+static _Bool check_cache_value(atsd_series_t *series, double value,
+                               uint64_t time, struct wa_callback *cb) {
+  if (!series->cache_rule_resolved) {
+    series->cache_rule = wa_cache_lookup(series, cb);
+    series->cache_rule_resolved = true;
+  }
+
+  const struct wa_cache_s *cache = series->cache_rule;
+  if (cache == NULL)
+    return true;
+
+  if (series->has_value) {
+    /* The new value is older than that is stored in cache,
+     * just send it without updating the cache
+     */
+    if (series->value_time > time)
+      return true;
+
+    _Bool within_deadband;
+    if (isnan(value) || isnan(series->value)) {
+      within_deadband = isnan(value) && isnan(series->value);
+    } else {
+      double diff = fabs(value - series->value);
+      within_deadband =
+          (diff <= cache->absolute_threshold) ||
+          (diff <= cache->threshold * fabs(series->value) / 100.0);
+    }
+
+    if (within_deadband &&
+        (time - series->value_time < CDTIME_T_TO_MS(cache->interval)))
+      return false;
+  }
+
+  series->has_value = true;
+  series->value = value;
+  series->value_time = time;
+
+  return true;
+}
+
+/* Commands formatted by a write callback and the number of series sent,
+ * suppressed and not formatted because of an error. `data' is a buffer on the
+ * stack until more space is needed. */
+struct wa_output {
+  char *data;
+  size_t len;
+  size_t size;
+  _Bool heap;
+
+  uint64_t series_sent;
+  uint64_t series_suppressed;
+  uint64_t series_failed;
+};
+
+/* wa_output_reserve makes sure at least `size' bytes are free in the
+ * output. */
+static int wa_output_reserve(struct wa_output *out, size_t size) {
+  if (out->size - out->len >= size)
+    return 0;
+
+  size_t new_size = 2 * out->size;
+  while (new_size - out->len < size)
+    new_size *= 2;
+
+  char *data = out->heap ? realloc(out->data, new_size) : malloc(new_size);
+  if (data == NULL) {
+    ERROR("write_atsd plugin: Allocating %zu bytes for commands failed.",
+          new_size);
+    return -1;
+  }
+  if (!out->heap)
+    memcpy(data, out->data, out->len);
+
+  out->data = data;
+  out->size = new_size;
+  out->heap = true;
+  return 0;
+}
+
+/* wa_format_commands appends the commands of one data source to `out',
+ * rendered from the template of the series. The metric command is included
+ * when the template is new, i.e. the first time the series is sent or after
+ * the entity or prefix changed. Must hold the series cache entry. */
+static int wa_format_commands(atsd_series_t *series, format_info_t *format,
+                              struct wa_output *out, struct wa_callback *cb) {
+  _Bool update_metrics = false;
+
+  if ((series->tmpl != NULL) &&
+      !format_atsd_template_matches(series->tmpl, format)) {
+    format_atsd_template_destroy(series->tmpl);
+    series->tmpl = NULL;
+  }
+
+  if (series->tmpl == NULL) {
+    series->tmpl = format_atsd_template_create(format);
+    if (series->tmpl == NULL) {
+      ERROR("write_atsd plugin: Creating the series template failed.");
+      return -1;
+    }
+
+    /* Definitions delivered before, possibly by the previous run, are not
+     * repeated when a series is first seen or its entity changes. */
+    update_metrics = (cb->metrics == NULL);
+    size_t series_num = format_atsd_template_series_num(series->tmpl);
+    for (size_t i = 0; (i < series_num) && !update_metrics; i++)
+      update_metrics = !atsd_metrics_check(
+          cb->metrics, format_atsd_template_metric_hash(series->tmpl, i));
+  }
+
+  size_t size =
+      format_atsd_template_command_size(series->tmpl, update_metrics);
+  if (wa_output_reserve(out, size) != 0)
+    return -1;
+
+  format->buffer = out->data + out->len;
+  format->buffer_len = out->size - out->len;
+
+  int status =
+      format_atsd_template_command(series->tmpl, format, update_metrics);
+  if (status != 0)
+    return status;
+
+  out->len += strlen(format->buffer);
+  return 0;
+}
+
+/* wa_write_messages appends the commands of a value list to `out'. */
+static int wa_write_messages(const data_set_t *ds, const value_list_t *vl,
+                             struct wa_output *out, struct wa_callback *cb) {
+  int status;
+  int failed = 0;
+
   char entity[WA_MAX_LENGTH];
 
   gauge_t *rates = NULL;
@@ -605,24 +2030,17 @@ static int wa_write_messages(const data_set_t *ds, const value_list_t *vl,
     }
   }
 
-  status = format_entity(entity, sizeof(entity), cb->entity, vl->host,
-                         cb->short_hostname);
-  if (status != 0) {
-    sfree(rates);
-    return -1;
-  }
-
-  status = wa_update_property(vl, entity, cb);
+  status = atsd_entity_cache_get(cb->entity_cache, vl->host, entity,
+                                 sizeof(entity));
   if (status != 0) {
     sfree(rates);
     return -1;
   }
 
   format_info_t format;
-  format.buffer = commands;
-  format.buffer_len = sizeof(commands);
   format.entity = entity;
   format.prefix = cb->prefix;
+  format.rules = cb->rules;
   format.vl = vl;
   format.ds = ds;
   format.rates = rates;
@@ -633,81 +2051,251 @@ static int wa_write_messages(const data_set_t *ds, const value_list_t *vl,
 
     format.index = i;
 
-    atsd_key_t cache_key;
-    atsd_value_t cache_value;
-    strncpy(cache_key.host, vl->host, DATA_MAX_NAME_LEN);
-    strncpy(cache_key.plugin, vl->plugin, DATA_MAX_NAME_LEN);
-    strncpy(cache_key.plugin_instance, vl->plugin_instance, DATA_MAX_NAME_LEN);
-    strncpy(cache_key.type, vl->type, DATA_MAX_NAME_LEN);
-    strncpy(cache_key.type_instance, vl->type_instance, DATA_MAX_NAME_LEN);
-    strncpy(cache_key.data_source, ds->ds[i].name, DATA_MAX_NAME_LEN);
-
-    status = get_value(&format, &cache_value.value);
+    double value;
+    status = get_value(&format, &value);
     if (status != 0) {
       sfree(rates);
       return -1;
     }
 
-    cache_value.time = CDTIME_T_TO_MS(vl->time);
-
-    _Bool update_metrics;
-    _Bool update_series;
-
-    status = check_cache_value(&cache_key, &cache_value, cb, &update_series,
-                               &update_metrics);
-    if (status != 0) {
+    atsd_series_t *series =
+        atsd_cache_acquire(cb->series_cache, vl, ds->ds[i].name);
+    if (series == NULL) {
+      ERROR("write_atsd plugin: atsd_cache_acquire failed.");
       sfree(rates);
       return -1;
     }
 
-    if (update_series) {
-      format_atsd_command(&format, update_metrics);
-      status = wa_send_message(commands, cb);
-      if (status != 0) {
-        sfree(rates);
-        return -1;
-      }
+    _Bool update_series =
+        check_cache_value(series, value, CDTIME_T_TO_MS(vl->time), cb);
+    if (update_series)
+      status = wa_format_commands(series, &format, out, cb);
+
+    atsd_cache_release(cb->series_cache, series);
+
+    if (!update_series)
+      out->series_suppressed++;
+    else if (status == 0)
+      out->series_sent++;
+    else {
+      out->series_failed++;
+      failed = -1;
     }
   }
 
   sfree(rates);
-  return 0;
+  return failed;
 }
 
-/* int wa_write_messages */
+/* wa_write_batch formats the commands of `vl_num' value lists straight into
+ * one growing buffer and hands them to the sender thread at once. */
+static int wa_write_batch(struct wa_callback *cb, const data_set_t *const *ds,
+                          const value_list_t *const *vl, size_t vl_num) {
+  char buffer[WA_FORMAT_BUFFER_SIZE];
+  struct wa_output out = {.data = buffer, .size = sizeof(buffer)};
+  int status = 0;
 
-static int wa_write(const data_set_t *ds, const value_list_t *vl,
-                    user_data_t *user_data) {
+  if (vl_num == 0)
+    return 0;
+
+  for (size_t i = 0; i < vl_num; i++)
+    if (wa_write_messages(ds[i], vl[i], &out, cb) != 0)
+      status = -1;
+
+  if (wa_send_commands(cb, out.data, out.len, out.series_sent,
+                       out.series_suppressed, out.series_failed) != 0)
+    status = -1;
+
+  if (out.heap)
+    sfree(out.data);
+  return status;
+}
+
+static int wa_write(const data_set_t *const *ds, const value_list_t *const *vl,
+                    size_t vl_num, user_data_t *user_data) {
   if (user_data == NULL)
     return -1;
 
-  return wa_write_messages(ds, vl, user_data->data);
+  return wa_write_batch(user_data->data, ds, vl, vl_num);
 }
 
-static int wa_config_cache(struct wa_callback *cb, oconfig_item_t *child) {
-  int status;
+static void wa_submit(const char *plugin_instance, const char *type,
+                      const char *type_instance, value_t value) {
+  value_list_t vl = VALUE_LIST_INIT;
 
-  struct wa_cache_s *wc = malloc(sizeof(struct wa_cache_s));
-  if (wc == NULL) {
-    ERROR("write_atsd plugin: malloc failed.");
+  vl.values = &value;
+  vl.values_len = 1;
+  sstrncpy(vl.plugin, "write_atsd", sizeof(vl.plugin));
+  sstrncpy(vl.plugin_instance, plugin_instance, sizeof(vl.plugin_instance));
+  sstrncpy(vl.type, type, sizeof(vl.type));
+  sstrncpy(vl.type_instance, type_instance, sizeof(vl.type_instance));
+
+  plugin_dispatch_values(&vl);
+}
+
+/* wa_submit_latency dispatches the average, maximum, percentiles and bucket
+ * rates of a latency counter and resets it. The values are computed under
+ * cb->send_lock and dispatched after releasing it. */
+static void wa_submit_latency(struct wa_callback *cb,
+                              const char *plugin_instance, const char *name,
+                              latency_counter_t *latency) {
+  const latency_config_t *conf = &cb->latency;
+  gauge_t values[2 + conf->percentile_num + conf->buckets_num];
+  char type_instance[DATA_MAX_NAME_LEN];
+  cdtime_t now = cdtime();
+
+  pthread_mutex_lock(&cb->send_lock);
+  _Bool have_events = (latency_counter_get_num(latency) > 0);
+  values[0] = have_events
+                  ? CDTIME_T_TO_DOUBLE(latency_counter_get_average(latency))
+                  : NAN;
+  values[1] =
+      have_events ? CDTIME_T_TO_DOUBLE(latency_counter_get_max(latency)) : NAN;
+  for (size_t i = 0; i < conf->percentile_num; i++)
+    values[2 + i] = have_events
+                        ? CDTIME_T_TO_DOUBLE(latency_counter_get_percentile(
+                              latency, conf->percentile[i]))
+                        : NAN;
+  for (size_t i = 0; i < conf->buckets_num; i++)
+    values[2 + conf->percentile_num + i] = latency_counter_get_rate(
+        latency, conf->buckets[i].lower_bound, conf->buckets[i].upper_bound,
+        now);
+  latency_counter_reset(latency);
+  pthread_mutex_unlock(&cb->send_lock);
+
+  snprintf(type_instance, sizeof(type_instance), "%s-average", name);
+  wa_submit(plugin_instance, "latency", type_instance,
+            (value_t){.gauge = values[0]});
+  snprintf(type_instance, sizeof(type_instance), "%s-max", name);
+  wa_submit(plugin_instance, "latency", type_instance,
+            (value_t){.gauge = values[1]});
+
+  for (size_t i = 0; i < conf->percentile_num; i++) {
+    snprintf(type_instance, sizeof(type_instance), "%s-%.5g", name,
+             conf->percentile[i]);
+    wa_submit(plugin_instance, "latency", type_instance,
+              (value_t){.gauge = values[2 + i]});
+  }
+
+  for (size_t i = 0; i < conf->buckets_num; i++) {
+    latency_bucket_t bucket = conf->buckets[i];
+    double lower_bound = CDTIME_T_TO_DOUBLE(bucket.lower_bound);
+    double upper_bound =
+        bucket.upper_bound ? CDTIME_T_TO_DOUBLE(bucket.upper_bound) : INFINITY;
+
+    snprintf(type_instance, sizeof(type_instance), "%s-%g_%g", name,
+             lower_bound, upper_bound);
+    wa_submit(plugin_instance,
+              (conf->bucket_type != NULL) ? conf->bucket_type : "bucket",
+              type_instance,
+              (value_t){.gauge = values[2 + conf->percentile_num + i]});
+  }
+}
+
+/* wa_submit_stats dispatches the ReportStats counters and latencies. */
+static void wa_submit_stats(struct wa_callback *cb,
+                            const char *plugin_instance) {
+  pthread_mutex_lock(&cb->spool_lock);
+  struct wa_stats spool_stats = cb->stats;
+  gauge_t spool_fill = (gauge_t)cb->spool_fill;
+  pthread_mutex_unlock(&cb->spool_lock);
+
+  pthread_mutex_lock(&cb->send_lock);
+  struct wa_stats send_stats = cb->stats;
+  pthread_mutex_unlock(&cb->send_lock);
+
+  wa_submit(plugin_instance, "total_values", "sent",
+            (value_t){.derive = (derive_t)spool_stats.series_sent});
+  wa_submit(plugin_instance, "total_values", "suppressed",
+            (value_t){.derive = (derive_t)spool_stats.series_suppressed});
+  wa_submit(plugin_instance, "total_values", "failed",
+            (value_t){.derive = (derive_t)spool_stats.series_failed});
+  wa_submit(plugin_instance, "total_values", "dropped",
+            (value_t){.derive = (derive_t)spool_stats.commands_dropped});
+  wa_submit(plugin_instance, "bytes", "spool",
+            (value_t){.gauge = spool_fill});
+
+  wa_submit(plugin_instance, "total_bytes", "sent",
+            (value_t){.derive = (derive_t)send_stats.bytes_sent});
+  wa_submit(plugin_instance, "total_operations", "send",
+            (value_t){.derive = (derive_t)send_stats.sends});
+  wa_submit(plugin_instance, "total_operations", "send_failed",
+            (value_t){.derive = (derive_t)send_stats.send_failures});
+  wa_submit(plugin_instance, "connections", "opened",
+            (value_t){.derive = (derive_t)send_stats.connects});
+  wa_submit(plugin_instance, "connections", "failed",
+            (value_t){.derive = (derive_t)send_stats.connect_failures});
+
+  wa_submit_latency(cb, plugin_instance, "send_lock",
+                    cb->stats.send_lock_latency);
+  wa_submit_latency(cb, plugin_instance, "send", cb->stats.send_latency);
+  wa_submit_latency(cb, plugin_instance, "connect",
+                    cb->stats.connect_latency);
+}
+
+static int wa_read(user_data_t *user_data) {
+  struct wa_callback *cb = user_data->data;
+  const char *plugin_instance = (cb->name != NULL) ? cb->name : cb->node;
+
+  wa_send_properties(cb);
+
+  if (cb->disk_spool_enabled) {
+    pthread_mutex_lock(&cb->spool_lock);
+    gauge_t disk_spool_bytes = (gauge_t)cb->disk_spool_bytes;
+    pthread_mutex_unlock(&cb->spool_lock);
+
+    wa_submit(plugin_instance, "bytes", "disk_spool",
+              (value_t){.gauge = disk_spool_bytes});
+  }
+
+  if (cb->udp) {
+    pthread_mutex_lock(&cb->send_lock);
+    derive_t datagrams = (derive_t)cb->udp_datagrams;
+    derive_t bytes = (derive_t)cb->udp_bytes;
+    pthread_mutex_unlock(&cb->send_lock);
+
+    wa_submit(plugin_instance, "packets", "udp",
+              (value_t){.derive = datagrams});
+    wa_submit(plugin_instance, "total_bytes", "udp",
+              (value_t){.derive = bytes});
+  }
+
+  if (cb->report_stats)
+    wa_submit_stats(cb, plugin_instance);
+
+  return 0;
+}
+
+static int wa_config_cache(struct wa_callback *cb, oconfig_item_t *child) {
+  struct wa_cache_s *caches =
+      realloc(cb->wa_caches, (cb->wa_num_caches + 1) * sizeof(*caches));
+  if (caches == NULL) {
+    ERROR("write_atsd plugin: realloc failed.");
     return -1;
   }
+  cb->wa_caches = caches;
 
-  memset(wc, 0, sizeof(struct wa_cache_s));
-  wc->next = cb->wa_caches;
-  cb->wa_caches = wc;
+  struct wa_cache_s *wc = caches + cb->wa_num_caches;
+  memset(wc, 0, sizeof(*wc));
+  cb->wa_num_caches++;
 
-  status = cf_util_get_string(child, &wc->name);
+  int status = cf_util_get_string(child, &wc->plugin);
   if (status != 0)
     return status;
 
   for (int q = 0; q < child->children_num; q++) {
     oconfig_item_t *grandchild = child->children + q;
 
-    if (strcasecmp("Interval", grandchild->key) == 0)
-      cf_util_get_int(grandchild, &wc->interval);
+    if (strcasecmp("Type", grandchild->key) == 0)
+      status = cf_util_get_string(grandchild, &wc->type);
+    else if (strcasecmp("TypeInstance", grandchild->key) == 0)
+      status = cf_util_get_string(grandchild, &wc->type_instance);
+    else if (strcasecmp("Interval", grandchild->key) == 0)
+      status = cf_util_get_cdtime(grandchild, &wc->interval);
     else if (strcasecmp("Threshold", grandchild->key) == 0)
-      cf_util_get_double(grandchild, &wc->threshold);
+      status = cf_util_get_double(grandchild, &wc->threshold);
+    else if (strcasecmp("AbsoluteThreshold", grandchild->key) == 0)
+      status = cf_util_get_double(grandchild, &wc->absolute_threshold);
     else {
       ERROR("write_atsd plugin: Invalid configuration "
             "option: %s.",
@@ -716,7 +2304,226 @@ static int wa_config_cache(struct wa_callback *cb, oconfig_item_t *child) {
     }
 
     if (status != 0)
-      break;
+      return status;
+  }
+
+  if (!(wc->threshold >= 0.0) || !(wc->absolute_threshold >= 0.0)) {
+    ERROR("write_atsd plugin: Cache thresholds must not be negative.");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int wa_config_derive(struct wa_callback *cb, oconfig_item_t *ci) {
+  char *plugin = NULL;
+  char *type = NULL;
+  char *type_instance = NULL;
+  char *metric = NULL;
+  format_rule_t rule = {.tags = FORMAT_TAGS_INSTANCE};
+  int status = 0;
+
+  for (int i = 0; (i < ci->children_num) && (status == 0); i++) {
+    oconfig_item_t *child = ci->children + i;
+
+    if (strcasecmp("Plugin", child->key) == 0)
+      status = cf_util_get_string(child, &plugin);
+    else if (strcasecmp("Type", child->key) == 0)
+      status = cf_util_get_string(child, &type);
+    else if (strcasecmp("TypeInstance", child->key) == 0)
+      status = cf_util_get_string(child, &type_instance);
+    else if (strcasecmp("Metric", child->key) == 0)
+      status = cf_util_get_string(child, &metric);
+    else if (strcasecmp("KeepOriginal", child->key) == 0)
+      status = cf_util_get_boolean(child, &rule.keep_original);
+    else if (strcasecmp("Final", child->key) == 0)
+      status = cf_util_get_boolean(child, &rule.final);
+    else if (strcasecmp("Transform", child->key) == 0) {
+      if ((child->values_num < 1) || (child->values_num > 2) ||
+          (child->values[0].type != OCONFIG_TYPE_STRING) ||
+          ((child->values_num == 2) &&
+           (child->values[1].type != OCONFIG_TYPE_NUMBER))) {
+        ERROR("write_atsd plugin: Transform expects a name and an optional "
+              "number.");
+        status = -1;
+        break;
+      }
+
+      const char *name = child->values[0].value.string;
+      if (strcasecmp("None", name) == 0)
+        rule.transform = FORMAT_TRANSFORM_NONE;
+      else if (strcasecmp("Invert", name) == 0) {
+        rule.transform = FORMAT_TRANSFORM_INVERT;
+        rule.factor = 100.0;
+      } else if (strcasecmp("Scale", name) == 0) {
+        rule.transform = FORMAT_TRANSFORM_SCALE;
+        rule.factor = 1.0;
+      } else if (strcasecmp("Sum", name) == 0)
+        rule.transform = FORMAT_TRANSFORM_SUM;
+      else {
+        ERROR("write_atsd plugin: Unknown Transform (%s)", name);
+        status = -1;
+      }
+
+      if (child->values_num == 2)
+        rule.factor = child->values[1].value.number;
+    } else if (strcasecmp("Tags", child->key) == 0) {
+      char tags[16];
+      status = cf_util_get_string_buffer(child, tags, sizeof(tags));
+      if (status != 0)
+        break;
+      if (strcasecmp("Instance", tags) == 0)
+        rule.tags = FORMAT_TAGS_INSTANCE;
+      else if (strcasecmp("None", tags) == 0)
+        rule.tags = FORMAT_TAGS_NONE;
+      else if (strcasecmp("DiskName", tags) == 0)
+        rule.tags = FORMAT_TAGS_DISK_NAME;
+      else if (strcasecmp("KeyValue", tags) == 0)
+        rule.tags = FORMAT_TAGS_KEY_VALUE;
+      else {
+        ERROR("write_atsd plugin: Unknown Tags (%s)", tags);
+        status = -1;
+      }
+    } else {
+      ERROR("write_atsd plugin: Invalid configuration option in Derive "
+            "block: %s.",
+            child->key);
+      status = -1;
+    }
+  }
+
+  if ((status == 0) && (metric == NULL)) {
+    ERROR("write_atsd plugin: Derive block without Metric.");
+    status = -1;
+  }
+
+  if (status == 0) {
+    rule.plugin = plugin;
+    rule.type = type;
+    rule.type_instance = type_instance;
+    rule.metric = metric;
+    status = format_rules_add(cb->rules, &rule);
+  }
+
+  sfree(plugin);
+  sfree(type);
+  sfree(type_instance);
+  sfree(metric);
+  return status;
+}
+
+static int wa_add_endpoint(struct wa_callback *cb, const char *node,
+                           const char *service) {
+  struct wa_endpoint *endpoints =
+      realloc(cb->endpoints, (cb->endpoints_num + 1) * sizeof(*endpoints));
+  if (endpoints == NULL) {
+    ERROR("write_atsd plugin: realloc failed.");
+    return -1;
+  }
+  cb->endpoints = endpoints;
+
+  struct wa_endpoint *ep = endpoints + cb->endpoints_num;
+  memset(ep, 0, sizeof(*ep));
+  ep->sock_fd = -1;
+  ep->backoff = WA_MIN_RECONNECT_INTERVAL;
+  C_COMPLAIN_INIT(&ep->complaint);
+
+  ep->node = strdup(node);
+  ep->service = strdup(service);
+  if (ep->node == NULL || ep->service == NULL) {
+    ERROR("write_atsd plugin: strdup failed");
+    sfree(ep->node);
+    sfree(ep->service);
+    return -1;
+  }
+  cb->endpoints_num++;
+
+  return 0;
+}
+
+/* wa_config_url adds the endpoint of an AtsdUrl option. All endpoints of a
+ * node must use the same protocol. */
+static int wa_config_url(struct wa_callback *cb, oconfig_item_t *child) {
+  char url[1024];
+  char protocol[100] = "";
+  char node[100] = "";
+  char service[100] = "";
+
+  if (cf_util_get_string_buffer(child, url, sizeof(url)) != 0)
+    return -1;
+
+  int s = 0;
+  for (size_t q = 0; q < strlen(url); q++)
+    if (url[q] == ':')
+      s++;
+  if (s > 2) {
+    ERROR("write_atsd plugin: failed to parse atsdurl (%s)", url);
+    return -1;
+  }
+
+  int args =
+      sscanf(url, "%99[^:]://%99[^:]:%99[^\n]", protocol, node, service);
+  if (args == 2) {
+    if (strlen(node) == 0) {
+      ERROR("write_atsd plugin: No hostname given (%s)", url);
+      return -1;
+    }
+    if (strcasecmp("TCP", protocol) == 0)
+      sstrncpy(service, "8081", sizeof(service));
+    else if (strcasecmp("UDP", protocol) == 0)
+      sstrncpy(service, "8082", sizeof(service));
+    else if (strcasecmp("HTTP", protocol) == 0)
+      sstrncpy(service, WA_DEFAULT_HTTP_SERVICE, sizeof(service));
+  } else if (args != 3) {
+    ERROR("write_atsd plugin: failed to parse atsdurl (%s)", url);
+    return -1;
+  }
+
+  if (strcasecmp("UDP", protocol) != 0 && strcasecmp("TCP", protocol) != 0 &&
+      strcasecmp("HTTP", protocol) != 0) {
+    ERROR("write_atsd plugin: Unknown protocol (%s)", protocol);
+    return -1;
+  }
+
+  if (cb->endpoints_num == 0) {
+    sfree(cb->protocol);
+    cb->protocol = strdup(protocol);
+    if (cb->protocol == NULL) {
+      ERROR("write_atsd plugin: strdup failed");
+      return -1;
+    }
+  } else if (strcasecmp(cb->protocol, protocol) != 0) {
+    ERROR("write_atsd plugin: All AtsdUrl of a node must use the same "
+          "protocol (%s, %s)",
+          cb->protocol, url);
+    return -1;
+  }
+
+  return wa_add_endpoint(cb, node, service);
+}
+
+/* wa_stats_init creates the latency counters of ReportStats and the default
+ * percentiles if no <Latency> block was given. */
+static int wa_stats_init(struct wa_callback *cb) {
+  if ((cb->latency.percentile_num == 0) && (cb->latency.buckets_num == 0)) {
+    double percentiles[] = WA_DEFAULT_LATENCY_PERCENTILES;
+
+    cb->latency.percentile = malloc(sizeof(percentiles));
+    if (cb->latency.percentile == NULL) {
+      ERROR("write_atsd plugin: malloc failed.");
+      return -1;
+    }
+    memcpy(cb->latency.percentile, percentiles, sizeof(percentiles));
+    cb->latency.percentile_num = STATIC_ARRAY_SIZE(percentiles);
+  }
+
+  cb->stats.send_lock_latency = latency_counter_create();
+  cb->stats.send_latency = latency_counter_create();
+  cb->stats.connect_latency = latency_counter_create();
+  if ((cb->stats.send_lock_latency == NULL) ||
+      (cb->stats.send_latency == NULL) || (cb->stats.connect_latency == NULL)) {
+    ERROR("write_atsd plugin: latency_counter_create failed.");
+    return -1;
   }
 
   return 0;
@@ -729,15 +2536,16 @@ static int wa_config_node(oconfig_item_t *ci) {
     return -1;
   }
 
-  cb->sock_fd = -1;
+  pthread_mutex_init(&cb->send_lock, /* attr = */ NULL);
+  pthread_mutex_init(&cb->spool_lock, /* attr = */ NULL);
+  cb->send_fd = -1;
+  pthread_cond_init(&cb->spool_cond, /* attr = */ NULL);
+
   cb->name = NULL;
-  cb->node = strdup(WA_DEFAULT_NODE);
-  cb->service = strdup(WA_DEFAULT_SERVICE);
   cb->protocol = strdup(WA_DEFAULT_PROTOCOL);
   cb->prefix = strdup(WA_DEFAULT_PREFIX);
 
-  if (cb->node == NULL || cb->service == NULL || cb->protocol == NULL ||
-      cb->prefix == NULL) {
+  if (cb->protocol == NULL || cb->prefix == NULL) {
     ERROR("write_atsd plugin: strdup failed");
     wa_cb_free(cb);
     return -1;
@@ -746,85 +2554,57 @@ static int wa_config_node(oconfig_item_t *ci) {
   cb->entity = NULL;
   cb->short_hostname = false;
   cb->store_rates = true;
+  cb->metric_snapshot = false;
+  cb->derive_defaults = true;
   cb->wa_num_caches = 0;
   cb->wa_caches = NULL;
-  cb->value_cache = NULL;
-  cb->value_cache = c_avl_create((void *)compare_atsd_keys);
-  cb->metric_cache = NULL;
-  cb->metric_cache = c_avl_create((void *)compare_atsd_keys);
+  cb->series_cache = atsd_cache_create(WA_SERIES_CACHE_TTL);
 
-  if (cb->value_cache == NULL || cb->value_cache == NULL) {
-    ERROR("write_atsd plugin: c_avl_create failed");
+  if (cb->series_cache == NULL) {
+    ERROR("write_atsd plugin: atsd_cache_create failed");
     wa_cb_free(cb);
     return -1;
   }
 
-  pthread_mutex_init(&cb->send_lock, /* attr = */ NULL);
-  pthread_mutex_init(&cb->value_cache_lock, /* attr = */ NULL);
-  pthread_mutex_init(&cb->metric_cache_lock, /* attr = */ NULL);
+  cb->rules = format_rules_create();
+  if (cb->rules == NULL) {
+    ERROR("write_atsd plugin: format_rules_create failed");
+    wa_cb_free(cb);
+    return -1;
+  }
+
+  cb->send_buf_size = 0;
+  cb->mtu = WA_DEFAULT_MTU;
+  cb->flush_interval = WA_DEFAULT_FLUSH_INTERVAL;
+  cb->spool_size = WA_DEFAULT_SPOOL_SIZE;
+  cb->spool_policy = WA_SPOOL_DROP_OLDEST;
+  cb->disk_spool_size = WA_DEFAULT_DISK_SPOOL_SIZE;
+  cb->disk_spool_segment_size = WA_DEFAULT_DISK_SPOOL_SEGMENT_SIZE;
+  cb->disk_spool_replay_rate = WA_DEFAULT_DISK_SPOOL_REPLAY_RATE;
+  cb->balance = WA_BALANCE_FAILOVER;
+  cb->connect_timeout = WA_DEFAULT_CONNECT_TIMEOUT;
+  cb->resolve_interval = WA_DEFAULT_RESOLVE_INTERVAL;
+#if HAVE_LIBZ
+  cb->compression = ATSD_HTTP_COMPRESSION_GZIP;
+#else
+  cb->compression = ATSD_HTTP_COMPRESSION_NONE;
+#endif
+
+  if (ci->values_num == 1 && cf_util_get_string(ci, &cb->name) != 0) {
+    wa_cb_free(cb);
+    return -1;
+  }
 
-  C_COMPLAIN_INIT(&cb->init_complaint);
+  C_COMPLAIN_INIT(&cb->spool_complaint);
+  C_COMPLAIN_INIT(&cb->format_complaint);
 
   for (int i = 0; i < ci->children_num; i++) {
     oconfig_item_t *child = ci->children + i;
 
     if (strcasecmp("atsdurl", child->key) == 0) {
-      int s = 0;
-      for (int q = 0; q < strlen(child->values[0].value.string); q++)
-        if (child->values[0].value.string[q] == ':')
-          s++;
-      if (s > 2) {
-        ERROR("write_atsd plugin: failed to parse atsdurl (%s)",
-              child->values[0].value.string);
+      if (wa_config_url(cb, child) != 0) {
         wa_cb_free(cb);
         return -1;
-      } else {
-        int args =
-            sscanf(child->values[0].value.string, "%99[^:]://%99[^:]:%99[^\n]",
-                   cb->protocol, cb->node, cb->service);
-        if (args == 3) {
-          if (strcasecmp("UDP", cb->protocol) != 0 &&
-              strcasecmp("TCP", cb->protocol) != 0) {
-            ERROR("write_atsd plugin: Unknown protocol (%s)", cb->protocol);
-            wa_cb_free(cb);
-            return -1;
-          }
-        } else if (args == 2) {
-          if (strlen(cb->protocol) == 0) {
-            ERROR("write_atsd plugin: No protocol given (%s)",
-                  child->values[0].value.string);
-
-            wa_cb_free(cb);
-            return -1;
-          } else if (strlen(cb->node) == 0) {
-            ERROR("write_atsd plugin: No hostname given (%s)",
-                  child->values[0].value.string);
-            wa_cb_free(cb);
-            return -1;
-          } else {
-            if (strcasecmp("TCP", cb->protocol) == 0) {
-              sfree(cb->service);
-              cb->service = strdup("8081");
-            } else if (strcasecmp("UDP", cb->protocol) == 0) {
-              sfree(cb->service);
-              cb->service = strdup("8082");
-            } else {
-              ERROR("write_atsd plugin: Unknown protocol (%s)", cb->protocol);
-              wa_cb_free(cb);
-              return -1;
-            }
-            if (cb->service == NULL) {
-              ERROR("write_atsd plugin: strdup failed");
-              wa_cb_free(cb);
-              return -1;
-            }
-          }
-        } else {
-          ERROR("write_atsd plugin: failed to parse atsdurl (%s)",
-                child->values[0].value.string);
-          wa_cb_free(cb);
-          return -1;
-        }
       }
     } else if (strcasecmp("Prefix", child->key) == 0)
       cf_util_get_string(child, &cb->prefix);
@@ -834,9 +2614,153 @@ static int wa_config_node(oconfig_item_t *ci) {
       cf_util_get_boolean(child, &cb->short_hostname);
     else if (strcasecmp("StoreRates", child->key) == 0)
       cf_util_get_boolean(child, &cb->store_rates);
-    else if (strcasecmp("Cache", child->key) == 0)
-      wa_config_cache(cb, child);
-    else {
+    else if (strcasecmp("Cache", child->key) == 0) {
+      if (wa_config_cache(cb, child) != 0) {
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else if (strcasecmp("Derive", child->key) == 0) {
+      if (wa_config_derive(cb, child) != 0) {
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else if (strcasecmp("DeriveDefaults", child->key) == 0)
+      cf_util_get_boolean(child, &cb->derive_defaults);
+    else if (strcasecmp("BufferSize", child->key) == 0) {
+      int buffer_size = 0;
+      if (cf_util_get_int(child, &buffer_size) != 0 ||
+          buffer_size < WA_SEND_BUF_SIZE) {
+        ERROR("write_atsd plugin: BufferSize must be at least %d bytes.",
+              WA_SEND_BUF_SIZE);
+        wa_cb_free(cb);
+        return -1;
+      }
+      cb->send_buf_size = (size_t)buffer_size;
+    } else if (strcasecmp("Mtu", child->key) == 0) {
+      if (cf_util_get_int(child, &cb->mtu) != 0 ||
+          cb->mtu <= WA_UDP_HEADER_SIZE || cb->mtu > 65535) {
+        ERROR("write_atsd plugin: Mtu must be between %d and 65535.",
+              WA_UDP_HEADER_SIZE + 1);
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else if (strcasecmp("FlushInterval", child->key) == 0) {
+      if (cf_util_get_cdtime(child, &cb->flush_interval) != 0) {
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else if (strcasecmp("SpoolSize", child->key) == 0) {
+      int spool_size = 0;
+      if (cf_util_get_int(child, &spool_size) != 0 ||
+          spool_size < WA_SEND_BUF_SIZE) {
+        ERROR("write_atsd plugin: SpoolSize must be at least %d bytes.",
+              WA_SEND_BUF_SIZE);
+        wa_cb_free(cb);
+        return -1;
+      }
+      cb->spool_size = (size_t)spool_size;
+    } else if (strcasecmp("SpoolPolicy", child->key) == 0) {
+      char policy[16];
+      if (cf_util_get_string_buffer(child, policy, sizeof(policy)) != 0) {
+        wa_cb_free(cb);
+        return -1;
+      }
+      if (strcasecmp("DropOldest", policy) == 0)
+        cb->spool_policy = WA_SPOOL_DROP_OLDEST;
+      else if (strcasecmp("DropNewest", policy) == 0)
+        cb->spool_policy = WA_SPOOL_DROP_NEWEST;
+      else {
+        ERROR("write_atsd plugin: Unknown SpoolPolicy (%s)", policy);
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else if (strcasecmp("Balance", child->key) == 0) {
+      char balance[16];
+      if (cf_util_get_string_buffer(child, balance, sizeof(balance)) != 0) {
+        wa_cb_free(cb);
+        return -1;
+      }
+      if (strcasecmp("Failover", balance) == 0)
+        cb->balance = WA_BALANCE_FAILOVER;
+      else if (strcasecmp("RoundRobin", balance) == 0)
+        cb->balance = WA_BALANCE_ROUND_ROBIN;
+      else if (strcasecmp("Entity", balance) == 0)
+        cb->balance = WA_BALANCE_ENTITY;
+      else {
+        ERROR("write_atsd plugin: Unknown Balance (%s)", balance);
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else if (strcasecmp("Compression", child->key) == 0) {
+      char compression[16];
+      if (cf_util_get_string_buffer(child, compression, sizeof(compression)) !=
+          0) {
+        wa_cb_free(cb);
+        return -1;
+      }
+      if (strcasecmp("None", compression) == 0)
+        cb->compression = ATSD_HTTP_COMPRESSION_NONE;
+#if HAVE_LIBZ
+      else if (strcasecmp("gzip", compression) == 0)
+        cb->compression = ATSD_HTTP_COMPRESSION_GZIP;
+#endif
+#if HAVE_LIBZSTD
+      else if (strcasecmp("zstd", compression) == 0)
+        cb->compression = ATSD_HTTP_COMPRESSION_ZSTD;
+#endif
+      else {
+        ERROR("write_atsd plugin: Compression \"%s\" is unknown or not "
+              "supported by this build.",
+              compression);
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else if (strcasecmp("User", child->key) == 0)
+      cf_util_get_string(child, &cb->user);
+    else if (strcasecmp("Password", child->key) == 0)
+      cf_util_get_string(child, &cb->password);
+    else if (strcasecmp("ReconnectInterval", child->key) == 0) {
+      if (cf_util_get_cdtime(child, &cb->reconnect_interval) != 0) {
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else if (strcasecmp("ConnectTimeout", child->key) == 0) {
+      if (cf_util_get_cdtime(child, &cb->connect_timeout) != 0) {
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else if (strcasecmp("ResolveInterval", child->key) == 0) {
+      if (cf_util_get_cdtime(child, &cb->resolve_interval) != 0) {
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else if (strcasecmp("DiskSpool", child->key) == 0)
+      cf_util_get_boolean(child, &cb->disk_spool_enabled);
+    else if (strcasecmp("DiskSpoolSize", child->key) == 0) {
+      if (cf_util_get_int(child, &cb->disk_spool_size) != 0) {
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else if (strcasecmp("DiskSpoolSegmentSize", child->key) == 0) {
+      if (cf_util_get_int(child, &cb->disk_spool_segment_size) != 0) {
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else if (strcasecmp("DiskSpoolReplayRate", child->key) == 0) {
+      if (cf_util_get_int(child, &cb->disk_spool_replay_rate) != 0) {
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else if (strcasecmp("MetricSnapshot", child->key) == 0)
+      cf_util_get_boolean(child, &cb->metric_snapshot);
+    else if (strcasecmp("ReportStats", child->key) == 0)
+      cf_util_get_boolean(child, &cb->report_stats);
+    else if (strcasecmp("Latency", child->key) == 0) {
+      if (latency_config(&cb->latency, child, "write_atsd") != 0) {
+        wa_cb_free(cb);
+        return -1;
+      }
+    } else {
       ERROR("write_atsd plugin: Invalid configuration "
             "option: %s.",
             child->key);
@@ -845,19 +2769,127 @@ static int wa_config_node(oconfig_item_t *ci) {
     }
   }
 
+  if (cb->disk_spool_enabled &&
+      (cb->disk_spool_segment_size <= 0 ||
+       cb->disk_spool_segment_size > cb->disk_spool_size ||
+       cb->disk_spool_replay_rate < 0)) {
+    ERROR("write_atsd plugin: DiskSpoolSegmentSize must be positive and not "
+          "larger than DiskSpoolSize, DiskSpoolReplayRate must not be "
+          "negative.");
+    wa_cb_free(cb);
+    return -1;
+  }
+
+  if (cb->connect_timeout == 0) {
+    ERROR("write_atsd plugin: ConnectTimeout must be positive.");
+    wa_cb_free(cb);
+    return -1;
+  }
+
+  if (cb->derive_defaults && (format_rules_add_defaults(cb->rules) != 0)) {
+    wa_cb_free(cb);
+    return -1;
+  }
+
+  if (cb->report_stats && (wa_stats_init(cb) != 0)) {
+    wa_cb_free(cb);
+    return -1;
+  }
+
+  if ((cb->endpoints_num == 0) &&
+      (wa_add_endpoint(cb, WA_DEFAULT_NODE, WA_DEFAULT_SERVICE) != 0)) {
+    wa_cb_free(cb);
+    return -1;
+  }
+  cb->node = cb->endpoints[0].node;
+  cb->service = cb->endpoints[0].service;
+
+  /* A single endpoint has nothing to balance. */
+  if (cb->endpoints_num == 1)
+    cb->balance = WA_BALANCE_FAILOVER;
+
+  cb->udp = (strcasecmp("UDP", cb->protocol) == 0);
+
+  if (cb->send_buf_size == 0)
+    cb->send_buf_size = WA_DEFAULT_BUFFER_SIZE;
+
+  if (cb->spool_size < cb->send_buf_size) {
+    ERROR("write_atsd plugin: SpoolSize must not be smaller than BufferSize.");
+    wa_cb_free(cb);
+    return -1;
+  }
+
+  cb->send_buf = malloc(cb->send_buf_size);
+  cb->spool = malloc(cb->spool_size);
+  if (cb->balance == WA_BALANCE_ENTITY)
+    cb->route_buf = malloc(cb->send_buf_size);
+  if (cb->send_buf == NULL || cb->spool == NULL ||
+      ((cb->balance == WA_BALANCE_ENTITY) && (cb->route_buf == NULL))) {
+    ERROR("write_atsd plugin: malloc failed.");
+    wa_cb_free(cb);
+    return -1;
+  }
+  wa_reset_buffer(cb);
+
+  if (strcasecmp("HTTP", cb->protocol) == 0) {
+    cb->http = atsd_http_create(cb->compression, cb->send_buf_size, cb->user,
+                                cb->password);
+    if (cb->http == NULL) {
+      ERROR("write_atsd plugin: atsd_http_create failed.");
+      wa_cb_free(cb);
+      return -1;
+    }
+  }
+
+  cb->entity_cache = atsd_entity_cache_create(cb->entity, cb->short_hostname,
+                                              WA_ENTITY_CACHE_TTL);
+  if (cb->entity_cache == NULL) {
+    ERROR("write_atsd plugin: atsd_entity_cache_create failed.");
+    wa_cb_free(cb);
+    return -1;
+  }
+
+  cb->uname_tags = wa_uname_tags();
+  cb->property_times =
+      c_avl_create((int (*)(const void *, const void *))strcmp);
+  if ((cb->uname_tags == NULL) || (cb->property_times == NULL)) {
+    ERROR("write_atsd plugin: Allocating the property table failed.");
+    wa_cb_free(cb);
+    return -1;
+  }
+
+  if (cb->metric_snapshot) {
+    char path[PATH_MAX];
+    wa_state_path(cb, path, sizeof(path), "metrics.snapshot");
+
+    cb->metrics = atsd_metrics_create(
+        path, format_atsd_naming_hash(cb->rules, cb->prefix));
+    if (cb->metrics == NULL) {
+      ERROR("write_atsd plugin: atsd_metrics_create failed.");
+      wa_cb_free(cb);
+      return -1;
+    }
+  }
+
   char callback_name[DATA_MAX_NAME_LEN];
   if (cb->name == NULL)
     snprintf(callback_name, sizeof(callback_name), "write_atsd/%s/%s/%s",
-             cb->node != NULL ? cb->node : WA_DEFAULT_NODE,
-             cb->service != NULL ? cb->service : WA_DEFAULT_SERVICE,
-             cb->protocol != NULL ? cb->protocol : WA_DEFAULT_PROTOCOL);
+             cb->node, cb->service, cb->protocol);
   else
     snprintf(callback_name, sizeof(callback_name), "write_atsd/%s", cb->name);
 
-  plugin_register_write(callback_name, wa_write,
-                        &(user_data_t){
-                            .data = cb, .free_func = wa_callback_free,
-                        });
+  plugin_register_write_batch(callback_name, wa_write,
+                              &(user_data_t){
+                                  .data = cb, .free_func = wa_callback_free,
+                              });
+
+  plugin_register_flush(callback_name, wa_flush, &(user_data_t){.data = cb});
+
+  plugin_register_complex_read(/* group = */ NULL, callback_name, wa_read,
+                               /* interval = */ 0,
+                               &(user_data_t){
+                                   .data = cb,
+                               });
 
   return 0;
 }
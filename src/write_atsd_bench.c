@@ -0,0 +1,455 @@
+/**
+ * collectd - src/write_atsd_bench.c
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; only version 2 of the License is applicable.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ **/
+
+/* Measures the write path of the write_atsd plugin end to end: value lists
+ * are handed to the batch write callback as the write threads would, and the
+ * commands are sent through the sender thread to a local stub of ATSD, which
+ * counts and checks them.
+ *
+ * Usage: bench_write_atsd [tcp|udp] [value lists] [cardinality] [batch]
+ *
+ * Reports series and bytes per second, the CPU time spent per series outside
+ * the stub, and, with the GNU C library, the number of allocations per
+ * series. */
+
+#include "write_atsd.c" /* sic */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_VALUE_LISTS 1000000
+#define BENCH_DEFAULT_CARDINALITY 10000
+#define BENCH_SERIES_PER_HOST 100
+
+/* Seconds without progress after which the stub gives up waiting. */
+#define BENCH_DRAIN_TIMEOUT 5.0
+
+/*
+ * Allocation counting
+ */
+#ifdef __GLIBC__
+#define BENCH_COUNT_ALLOCATIONS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations;
+
+void *malloc(size_t size) {
+  __sync_fetch_and_add(&allocations, 1);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  __sync_fetch_and_add(&allocations, 1);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  __sync_fetch_and_add(&allocations, 1);
+  return __libc_realloc(ptr, size);
+}
+
+static unsigned long allocations_get(void) {
+  return __sync_fetch_and_add(&allocations, 0);
+}
+#else
+#define BENCH_COUNT_ALLOCATIONS 0
+static unsigned long allocations_get(void) { return 0; }
+#endif
+
+/*
+ * Daemon functions the plugin mock does not provide
+ */
+static user_data_t bench_user_data;
+
+int plugin_register_write_batch(const char *name,
+                                plugin_write_batch_cb callback,
+                                user_data_t const *user_data) {
+  bench_user_data = *user_data;
+  return 0;
+}
+
+int plugin_register_flush(const char *name, plugin_flush_cb callback,
+                          user_data_t const *user_data) {
+  return 0;
+}
+
+int plugin_thread_create(pthread_t *thread, const pthread_attr_t *attr,
+                         void *(*start_routine)(void *), void *arg,
+                         char const *name) {
+  return pthread_create(thread, attr, start_routine, arg);
+}
+
+/*
+ * The ATSD stub
+ */
+typedef struct {
+  _Bool udp;
+  int fd;
+  int port;
+  pthread_t thread;
+  volatile _Bool stop;
+
+  char line[8192];
+  size_t line_len;
+
+  pthread_mutex_t lock;
+  uint64_t bytes;
+  uint64_t series;
+  uint64_t metrics;
+  uint64_t properties;
+  uint64_t malformed;
+} sink_t;
+
+static _Bool has_prefix(const char *line, size_t len, const char *prefix) {
+  size_t prefix_len = strlen(prefix);
+  return (len >= prefix_len) && (memcmp(line, prefix, prefix_len) == 0);
+}
+
+static void sink_line(sink_t *s, const char *line, size_t len) {
+  if (has_prefix(line, len, "series e:\"") &&
+      (memmem(line, len, " m:\"", 4) != NULL) &&
+      (memmem(line, len, " ms:", 4) != NULL))
+    s->series++;
+  else if (has_prefix(line, len, "metric m:\""))
+    s->metrics++;
+  else if (has_prefix(line, len, "property e:\""))
+    s->properties++;
+  else
+    s->malformed++;
+}
+
+static void sink_data(sink_t *s, const char *data, size_t len) {
+  pthread_mutex_lock(&s->lock);
+  s->bytes += len;
+
+  while (len > 0) {
+    const char *end = memchr(data, '\n', len);
+    size_t n = (end != NULL) ? (size_t)(end - data) : len;
+
+    if (s->line_len + n < sizeof(s->line)) {
+      memcpy(s->line + s->line_len, data, n);
+      s->line_len += n;
+    } else {
+      /* Too long for any command write_atsd sends */
+      s->line_len = sizeof(s->line);
+    }
+
+    if (end == NULL)
+      break;
+
+    if (s->line_len < sizeof(s->line))
+      sink_line(s, s->line, s->line_len);
+    else
+      s->malformed++;
+    s->line_len = 0;
+
+    data += n + 1;
+    len -= n + 1;
+  }
+
+  pthread_mutex_unlock(&s->lock);
+}
+
+static void *sink_thread(void *arg) {
+  sink_t *s = arg;
+  static char buffer[65536];
+  int conn = -1;
+
+  while (!s->stop) {
+    struct pollfd fds[2] = {{.fd = s->fd, .events = POLLIN},
+                            {.fd = conn, .events = POLLIN}};
+    if (poll(fds, (conn < 0) ? 1 : 2, /* timeout = */ 100) <= 0)
+      continue;
+
+    if (s->udp) {
+      ssize_t n = recv(s->fd, buffer, sizeof(buffer), 0);
+      if (n > 0)
+        sink_data(s, buffer, (size_t)n);
+      continue;
+    }
+
+    if ((fds[0].revents & POLLIN) && (conn < 0))
+      conn = accept(s->fd, NULL, NULL);
+
+    if ((conn >= 0) && (fds[1].revents & (POLLIN | POLLHUP))) {
+      ssize_t n = read(conn, buffer, sizeof(buffer));
+      if (n > 0) {
+        sink_data(s, buffer, (size_t)n);
+      } else {
+        /* The plugin reconnects with a fresh command stream. */
+        close(conn);
+        conn = -1;
+        s->line_len = 0;
+      }
+    }
+  }
+
+  if (conn >= 0)
+    close(conn);
+  return NULL;
+}
+
+static int sink_start(sink_t *s, _Bool udp) {
+  struct sockaddr_in sa = {
+      .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  socklen_t sa_len = sizeof(sa);
+
+  s->udp = udp;
+  s->fd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+  if (s->fd < 0)
+    return -1;
+
+  if (udp) {
+    /* Keep up with bursts of the sender thread. */
+    int rcvbuf = 8 * 1024 * 1024;
+    setsockopt(s->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+
+  if ((bind(s->fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) ||
+      (!udp && (listen(s->fd, 4) != 0)) ||
+      (getsockname(s->fd, (struct sockaddr *)&sa, &sa_len) != 0)) {
+    close(s->fd);
+    return -1;
+  }
+  s->port = ntohs(sa.sin_port);
+
+  pthread_mutex_init(&s->lock, NULL);
+  if (pthread_create(&s->thread, NULL, sink_thread, s) != 0) {
+    close(s->fd);
+    return -1;
+  }
+  return 0;
+}
+
+static void sink_stop(sink_t *s) {
+  s->stop = 1;
+  pthread_join(s->thread, NULL);
+  close(s->fd);
+  pthread_mutex_destroy(&s->lock);
+}
+
+static uint64_t sink_bytes(sink_t *s) {
+  pthread_mutex_lock(&s->lock);
+  uint64_t bytes = s->bytes;
+  pthread_mutex_unlock(&s->lock);
+  return bytes;
+}
+
+/*
+ * The benchmark
+ */
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double cpu_seconds(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) +
+         (double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static double thread_cpu_seconds(pthread_t thread) {
+  clockid_t clock;
+  struct timespec ts;
+  if ((pthread_getcpuclockid(thread, &clock) != 0) ||
+      (clock_gettime(clock, &ts) != 0))
+    return 0.0;
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Configures a node sending to the stub, the way the daemon would. */
+static struct wa_callback *bench_configure(const char *protocol, int port) {
+  char path[] = "/tmp/bench_write_atsd.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0)
+    return NULL;
+
+  /* Commands are sent as soon as the sender thread gets to them. */
+  FILE *fh = fdopen(fd, "w");
+  fprintf(fh, "<Node \"bench\">\n"
+              "  AtsdUrl \"%s://127.0.0.1:%d\"\n"
+              "  FlushInterval 0\n"
+              "  StoreRates false\n"
+              "  MetricSnapshot false\n"
+              "</Node>\n",
+          protocol, port);
+  fclose(fh);
+
+  oconfig_item_t *ci = oconfig_parse_file(path);
+  unlink(path);
+  if ((ci == NULL) || (ci->children_num != 1)) {
+    oconfig_free(ci);
+    return NULL;
+  }
+
+  int status = wa_config_node(ci->children);
+  oconfig_free(ci);
+  return (status == 0) ? bench_user_data.data : NULL;
+}
+
+int main(int argc, char **argv) {
+  const char *protocol = (argc > 1) ? argv[1] : "tcp";
+  long value_lists = (argc > 2) ? atol(argv[2]) : BENCH_DEFAULT_VALUE_LISTS;
+  long cardinality = (argc > 3) ? atol(argv[3]) : BENCH_DEFAULT_CARDINALITY;
+  long batch = (argc > 4) ? atol(argv[4]) : 1;
+
+  _Bool udp = (strcasecmp("udp", protocol) == 0);
+  if ((!udp && (strcasecmp("tcp", protocol) != 0)) || (value_lists <= 0) ||
+      (cardinality <= 0) || (batch <= 0)) {
+    fprintf(stderr,
+            "Usage: %s [tcp|udp] [value lists] [cardinality] [batch]\n",
+            argv[0]);
+    return 1;
+  }
+
+  sink_t sink = {0};
+  if (sink_start(&sink, udp) != 0) {
+    fprintf(stderr, "Starting the ATSD stub failed: %s\n", STRERRNO);
+    return 1;
+  }
+
+  struct wa_callback *cb = bench_configure(protocol, sink.port);
+  if (cb == NULL) {
+    fprintf(stderr, "Configuring write_atsd failed\n");
+    sink_stop(&sink);
+    return 1;
+  }
+
+  /* One value list per series, updated in place for every round. */
+  data_source_t dsrc = {"value", DS_TYPE_GAUGE, 0.0, NAN};
+  data_set_t ds = {"gauge", 1, &dsrc};
+
+  value_t *values = calloc((size_t)cardinality, sizeof(*values));
+  value_list_t *vl = calloc((size_t)cardinality, sizeof(*vl));
+  const data_set_t **ds_batch = calloc((size_t)batch, sizeof(*ds_batch));
+  const value_list_t **vl_batch = calloc((size_t)batch, sizeof(*vl_batch));
+  if ((values == NULL) || (vl == NULL) || (ds_batch == NULL) ||
+      (vl_batch == NULL)) {
+    fprintf(stderr, "calloc failed\n");
+    return 1;
+  }
+
+  for (long i = 0; i < cardinality; i++) {
+    vl[i].values = values + i;
+    vl[i].values_len = 1;
+    vl[i].time = TIME_T_TO_CDTIME_T(1500000000);
+    vl[i].interval = TIME_T_TO_CDTIME_T(10);
+    snprintf(vl[i].host, sizeof(vl[i].host), "host-%05ld.example.com",
+             i / BENCH_SERIES_PER_HOST);
+    sstrncpy(vl[i].plugin, "bench", sizeof(vl[i].plugin));
+    snprintf(vl[i].plugin_instance, sizeof(vl[i].plugin_instance), "%ld",
+             i % BENCH_SERIES_PER_HOST);
+    sstrncpy(vl[i].type, "gauge", sizeof(vl[i].type));
+  }
+  for (long i = 0; i < batch; i++)
+    ds_batch[i] = &ds;
+
+  unsigned long allocations_start = allocations_get();
+  double cpu_start = cpu_seconds();
+  double sink_cpu_start = thread_cpu_seconds(sink.thread);
+  double start = now_seconds();
+
+  for (long i = 0; i < value_lists;) {
+    size_t n = 0;
+    for (; (n < (size_t)batch) && (i < value_lists); n++, i++) {
+      value_list_t *v = vl + (i % cardinality);
+      v->values[0].gauge = (gauge_t)i * 0.25;
+      v->time += MS_TO_CDTIME_T(1);
+      vl_batch[n] = v;
+    }
+
+    if (wa_write(ds_batch, vl_batch, n, &bench_user_data) != 0) {
+      fprintf(stderr, "wa_write failed\n");
+      return 1;
+    }
+  }
+  wa_flush(/* timeout = */ 0, NULL, &bench_user_data);
+
+  /* Wait for the spool to drain and the stub to read everything sent, or to
+   * stop making progress. */
+  uint64_t received = 0;
+  double progress = now_seconds();
+  while (1) {
+    pthread_mutex_lock(&cb->spool_lock);
+    size_t spooled = cb->spool_fill;
+    pthread_mutex_unlock(&cb->spool_lock);
+
+    pthread_mutex_lock(&cb->send_lock);
+    uint64_t sent = cb->stats.bytes_sent;
+    pthread_mutex_unlock(&cb->send_lock);
+
+    uint64_t bytes = sink_bytes(&sink);
+    if ((spooled == 0) && (bytes == sent))
+      break;
+
+    if (bytes != received) {
+      received = bytes;
+      progress = now_seconds();
+    } else if (now_seconds() - progress > BENCH_DRAIN_TIMEOUT) {
+      break;
+    }
+    usleep(1000);
+  }
+
+  double elapsed = now_seconds() - start;
+  double cpu = (cpu_seconds() - cpu_start) -
+               (thread_cpu_seconds(sink.thread) - sink_cpu_start);
+  unsigned long allocs = allocations_get() - allocations_start;
+
+  pthread_mutex_lock(&cb->spool_lock);
+  uint64_t dropped = cb->stats.commands_dropped;
+  pthread_mutex_unlock(&cb->spool_lock);
+
+  bench_user_data.free_func(bench_user_data.data);
+  sink_stop(&sink);
+
+  double series = (sink.series > 0) ? (double)sink.series : 1.0;
+  printf("%s: %ld value lists of %ld series in batches of %ld, %.3f s\n",
+         protocol, value_lists, cardinality, batch, elapsed);
+  printf("  received %" PRIu64 " series, %" PRIu64 " metric, %" PRIu64
+         " property and %" PRIu64 " malformed commands, %" PRIu64
+         " commands dropped\n",
+         sink.series, sink.metrics, sink.properties, sink.malformed, dropped);
+  printf("  %.0f series/s, %.1f MB/s, %.2f us CPU per series",
+         (double)sink.series / elapsed,
+         (double)sink.bytes / elapsed / (1024.0 * 1024.0), 1e6 * cpu / series);
+  if (BENCH_COUNT_ALLOCATIONS)
+    printf(", %.3f allocations per series", (double)allocs / series);
+  printf("\n");
+
+  sfree(values);
+  sfree(vl);
+  sfree(ds_batch);
+  sfree(vl_batch);
+
+  /* Datagrams may be lost, a stream must deliver every command the spool did
+   * not drop, intact. */
+  if ((sink.malformed > 0) ||
+      (!udp && (dropped == 0) && (sink.series != (uint64_t)value_lists)))
+    return 1;
+  return 0;
+}